@@ -153,6 +153,7 @@ if [ "$INSTALL" = true ]; then
         sudo make install
     else
         sudo cp keikaku /usr/local/bin/
+        sudo cp libkeikaku_runtime.a /usr/local/lib/
     fi
     
     echo -e "${GREEN}  ✓ Installed to /usr/local/bin/keikaku${NC}"
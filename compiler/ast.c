@@ -15,16 +15,16 @@
  */
 
 static const char *node_type_names[] = {
-    "INTEGER",   "FLOAT",       "STRING",      "BOOL",          "LIST",
-    "DICT",      "IDENTIFIER",  "BINARY_OP",   "UNARY_OP",      "CALL",
-    "INDEX",     "MEMBER",      "DESIGNATE",   "ASSIGN",        "EXPR_STMT",
-    "BLOCK",     "FORESEE",     "CYCLE_WHILE", "CYCLE_THROUGH", "CYCLE_FROM_TO",
-    "PROTOCOL",  "YIELD",       "DELEGATE",    "PARAM",         "BREAK",
-    "CONTINUE",  "SCHEME",      "PREVIEW",     "OVERRIDE",      "ABSOLUTE",
-    "ANOMALY",   "ENTITY",      "MANIFEST",    "SELF",          "METHOD_CALL",
-    "ASCEND",    "INCORPORATE", "ATTEMPT",     "LAMBDA",        "TERNARY",
-    "LIST_COMP", "SLICE",       "SITUATION",   "ALIGNMENT",     "SPREAD",
-    "GEN_EXPR",  "AWAIT",       "PROGRAM"};
+    "INTEGER",       "FLOAT",     "STRING",      "FSTRING",     "BOOL",
+    "LIST",          "DICT",      "IDENTIFIER",  "BINARY_OP",   "UNARY_OP",
+    "CALL",          "INDEX",     "MEMBER",      "DESIGNATE",   "ASSIGN",
+    "EXPR_STMT",     "BLOCK",     "FORESEE",     "CYCLE_WHILE", "CYCLE_THROUGH",
+    "CYCLE_FROM_TO", "PROTOCOL",  "YIELD",       "DELEGATE",    "PARAM",
+    "BREAK",         "CONTINUE",  "SCHEME",      "PREVIEW",     "OVERRIDE",
+    "ABSOLUTE",      "ANOMALY",   "ENTITY",      "MANIFEST",    "SELF",
+    "METHOD_CALL",   "ASCEND",    "INCORPORATE", "ATTEMPT",     "LAMBDA",
+    "TERNARY",       "LIST_COMP", "SLICE",       "SITUATION",   "ALIGNMENT",
+    "SPREAD",        "GEN_EXPR",  "AWAIT",       "PROGRAM"};
 
 const char *ast_node_type_name(ASTNodeType type) {
   if (type >= 0 && type < AST_NODE_COUNT) {
@@ -63,6 +63,17 @@ void ast_array_push(ASTNodeArray *arr, ASTNode *node) {
   arr->nodes[arr->count++] = node;
 }
 
+void ast_fstring_push(ASTNode *fstring, ASTNode *part, char *spec) {
+  ASTNodeArray *parts = &fstring->data.fstring.parts;
+  fstring->data.fstring.specs = (char **)realloc(
+      fstring->data.fstring.specs, sizeof(char *) * (parts->count + 1));
+  fstring->data.fstring.specs[parts->count] = spec;
+  if (part->type == AST_STRING && !spec) {
+    fstring->data.fstring.literal_length += strlen(part->data.string_value);
+  }
+  ast_array_push(parts, part);
+}
+
 void ast_param_array_init(ASTParamArray *arr) {
   arr->params = NULL;
   arr->count = 0;
@@ -148,6 +159,12 @@ ASTNode *ast_create_string(const char *value, int line, int col) {
   return node;
 }
 
+ASTNode *ast_create_fstring(int line, int col) {
+  ASTNode *node = create_node(AST_FSTRING, line, col);
+  ast_array_init(&node->data.fstring.parts);
+  return node;
+}
+
 ASTNode *ast_create_bool(bool value, int line, int col) {
   ASTNode *node = create_node(AST_BOOL, line, col);
   node->data.bool_value = value;
@@ -376,6 +393,17 @@ void ast_destroy_array(ASTNodeArray *arr) {
   arr->capacity = 0;
 }
 
+static void ast_free_vars_destroy(ASTFreeVars *fv) {
+  for (size_t i = 0; i < fv->count; i++) {
+    free(fv->names[i]);
+  }
+  free(fv->names);
+  for (size_t i = 0; i < fv->bound_count; i++) {
+    free(fv->bound[i]);
+  }
+  free(fv->bound);
+}
+
 void ast_destroy(ASTNode *node) {
   if (!node)
     return;
@@ -385,6 +413,14 @@ void ast_destroy(ASTNode *node) {
     free(node->data.string_value);
     break;
 
+  case AST_FSTRING:
+    for (size_t i = 0; i < node->data.fstring.parts.count; i++) {
+      free(node->data.fstring.specs[i]);
+    }
+    free(node->data.fstring.specs);
+    ast_destroy_array(&node->data.fstring.parts);
+    break;
+
   case AST_IDENTIFIER:
     free(node->data.identifier.name);
     break;
@@ -464,6 +500,7 @@ void ast_destroy(ASTNode *node) {
     }
     free(node->data.protocol.params.params);
     ast_destroy_array(&node->data.protocol.body);
+    ast_free_vars_destroy(&node->data.protocol.free_vars);
     break;
 
   case AST_YIELD:
@@ -538,6 +575,7 @@ void ast_destroy(ASTNode *node) {
     }
     free(node->data.lambda.params.params);
     ast_destroy(node->data.lambda.body);
+    ast_free_vars_destroy(&node->data.lambda.free_vars);
     break;
 
   case AST_TERNARY:
@@ -572,6 +610,8 @@ void ast_destroy(ASTNode *node) {
   case AST_SITUATION:
     ast_destroy(node->data.situation.value);
     ast_destroy_array(&node->data.situation.alignments);
+    if (node->data.situation.dispatch_free)
+      node->data.situation.dispatch_free(node->data.situation.dispatch);
     break;
 
   case AST_ALIGNMENT:
@@ -590,6 +630,186 @@ void ast_destroy(ASTNode *node) {
   free(node);
 }
 
+static void visit_array(ASTNodeArray *arr, void (*visit)(ASTNode *, void *),
+                        void *ctx) {
+  for (size_t i = 0; i < arr->count; i++) {
+    visit(arr->nodes[i], ctx);
+  }
+}
+
+static void visit_params(ASTParamArray *params,
+                         void (*visit)(ASTNode *, void *), void *ctx) {
+  for (size_t i = 0; i < params->count; i++) {
+    visit(params->params[i].pattern, ctx);
+    if (params->params[i].default_value)
+      visit(params->params[i].default_value, ctx);
+  }
+}
+
+void ast_visit_children(ASTNode *node, void (*visit)(ASTNode *, void *),
+                        void *ctx) {
+#define VISIT(child)                                                           \
+  do {                                                                         \
+    if (child)                                                                 \
+      visit(child, ctx);                                                       \
+  } while (0)
+
+  switch (node->type) {
+  case AST_FSTRING:
+    visit_array(&node->data.fstring.parts, visit, ctx);
+    break;
+  case AST_LIST:
+    visit_array(&node->data.list.elements, visit, ctx);
+    break;
+  case AST_DICT:
+    for (size_t i = 0; i < node->data.dict.pairs.count; i++) {
+      VISIT(node->data.dict.pairs.pairs[i].key);
+      VISIT(node->data.dict.pairs.pairs[i].value);
+    }
+    break;
+  case AST_BINARY_OP:
+    VISIT(node->data.binary.left);
+    VISIT(node->data.binary.right);
+    break;
+  case AST_UNARY_OP:
+    VISIT(node->data.unary.operand);
+    break;
+  case AST_CALL:
+    visit_array(&node->data.call.args, visit, ctx);
+    break;
+  case AST_INDEX:
+    VISIT(node->data.index.object);
+    VISIT(node->data.index.index);
+    break;
+  case AST_MEMBER:
+    VISIT(node->data.member.object);
+    break;
+  case AST_DESIGNATE:
+  case AST_ASSIGN:
+    VISIT(node->data.assign.target);
+    VISIT(node->data.assign.value);
+    break;
+  case AST_EXPR_STMT:
+    VISIT(node->data.expr_stmt.expr);
+    break;
+  case AST_BLOCK:
+    visit_array(&node->data.block.statements, visit, ctx);
+    break;
+  case AST_FORESEE:
+    VISIT(node->data.foresee.condition);
+    visit_array(&node->data.foresee.body, visit, ctx);
+    for (size_t i = 0; i < node->data.foresee.alternates.count; i++) {
+      VISIT(node->data.foresee.alternates.alts[i].condition);
+      visit_array(&node->data.foresee.alternates.alts[i].body, visit, ctx);
+    }
+    visit_array(&node->data.foresee.otherwise, visit, ctx);
+    break;
+  case AST_CYCLE_WHILE:
+    VISIT(node->data.cycle_while.condition);
+    visit_array(&node->data.cycle_while.body, visit, ctx);
+    break;
+  case AST_CYCLE_THROUGH:
+    VISIT(node->data.cycle_through.iterable);
+    VISIT(node->data.cycle_through.var_pattern);
+    visit_array(&node->data.cycle_through.body, visit, ctx);
+    break;
+  case AST_CYCLE_FROM_TO:
+    VISIT(node->data.cycle_from_to.start);
+    VISIT(node->data.cycle_from_to.end);
+    VISIT(node->data.cycle_from_to.step);
+    VISIT(node->data.cycle_from_to.var_pattern);
+    visit_array(&node->data.cycle_from_to.body, visit, ctx);
+    break;
+  case AST_PROTOCOL:
+    visit_params(&node->data.protocol.params, visit, ctx);
+    visit_array(&node->data.protocol.body, visit, ctx);
+    break;
+  case AST_YIELD:
+    VISIT(node->data.yield.value);
+    break;
+  case AST_DELEGATE:
+    VISIT(node->data.delegate.iterable);
+    break;
+  case AST_SCHEME:
+    visit_array(&node->data.scheme.body, visit, ctx);
+    break;
+  case AST_PREVIEW:
+    VISIT(node->data.preview.expr);
+    break;
+  case AST_OVERRIDE:
+    VISIT(node->data.override.value);
+    break;
+  case AST_ABSOLUTE:
+    VISIT(node->data.absolute.condition);
+    break;
+  case AST_ANOMALY:
+    visit_array(&node->data.anomaly.body, visit, ctx);
+    break;
+  case AST_ENTITY:
+    visit_array(&node->data.entity.members, visit, ctx);
+    break;
+  case AST_MANIFEST:
+    visit_array(&node->data.manifest.args, visit, ctx);
+    break;
+  case AST_METHOD_CALL:
+    VISIT(node->data.method_call.object);
+    visit_array(&node->data.method_call.args, visit, ctx);
+    break;
+  case AST_ASCEND:
+    visit_array(&node->data.ascend.args, visit, ctx);
+    break;
+  case AST_ATTEMPT:
+    visit_array(&node->data.attempt.try_body, visit, ctx);
+    visit_array(&node->data.attempt.recover_body, visit, ctx);
+    break;
+  case AST_LAMBDA:
+    visit_params(&node->data.lambda.params, visit, ctx);
+    VISIT(node->data.lambda.body);
+    break;
+  case AST_TERNARY:
+    VISIT(node->data.ternary.condition);
+    VISIT(node->data.ternary.true_value);
+    VISIT(node->data.ternary.false_value);
+    break;
+  case AST_LIST_COMP:
+    VISIT(node->data.list_comp.iterable);
+    VISIT(node->data.list_comp.expr);
+    VISIT(node->data.list_comp.condition);
+    break;
+  case AST_SLICE:
+    VISIT(node->data.slice.object);
+    VISIT(node->data.slice.start);
+    VISIT(node->data.slice.end);
+    VISIT(node->data.slice.step);
+    break;
+  case AST_SITUATION:
+    VISIT(node->data.situation.value);
+    visit_array(&node->data.situation.alignments, visit, ctx);
+    break;
+  case AST_ALIGNMENT:
+    visit_array(&node->data.alignment.values, visit, ctx);
+    visit_array(&node->data.alignment.body, visit, ctx);
+    break;
+  case AST_SPREAD:
+    VISIT(node->data.spread.expr);
+    break;
+  case AST_GEN_EXPR:
+    VISIT(node->data.gen_expr.iterable);
+    VISIT(node->data.gen_expr.expr);
+    VISIT(node->data.gen_expr.condition);
+    break;
+  case AST_AWAIT:
+    VISIT(node->data.await.expr);
+    break;
+  case AST_PROGRAM:
+    visit_array(&node->data.program.statements, visit, ctx);
+    break;
+  default:
+    break;
+  }
+#undef VISIT
+}
+
 /* ============================================================================
  * Debug Printing
  * ============================================================================
@@ -624,6 +844,13 @@ void ast_print(ASTNode *node, int indent) {
     printf(": \"%s\"\n", node->data.string_value);
     break;
 
+  case AST_FSTRING:
+    printf("\n");
+    for (size_t i = 0; i < node->data.fstring.parts.count; i++) {
+      ast_print(node->data.fstring.parts.nodes[i], indent + 1);
+    }
+    break;
+
   case AST_BOOL:
     printf(": %s\n", node->data.bool_value ? "true" : "false");
     break;
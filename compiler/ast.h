@@ -21,6 +21,7 @@ typedef enum {
   AST_INTEGER,
   AST_FLOAT,
   AST_STRING,
+  AST_FSTRING, /* f"..." interpolated string */
   AST_BOOL,
   AST_LIST,
   AST_DICT,
@@ -163,6 +164,58 @@ typedef struct {
   size_t capacity;
 } ASTParamArray;
 
+/* Names a protocol or lambda body uses from enclosing scopes, and the
+ * names it binds for itself, found by the interpreter's free-variable
+ * analysis on first use */
+typedef struct {
+  char **names;
+  size_t count;
+  char **bound;
+  size_t bound_count;
+  bool ready;
+} ASTFreeVars;
+
+/* Baseline JIT bookkeeping for a protocol, see jit.h. The code itself is
+ * owned by the interpreter's JIT. */
+typedef struct {
+  uint32_t calls;       /* Calls counted before compiling */
+  struct JitCode *code; /* NULL until compiled */
+  bool rejected;        /* Uses something the JIT does not handle */
+} ASTJitState;
+
+/* Quickening: once evaluated, a binary operation, call or member access
+ * rewrites itself into a form specialised to what it saw, guarded so that
+ * anything else deoptimises it back to the generic evaluation. */
+typedef enum {
+  QUICK_UNSEEN,      /* Not evaluated yet (or since a deoptimisation) */
+  QUICK_GENERIC,     /* Left unspecialised */
+  QUICK_INT_INT,     /* Arithmetic on two ints */
+  QUICK_FLOAT_FLOAT, /* Arithmetic on two floats */
+  QUICK_CALL_GLOBAL, /* Call of a name bound in the global scope */
+  QUICK_MEMBER_SLOT  /* Instance field at a fixed position */
+} ASTQuickKind;
+
+typedef struct {
+  uint8_t kind;   /* ASTQuickKind */
+  uint8_t deopts; /* Deoptimisations so far */
+  uint16_t slot;  /* QUICK_MEMBER_SLOT: position among the fields */
+  uint32_t owner; /* QUICK_CALL_GLOBAL: serial of the resolving interpreter */
+  void *entry;    /* QUICK_CALL_GLOBAL: the global binding */
+} ASTQuick;
+
+/* A type every evaluation of a node is proven to produce, filled in by the
+ * optional inference pass (see infer.h). On an assignment it is the type
+ * bound, on a counting cycle the counter's, on a protocol that of every
+ * result. */
+typedef enum {
+  PROVEN_NONE, /* Nothing proven */
+  PROVEN_BOOL,
+  PROVEN_INT,
+  PROVEN_FLOAT,
+  PROVEN_STRING,
+  PROVEN_LIST
+} ASTProvenType;
+
 /* Alternate branch (for foresee) */
 typedef struct {
   ASTNode *condition;
@@ -180,6 +233,7 @@ struct ASTNode {
   ASTNodeType type;
   int line;
   int column;
+  uint8_t proven; /* ASTProvenType */
 
   union {
     /* Literals */
@@ -198,6 +252,13 @@ struct ASTNode {
       ASTKeyValueArray pairs;
     } dict;
 
+    /* Interpolated string - literal parts are AST_STRING nodes */
+    struct {
+      ASTNodeArray parts;
+      char **specs;          /* Format spec per part, NULL if none */
+      size_t literal_length; /* Total bytes of literal parts */
+    } fstring;
+
     /* Identifier */
     struct {
       char *name;
@@ -208,6 +269,7 @@ struct ASTNode {
       BinaryOp op;
       ASTNode *left;
       ASTNode *right;
+      ASTQuick quick;
     } binary;
 
     /* Unary Op */
@@ -220,6 +282,7 @@ struct ASTNode {
     struct {
       char *name;
       ASTNodeArray args;
+      ASTQuick quick;
     } call;
 
     /* Index Access */
@@ -232,6 +295,7 @@ struct ASTNode {
     struct {
       ASTNode *object;
       char *member;
+      ASTQuick quick;
     } member;
 
     /* Designate / Assign */
@@ -287,6 +351,8 @@ struct ASTNode {
       ASTNodeArray body;
       bool is_sequence;
       bool is_async;
+      ASTFreeVars free_vars;
+      ASTJitState jit;
     } protocol;
 
     /* Yield (return) */
@@ -368,6 +434,7 @@ struct ASTNode {
     struct {
       ASTParamArray params;
       ASTNode *body; /* Single expression */
+      ASTFreeVars free_vars;
     } lambda;
 
     /* Ternary Expression */
@@ -397,6 +464,8 @@ struct ASTNode {
     struct {
       ASTNode *value;
       ASTNodeArray alignments; /* Cases */
+      void *dispatch; /* Interpreter's compiled lookup, built on first run */
+      void (*dispatch_free)(void *dispatch);
     } situation;
 
     /* Alignment (Case) */
@@ -441,6 +510,7 @@ struct ASTNode {
 ASTNode *ast_create_int(int64_t value, int line, int col);
 ASTNode *ast_create_float(double value, int line, int col);
 ASTNode *ast_create_string(const char *value, int line, int col);
+ASTNode *ast_create_fstring(int line, int col);
 ASTNode *ast_create_bool(bool value, int line, int col);
 ASTNode *ast_create_identifier(const char *name, int line, int col);
 ASTNode *ast_create_binary(BinaryOp op, ASTNode *left, ASTNode *right, int line,
@@ -485,10 +555,16 @@ ASTNode *ast_create_ascend(const char *name, int line, int col);
 
 void ast_destroy_array(ASTNodeArray *arr);
 
+/* Call visit on each direct child node, in source order */
+void ast_visit_children(ASTNode *node, void (*visit)(ASTNode *, void *),
+                        void *ctx);
+
 /* Array operations */
 void ast_array_init(ASTNodeArray *arr);
 void ast_array_push(ASTNodeArray *arr, ASTNode *node);
 
+void ast_fstring_push(ASTNode *fstring, ASTNode *part, char *spec);
+
 void ast_param_array_init(ASTParamArray *arr);
 void ast_param_array_push(ASTParamArray *arr, ASTNode *pattern,
                           ASTNode *default_val, bool is_rest);
@@ -0,0 +1,294 @@
+/*
+ * Keikaku Programming Language - Native Builds
+ *
+ * "The outcome was decided long before execution."
+ */
+
+#define _DEFAULT_SOURCE /* strdup, readlink, fork, mkstemps */
+
+#include "build.h"
+#include "ast.h"
+#include "infer.h"
+#include "lexer.h"
+#include "parser.h"
+#include "translate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* ============================================================================
+ * Parsing
+ * ============================================================================
+ */
+
+/* A parsed script and everything its AST refers to */
+typedef struct {
+  Lexer *lexer;
+  Token *tokens;
+  size_t token_count;
+  Parser *parser;
+  ASTNode *ast;
+} ParsedScript;
+
+static void parsed_free(ParsedScript *script) {
+  if (script->ast)
+    ast_destroy(script->ast);
+  if (script->parser)
+    parser_destroy(script->parser);
+  if (script->tokens)
+    lexer_free_tokens(script->tokens, script->token_count);
+  if (script->lexer)
+    lexer_destroy(script->lexer);
+}
+
+/* Parse source, reporting any syntax error. Free the script either way. */
+static bool parse_script(ParsedScript *script, const char *source,
+                         const char *filename) {
+  memset(script, 0, sizeof(*script));
+  script->lexer = lexer_create(source, filename);
+  if (!script->lexer) {
+    fprintf(stderr,
+            "  ⚠ Memory allocation failed. The scenario cannot proceed.\n");
+    return false;
+  }
+
+  script->tokens = lexer_tokenize_all(script->lexer, &script->token_count);
+  if (lexer_has_error(script->lexer)) {
+    fprintf(stderr, "%s\n", lexer_get_error(script->lexer));
+    return false;
+  }
+
+  script->parser = parser_create(script->tokens, script->token_count, source,
+                                 filename);
+  if (!script->parser)
+    return false;
+
+  script->ast = parser_parse(script->parser);
+  if (parser_has_error(script->parser)) {
+    fprintf(stderr, "%s\n", parser_get_error(script->parser));
+    return false;
+  }
+  return true;
+}
+
+/* ============================================================================
+ * Building
+ * ============================================================================
+ */
+
+static char *read_script(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "  ⚠ Unable to locate file '%s'.\n", path);
+    fprintf(stderr,
+            "    The designated path was not found. Check your parameters.\n");
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  size_t size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *buffer = (char *)malloc(size + 1);
+  size_t read = fread(buffer, 1, size, file);
+  buffer[read] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+/* The runtime library: $KEIKAKU_RUNTIME, else next to this executable (a
+ * build tree) or in ../lib beside it (an installation) */
+static char *find_runtime(void) {
+  const char *env = getenv("KEIKAKU_RUNTIME");
+  if (env && *env)
+    return strdup(env);
+
+  char dir[4096];
+  ssize_t length = readlink("/proc/self/exe", dir, sizeof(dir) - 1);
+  if (length <= 0)
+    return NULL;
+  dir[length] = '\0';
+  char *slash = strrchr(dir, '/');
+  if (!slash)
+    return NULL;
+  *slash = '\0';
+
+  static const char *places[] = {"", "/../lib"};
+  char path[4200];
+  for (size_t i = 0; i < sizeof(places) / sizeof(places[0]); i++) {
+    snprintf(path, sizeof(path), "%s%s/%s", dir, places[i],
+             BUILD_RUNTIME_LIBRARY);
+    if (access(path, R_OK) == 0)
+      return strdup(path);
+  }
+  return NULL;
+}
+
+/* The generated program: the translated script if there is one, else the
+ * script as a byte array and a main() that runs it with the options given
+ * at build time. Takes ownership of fd. */
+static bool write_program(int fd, const char *translated, const char *source,
+                          const char *filename, const BuildOptions *options) {
+  FILE *out = fdopen(fd, "w");
+  if (!out) {
+    close(fd);
+    return false;
+  }
+  if (translated) {
+    fputs(translated, out);
+    return fclose(out) == 0;
+  }
+
+  fprintf(out, "/* Generated by keikaku build from %s */\n\n", filename);
+  fprintf(out, "#include <stdbool.h>\n\n");
+  fprintf(out, "int build_run_embedded(const char *source, "
+               "const char *filename,\n"
+               "                       int report_level, bool jit, "
+               "bool infer);\n\n");
+
+  fprintf(out, "static const char source[] = {");
+  size_t length = strlen(source);
+  for (size_t i = 0; i <= length; i++) {
+    fprintf(out, "%s0x%02x%s", i % 12 == 0 ? "\n    " : "",
+            (unsigned char)source[i], i < length ? ", " : "");
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "int main(void) {\n  return build_run_embedded(source, ");
+  translate_write_string(out, filename, strlen(filename));
+  fprintf(out, ", %d, %s, %s);\n}\n", (int)options->report_level,
+          options->jit ? "true" : "false", options->infer ? "true" : "false");
+
+  return fclose(out) == 0;
+}
+
+/* Run the C compiler, returning its exit status */
+static int run_compiler(const char *c_path, const char *runtime,
+                        const char *output) {
+  const char *cc = getenv("CC");
+  if (!cc || !*cc)
+    cc = "cc";
+  char *argv[] = {(char *)cc,     "-O2",           "-o",  (char *)output,
+                  (char *)c_path, (char *)runtime, "-lm", NULL};
+
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    execvp(cc, argv);
+    fprintf(stderr, "  ⚠ Unable to run the C compiler '%s'.\n", cc);
+    _exit(127);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+int build_executable(const char *script, const char *output,
+                     const BuildOptions *options) {
+  char *source = read_script(script);
+  if (!source)
+    return 1;
+
+  const char *slash = strrchr(script, '/');
+  const char *filename = slash ? slash + 1 : script;
+
+  /* Refuse scripts that would only fail once deployed */
+  ParsedScript parsed;
+  if (!parse_script(&parsed, source, filename)) {
+    parsed_free(&parsed);
+    free(source);
+    return 1;
+  }
+
+  /* Translate to C, or failing that run the script in the interpreter */
+  TranslateFailure failure = {0, ""};
+  char *translated = translate_program(parsed.ast, filename,
+                                       (int)options->report_level, &failure);
+  parsed_free(&parsed);
+  if (!translated)
+    printf("  ◈ Line %d: %s cannot be translated to C yet; the script is "
+           "bundled with the interpreter instead.\n",
+           failure.line, failure.what);
+
+  char *runtime = find_runtime();
+  if (!runtime) {
+    fprintf(stderr, "  ⚠ Runtime library '%s' not found.\n",
+            BUILD_RUNTIME_LIBRARY);
+    fprintf(stderr, "    Set KEIKAKU_RUNTIME to its path.\n");
+    free(translated);
+    free(source);
+    return 1;
+  }
+
+  /* The generated C goes to a private temporary file, never beside the
+   * output where it could replace a file of the user's */
+  const char *tmpdir = getenv("TMPDIR");
+  if (!tmpdir || !*tmpdir)
+    tmpdir = "/tmp";
+  size_t length = strlen(tmpdir) + sizeof("/keikaku-build-XXXXXX.c");
+  char *c_path = (char *)malloc(length);
+  snprintf(c_path, length, "%s/keikaku-build-XXXXXX.c", tmpdir);
+  int fd = mkstemps(c_path, 2);
+
+  int status = 1;
+  if (fd < 0) {
+    fprintf(stderr, "  ⚠ Unable to create a temporary file in '%s'.\n",
+            tmpdir);
+    free(c_path);
+    free(runtime);
+    free(translated);
+    free(source);
+    return 1;
+  }
+  if (!write_program(fd, translated, source, filename, options)) {
+    fprintf(stderr, "  ⚠ Unable to write '%s'.\n", c_path);
+  } else if (run_compiler(c_path, runtime, output) != 0) {
+    fprintf(stderr, "  ⚠ The C compiler failed. '%s' was not built.\n",
+            output);
+  } else {
+    printf("  ◈ '%s' has been built. The plan no longer needs its author.\n",
+           output);
+    status = 0;
+  }
+
+  remove(c_path);
+  free(c_path);
+  free(runtime);
+  free(translated);
+  free(source);
+  return status;
+}
+
+/* ============================================================================
+ * Running
+ * ============================================================================
+ */
+
+int build_run_embedded(const char *source, const char *filename,
+                       int report_level, bool jit, bool infer) {
+  Interpreter *interp = interpreter_create();
+  if (!interp)
+    return 1;
+  interpreter_set_report_level(interp, (ReportLevel)report_level);
+  if (jit)
+    interpreter_enable_jit(interp);
+
+  int status = 1;
+  ParsedScript parsed;
+  if (parse_script(&parsed, source, filename)) {
+    if (infer)
+      infer_program(parsed.ast);
+    Value result = interpreter_execute(interp, parsed.ast);
+    status = interpreter_has_error(interp) ? 1 : 0;
+    value_free(&result);
+  }
+
+  parsed_free(&parsed);
+  interpreter_destroy(interp);
+  return status;
+}
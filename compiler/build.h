@@ -0,0 +1,43 @@
+/*
+ * Keikaku Programming Language - Native Builds
+ *
+ * "The outcome was decided long before execution."
+ *
+ * `keikaku build script.kei -o script` compiles a script into a standalone
+ * executable. The script is parsed up front, so syntax errors surface at
+ * build time, then translated to C (see translate.h) and linked by the
+ * system C compiler with the runtime library (every compiler source except
+ * main.c); the result needs neither the script nor keikaku to run. A script
+ * using constructs the translator does not handle is bundled instead: the
+ * generated main() hands its text to the runtime library, which parses and
+ * interprets it when the executable starts, exactly as keikaku would.
+ */
+
+#ifndef KEIKAKU_BUILD_H
+#define KEIKAKU_BUILD_H
+
+#include "interpreter.h"
+#include <stdbool.h>
+
+/* Name of the runtime library archive looked up by keikaku build */
+#define BUILD_RUNTIME_LIBRARY "libkeikaku_runtime.a"
+
+/* Settings the built executable runs with */
+typedef struct {
+  ReportLevel report_level;
+  bool jit;
+  bool infer;
+} BuildOptions;
+
+/* Build script into an executable at output. Returns 0 on success. The C
+ * compiler is $CC or cc; $KEIKAKU_RUNTIME overrides the runtime library.
+ * The generated C is written to a temporary file in $TMPDIR (or /tmp). */
+int build_executable(const char *script, const char *output,
+                     const BuildOptions *options);
+
+/* Entry point of bundled executables: run an embedded script. Returns the
+ * process exit status. */
+int build_run_embedded(const char *source, const char *filename,
+                       int report_level, bool jit, bool infer);
+
+#endif /* KEIKAKU_BUILD_H */
@@ -0,0 +1,1038 @@
+/*
+ * Keikaku Programming Language - Type Inference
+ *
+ * "Every variable was accounted for in advance."
+ *
+ * Each protocol body is interpreted abstractly: the state at each point maps
+ * the variables whose type is known to that type. Branches are analysed
+ * separately and joined; loops are run until the state at their head stops
+ * changing, which takes at most a few passes since a join can only lose
+ * knowledge. A node is annotated on every pass, so the last pass, made from
+ * the final state, is what remains.
+ */
+
+#include "infer.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* ============================================================================
+ * Name Sets
+ * ============================================================================
+ */
+
+typedef struct {
+  const char **names;
+  size_t count;
+  size_t capacity;
+} NameSet;
+
+static bool name_set_has(const NameSet *set, const char *name) {
+  for (size_t i = 0; i < set->count; i++) {
+    if (strcmp(set->names[i], name) == 0)
+      return true;
+  }
+  return false;
+}
+
+static void name_set_add(NameSet *set, const char *name) {
+  if (!name || name_set_has(set, name))
+    return;
+  if (set->count >= set->capacity) {
+    set->capacity = set->capacity == 0 ? 8 : set->capacity * 2;
+    set->names = (const char **)realloc(set->names,
+                                        sizeof(const char *) * set->capacity);
+  }
+  set->names[set->count++] = name;
+}
+
+static void name_set_free(NameSet *set) {
+  free(set->names);
+  set->names = NULL;
+  set->count = set->capacity = 0;
+}
+
+/* Names a destructuring pattern binds */
+static void add_pattern_names(ASTNode *pattern, NameSet *set) {
+  if (!pattern)
+    return;
+  switch (pattern->type) {
+  case AST_IDENTIFIER:
+    name_set_add(set, pattern->data.identifier.name);
+    break;
+  case AST_LIST:
+    for (size_t i = 0; i < pattern->data.list.elements.count; i++) {
+      add_pattern_names(pattern->data.list.elements.nodes[i], set);
+    }
+    break;
+  case AST_DICT:
+    for (size_t i = 0; i < pattern->data.dict.pairs.count; i++) {
+      add_pattern_names(pattern->data.dict.pairs.pairs[i].value, set);
+    }
+    break;
+  case AST_SPREAD:
+    add_pattern_names(pattern->data.spread.expr, set);
+    break;
+  default:
+    break; /* Index and member targets bind no name */
+  }
+}
+
+typedef struct {
+  NameSet *names;
+  bool nested;    /* Also collect inside nested protocols and lambdas */
+  bool yields;    /* A yield was seen outside nested protocols */
+  bool imports;   /* An incorporate was seen */
+} BindingScan;
+
+/* Collect every name bound within node */
+static void scan_bindings(ASTNode *node, void *data) {
+  BindingScan *scan = (BindingScan *)data;
+  bool descend = true;
+
+  switch (node->type) {
+  case AST_DESIGNATE:
+  case AST_ASSIGN:
+    add_pattern_names(node->data.assign.target, scan->names);
+    break;
+  case AST_CYCLE_THROUGH:
+    add_pattern_names(node->data.cycle_through.var_pattern, scan->names);
+    break;
+  case AST_CYCLE_FROM_TO:
+    add_pattern_names(node->data.cycle_from_to.var_pattern, scan->names);
+    break;
+  case AST_PROTOCOL:
+    name_set_add(scan->names, node->data.protocol.name);
+    for (size_t i = 0; i < node->data.protocol.params.count; i++) {
+      if (scan->nested)
+        add_pattern_names(node->data.protocol.params.params[i].pattern,
+                          scan->names);
+    }
+    descend = scan->nested;
+    break;
+  case AST_LAMBDA:
+    for (size_t i = 0; i < node->data.lambda.params.count; i++) {
+      if (scan->nested)
+        add_pattern_names(node->data.lambda.params.params[i].pattern,
+                          scan->names);
+    }
+    descend = scan->nested;
+    break;
+  case AST_ENTITY:
+    name_set_add(scan->names, node->data.entity.name);
+    descend = scan->nested;
+    break;
+  case AST_ATTEMPT:
+    name_set_add(scan->names, node->data.attempt.error_var);
+    break;
+  case AST_LIST_COMP:
+    name_set_add(scan->names, node->data.list_comp.var_name);
+    break;
+  case AST_GEN_EXPR:
+    name_set_add(scan->names, node->data.gen_expr.var_name);
+    break;
+  case AST_OVERRIDE:
+    name_set_add(scan->names, node->data.override.name);
+    break;
+  case AST_INCORPORATE:
+    scan->imports = true;
+    break;
+  case AST_YIELD:
+    scan->yields = true;
+    break;
+  default:
+    break;
+  }
+
+  if (descend)
+    ast_visit_children(node, scan_bindings, scan);
+}
+
+/* Every name referred to within node */
+static void scan_names(ASTNode *node, void *data) {
+  NameSet *names = (NameSet *)data;
+  if (node->type == AST_IDENTIFIER)
+    name_set_add(names, node->data.identifier.name);
+  else if (node->type == AST_CALL)
+    name_set_add(names, node->data.call.name);
+  else if (node->type == AST_OVERRIDE)
+    name_set_add(names, node->data.override.name);
+  ast_visit_children(node, scan_names, names);
+}
+
+/* Names nested protocols and entities refer to. Their closures can assign
+ * them whenever they are called. Lambdas are single expressions and cannot
+ * assign anything. */
+static void scan_captured(ASTNode *node, void *data) {
+  if (node->type == AST_PROTOCOL || node->type == AST_ENTITY) {
+    scan_names(node, data);
+    return;
+  }
+  ast_visit_children(node, scan_captured, data);
+}
+
+/* ============================================================================
+ * Abstract State
+ * ============================================================================
+ */
+
+typedef struct {
+  const char *name;
+  ASTProvenType type;
+  bool local; /* Bound in the call's own scope, out of other code's reach */
+} InferVar;
+
+/* What is known at one point of a body. Variables not listed are unknown
+ * and may live in any scope. */
+typedef struct {
+  InferVar *vars;
+  size_t count;
+  size_t capacity;
+  bool reachable;
+} InferState;
+
+static InferState state_new(bool reachable) {
+  InferState state = {NULL, 0, 0, reachable};
+  return state;
+}
+
+static InferState state_copy(const InferState *src) {
+  InferState copy = state_new(src->reachable);
+  if (src->count > 0) {
+    copy.vars = (InferVar *)malloc(sizeof(InferVar) * src->count);
+    memcpy(copy.vars, src->vars, sizeof(InferVar) * src->count);
+    copy.count = copy.capacity = src->count;
+  }
+  return copy;
+}
+
+static void state_free(InferState *state) {
+  free(state->vars);
+  state->vars = NULL;
+  state->count = state->capacity = 0;
+}
+
+/* Replace state with src, taking src over */
+static void state_move(InferState *state, InferState *src) {
+  state_free(state);
+  *state = *src;
+  *src = state_new(false);
+}
+
+static InferVar *state_find(const InferState *state, const char *name) {
+  for (size_t i = 0; i < state->count; i++) {
+    if (strcmp(state->vars[i].name, name) == 0)
+      return &state->vars[i];
+  }
+  return NULL;
+}
+
+static void state_remove(InferState *state, const char *name) {
+  InferVar *var = state_find(state, name);
+  if (var)
+    *var = state->vars[--state->count];
+}
+
+static void state_set(InferState *state, const char *name, ASTProvenType type,
+                      bool local) {
+  if (type == PROVEN_NONE && !local) {
+    state_remove(state, name); /* Nothing left to know */
+    return;
+  }
+  InferVar *var = state_find(state, name);
+  if (!var) {
+    if (state->count >= state->capacity) {
+      state->capacity = state->capacity == 0 ? 8 : state->capacity * 2;
+      state->vars =
+          (InferVar *)realloc(state->vars, sizeof(InferVar) * state->capacity);
+    }
+    var = &state->vars[state->count++];
+    var->name = name;
+  }
+  var->type = type;
+  var->local = local;
+}
+
+/* Other code ran: forget every variable it could have reassigned */
+static void state_forget_shared(InferState *state) {
+  for (size_t i = 0; i < state->count;) {
+    if (state->vars[i].local)
+      i++;
+    else
+      state->vars[i] = state->vars[--state->count];
+  }
+}
+
+/* Merge the state of another path reaching the same point into state */
+static void state_join(InferState *state, const InferState *other) {
+  if (!other->reachable)
+    return;
+  if (!state->reachable) {
+    InferState copy = state_copy(other);
+    state_move(state, &copy);
+    return;
+  }
+  for (size_t i = 0; i < state->count;) {
+    InferVar *var = &state->vars[i];
+    InferVar *theirs = state_find(other, var->name);
+    if (!theirs) {
+      *var = state->vars[--state->count];
+      continue;
+    }
+    if (var->type != theirs->type)
+      var->type = PROVEN_NONE;
+    var->local = var->local && theirs->local;
+    if (var->type == PROVEN_NONE && !var->local) {
+      *var = state->vars[--state->count];
+      continue;
+    }
+    i++;
+  }
+}
+
+static bool state_equal(const InferState *a, const InferState *b) {
+  if (a->reachable != b->reachable || a->count != b->count)
+    return false;
+  for (size_t i = 0; i < a->count; i++) {
+    InferVar *theirs = state_find(b, a->vars[i].name);
+    if (!theirs || theirs->type != a->vars[i].type ||
+        theirs->local != a->vars[i].local)
+      return false;
+  }
+  return true;
+}
+
+/* ============================================================================
+ * Expressions
+ * ============================================================================
+ */
+
+typedef struct {
+  NameSet rebound;     /* Names the program binds anywhere */
+  bool builtins_known; /* Nothing is incorporated */
+} InferProgram;
+
+typedef struct {
+  InferProgram *program;
+  NameSet captured;       /* Names nested protocols can assign */
+  InferState *breaks;     /* Innermost loop's states at break */
+  InferState *continues;  /* ... and at continue */
+  size_t opaque;          /* Times other code may have run */
+  ASTProvenType result;   /* Join of every yield so far */
+  bool yields;
+} InferContext;
+
+/* Built-ins that never run other code, with the type of all their results
+ * (PROVEN_NONE where it varies) */
+static const struct {
+  const char *name;
+  ASTProvenType result;
+} pure_builtins[] = {
+    {"measure", PROVEN_INT},      {"number", PROVEN_INT},
+    {"find", PROVEN_INT},         {"clock", PROVEN_INT},
+    {"timestamp", PROVEN_INT},    {"decimal", PROVEN_FLOAT},
+    {"sqrt", PROVEN_FLOAT},       {"text", PROVEN_STRING},
+    {"classify", PROVEN_STRING},  {"uppercase", PROVEN_STRING},
+    {"lowercase", PROVEN_STRING}, {"trim", PROVEN_STRING},
+    {"join", PROVEN_STRING},      {"contains", PROVEN_BOOL},
+    {"boolean", PROVEN_BOOL},     {"span", PROVEN_LIST},
+    {"split", PROVEN_LIST},       {"abs", PROVEN_NONE},
+    {"min", PROVEN_NONE},         {"max", PROVEN_NONE},
+    {"hash", PROVEN_NONE},        {"push", PROVEN_NONE},
+    {"pop", PROVEN_NONE},         {"insert", PROVEN_NONE},
+    {"extend", PROVEN_NONE},      {"reserve", PROVEN_NONE},
+    {"declare", PROVEN_NONE},     {"announce", PROVEN_NONE},
+};
+
+#define PURE_BUILTIN_COUNT (sizeof(pure_builtins) / sizeof(pure_builtins[0]))
+
+/* Index into pure_builtins of the built-in a call refers to, or -1 */
+static int pure_builtin(const InferProgram *program, const char *name) {
+  if (!program->builtins_known || name_set_has(&program->rebound, name))
+    return -1;
+  for (size_t i = 0; i < PURE_BUILTIN_COUNT; i++) {
+    if (strcmp(pure_builtins[i].name, name) == 0)
+      return (int)i;
+  }
+  return -1;
+}
+
+static void forget_shared(InferContext *ctx, InferState *state) {
+  ctx->opaque++;
+  state_forget_shared(state);
+}
+
+static ASTProvenType join_types(ASTProvenType a, ASTProvenType b) {
+  return a == b ? a : PROVEN_NONE;
+}
+
+static bool is_number(ASTProvenType type) {
+  return type == PROVEN_INT || type == PROVEN_FLOAT;
+}
+
+/* The result of a binary operator, as eval_binary computes it */
+static ASTProvenType binary_type(BinaryOp op, ASTProvenType a,
+                                 ASTProvenType b) {
+  bool numbers = is_number(a) && is_number(b);
+  ASTProvenType mixed =
+      a == PROVEN_FLOAT || b == PROVEN_FLOAT ? PROVEN_FLOAT : PROVEN_INT;
+
+  switch (op) {
+  case OP_ADD:
+    if (a == PROVEN_STRING || b == PROVEN_STRING)
+      return PROVEN_STRING;
+    return numbers ? mixed : PROVEN_NONE;
+  case OP_MUL:
+    if (a == PROVEN_STRING && b == PROVEN_INT)
+      return PROVEN_STRING;
+    return numbers ? mixed : PROVEN_NONE;
+  case OP_SUB:
+    return numbers ? mixed : PROVEN_NONE;
+  case OP_DIV:
+  case OP_POW:
+    return numbers ? PROVEN_FLOAT : PROVEN_NONE;
+  case OP_INT_DIV:
+  case OP_MOD:
+    return numbers ? PROVEN_INT : PROVEN_NONE;
+  default:
+    return PROVEN_BOOL; /* Comparisons, and, or */
+  }
+}
+
+static ASTProvenType infer_expr(InferContext *ctx, InferState *state,
+                                ASTNode *node);
+
+typedef struct {
+  InferContext *ctx;
+  InferState *state;
+} InferWalk;
+
+static void infer_child(ASTNode *child, void *data) {
+  InferWalk *walk = (InferWalk *)data;
+  infer_expr(walk->ctx, walk->state, child);
+}
+
+static void infer_children(InferContext *ctx, InferState *state,
+                           ASTNode *node) {
+  InferWalk walk = {ctx, state};
+  ast_visit_children(node, infer_child, &walk);
+}
+
+static ASTProvenType infer_call(InferContext *ctx, InferState *state,
+                                ASTNode *node) {
+  infer_children(ctx, state, node);
+  int pure = pure_builtin(ctx->program, node->data.call.name);
+  if (pure < 0) {
+    forget_shared(ctx, state);
+    return PROVEN_NONE;
+  }
+
+  /* abs keeps the kind of number it is given */
+  ASTNodeArray *args = &node->data.call.args;
+  if (strcmp(pure_builtins[pure].name, "abs") == 0 && args->count == 1 &&
+      is_number(args->nodes[0]->proven))
+    return (ASTProvenType)args->nodes[0]->proven;
+  return pure_builtins[pure].result;
+}
+
+/* The comprehension's variable lives in a scope of its own */
+static ASTProvenType infer_comprehension(InferContext *ctx,
+                                         InferState *state, ASTNode *node) {
+  ASTProvenType source = infer_expr(ctx, state, node->data.list_comp.iterable);
+  if (source != PROVEN_LIST)
+    forget_shared(ctx, state); /* Generators run code as they are read */
+
+  size_t opaque = ctx->opaque;
+  InferState inner = state_copy(state);
+  state_set(&inner, node->data.list_comp.var_name, PROVEN_NONE, true);
+  if (node->data.list_comp.condition)
+    infer_expr(ctx, &inner, node->data.list_comp.condition);
+  infer_expr(ctx, &inner, node->data.list_comp.expr);
+  state_free(&inner);
+  if (ctx->opaque != opaque)
+    forget_shared(ctx, state);
+  return PROVEN_LIST;
+}
+
+static ASTProvenType infer_expr(InferContext *ctx, InferState *state,
+                                ASTNode *node) {
+  ASTProvenType type = PROVEN_NONE;
+
+  switch (node->type) {
+  case AST_INTEGER:
+    type = PROVEN_INT;
+    break;
+  case AST_FLOAT:
+    type = PROVEN_FLOAT;
+    break;
+  case AST_STRING:
+    type = PROVEN_STRING;
+    break;
+  case AST_BOOL:
+    type = PROVEN_BOOL;
+    break;
+
+  case AST_FSTRING:
+    infer_children(ctx, state, node);
+    type = PROVEN_STRING;
+    break;
+
+  case AST_LIST:
+    infer_children(ctx, state, node);
+    type = PROVEN_LIST;
+    break;
+
+  case AST_IDENTIFIER: {
+    InferVar *var = state_find(state, node->data.identifier.name);
+    type = var ? var->type : PROVEN_NONE;
+    break;
+  }
+
+  case AST_BINARY_OP: {
+    ASTProvenType a = infer_expr(ctx, state, node->data.binary.left);
+    ASTProvenType b = infer_expr(ctx, state, node->data.binary.right);
+    type = binary_type(node->data.binary.op, a, b);
+    break;
+  }
+
+  case AST_UNARY_OP: {
+    ASTProvenType operand = infer_expr(ctx, state, node->data.unary.operand);
+    if (node->data.unary.op == OP_NOT)
+      type = PROVEN_BOOL;
+    else if (is_number(operand))
+      type = operand;
+    break;
+  }
+
+  case AST_TERNARY:
+    infer_expr(ctx, state, node->data.ternary.condition);
+    type = join_types(infer_expr(ctx, state, node->data.ternary.true_value),
+                      infer_expr(ctx, state, node->data.ternary.false_value));
+    break;
+
+  case AST_CALL:
+    type = infer_call(ctx, state, node);
+    break;
+
+  case AST_LIST_COMP:
+    type = infer_comprehension(ctx, state, node);
+    break;
+
+  case AST_DICT:
+  case AST_INDEX:
+  case AST_MEMBER:
+  case AST_SLICE:
+  case AST_SPREAD:
+    infer_children(ctx, state, node);
+    break;
+
+  case AST_SELF:
+  case AST_LAMBDA: /* Its body runs elsewhere */
+    break;
+
+  case AST_GEN_EXPR:
+    /* Runs lazily, seeing whatever the variables hold by then */
+    forget_shared(ctx, state);
+    break;
+
+  default:
+    /* Method calls, manifestations, awaits: other code runs */
+    infer_children(ctx, state, node);
+    forget_shared(ctx, state);
+    break;
+  }
+
+  node->proven = (uint8_t)type;
+  return type;
+}
+
+/* ============================================================================
+ * Statements
+ * ============================================================================
+ */
+
+/* Bind a name as assignment does. Designation binds in the call's scope;
+ * plain assignment rebinds a name already there and otherwise may reach
+ * an enclosing scope. */
+static void infer_bind(InferContext *ctx, InferState *state, const char *name,
+                       ASTProvenType type, bool designate) {
+  InferVar *var = state_find(state, name);
+  bool local = (designate || (var && var->local)) &&
+               !name_set_has(&ctx->captured, name);
+  state_set(state, name, type, local);
+}
+
+static void infer_pattern(InferContext *ctx, InferState *state,
+                          ASTNode *pattern, ASTProvenType type,
+                          bool designate) {
+  switch (pattern->type) {
+  case AST_IDENTIFIER:
+    infer_bind(ctx, state, pattern->data.identifier.name, type, designate);
+    break;
+  case AST_LIST:
+    for (size_t i = 0; i < pattern->data.list.elements.count; i++) {
+      infer_pattern(ctx, state, pattern->data.list.elements.nodes[i],
+                    PROVEN_NONE, designate);
+    }
+    break;
+  case AST_DICT:
+    for (size_t i = 0; i < pattern->data.dict.pairs.count; i++) {
+      infer_pattern(ctx, state, pattern->data.dict.pairs.pairs[i].value,
+                    PROVEN_NONE, designate);
+    }
+    break;
+  case AST_SPREAD:
+    infer_pattern(ctx, state, pattern->data.spread.expr, PROVEN_NONE,
+                  designate);
+    break;
+  default:
+    /* An index or member target evaluates its parts */
+    infer_children(ctx, state, pattern);
+    break;
+  }
+}
+
+/* Forget every name a pattern binds */
+static void forget_pattern(InferState *state, ASTNode *pattern) {
+  NameSet names = {0};
+  add_pattern_names(pattern, &names);
+  for (size_t i = 0; i < names.count; i++) {
+    state_remove(state, names.names[i]);
+  }
+  name_set_free(&names);
+}
+
+static void infer_block(InferContext *ctx, InferState *state,
+                        ASTNodeArray *body);
+
+/* Analyse a loop until the state at its head is stable. Each pass starts
+ * from the head, evaluates the condition, binds the loop variable and runs
+ * the body; the head then absorbs the states that come back around. On
+ * exit the state is the head's after the condition, joined with every
+ * break. */
+static void infer_loop(InferContext *ctx, InferState *state,
+                       ASTNode *condition, ASTNode *var, ASTProvenType type,
+                       bool opaque_step, ASTNodeArray *body) {
+  InferState *outer_breaks = ctx->breaks;
+  InferState *outer_continues = ctx->continues;
+  InferState head = state_copy(state);
+  InferState exit = state_new(false);
+  InferState breaks = state_new(false);
+
+  for (;;) {
+    InferState pass = state_copy(&head);
+    if (opaque_step)
+      forget_shared(ctx, &pass); /* Reading a generator runs its body */
+    if (condition)
+      infer_expr(ctx, &pass, condition);
+    state_free(&exit);
+    exit = state_copy(&pass);
+    if (var)
+      infer_pattern(ctx, &pass, var, type, true);
+
+    InferState continues = state_new(false);
+    state_free(&breaks);
+    ctx->breaks = &breaks;
+    ctx->continues = &continues;
+    infer_block(ctx, &pass, body);
+    state_join(&pass, &continues);
+    state_free(&continues);
+
+    InferState next = state_copy(&head);
+    state_join(&next, &pass);
+    state_free(&pass);
+    bool stable = state_equal(&next, &head);
+    state_move(&head, &next);
+    if (stable)
+      break;
+  }
+
+  ctx->breaks = outer_breaks;
+  ctx->continues = outer_continues;
+  state_join(&exit, &breaks);
+  state_move(state, &exit);
+  state_free(&breaks);
+  state_free(&head);
+}
+
+static void infer_foresee(InferContext *ctx, InferState *state,
+                          ASTNode *node) {
+  InferState merged = state_new(false);
+  infer_expr(ctx, state, node->data.foresee.condition);
+  InferState branch = state_copy(state);
+  infer_block(ctx, &branch, &node->data.foresee.body);
+  state_join(&merged, &branch);
+  state_free(&branch);
+
+  for (size_t i = 0; i < node->data.foresee.alternates.count; i++) {
+    ASTAlternate *alt = &node->data.foresee.alternates.alts[i];
+    infer_expr(ctx, state, alt->condition);
+    branch = state_copy(state);
+    infer_block(ctx, &branch, &alt->body);
+    state_join(&merged, &branch);
+    state_free(&branch);
+  }
+
+  /* Without an otherwise block, the empty block falls through */
+  infer_block(ctx, state, &node->data.foresee.otherwise);
+  state_join(&merged, state);
+  state_move(state, &merged);
+}
+
+static void infer_attempt(InferContext *ctx, InferState *state,
+                          ASTNode *node) {
+  InferState recover = state_copy(state);
+  infer_block(ctx, state, &node->data.attempt.try_body);
+  if (node->data.attempt.recover_body.count == 0) {
+    state_free(&recover); /* The deviation keeps unwinding */
+    return;
+  }
+
+  /* A deviation can cut the guarded block short anywhere, even after an
+   * assignment has bound void, so its bindings are all forgotten */
+  NameSet bound = {0};
+  BindingScan scan = {&bound, false, false, false};
+  for (size_t i = 0; i < node->data.attempt.try_body.count; i++) {
+    scan_bindings(node->data.attempt.try_body.nodes[i], &scan);
+  }
+  for (size_t i = 0; i < bound.count; i++) {
+    state_remove(&recover, bound.names[i]);
+  }
+  name_set_free(&bound);
+  forget_shared(ctx, &recover);
+
+  if (node->data.attempt.error_var)
+    infer_bind(ctx, &recover, node->data.attempt.error_var, PROVEN_NONE,
+               true);
+  infer_block(ctx, &recover, &node->data.attempt.recover_body);
+  state_join(state, &recover);
+  state_free(&recover);
+}
+
+/* A statement not analysed in detail: forget whatever it may bind or let
+ * other code change. That state holds anywhere inside it too, so it also
+ * stands for any break, continue or yield within. */
+static void infer_opaque(InferContext *ctx, InferState *state,
+                         ASTNode *node) {
+  NameSet bound = {0};
+  BindingScan scan = {&bound, false, false, false};
+  scan_bindings(node, &scan);
+  for (size_t i = 0; i < bound.count; i++) {
+    state_remove(state, bound.names[i]);
+  }
+  name_set_free(&bound);
+  forget_shared(ctx, state);
+
+  if (ctx->breaks) {
+    state_join(ctx->breaks, state);
+    state_join(ctx->continues, state);
+  }
+  if (scan.yields) {
+    ctx->result = PROVEN_NONE;
+    ctx->yields = true;
+  }
+}
+
+static void infer_stmt(InferContext *ctx, InferState *state, ASTNode *node) {
+  switch (node->type) {
+  case AST_EXPR_STMT:
+    infer_expr(ctx, state, node->data.expr_stmt.expr);
+    break;
+
+  case AST_DESIGNATE:
+  case AST_ASSIGN: {
+    ASTProvenType type = infer_expr(ctx, state, node->data.assign.value);
+    ASTNode *target = node->data.assign.target;
+    infer_pattern(ctx, state, target, type, node->type == AST_DESIGNATE);
+    node->proven =
+        (uint8_t)(target->type == AST_IDENTIFIER ? type : PROVEN_NONE);
+    break;
+  }
+
+  case AST_FORESEE:
+    infer_foresee(ctx, state, node);
+    break;
+
+  case AST_CYCLE_WHILE:
+    infer_loop(ctx, state, node->data.cycle_while.condition, NULL,
+               PROVEN_NONE, false, &node->data.cycle_while.body);
+    break;
+
+  case AST_CYCLE_FROM_TO: {
+    /* Any float bound makes every value a float; see range_bounds */
+    ASTNode *bounds[3] = {node->data.cycle_from_to.start,
+                          node->data.cycle_from_to.end,
+                          node->data.cycle_from_to.step};
+    ASTProvenType type = PROVEN_INT;
+    for (int i = 0; i < 3; i++) {
+      if (!bounds[i])
+        continue;
+      ASTProvenType bound = infer_expr(ctx, state, bounds[i]);
+      if (!is_number(bound) || !is_number(type))
+        type = PROVEN_NONE;
+      else if (bound == PROVEN_FLOAT)
+        type = PROVEN_FLOAT;
+    }
+    ASTNode *var = node->data.cycle_from_to.var_pattern;
+    node->proven =
+        (uint8_t)(var->type == AST_IDENTIFIER ? type : PROVEN_NONE);
+    infer_loop(ctx, state, NULL, var, type, false,
+               &node->data.cycle_from_to.body);
+    /* Void if the loop never ran */
+    infer_pattern(ctx, state, var, PROVEN_NONE, true);
+    break;
+  }
+
+  case AST_CYCLE_THROUGH: {
+    ASTProvenType source =
+        infer_expr(ctx, state, node->data.cycle_through.iterable);
+    ASTNode *var = node->data.cycle_through.var_pattern;
+    infer_loop(ctx, state, NULL, var, PROVEN_NONE,
+               source != PROVEN_LIST && source != PROVEN_STRING,
+               &node->data.cycle_through.body);
+    forget_pattern(state, var); /* Unbound if the loop never ran */
+    break;
+  }
+
+  case AST_YIELD: {
+    ASTProvenType type = node->data.yield.value
+                             ? infer_expr(ctx, state, node->data.yield.value)
+                             : PROVEN_NONE;
+    node->proven = (uint8_t)type;
+    ctx->result = ctx->yields ? join_types(ctx->result, type) : type;
+    ctx->yields = true;
+    state->reachable = false;
+    break;
+  }
+
+  case AST_BREAK:
+  case AST_CONTINUE:
+    if (ctx->breaks)
+      state_join(node->type == AST_BREAK ? ctx->breaks : ctx->continues,
+                 state);
+    state->reachable = false;
+    break;
+
+  case AST_ATTEMPT:
+    infer_attempt(ctx, state, node);
+    break;
+
+  case AST_PROTOCOL:
+    /* Defining a nested protocol runs nothing; it is analysed on its own */
+    infer_bind(ctx, state, node->data.protocol.name, PROVEN_NONE, true);
+    break;
+
+  default:
+    infer_opaque(ctx, state, node);
+    break;
+  }
+}
+
+static void infer_block(InferContext *ctx, InferState *state,
+                        ASTNodeArray *body) {
+  for (size_t i = 0; i < body->count && state->reachable; i++) {
+    infer_stmt(ctx, state, body->nodes[i]);
+  }
+}
+
+/* ============================================================================
+ * Protocols
+ * ============================================================================
+ */
+
+static bool analysed(const ASTNode *protocol) {
+  return !protocol->data.protocol.is_sequence &&
+         !protocol->data.protocol.is_async;
+}
+
+static void infer_protocol(InferProgram *program, ASTNode *node) {
+  InferContext ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.program = program;
+  for (size_t i = 0; i < node->data.protocol.body.count; i++) {
+    scan_captured(node->data.protocol.body.nodes[i], &ctx.captured);
+  }
+
+  /* Arguments can be anything, except that rest parameters collect them
+   * into a list */
+  InferState state = state_new(true);
+  for (size_t i = 0; i < node->data.protocol.params.count; i++) {
+    ASTParam *param = &node->data.protocol.params.params[i];
+    infer_pattern(&ctx, &state, param->pattern,
+                  param->is_rest ? PROVEN_LIST : PROVEN_NONE, true);
+  }
+
+  infer_block(&ctx, &state, &node->data.protocol.body);
+
+  /* Falling off the end yields void */
+  node->proven =
+      (uint8_t)(ctx.yields && !state.reachable ? ctx.result : PROVEN_NONE);
+  state_free(&state);
+  name_set_free(&ctx.captured);
+}
+
+static void infer_protocols(ASTNode *node, void *data) {
+  if (node->type == AST_PROTOCOL && analysed(node))
+    infer_protocol((InferProgram *)data, node);
+  ast_visit_children(node, infer_protocols, data);
+}
+
+void infer_program(ASTNode *program) {
+  InferProgram info;
+  memset(&info, 0, sizeof(info));
+  BindingScan scan = {&info.rebound, true, false, false};
+  scan_bindings(program, &scan);
+  info.builtins_known = !scan.imports;
+
+  infer_protocols(program, &info);
+  name_set_free(&info.rebound);
+}
+
+/* ============================================================================
+ * Reporting
+ * ============================================================================
+ */
+
+const char *infer_type_name(ASTProvenType type) {
+  switch (type) {
+  case PROVEN_BOOL:
+    return "bool";
+  case PROVEN_INT:
+    return "int";
+  case PROVEN_FLOAT:
+    return "float";
+  case PROVEN_STRING:
+    return "string";
+  case PROVEN_LIST:
+    return "list";
+  default:
+    return "?";
+  }
+}
+
+static bool is_expression(ASTNodeType type) {
+  switch (type) {
+  case AST_INTEGER:
+  case AST_FLOAT:
+  case AST_STRING:
+  case AST_FSTRING:
+  case AST_BOOL:
+  case AST_LIST:
+  case AST_DICT:
+  case AST_IDENTIFIER:
+  case AST_BINARY_OP:
+  case AST_UNARY_OP:
+  case AST_CALL:
+  case AST_INDEX:
+  case AST_MEMBER:
+  case AST_MANIFEST:
+  case AST_SELF:
+  case AST_METHOD_CALL:
+  case AST_ASCEND:
+  case AST_LAMBDA:
+  case AST_TERNARY:
+  case AST_LIST_COMP:
+  case AST_SLICE:
+  case AST_SPREAD:
+  case AST_GEN_EXPR:
+  case AST_AWAIT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+typedef struct {
+  FILE *out;
+  size_t expressions;
+  size_t proven;
+} InferReport;
+
+/* Report the bindings in a body and count its expressions, leaving nested
+ * protocols to their own report */
+static void report_node(ASTNode *node, void *data) {
+  InferReport *report = (InferReport *)data;
+
+  switch (node->type) {
+  case AST_PROTOCOL:
+  case AST_ENTITY:
+    return;
+
+  case AST_DESIGNATE:
+  case AST_ASSIGN: {
+    ASTNode *target = node->data.assign.target;
+    if (target->type == AST_IDENTIFIER) {
+      fprintf(report->out, "      line %-4d %s : %s\n", node->line,
+              target->data.identifier.name,
+              infer_type_name((ASTProvenType)node->proven));
+    } else if (target->type == AST_INDEX || target->type == AST_MEMBER) {
+      ast_visit_children(target, report_node, report);
+    }
+    report_node(node->data.assign.value, report);
+    return;
+  }
+
+  case AST_CYCLE_FROM_TO: {
+    ASTNode *var = node->data.cycle_from_to.var_pattern;
+    if (var->type == AST_IDENTIFIER) {
+      fprintf(report->out, "      line %-4d %s : %s (counter)\n", node->line,
+              var->data.identifier.name,
+              infer_type_name((ASTProvenType)node->proven));
+    }
+    ASTNode *bounds[3] = {node->data.cycle_from_to.start,
+                          node->data.cycle_from_to.end,
+                          node->data.cycle_from_to.step};
+    for (int i = 0; i < 3; i++) {
+      if (bounds[i])
+        report_node(bounds[i], report);
+    }
+    for (size_t i = 0; i < node->data.cycle_from_to.body.count; i++) {
+      report_node(node->data.cycle_from_to.body.nodes[i], report);
+    }
+    return;
+  }
+
+  case AST_CYCLE_THROUGH:
+    report_node(node->data.cycle_through.iterable, report);
+    for (size_t i = 0; i < node->data.cycle_through.body.count; i++) {
+      report_node(node->data.cycle_through.body.nodes[i], report);
+    }
+    return;
+
+  default:
+    break;
+  }
+
+  if (is_expression(node->type)) {
+    report->expressions++;
+    if (node->proven != PROVEN_NONE)
+      report->proven++;
+    if (node->type == AST_LAMBDA || node->type == AST_GEN_EXPR)
+      return; /* Not analysed inside */
+  }
+  ast_visit_children(node, report_node, report);
+}
+
+static void dump_protocols(ASTNode *node, void *data) {
+  FILE *out = (FILE *)data;
+  if (node->type == AST_PROTOCOL) {
+    if (!analysed(node)) {
+      fprintf(out, "  ◈ %s (line %d): sequences and async protocols are not "
+                   "analysed\n",
+              node->data.protocol.name, node->line);
+    } else {
+      fprintf(out, "  ◈ %s (line %d) yields %s\n", node->data.protocol.name,
+              node->line, infer_type_name((ASTProvenType)node->proven));
+      InferReport report = {out, 0, 0};
+      for (size_t i = 0; i < node->data.protocol.body.count; i++) {
+        report_node(node->data.protocol.body.nodes[i], &report);
+      }
+      fprintf(out, "      %zu of %zu expressions proven\n", report.proven,
+              report.expressions);
+    }
+  }
+  ast_visit_children(node, dump_protocols, data);
+}
+
+void infer_dump(FILE *out, ASTNode *program) {
+  dump_protocols(program, out);
+}
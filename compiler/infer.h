@@ -0,0 +1,39 @@
+/*
+ * Keikaku Programming Language - Type Inference
+ *
+ * "Every variable was accounted for in advance."
+ *
+ * An optional pass over protocol bodies that proves which expressions can
+ * only ever produce one type, recording it in each node's `proven` field.
+ * The evaluator then runs arithmetic on proven operands without checking
+ * or specialising on their types.
+ *
+ * The pass is flow-sensitive: a variable's type follows its assignments
+ * through branches and loops, merging where paths meet. It is conservative:
+ * parameters, indexing, members and calls of protocols prove nothing, and
+ * anything that can run other code (a protocol call, a method, a
+ * manifestation) forgets every variable that might not live in the call's
+ * own scope. Variables that nested protocols refer to are never considered
+ * the call's own. Sequences and async protocols are skipped.
+ *
+ * Built-ins contribute their result types only while the program binds no
+ * name of its own over them and incorporates nothing, so proofs assume the
+ * program runs in a fresh interpreter.
+ */
+
+#ifndef KEIKAKU_INFER_H
+#define KEIKAKU_INFER_H
+
+#include "ast.h"
+#include <stdio.h>
+
+/* Annotate every protocol in program */
+void infer_program(ASTNode *program);
+
+/* Print what infer_program proved, protocol by protocol */
+void infer_dump(FILE *out, ASTNode *program);
+
+/* "int", "float", ... or "?" for PROVEN_NONE */
+const char *infer_type_name(ASTProvenType type);
+
+#endif /* KEIKAKU_INFER_H */
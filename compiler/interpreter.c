@@ -5,8 +5,11 @@
  */
 
 #include "interpreter.h"
+#include "jit.h"
+#include "keikaku.h"
 #include "lexer.h"
 #include "parser.h"
+#include "regex.h"
 #include <ctype.h>
 #include <math.h>
 #include <stdio.h>
@@ -15,6 +18,10 @@
 #include <time.h>
 
 #define INTERP_DEBUG 0
+
+/* Uncaught deviation reporting limits (ignored in verbose mode) */
+#define ERROR_REPEAT_LIMIT 3  /* Identical consecutive reports */
+#define ERROR_REPORT_LIMIT 50 /* Reports per program run */
 #define DEBUG_PRINT(...)                                                       \
   do {                                                                         \
     if (INTERP_DEBUG) {                                                        \
@@ -50,7 +57,7 @@ void voice_print_prompt(void) {
 }
 
 void voice_print_result(Value *val) {
-  if (val->type == VAL_NULL)
+  if (VALUE_TYPE(*val) == VAL_NULL)
     return;
   char *str = value_to_string(val);
   printf("  → %s\n", str);
@@ -111,33 +118,128 @@ void voice_print_runtime_error_tracked(const char *msg, int line,
                                        int repeat_count) {
   if (repeat_count <= 1) {
     /* First occurrence - vague message */
-    printf("  ⚠ A deviation has occurred at line %d.\n", line);
-    printf("    Error: %s\n", msg);
-    printf("    This outcome was... anticipated.\n");
-    printf("    The scenario adjusts accordingly.\n");
+    fprintf(stderr, "  ⚠ A deviation has occurred at line %d.\n", line);
+    fprintf(stderr, "    Error: %s\n", msg);
+    fprintf(stderr, "    This outcome was... anticipated.\n");
+    fprintf(stderr, "    The scenario adjusts accordingly.\n");
   } else if (repeat_count == 2) {
     /* Second occurrence - hint at the problem */
-    printf("  ⚠ The same deviation persists at line %d.\n", line);
-    printf("    Your approach requires... reconsideration.\n");
-    printf("    Hint: %s\n", msg);
+    fprintf(stderr, "  ⚠ The same deviation persists at line %d.\n", line);
+    fprintf(stderr, "    Your approach requires... reconsideration.\n");
+    fprintf(stderr, "    Hint: %s\n", msg);
   } else {
     /* Third+ occurrence - full reveal with Soul Society reference */
-    printf("  ⚠ TERMINAL DEVIATION at line %d.\n", line);
-    printf("    Error: %s\n", msg);
-    printf("\n");
-    printf("    │  \"You will never reach the Zenith.\"                │\n");
-    printf("    │                                                     │\n");
-    printf("    │  Your repeated failures have been noted.            │\n");
-    printf("    │  Perhaps programming was not part of your plan.     │\n");
-    printf("    └─────────────────────────────────────────────────────┘\n");
+    fprintf(stderr, "  ⚠ TERMINAL DEVIATION at line %d.\n", line);
+    fprintf(stderr, "    Error: %s\n", msg);
+    fprintf(stderr, "\n");
+    fprintf(stderr,
+            "    │  \"You will never reach the Zenith.\"                │\n");
+    fprintf(stderr,
+            "    │                                                     │\n");
+    fprintf(stderr,
+            "    │  Your repeated failures have been noted.            │\n");
+    fprintf(stderr,
+            "    │  Perhaps programming was not part of your plan.     │\n");
+    fprintf(stderr,
+            "    └─────────────────────────────────────────────────────┘\n");
   }
 }
 
+void voice_print_deviation_brief(const char *kind, const char *msg, int line) {
+  fprintf(stderr, "  ⚠ line %d: %s: %s\n", line, kind, msg);
+}
+
+void voice_print_deviations_suppressed(size_t count) {
+  fprintf(stderr, "  ◇ %zu further deviation%s suppressed. The pattern is "
+                  "already understood.\n",
+          count, count == 1 ? "" : "s");
+}
+
 /* ============================================================================
  * Value Functions
  * ============================================================================
  */
 
+#ifdef KEIKAKU_NAN_BOXING
+
+static Value nanbox(unsigned tag, uint64_t payload) {
+  Value v;
+  v.bits = ((uint64_t)tag << NANBOX_TAG_SHIFT) | payload;
+  return v;
+}
+
+static Value nanbox_pointer(unsigned tag, const void *object) {
+  uintptr_t address = (uintptr_t)object;
+  if (address > NANBOX_PAYLOAD) {
+    fprintf(stderr, "  ⚠ Address %p does not fit a NaN-boxed value.\n",
+            object);
+    abort();
+  }
+  return nanbox(tag, address);
+}
+
+/* Ints too wide for the payload point to a reference-counted box holding
+ * them. Copies share the box and value_free releases it. */
+typedef struct {
+  int64_t value; /* First, so value_int_of can read it through the pointer */
+  size_t refcount;
+} BigInt;
+
+static bool is_big_int(Value v) {
+  return (v.bits >> NANBOX_TAG_SHIFT) == NANBOX_BIG_INT;
+}
+
+static BigInt *big_int_of(Value v) { return (BigInt *)NANBOX_POINTER(v); }
+
+/* Numbers own nothing but a boxed int, so fast paths release them with
+ * this rather than value_free */
+static inline void value_free_number(Value *val) {
+  if (is_big_int(*val) && --big_int_of(*val)->refcount == 0)
+    free(big_int_of(*val));
+}
+
+Value value_null(void) { return nanbox(VAL_NULL, 0); }
+
+Value value_bool(bool val) { return nanbox(VAL_BOOL, val ? 1 : 0); }
+
+Value value_int(int64_t val) {
+  int64_t limit = (int64_t)1 << (NANBOX_TAG_SHIFT - 1);
+  if (val >= -limit && val < limit)
+    return nanbox(VAL_INT, (uint64_t)val & NANBOX_PAYLOAD);
+  BigInt *box = (BigInt *)malloc(sizeof(BigInt));
+  box->value = val;
+  box->refcount = 1;
+  return nanbox_pointer(NANBOX_BIG_INT, box);
+}
+
+Value value_float(double val) {
+  union {
+    double d;
+    uint64_t bits;
+  } f = {val};
+  /* Only the canonical NaN is a float; other NaN bits encode the rest */
+  if (val != val)
+    f.bits = UINT64_C(0x7FF8000000000000);
+  Value v;
+  v.bits = f.bits ^ NANBOX_XOR;
+  return v;
+}
+
+Value value_builtin(BuiltinFn fn) {
+  uintptr_t address = (uintptr_t)fn;
+  if (address > NANBOX_PAYLOAD)
+    abort();
+  return nanbox(VAL_BUILTIN, address);
+}
+
+Value value_wrap(ValueType type, void *object) {
+  return nanbox_pointer(type, object);
+}
+
+#else
+
+static inline void value_free_number(Value *val) { (void)val; }
+
 Value value_null(void) {
   Value v;
   v.type = VAL_NULL;
@@ -165,87 +267,295 @@ Value value_float(double val) {
   return v;
 }
 
-Value value_string(const char *val) {
+Value value_builtin(BuiltinFn fn) {
   Value v;
-  v.type = VAL_STRING;
-  v.data.string_val = strdup(val);
+  v.type = VAL_BUILTIN;
+  v.data.builtin_val = fn;
   return v;
 }
 
-Value value_list_new(void) {
+Value value_wrap(ValueType type, void *object) {
   Value v;
-  v.type = VAL_LIST;
-  v.data.list_val = (ValueList *)calloc(1, sizeof(ValueList));
+  v.type = type;
+  switch (type) {
+  case VAL_STRING:
+    v.data.string_val = (char *)object;
+    break;
+  case VAL_LIST:
+    v.data.list_val = (ValueList *)object;
+    break;
+  case VAL_DICT:
+    v.data.dict_val = (ValueDict *)object;
+    break;
+  case VAL_SET:
+    v.data.set_val = (ValueSet *)object;
+    break;
+  case VAL_FUNCTION:
+    v.data.func_val = (Function *)object;
+    break;
+  case VAL_CLASS:
+    v.data.class_val = (KeikakuClass *)object;
+    break;
+  case VAL_INSTANCE:
+    v.data.instance_val = (KeikakuInstance *)object;
+    break;
+  case VAL_GENERATOR:
+    v.data.gen_val = (Generator *)object;
+    break;
+  case VAL_PROMISE:
+    v.data.promise_val = (Promise *)object;
+    break;
+  case VAL_ERROR:
+    v.data.error_val = (KeikakuError *)object;
+    break;
+  default:
+    return value_null();
+  }
   return v;
 }
 
-Value value_dict_new(void) {
-  Value v;
-  v.type = VAL_DICT;
-  v.data.dict_val = (ValueDict *)calloc(1, sizeof(ValueDict));
+#endif /* KEIKAKU_NAN_BOXING */
+
+/* Strings keep their byte length in a header just before the characters,
+ * so string_val stays a plain NUL-terminated char * for existing callers.
+ * Text is UTF-8; indexing, slicing and measure count codepoints. */
+typedef struct StringHeader {
+  size_t length;     /* Bytes */
+  size_t codepoints; /* STRING_UNSCANNED until first needed */
+  size_t *offsets;   /* Byte offset of every STRING_STRIDE-th codepoint;
+                      * NULL for pure ASCII, where offsets are identity */
+  uint64_t hash;     /* 0 until first hashed; strings never change */
+} StringHeader;
+
+#define STRING_HEADER(chars) (((StringHeader *)(void *)(chars)) - 1)
+#define STRING_UNSCANNED SIZE_MAX
+#define STRING_STRIDE 32
+
+#define UTF8_IS_CONTINUATION(byte) (((unsigned char)(byte) & 0xC0) == 0x80)
+
+/* A string of the given length with uninitialized contents to fill in */
+Value value_string_alloc(size_t length) {
+  StringHeader *header =
+      (StringHeader *)malloc(sizeof(StringHeader) + length + 1);
+  header->length = length;
+  header->codepoints = STRING_UNSCANNED;
+  header->offsets = NULL;
+  header->hash = 0;
+  char *chars = (char *)(header + 1);
+  chars[length] = '\0';
+  return value_wrap(VAL_STRING, chars);
+}
+
+Value value_string_from(const char *data, size_t length) {
+  Value v = value_string_alloc(length);
+  memcpy(VALUE_STRING(v), data, length);
   return v;
 }
 
+Value value_string(const char *val) {
+  return value_string_from(val, strlen(val));
+}
+
+size_t value_string_length(const Value *val) {
+  return STRING_HEADER(VALUE_STRING(*val))->length;
+}
+
+/* Count codepoints once; non-ASCII strings also get a sparse offset index */
+static StringHeader *string_scan(const Value *val) {
+  StringHeader *header = STRING_HEADER(VALUE_STRING(*val));
+  if (header->codepoints != STRING_UNSCANNED)
+    return header;
+
+  const char *chars = VALUE_STRING(*val);
+  size_t count = 0;
+  for (size_t i = 0; i < header->length; i++) {
+    count += !UTF8_IS_CONTINUATION(chars[i]);
+  }
+  header->codepoints = count;
+
+  if (count != header->length) {
+    header->offsets =
+        (size_t *)malloc(sizeof(size_t) * (count / STRING_STRIDE + 1));
+    size_t cp = 0;
+    for (size_t i = 0; i < header->length; i++) {
+      if (UTF8_IS_CONTINUATION(chars[i]))
+        continue;
+      if (cp % STRING_STRIDE == 0)
+        header->offsets[cp / STRING_STRIDE] = i;
+      cp++;
+    }
+  }
+  return header;
+}
+
+size_t value_string_codepoints(const Value *val) {
+  return string_scan(val)->codepoints;
+}
+
+/* Byte offset of a codepoint position (the byte length at the end) */
+size_t value_string_offset(const Value *val, size_t codepoint) {
+  StringHeader *header = string_scan(val);
+  if (!header->offsets)
+    return codepoint < header->length ? codepoint : header->length;
+  if (codepoint >= header->codepoints)
+    return header->length;
+
+  /* Jump to the nearest indexed codepoint, then walk at most a stride */
+  const char *chars = VALUE_STRING(*val);
+  size_t offset = header->offsets[codepoint / STRING_STRIDE];
+  for (size_t n = codepoint % STRING_STRIDE; n > 0; n--) {
+    do {
+      offset++;
+    } while (UTF8_IS_CONTINUATION(chars[offset]));
+  }
+  return offset;
+}
+
+/* Appends into a string header block, which becomes the final Value without
+ * a further copy */
+typedef struct StringBuilder {
+  StringHeader *block;
+  size_t length;
+  size_t capacity; /* Bytes for characters, excluding the NUL */
+} StringBuilder;
+
+static void sb_init(StringBuilder *sb, size_t capacity) {
+  sb->block = (StringHeader *)malloc(sizeof(StringHeader) + capacity + 1);
+  sb->length = 0;
+  sb->capacity = capacity;
+}
+
+/* Room for extra bytes (plus a NUL) at the end; returns the write position */
+static char *sb_reserve(StringBuilder *sb, size_t extra) {
+  if (sb->length + extra > sb->capacity) {
+    size_t capacity = sb->capacity * 2;
+    if (capacity < sb->length + extra)
+      capacity = sb->length + extra;
+    sb->block = (StringHeader *)realloc(sb->block,
+                                        sizeof(StringHeader) + capacity + 1);
+    sb->capacity = capacity;
+  }
+  return (char *)(sb->block + 1) + sb->length;
+}
+
+static void sb_append(StringBuilder *sb, const char *data, size_t length) {
+  memcpy(sb_reserve(sb, length), data, length);
+  sb->length += length;
+}
+
+static void sb_fill(StringBuilder *sb, char c, size_t count) {
+  memset(sb_reserve(sb, count), c, count);
+  sb->length += count;
+}
+
+static Value sb_finish(StringBuilder *sb) {
+  sb->block->length = sb->length;
+  sb->block->codepoints = STRING_UNSCANNED;
+  sb->block->offsets = NULL;
+  sb->block->hash = 0;
+  char *chars = (char *)(sb->block + 1);
+  chars[sb->length] = '\0';
+  return value_wrap(VAL_STRING, chars);
+}
+
+static void sb_discard(StringBuilder *sb) { free(sb->block); }
+
+static char *sb_data(StringBuilder *sb) { return (char *)(sb->block + 1); }
+
+/* Codepoint position of a byte offset */
+static size_t string_codepoint_at(const Value *val, size_t offset) {
+  StringHeader *header = string_scan(val);
+  if (!header->offsets)
+    return offset;
+  size_t count = 0;
+  for (size_t i = 0; i < offset; i++) {
+    count += !UTF8_IS_CONTINUATION(VALUE_STRING(*val)[i]);
+  }
+  return count;
+}
+
+Value value_list_new(void) {
+  return value_wrap(VAL_LIST, calloc(1, sizeof(ValueList)));
+}
+
+Value value_dict_new(void) {
+  return value_wrap(VAL_DICT, calloc(1, sizeof(ValueDict)));
+}
+
+Value value_set_new(void) {
+  return value_wrap(VAL_SET, calloc(1, sizeof(ValueSet)));
+}
+
 Value value_function(ASTNode *node, Environment *closure) {
-  Value v;
-  v.type = VAL_FUNCTION;
-  v.data.func_val = (Function *)calloc(1, sizeof(Function));
-  v.data.func_val->name = strdup(node->data.protocol.name);
-  v.data.func_val->node = node;
-  v.data.func_val->closure = closure;
-  v.data.func_val->is_lambda = false;
-  v.data.func_val->is_sequence = node->data.protocol.is_sequence;
-  return v;
+  Function *func = (Function *)calloc(1, sizeof(Function));
+  func->name = strdup(node->data.protocol.name);
+  func->node = node;
+  func->closure = closure;
+  func->is_lambda = false;
+  func->is_sequence = node->data.protocol.is_sequence;
+  return value_wrap(VAL_FUNCTION, func);
 }
 
 Value value_generator_new(Function *func, Environment *env, Value self_val) {
-  Value v;
-  v.type = VAL_GENERATOR;
-  v.data.gen_val = (Generator *)calloc(1, sizeof(Generator));
-
-  Value func_v;
-  func_v.type = VAL_FUNCTION;
-  func_v.data.func_val = func;
-  v.data.gen_val->func_val = value_copy(&func_v);
-
-  v.data.gen_val->env = env;
-  v.data.gen_val->self_val = value_copy(&self_val);
-  v.data.gen_val->status = GEN_SUSPENDED;
-  v.data.gen_val->stack = NULL;
-  v.data.gen_val->stack_count = 0;
-  v.data.gen_val->stack_capacity = 0;
-  v.data.gen_val->sent_value = value_null();
-  v.data.gen_val->has_sent = false;
-  v.data.gen_val->thrown_value = value_null();
-  v.data.gen_val->has_thrown = false;
-  return v;
+  Generator *gen = (Generator *)calloc(1, sizeof(Generator));
+  Value func_v = value_wrap(VAL_FUNCTION, func);
+  gen->func_val = value_copy(&func_v);
+
+  gen->env = env;
+  gen->self_val = value_copy(&self_val);
+  gen->status = GEN_SUSPENDED;
+  gen->stack = NULL;
+  gen->stack_count = 0;
+  gen->stack_capacity = 0;
+  gen->sent_value = value_null();
+  gen->has_sent = false;
+  gen->thrown_value = value_null();
+  gen->has_thrown = false;
+  return value_wrap(VAL_GENERATOR, gen);
 }
 
-Value value_builtin(BuiltinFn fn) {
-  Value v;
-  v.type = VAL_BUILTIN;
-  v.data.builtin_val = fn;
-  return v;
+Value value_native_sequence(const char *name, void *state,
+                            bool (*next)(void *state, Value *out),
+                            void (*destroy)(void *state)) {
+  NativeSequence *native = (NativeSequence *)malloc(sizeof(NativeSequence));
+  native->name = name;
+  native->refcount = 1;
+  native->state = state;
+  native->next = next;
+  native->destroy = destroy;
+
+  Generator *gen = (Generator *)calloc(1, sizeof(Generator));
+  gen->func_val = value_null();
+  gen->native = native;
+  gen->self_val = value_null();
+  gen->status = GEN_SUSPENDED;
+  gen->sent_value = value_null();
+  gen->thrown_value = value_null();
+  return value_wrap(VAL_GENERATOR, gen);
 }
 
 Value value_promise_new(void) {
-  Value v;
-  v.type = VAL_PROMISE;
-  v.data.promise_val = (Promise *)calloc(1, sizeof(Promise));
-  v.data.promise_val->state = PROMISE_PENDING;
-  v.data.promise_val->result = value_null();
-  v.data.promise_val->continuation = NULL;
-  return v;
+  Promise *promise = (Promise *)calloc(1, sizeof(Promise));
+  promise->state = PROMISE_PENDING;
+  promise->result = value_null();
+  promise->continuation = NULL;
+  return value_wrap(VAL_PROMISE, promise);
+}
+
+Value value_error_new(const char *kind, const char *message, int line) {
+  KeikakuError *err = (KeikakuError *)calloc(1, sizeof(KeikakuError));
+  err->kind = strdup(kind ? kind : "Deviation");
+  err->message = strdup(message ? message : "");
+  err->line = line;
+  return value_wrap(VAL_ERROR, err);
 }
 
 Value value_promise_resolved(Value result) {
-  Value v;
-  v.type = VAL_PROMISE;
-  v.data.promise_val = (Promise *)calloc(1, sizeof(Promise));
-  v.data.promise_val->state = PROMISE_RESOLVED;
-  v.data.promise_val->result = result;
-  v.data.promise_val->continuation = NULL;
-  return v;
+  Promise *promise = (Promise *)calloc(1, sizeof(Promise));
+  promise->state = PROMISE_RESOLVED;
+  promise->result = result;
+  promise->continuation = NULL;
+  return value_wrap(VAL_PROMISE, promise);
 }
 
 const char *value_type_name(ValueType type) {
@@ -264,6 +574,8 @@ const char *value_type_name(ValueType type) {
     return "list";
   case VAL_DICT:
     return "dict";
+  case VAL_SET:
+    return "set";
   case VAL_FUNCTION:
     return "protocol";
   case VAL_BUILTIN:
@@ -276,6 +588,8 @@ const char *value_type_name(ValueType type) {
     return "sequence";
   case VAL_PROMISE:
     return "promise";
+  case VAL_ERROR:
+    return "deviation";
   default:
     return "unknown";
   }
@@ -284,30 +598,30 @@ const char *value_type_name(ValueType type) {
 char *value_to_string(Value *val) {
   char buffer[1024];
 
-  switch (val->type) {
+  switch (VALUE_TYPE(*val)) {
   case VAL_NULL:
     return strdup("void");
   case VAL_BOOL:
-    return strdup(val->data.bool_val ? "true" : "false");
+    return strdup(VALUE_BOOL(*val) ? "true" : "false");
   case VAL_INT:
-    snprintf(buffer, sizeof(buffer), "%lld", (long long)val->data.int_val);
+    snprintf(buffer, sizeof(buffer), "%lld", (long long)VALUE_INT(*val));
     return strdup(buffer);
   case VAL_FLOAT:
-    snprintf(buffer, sizeof(buffer), "%g", val->data.float_val);
+    snprintf(buffer, sizeof(buffer), "%g", VALUE_FLOAT(*val));
     return strdup(buffer);
   case VAL_STRING:
-    snprintf(buffer, sizeof(buffer), "\"%s\"", val->data.string_val);
+    snprintf(buffer, sizeof(buffer), "\"%s\"", VALUE_STRING(*val));
     return strdup(buffer);
   case VAL_LIST: {
     char *result = strdup("[");
-    for (size_t i = 0; i < val->data.list_val->count; i++) {
+    for (size_t i = 0; i < VALUE_LIST(*val)->count; i++) {
       if (i > 0) {
         char *temp = result;
         result = (char *)malloc(strlen(temp) + 3);
         sprintf(result, "%s, ", temp);
         free(temp);
       }
-      char *item = value_to_string(&val->data.list_val->items[i]);
+      char *item = value_to_string(&VALUE_LIST(*val)->items[i]);
       char *temp = result;
       result = (char *)malloc(strlen(temp) + strlen(item) + 1);
       sprintf(result, "%s%s", temp, item);
@@ -320,77 +634,153 @@ char *value_to_string(Value *val) {
     free(temp);
     return result;
   }
-  case VAL_DICT:
-    return strdup("{...}");
+  case VAL_DICT: {
+    StringBuilder sb;
+    sb_init(&sb, 16);
+    sb_append(&sb, "{", 1);
+    ValueDict *dict = VALUE_DICT(*val);
+    for (size_t i = 0; i < dict->count; i++) {
+      if (i > 0)
+        sb_append(&sb, ", ", 2);
+      sb_append(&sb, "\"", 1);
+      sb_append(&sb, dict->entries[i].key, strlen(dict->entries[i].key));
+      sb_append(&sb, "\": ", 3);
+      char *item = value_to_string(&dict->entries[i].value);
+      sb_append(&sb, item, strlen(item));
+      free(item);
+    }
+    sb_append(&sb, "}", 1);
+    Value text = sb_finish(&sb);
+    char *result = strdup(VALUE_STRING(text));
+    value_free(&text);
+    return result;
+  }
+  case VAL_SET: {
+    ValueSet *set = VALUE_SET(*val);
+    if (set->count == 0)
+      return strdup("set()");
+    StringBuilder sb;
+    sb_init(&sb, 16);
+    sb_append(&sb, "{", 1);
+    for (size_t i = 0; i < set->count; i++) {
+      if (i > 0)
+        sb_append(&sb, ", ", 2);
+      char *item = value_to_string(&set->items[i]);
+      sb_append(&sb, item, strlen(item));
+      free(item);
+    }
+    sb_append(&sb, "}", 1);
+    Value text = sb_finish(&sb);
+    char *result = strdup(VALUE_STRING(text));
+    value_free(&text);
+    return result;
+  }
   case VAL_FUNCTION:
-    snprintf(buffer, sizeof(buffer), "<protocol %s>", val->data.func_val->name);
+    snprintf(buffer, sizeof(buffer), "<protocol %s>",
+             VALUE_FUNCTION(*val)->name);
     return strdup(buffer);
   case VAL_BUILTIN:
     return strdup("<builtin>");
   case VAL_INSTANCE:
     snprintf(buffer, sizeof(buffer), "<manifestation of %s>",
-             val->data.instance_val->class_def->name);
+             VALUE_INSTANCE(*val)->class_def->name);
     return strdup(buffer);
   case VAL_CLASS:
-    snprintf(buffer, sizeof(buffer), "<entity %s>", val->data.class_val->name);
+    snprintf(buffer, sizeof(buffer), "<entity %s>", VALUE_CLASS(*val)->name);
     return strdup(buffer);
   case VAL_GENERATOR:
     snprintf(buffer, sizeof(buffer), "<sequence %s>",
-             val->data.gen_val->func_val.data.func_val->name);
+             VALUE_GENERATOR(*val)->native
+                 ? VALUE_GENERATOR(*val)->native->name
+                 : VALUE_FUNCTION(VALUE_GENERATOR(*val)->func_val)->name);
     return strdup(buffer);
+  case VAL_ERROR:
+    return strdup(VALUE_ERROR(*val)->message);
   default:
     return strdup("<unknown>");
   }
 }
 
 bool value_is_truthy(Value *val) {
-  switch (val->type) {
+  switch (VALUE_TYPE(*val)) {
   case VAL_NULL:
     return false;
   case VAL_BOOL:
-    return val->data.bool_val;
+    return VALUE_BOOL(*val);
   case VAL_INT:
-    return val->data.int_val != 0;
+    return VALUE_INT(*val) != 0;
   case VAL_FLOAT:
-    return val->data.float_val != 0.0;
+    return VALUE_FLOAT(*val) != 0.0;
   case VAL_STRING:
-    return strlen(val->data.string_val) > 0;
+    return value_string_length(val) > 0;
   case VAL_LIST:
-    return val->data.list_val->count > 0;
+    return VALUE_LIST(*val)->count > 0;
+  case VAL_SET:
+    return VALUE_SET(*val)->count > 0;
   default:
     return true;
   }
 }
 
+static void memo_retain(struct MemoCache *memo);
+static void memo_release(struct MemoCache *memo);
+
 void value_free(Value *val) {
-  switch (val->type) {
+  switch (VALUE_TYPE(*val)) {
+#ifdef KEIKAKU_NAN_BOXING
+  case VAL_INT:
+    value_free_number(val);
+    break;
+#endif
   case VAL_STRING:
-    free(val->data.string_val);
+    free(STRING_HEADER(VALUE_STRING(*val))->offsets);
+    free(STRING_HEADER(VALUE_STRING(*val)));
     break;
   case VAL_LIST:
-    for (size_t i = 0; i < val->data.list_val->count; i++) {
-      value_free(&val->data.list_val->items[i]);
+    for (size_t i = 0; i < VALUE_LIST(*val)->count; i++) {
+      value_free(&VALUE_LIST(*val)->items[i]);
     }
-    free(val->data.list_val->items);
-    free(val->data.list_val);
+    free(VALUE_LIST(*val)->items);
+    free(VALUE_LIST(*val));
     break;
   case VAL_DICT:
-    for (size_t i = 0; i < val->data.dict_val->count; i++) {
-      free(val->data.dict_val->entries[i].key);
-      value_free(&val->data.dict_val->entries[i].value);
+    for (size_t i = 0; i < VALUE_DICT(*val)->count; i++) {
+      free(VALUE_DICT(*val)->entries[i].key);
+      value_free(&VALUE_DICT(*val)->entries[i].value);
+    }
+    free(VALUE_DICT(*val)->entries);
+    free(VALUE_DICT(*val));
+    break;
+  case VAL_SET:
+    for (size_t i = 0; i < VALUE_SET(*val)->count; i++) {
+      value_free(&VALUE_SET(*val)->items[i]);
     }
-    free(val->data.dict_val->entries);
-    free(val->data.dict_val);
+    free(VALUE_SET(*val)->items);
+    free(VALUE_SET(*val)->hashes);
+    free(VALUE_SET(*val)->slots);
+    free(VALUE_SET(*val));
     break;
   case VAL_FUNCTION:
-    free(val->data.func_val->name);
-    free(val->data.func_val);
+    if (VALUE_FUNCTION(*val)->memo)
+      memo_release(VALUE_FUNCTION(*val)->memo);
+    if (VALUE_FUNCTION(*val)->owns_closure &&
+        --VALUE_FUNCTION(*val)->closure->refcount == 0)
+      env_destroy(VALUE_FUNCTION(*val)->closure);
+    free(VALUE_FUNCTION(*val)->name);
+    free(VALUE_FUNCTION(*val));
     break;
   case VAL_GENERATOR: {
-    Generator *gen = val->data.gen_val;
+    Generator *gen = VALUE_GENERATOR(*val);
     value_free(&gen->func_val);
     value_free(&gen->self_val);
-    env_destroy(gen->env);
+    value_free(&gen->sent_value);
+    value_free(&gen->thrown_value);
+    if (gen->native && --gen->native->refcount == 0) {
+      gen->native->destroy(gen->native->state);
+      free(gen->native);
+    }
+    if (gen->env)
+      env_destroy(gen->env);
     for (size_t i = 0; i < gen->stack_count; i++) {
       if (gen->stack[i].type == GEN_FRAME_CYCLE_THROUGH) {
         value_free(&gen->stack[i].iterable);
@@ -400,115 +790,465 @@ void value_free(Value *val) {
     free(gen);
     break;
   }
+  case VAL_ERROR: {
+    KeikakuError *err = VALUE_ERROR(*val);
+    free(err->kind);
+    free(err->message);
+    for (size_t i = 0; i < err->trace_count; i++) {
+      free(err->trace[i]);
+    }
+    free(err->trace);
+    free(err);
+    break;
+  }
   default:
     break;
   }
-  val->type = VAL_NULL;
+  *val = value_null();
 }
 
 Value value_copy(Value *val) {
-  Value copy;
-  copy.type = val->type;
+  /* Everything not owned by the value is shared as is */
+  Value copy = *val;
 
-  switch (val->type) {
+  switch (VALUE_TYPE(*val)) {
+#ifdef KEIKAKU_NAN_BOXING
+  case VAL_INT:
+    if (is_big_int(*val))
+      big_int_of(*val)->refcount++;
+    break;
+#endif
   case VAL_STRING:
-    copy.data.string_val = strdup(val->data.string_val);
+    copy = value_string_from(VALUE_STRING(*val), value_string_length(val));
+    STRING_HEADER(VALUE_STRING(copy))->hash =
+        STRING_HEADER(VALUE_STRING(*val))->hash;
     break;
   case VAL_LIST: {
-    copy.data.list_val = (ValueList *)calloc(1, sizeof(ValueList));
-    for (size_t i = 0; i < val->data.list_val->count; i++) {
-      value_list_push(&copy, value_copy(&val->data.list_val->items[i]));
+    copy = value_list_new();
+    for (size_t i = 0; i < VALUE_LIST(*val)->count; i++) {
+      value_list_push(&copy, value_copy(&VALUE_LIST(*val)->items[i]));
+    }
+    break;
+  }
+  case VAL_DICT: {
+    ValueDict *src = VALUE_DICT(*val);
+    ValueDict *dict = (ValueDict *)calloc(1, sizeof(ValueDict));
+    if (src->count > 0) {
+      dict->entries = (DictEntry *)malloc(sizeof(DictEntry) * src->count);
+      dict->capacity = src->count;
+    }
+    for (size_t i = 0; i < src->count; i++) {
+      dict->entries[i].key = strdup(src->entries[i].key);
+      dict->entries[i].value = value_copy(&src->entries[i].value);
     }
+    dict->count = src->count;
+    copy = value_wrap(VAL_DICT, dict);
+    break;
+  }
+  case VAL_SET: {
+    /* Items keep their positions, so the index is copied as is */
+    ValueSet *src = VALUE_SET(*val);
+    ValueSet *set = (ValueSet *)calloc(1, sizeof(ValueSet));
+    if (src->slots) {
+      set->items = (Value *)malloc(sizeof(Value) * src->capacity);
+      set->hashes = (uint64_t *)malloc(sizeof(uint64_t) * src->capacity);
+      set->slots = (size_t *)malloc(sizeof(size_t) * (src->slot_mask + 1));
+      memcpy(set->hashes, src->hashes, sizeof(uint64_t) * src->count);
+      memcpy(set->slots, src->slots, sizeof(size_t) * (src->slot_mask + 1));
+      set->capacity = src->capacity;
+      set->slot_mask = src->slot_mask;
+    }
+    for (size_t i = 0; i < src->count; i++) {
+      set->items[i] = value_copy(&src->items[i]);
+    }
+    set->count = src->count;
+    copy = value_wrap(VAL_SET, set);
     break;
   }
   case VAL_FUNCTION: {
     /* Deep copy the function struct */
-    copy.data.func_val = (Function *)malloc(sizeof(Function));
-    copy.data.func_val->name =
-        val->data.func_val->name ? strdup(val->data.func_val->name) : NULL;
-    copy.data.func_val->node =
-        val->data.func_val->node; /* AST node is shared */
-    copy.data.func_val->closure =
-        val->data.func_val->closure; /* Closure is shared */
-    copy.data.func_val->is_lambda = val->data.func_val->is_lambda;
-    copy.data.func_val->is_sequence = val->data.func_val->is_sequence;
+    Function *func = (Function *)malloc(sizeof(Function));
+    func->name =
+        VALUE_FUNCTION(*val)->name ? strdup(VALUE_FUNCTION(*val)->name) : NULL;
+    func->node = VALUE_FUNCTION(*val)->node;       /* AST node is shared */
+    func->closure = VALUE_FUNCTION(*val)->closure; /* Closure is shared */
+    func->is_lambda = VALUE_FUNCTION(*val)->is_lambda;
+    func->is_sequence = VALUE_FUNCTION(*val)->is_sequence;
+    func->owns_closure = VALUE_FUNCTION(*val)->owns_closure;
+    if (VALUE_FUNCTION(*val)->owns_closure)
+      VALUE_FUNCTION(*val)->closure->refcount++;
+    func->memo = VALUE_FUNCTION(*val)->memo;
+    if (VALUE_FUNCTION(*val)->memo)
+      memo_retain(VALUE_FUNCTION(*val)->memo);
+    copy = value_wrap(VAL_FUNCTION, func);
     break;
   }
   case VAL_GENERATOR: {
-    Generator *src = val->data.gen_val;
-    copy.data.gen_val = (Generator *)calloc(1, sizeof(Generator));
-    copy.data.gen_val->func_val = value_copy(&src->func_val);
-    copy.data.gen_val->env = env_create(src->env->parent); // New local env
+    Generator *src = VALUE_GENERATOR(*val);
+    copy = value_wrap(VAL_GENERATOR, calloc(1, sizeof(Generator)));
+    if (src->native) {
+      /* Native sources cannot be duplicated; the copy shares the handle */
+      *VALUE_GENERATOR(copy) = *src;
+      VALUE_GENERATOR(copy)->sent_value = value_null();
+      VALUE_GENERATOR(copy)->thrown_value = value_null();
+      VALUE_GENERATOR(copy)->has_sent = false;
+      VALUE_GENERATOR(copy)->has_thrown = false;
+      src->native->refcount++;
+      break;
+    }
+    VALUE_GENERATOR(copy)->func_val = value_copy(&src->func_val);
+    VALUE_GENERATOR(copy)->env = env_create(src->env->parent); // New local env
+    VALUE_GENERATOR(copy)->env->function = src->env->function;
     // Copy entries from src->env to copy->env
     for (EnvEntry *e = src->env->entries; e != NULL; e = e->next) {
-      env_define(copy.data.gen_val->env, e->name, value_copy(&e->value));
+      env_define(VALUE_GENERATOR(copy)->env, e->name, value_copy(&e->value));
     }
-    copy.data.gen_val->self_val = value_copy(&src->self_val);
-    copy.data.gen_val->status = src->status;
-    copy.data.gen_val->stack_count = src->stack_count;
-    copy.data.gen_val->stack_capacity = src->stack_count;
+    VALUE_GENERATOR(copy)->self_val = value_copy(&src->self_val);
+    VALUE_GENERATOR(copy)->status = src->status;
+    VALUE_GENERATOR(copy)->stack_count = src->stack_count;
+    VALUE_GENERATOR(copy)->stack_capacity = src->stack_count;
     if (src->stack_count > 0) {
-      copy.data.gen_val->stack =
+      VALUE_GENERATOR(copy)->stack =
           (GenFrame *)malloc(sizeof(GenFrame) * src->stack_count);
       for (size_t i = 0; i < src->stack_count; i++) {
-        copy.data.gen_val->stack[i] = src->stack[i];
+        VALUE_GENERATOR(copy)->stack[i] = src->stack[i];
         if (src->stack[i].type == GEN_FRAME_CYCLE_THROUGH) {
-          copy.data.gen_val->stack[i].iterable =
+          VALUE_GENERATOR(copy)->stack[i].iterable =
               value_copy(&src->stack[i].iterable);
         }
       }
     }
     break;
   }
+  case VAL_ERROR: {
+    KeikakuError *src = VALUE_ERROR(*val);
+    KeikakuError *err = (KeikakuError *)calloc(1, sizeof(KeikakuError));
+    err->kind = strdup(src->kind);
+    err->message = strdup(src->message);
+    err->line = src->line;
+    if (src->trace_count > 0) {
+      err->trace = (char **)malloc(sizeof(char *) * src->trace_count);
+      for (size_t i = 0; i < src->trace_count; i++) {
+        err->trace[i] = strdup(src->trace[i]);
+      }
+      err->trace_count = src->trace_count;
+    }
+    copy = value_wrap(VAL_ERROR, err);
+    break;
+  }
   default:
-    copy.data = val->data;
     break;
   }
 
   return copy;
 }
 
+static EnvEntry *env_find(Environment *env, const char *name);
+
+
+/* The index slot holding an item equal to the given one, or the empty slot
+ * where it would go. The set must have slots. */
+static size_t *set_slot(ValueSet *set, Value *item, uint64_t hash) {
+  size_t i = (size_t)hash & set->slot_mask;
+  while (set->slots[i] != 0) {
+    size_t at = set->slots[i] - 1;
+    if (set->hashes[at] == hash && value_equals(&set->items[at], item))
+      break;
+    i = (i + 1) & set->slot_mask;
+  }
+  return &set->slots[i];
+}
+
+/* Same variables with equal values, in any order */
+static bool scopes_equal(Environment *a, Environment *b) {
+  size_t count = 0;
+  for (EnvEntry *e = b->entries; e; e = e->next) {
+    count++;
+  }
+  for (EnvEntry *e = a->entries; e; e = e->next) {
+    EnvEntry *other = env_find(b, e->name);
+    if (!other || !value_equals(&env_find(a, e->name)->value, &other->value))
+      return false;
+    count--;
+  }
+  return count == 0;
+}
+
+static bool frames_equal(GenFrame *a, GenFrame *b) {
+  if (a->type != b->type || a->node != b->node || a->index != b->index)
+    return false;
+  if (a->type == GEN_FRAME_CYCLE_THROUGH)
+    return a->current == b->current &&
+           value_equals(&a->iterable, &b->iterable);
+  if (a->type == GEN_FRAME_CYCLE_FROM_TO)
+    return a->current == b->current && a->end == b->end &&
+           a->step == b->step && a->origin == b->origin &&
+           a->stride == b->stride;
+  return true;
+}
+
+/* Suspended at the same point with equal state, so they yield alike */
+static bool generators_equal(Generator *a, Generator *b) {
+  if (a->native || b->native)
+    return a->native == b->native;
+  if (VALUE_FUNCTION(a->func_val)->node != VALUE_FUNCTION(b->func_val)->node ||
+      a->status != b->status || a->stack_count != b->stack_count)
+    return false;
+  for (size_t i = 0; i < a->stack_count; i++) {
+    if (!frames_equal(&a->stack[i], &b->stack[i]))
+      return false;
+  }
+  return value_equals(&a->self_val, &b->self_val) &&
+         scopes_equal(a->env, b->env);
+}
+
 bool value_equals(Value *a, Value *b) {
-  if (a->type != b->type)
+  if (VALUE_TYPE(*a) != VALUE_TYPE(*b))
     return false;
 
-  switch (a->type) {
+  switch (VALUE_TYPE(*a)) {
   case VAL_NULL:
     return true;
   case VAL_BOOL:
-    return a->data.bool_val == b->data.bool_val;
+    return VALUE_BOOL(*a) == VALUE_BOOL(*b);
   case VAL_INT:
-    return a->data.int_val == b->data.int_val;
+    return VALUE_INT(*a) == VALUE_INT(*b);
   case VAL_FLOAT:
-    return a->data.float_val == b->data.float_val;
-  case VAL_STRING:
-    return strcmp(a->data.string_val, b->data.string_val) == 0;
+    return VALUE_FLOAT(*a) == VALUE_FLOAT(*b);
+  case VAL_STRING: {
+    size_t length = value_string_length(a);
+    StringHeader *x = STRING_HEADER(VALUE_STRING(*a));
+    StringHeader *y = STRING_HEADER(VALUE_STRING(*b));
+    if (length != y->length || (x->hash && y->hash && x->hash != y->hash))
+      return false;
+    return memcmp(VALUE_STRING(*a), VALUE_STRING(*b), length) == 0;
+  }
   case VAL_LIST:
-    if (a->data.list_val->count != b->data.list_val->count)
+    if (VALUE_LIST(*a)->count != VALUE_LIST(*b)->count)
       return false;
-    for (size_t i = 0; i < a->data.list_val->count; i++) {
-      if (!value_equals(&a->data.list_val->items[i],
-                        &b->data.list_val->items[i]))
+    for (size_t i = 0; i < VALUE_LIST(*a)->count; i++) {
+      if (!value_equals(&VALUE_LIST(*a)->items[i], &VALUE_LIST(*b)->items[i]))
         return false;
     }
     return true;
-  case VAL_DICT:
-    return a->data.dict_val == b->data.dict_val; // For now
+  case VAL_DICT: {
+    /* Same keys with equal values, in any order */
+    ValueDict *x = VALUE_DICT(*a);
+    if (x->count != VALUE_DICT(*b)->count)
+      return false;
+    for (size_t i = 0; i < x->count; i++) {
+      Value *other = value_dict_slot(b, x->entries[i].key);
+      if (!other || !value_equals(&x->entries[i].value, other))
+        return false;
+    }
+    return true;
+  }
+  case VAL_SET: {
+    /* Same members, in any order */
+    ValueSet *x = VALUE_SET(*a);
+    ValueSet *y = VALUE_SET(*b);
+    if (x->count != y->count)
+      return false;
+    for (size_t i = 0; i < x->count; i++) {
+      size_t *slot = set_slot(y, &x->items[i], x->hashes[i]);
+      if (*slot == 0)
+        return false;
+    }
+    return true;
+  }
   case VAL_FUNCTION:
-    return a->data.func_val == b->data.func_val;
+    /* Copies of one protocol value share its node and captured scope */
+    return VALUE_FUNCTION(*a)->node == VALUE_FUNCTION(*b)->node &&
+           VALUE_FUNCTION(*a)->closure == VALUE_FUNCTION(*b)->closure;
   case VAL_BUILTIN:
-    return a->data.builtin_val == b->data.builtin_val;
+    return VALUE_BUILTIN(*a) == VALUE_BUILTIN(*b);
   case VAL_CLASS:
-    return a->data.class_val == b->data.class_val;
+    return VALUE_CLASS(*a) == VALUE_CLASS(*b);
   case VAL_INSTANCE:
-    return a->data.instance_val == b->data.instance_val;
+    /* Instances and promises are shared and change in place, so they are
+     * equal only to themselves and hash by identity; anything keyed on them
+     * stays valid when they change */
+    return VALUE_INSTANCE(*a) == VALUE_INSTANCE(*b);
+  case VAL_PROMISE:
+    return VALUE_PROMISE(*a) == VALUE_PROMISE(*b);
+  case VAL_GENERATOR: {
+    Generator *x = VALUE_GENERATOR(*a);
+    Generator *y = VALUE_GENERATOR(*b);
+    return x == y || generators_equal(x, y);
+  }
+  case VAL_ERROR:
+    return strcmp(VALUE_ERROR(*a)->kind, VALUE_ERROR(*b)->kind) == 0 &&
+           strcmp(VALUE_ERROR(*a)->message, VALUE_ERROR(*b)->message) == 0;
   default:
     return false;
   }
 }
 
+
+/* 64-bit finalizer (MurmurHash3 fmix64) */
+static uint64_t hash_mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+/* FNV-1a */
+static uint64_t hash_bytes(const char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* Hash consistent with value_equals */
+uint64_t value_hash(Value *val) {
+  switch (VALUE_TYPE(*val)) {
+  case VAL_NULL:
+    return 0x9e3779b97f4a7c15ULL;
+  case VAL_BOOL:
+    return hash_mix(VALUE_BOOL(*val) ? 1 : 2);
+  case VAL_INT:
+    return hash_mix((uint64_t)VALUE_INT(*val));
+  case VAL_FLOAT: {
+    double d = VALUE_FLOAT(*val) == 0.0 ? 0.0 : VALUE_FLOAT(*val);
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return hash_mix(bits ^ 0x5bd1e9955bd1e995ULL);
+  }
+  case VAL_STRING: {
+    StringHeader *header = STRING_HEADER(VALUE_STRING(*val));
+    if (!header->hash) {
+      uint64_t h = hash_bytes(VALUE_STRING(*val), header->length);
+      header->hash = h ? h : 1;
+    }
+    return header->hash;
+  }
+  case VAL_LIST: {
+    ValueList *list = VALUE_LIST(*val);
+    uint64_t h = hash_mix(list->count + 0x27d4eb2f165667c5ULL);
+    for (size_t i = 0; i < list->count; i++) {
+      h = hash_mix(h ^ value_hash(&list->items[i]));
+    }
+    return h;
+  }
+  case VAL_DICT: {
+    /* Order-independent, as dicts compare equal in any order */
+    ValueDict *dict = VALUE_DICT(*val);
+    uint64_t h = hash_mix(dict->count + 0x165667b19e3779f9ULL);
+    for (size_t i = 0; i < dict->count; i++) {
+      h += hash_mix(hash_bytes(dict->entries[i].key,
+                               strlen(dict->entries[i].key)) ^
+                    value_hash(&dict->entries[i].value));
+    }
+    return h;
+  }
+  case VAL_SET: {
+    /* Order-independent, from the hashes stored with the members */
+    ValueSet *set = VALUE_SET(*val);
+    uint64_t h = hash_mix(set->count + 0x2545f4914f6cdd1dULL);
+    for (size_t i = 0; i < set->count; i++) {
+      h += hash_mix(set->hashes[i]);
+    }
+    return h;
+  }
+  case VAL_FUNCTION:
+    return hash_mix((uint64_t)(uintptr_t)VALUE_FUNCTION(*val)->node ^
+                    ((uint64_t)(uintptr_t)VALUE_FUNCTION(*val)->closure << 1));
+  case VAL_BUILTIN:
+    return hash_mix((uint64_t)(uintptr_t)VALUE_BUILTIN(*val));
+  case VAL_CLASS:
+    return hash_mix((uint64_t)(uintptr_t)VALUE_CLASS(*val));
+  case VAL_INSTANCE:
+    return hash_mix((uint64_t)(uintptr_t)VALUE_INSTANCE(*val));
+  case VAL_GENERATOR: {
+    Generator *gen = VALUE_GENERATOR(*val);
+    if (gen->native)
+      return hash_mix((uint64_t)(uintptr_t)gen->native);
+    uint64_t h =
+        hash_mix((uint64_t)(uintptr_t)VALUE_FUNCTION(gen->func_val)->node ^
+                 gen->status);
+    for (size_t i = 0; i < gen->stack_count; i++) {
+      h = hash_mix(h ^ gen->stack[i].index);
+    }
+    return h;
+  }
+  case VAL_PROMISE:
+    return hash_mix((uint64_t)(uintptr_t)VALUE_PROMISE(*val));
+  case VAL_ERROR:
+    return hash_bytes(VALUE_ERROR(*val)->kind,
+                      strlen(VALUE_ERROR(*val)->kind)) ^
+           hash_bytes(VALUE_ERROR(*val)->message,
+                      strlen(VALUE_ERROR(*val)->message));
+  default:
+    return 0;
+  }
+}
+
+
+
+/* Total ordering used by sort and binary_search: numbers compare by value,
+ * strings bytewise, lists lexicographically; other values order by type */
+int value_compare(Value *a, Value *b) {
+  bool a_num = VALUE_TYPE(*a) == VAL_INT || VALUE_TYPE(*a) == VAL_FLOAT;
+  bool b_num = VALUE_TYPE(*b) == VAL_INT || VALUE_TYPE(*b) == VAL_FLOAT;
+
+  if (a_num && b_num) {
+    if (VALUE_TYPE(*a) == VAL_INT && VALUE_TYPE(*b) == VAL_INT) {
+      return (VALUE_INT(*a) > VALUE_INT(*b)) -
+             (VALUE_INT(*a) < VALUE_INT(*b));
+    }
+    double x = VALUE_TYPE(*a) == VAL_FLOAT ? VALUE_FLOAT(*a)
+                                           : (double)VALUE_INT(*a);
+    double y = VALUE_TYPE(*b) == VAL_FLOAT ? VALUE_FLOAT(*b)
+                                           : (double)VALUE_INT(*b);
+    /* NaN sorts after every number so the order stays total */
+    if (isnan(x) || isnan(y))
+      return isnan(x) - isnan(y);
+    return (x > y) - (x < y);
+  }
+
+  if (VALUE_TYPE(*a) != VALUE_TYPE(*b)) {
+    return a_num ? -1 : b_num ? 1 : (int)VALUE_TYPE(*a) - (int)VALUE_TYPE(*b);
+  }
+
+  switch (VALUE_TYPE(*a)) {
+  case VAL_BOOL:
+    return (int)VALUE_BOOL(*a) - (int)VALUE_BOOL(*b);
+  case VAL_STRING: {
+    int c = strcmp(VALUE_STRING(*a), VALUE_STRING(*b));
+    return (c > 0) - (c < 0);
+  }
+  case VAL_LIST: {
+    ValueList *x = VALUE_LIST(*a);
+    ValueList *y = VALUE_LIST(*b);
+    size_t n = x->count < y->count ? x->count : y->count;
+    for (size_t i = 0; i < n; i++) {
+      int c = value_compare(&x->items[i], &y->items[i]);
+      if (c != 0)
+        return c;
+    }
+    return (x->count > y->count) - (x->count < y->count);
+  }
+  default:
+    return 0;
+  }
+}
+
+void value_list_reserve(Value *list, size_t capacity) {
+  ValueList *l = VALUE_LIST(*list);
+  if (capacity > l->capacity) {
+    l->capacity = capacity;
+    l->items = (Value *)realloc(l->items, sizeof(Value) * l->capacity);
+  }
+}
+
 void value_list_push(Value *list, Value item) {
-  ValueList *l = list->data.list_val;
+  ValueList *l = VALUE_LIST(*list);
   if (l->count >= l->capacity) {
     l->capacity = l->capacity == 0 ? 4 : l->capacity * 2;
     l->items = (Value *)realloc(l->items, sizeof(Value) * l->capacity);
@@ -517,17 +1257,122 @@ void value_list_push(Value *list, Value item) {
 }
 
 Value value_list_get(Value *list, int64_t index) {
-  ValueList *l = list->data.list_val;
+  ValueList *l = VALUE_LIST(*list);
   if (index < 0 || (size_t)index >= l->count) {
     return value_null();
   }
   return value_copy(&l->items[index]);
 }
 
-/* ============================================================================
- * Environment Functions
- * ============================================================================
- */
+Value *value_dict_slot(Value *dict, const char *key) {
+  ValueDict *d = VALUE_DICT(*dict);
+  for (size_t i = 0; i < d->count; i++) {
+    if (strcmp(d->entries[i].key, key) == 0)
+      return &d->entries[i].value;
+  }
+  return NULL;
+}
+
+void value_dict_set(Value *dict, const char *key, Value val) {
+  Value *slot = value_dict_slot(dict, key);
+  if (slot) {
+    value_free(slot);
+    *slot = val;
+    return;
+  }
+  ValueDict *d = VALUE_DICT(*dict);
+  if (d->count >= d->capacity) {
+    d->capacity = d->capacity == 0 ? 4 : d->capacity * 2;
+    d->entries =
+        (DictEntry *)realloc(d->entries, sizeof(DictEntry) * d->capacity);
+  }
+  d->entries[d->count].key = strdup(key);
+  d->entries[d->count].value = val;
+  d->count++;
+}
+
+Value value_dict_get(Value *dict, const char *key) {
+  Value *slot = value_dict_slot(dict, key);
+  return slot ? value_copy(slot) : value_null();
+}
+
+/* Room for capacity items; the index stays at most half full */
+void value_set_reserve(Value *set, size_t capacity) {
+  ValueSet *s = VALUE_SET(*set);
+  if (capacity > s->capacity) {
+    s->items = (Value *)realloc(s->items, sizeof(Value) * capacity);
+    s->hashes = (uint64_t *)realloc(s->hashes, sizeof(uint64_t) * capacity);
+    s->capacity = capacity;
+  }
+
+  size_t slot_count = 8;
+  while (slot_count < capacity * 2) {
+    slot_count <<= 1;
+  }
+  if (s->slots && slot_count <= s->slot_mask + 1)
+    return;
+
+  free(s->slots);
+  s->slots = (size_t *)calloc(slot_count, sizeof(size_t));
+  s->slot_mask = slot_count - 1;
+  for (size_t at = 0; at < s->count; at++) {
+    size_t i = (size_t)s->hashes[at] & s->slot_mask;
+    while (s->slots[i] != 0) {
+      i = (i + 1) & s->slot_mask;
+    }
+    s->slots[i] = at + 1;
+  }
+}
+
+/* Add an item whose hash is known, taking ownership of it */
+static bool set_insert(Value *set, Value item, uint64_t hash) {
+  ValueSet *s = VALUE_SET(*set);
+  if (s->count >= s->capacity || !s->slots)
+    value_set_reserve(set, s->capacity == 0 ? 4 : s->capacity * 2);
+
+  size_t *slot = set_slot(s, &item, hash);
+  if (*slot != 0) {
+    value_free(&item);
+    return false;
+  }
+  s->items[s->count] = item;
+  s->hashes[s->count] = hash;
+  *slot = ++s->count;
+  return true;
+}
+
+bool value_set_add(Value *set, Value item) {
+  return set_insert(set, item, value_hash(&item));
+}
+
+static bool set_has(ValueSet *set, Value *item, uint64_t hash) {
+  return set->count > 0 && *set_slot(set, item, hash) != 0;
+}
+
+bool value_set_contains(Value *set, Value *item) {
+  return set_has(VALUE_SET(*set), item, value_hash(item));
+}
+
+/* Turn an owned set into a list of its items, in insertion order, without
+ * copying them */
+static Value set_into_list(Value *set) {
+  ValueSet *s = VALUE_SET(*set);
+  Value list = value_list_new();
+  VALUE_LIST(list)->items = s->items;
+  VALUE_LIST(list)->count = s->count;
+  VALUE_LIST(list)->capacity = s->capacity;
+  s->items = NULL;
+  s->count = 0;
+  s->capacity = 0;
+  value_free(set);
+  *set = value_null();
+  return list;
+}
+
+/* ============================================================================
+ * Environment Functions
+ * ============================================================================
+ */
 
 Environment *env_create(Environment *parent) {
   Environment *env = (Environment *)calloc(1, sizeof(Environment));
@@ -536,10 +1381,53 @@ Environment *env_create(Environment *parent) {
   return env;
 }
 
+/* Closures that outlive a scope take over the variables they captured
+ * from it. The first to claim a variable owns it, and closures sharing
+ * that variable are pointed at the owner's entry instead. */
+static void env_close_upvalues(Environment *env) {
+  Upvalue *u = env->captures;
+  env->captures = NULL;
+  while (u) {
+    Upvalue *next = u->next;
+    if (u->target_env == env) {
+      EnvEntry *var = u->target;
+      u->entry->value = var->value;
+      var->value = value_null();
+      for (Upvalue *v = next; v; v = v->next) {
+        if (v->target == var) {
+          v->target = u->entry;
+          v->target_env = u->home;
+        }
+      }
+      u->target = NULL;
+      u->target_env = NULL;
+      u->next = NULL;
+    } else {
+      /* Retargeted above: now open on the claiming closure's scope */
+      u->next = u->target_env->captures;
+      u->target_env->captures = u;
+    }
+    u = next;
+  }
+}
+
+static void upvalue_release(Upvalue *u) {
+  if (u->target) {
+    Upvalue **link = &u->target_env->captures;
+    while (*link != u)
+      link = &(*link)->next;
+    *link = u->next;
+  }
+  free(u);
+}
+
 void env_destroy(Environment *env) {
+  env_close_upvalues(env);
   EnvEntry *entry = env->entries;
   while (entry) {
     EnvEntry *next = entry->next;
+    if (entry->upvalue)
+      upvalue_release(entry->upvalue);
     free(entry->name);
     value_free(&entry->value);
     free(entry);
@@ -548,19 +1436,48 @@ void env_destroy(Environment *env) {
   free(env);
 }
 
+/* The entry for name in this scope alone, as stored */
+static EnvEntry *env_entry(Environment *env, const char *name) {
+  for (EnvEntry *e = env->entries; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static EnvEntry *env_find(Environment *env, const char *name) {
+  EnvEntry *e = env_entry(env, name);
+  /* An open captured variable still lives in the scope that defined it */
+  if (e && e->upvalue && e->upvalue->target)
+    return e->upvalue->target;
+  return e;
+}
+
 void env_define(Environment *env, const char *name, Value value) {
+  /* Redefining in the same scope (e.g. a loop variable) rebinds in place
+   * instead of shadowing, so the scope does not grow per iteration */
+  EnvEntry *existing = env_find(env, name);
+  if (existing) {
+    value_free(&existing->value);
+    existing->value = value;
+    return;
+  }
+
   EnvEntry *entry = (EnvEntry *)malloc(sizeof(EnvEntry));
   entry->name = strdup(name);
   entry->value = value;
   entry->is_override = false;
+  entry->upvalue = NULL;
   entry->next = env->entries;
   env->entries = entry;
 }
 
-static EnvEntry *env_find(Environment *env, const char *name) {
-  for (EnvEntry *e = env->entries; e != NULL; e = e->next) {
-    if (strcmp(e->name, name) == 0) {
-      return e;
+static EnvEntry *env_lookup(Environment *env, const char *name) {
+  for (; env != NULL; env = env->parent) {
+    EnvEntry *entry = env_find(env, name);
+    if (entry) {
+      return entry;
     }
   }
   return NULL;
@@ -629,8 +1546,8 @@ static Value builtin_declare(int argc, Value *argv) {
   for (int i = 0; i < argc; i++) {
     if (i > 0)
       printf(" ");
-    if (argv[i].type == VAL_STRING) {
-      printf("%s", argv[i].data.string_val);
+    if (VALUE_TYPE(argv[i]) == VAL_STRING) {
+      printf("%s", VALUE_STRING(argv[i]));
     } else {
       char *str = value_to_string(&argv[i]);
       printf("%s", str);
@@ -642,8 +1559,8 @@ static Value builtin_declare(int argc, Value *argv) {
 }
 
 static Value builtin_inquire(int argc, Value *argv) {
-  if (argc > 0 && argv[0].type == VAL_STRING) {
-    printf("  %s", argv[0].data.string_val);
+  if (argc > 0 && VALUE_TYPE(argv[0]) == VAL_STRING) {
+    printf("  %s", VALUE_STRING(argv[0]));
     fflush(stdout);
   }
 
@@ -662,13 +1579,15 @@ static Value builtin_measure(int argc, Value *argv) {
   if (argc < 1)
     return value_int(0);
 
-  switch (argv[0].type) {
+  switch (VALUE_TYPE(argv[0])) {
   case VAL_STRING:
-    return value_int(strlen(argv[0].data.string_val));
+    return value_int((int64_t)value_string_codepoints(&argv[0]));
   case VAL_LIST:
-    return value_int(argv[0].data.list_val->count);
+    return value_int(VALUE_LIST(argv[0])->count);
   case VAL_DICT:
-    return value_int(argv[0].data.dict_val->count);
+    return value_int(VALUE_DICT(argv[0])->count);
+  case VAL_SET:
+    return value_int(VALUE_SET(argv[0])->count);
   default:
     return value_int(0);
   }
@@ -677,16 +1596,18 @@ static Value builtin_measure(int argc, Value *argv) {
 static Value builtin_span(int argc, Value *argv) {
   int64_t start = 0, end = 0, step = 1;
 
-  if (argc == 1 && argv[0].type == VAL_INT) {
-    end = argv[0].data.int_val;
-  } else if (argc == 2 && argv[0].type == VAL_INT && argv[1].type == VAL_INT) {
-    start = argv[0].data.int_val;
-    end = argv[1].data.int_val;
-  } else if (argc == 3 && argv[0].type == VAL_INT && argv[1].type == VAL_INT &&
-             argv[2].type == VAL_INT) {
-    start = argv[0].data.int_val;
-    end = argv[1].data.int_val;
-    step = argv[2].data.int_val;
+  if (argc == 1 && VALUE_TYPE(argv[0]) == VAL_INT) {
+    end = VALUE_INT(argv[0]);
+  } else if (argc == 2 && VALUE_TYPE(argv[0]) == VAL_INT &&
+             VALUE_TYPE(argv[1]) == VAL_INT) {
+    start = VALUE_INT(argv[0]);
+    end = VALUE_INT(argv[1]);
+  } else if (argc == 3 && VALUE_TYPE(argv[0]) == VAL_INT &&
+             VALUE_TYPE(argv[1]) == VAL_INT &&
+             VALUE_TYPE(argv[2]) == VAL_INT) {
+    start = VALUE_INT(argv[0]);
+    end = VALUE_INT(argv[1]);
+    step = VALUE_INT(argv[2]);
   }
 
   Value list = value_list_new();
@@ -709,15 +1630,15 @@ static Value builtin_number(int argc, Value *argv) {
   if (argc < 1)
     return value_int(0);
 
-  switch (argv[0].type) {
+  switch (VALUE_TYPE(argv[0])) {
   case VAL_INT:
     return value_copy(&argv[0]);
   case VAL_FLOAT:
-    return value_int((int64_t)argv[0].data.float_val);
+    return value_int((int64_t)VALUE_FLOAT(argv[0]));
   case VAL_STRING:
-    return value_int(atoll(argv[0].data.string_val));
+    return value_int(atoll(VALUE_STRING(argv[0])));
   case VAL_BOOL:
-    return value_int(argv[0].data.bool_val ? 1 : 0);
+    return value_int(VALUE_BOOL(argv[0]) ? 1 : 0);
   default:
     return value_int(0);
   }
@@ -727,13 +1648,13 @@ static Value builtin_decimal(int argc, Value *argv) {
   if (argc < 1)
     return value_float(0.0);
 
-  switch (argv[0].type) {
+  switch (VALUE_TYPE(argv[0])) {
   case VAL_INT:
-    return value_float((double)argv[0].data.int_val);
+    return value_float((double)VALUE_INT(argv[0]));
   case VAL_FLOAT:
     return value_copy(&argv[0]);
   case VAL_STRING:
-    return value_float(atof(argv[0].data.string_val));
+    return value_float(atof(VALUE_STRING(argv[0])));
   default:
     return value_float(0.0);
   }
@@ -748,7 +1669,14 @@ static Value builtin_boolean(int argc, Value *argv) {
 static Value builtin_classify(int argc, Value *argv) {
   if (argc < 1)
     return value_string("void");
-  return value_string(value_type_name(argv[0].type));
+  return value_string(value_type_name(VALUE_TYPE(argv[0])));
+}
+
+/* hash(x) - Integer hash; values that are equal hash alike */
+static Value builtin_hash(int argc, Value *argv) {
+  if (argc < 1)
+    return value_null();
+  return value_int((int64_t)value_hash(&argv[0]));
 }
 
 /* ============================================================================
@@ -758,19 +1686,19 @@ static Value builtin_classify(int argc, Value *argv) {
 
 /* inscribe(filename, content) - Write to file */
 static Value builtin_inscribe(int argc, Value *argv) {
-  if (argc < 2 || argv[0].type != VAL_STRING) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_STRING) {
     return value_bool(false);
   }
 
-  FILE *file = fopen(argv[0].data.string_val, "w");
+  FILE *file = fopen(VALUE_STRING(argv[0]), "w");
   if (!file) {
     printf("  ⚠ Unable to inscribe to '%s'. Path inaccessible.\n",
-           argv[0].data.string_val);
+           VALUE_STRING(argv[0]));
     return value_bool(false);
   }
 
-  if (argv[1].type == VAL_STRING) {
-    fprintf(file, "%s", argv[1].data.string_val);
+  if (VALUE_TYPE(argv[1]) == VAL_STRING) {
+    fprintf(file, "%s", VALUE_STRING(argv[1]));
   } else {
     char *content = value_to_string(&argv[1]);
     fprintf(file, "%s", content);
@@ -779,20 +1707,20 @@ static Value builtin_inscribe(int argc, Value *argv) {
   fclose(file);
 
   printf("  ◈ Data inscribed to '%s'. The record is preserved.\n",
-         argv[0].data.string_val);
+         VALUE_STRING(argv[0]));
   return value_bool(true);
 }
 
 /* decipher(filename) - Read from file */
 static Value builtin_decipher(int argc, Value *argv) {
-  if (argc < 1 || argv[0].type != VAL_STRING) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING) {
     return value_null();
   }
 
-  FILE *file = fopen(argv[0].data.string_val, "r");
+  FILE *file = fopen(VALUE_STRING(argv[0]), "r");
   if (!file) {
     printf("  ⚠ Unable to decipher '%s'. File does not exist.\n",
-           argv[0].data.string_val);
+           VALUE_STRING(argv[0]));
     return value_null();
   }
 
@@ -812,17 +1740,17 @@ static Value builtin_decipher(int argc, Value *argv) {
 
 /* chronicle(filename, content) - Append to file */
 static Value builtin_chronicle(int argc, Value *argv) {
-  if (argc < 2 || argv[0].type != VAL_STRING) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_STRING) {
     return value_bool(false);
   }
 
-  FILE *file = fopen(argv[0].data.string_val, "a");
+  FILE *file = fopen(VALUE_STRING(argv[0]), "a");
   if (!file) {
     return value_bool(false);
   }
 
-  if (argv[1].type == VAL_STRING) {
-    fprintf(file, "%s", argv[1].data.string_val);
+  if (VALUE_TYPE(argv[1]) == VAL_STRING) {
+    fprintf(file, "%s", VALUE_STRING(argv[1]));
   } else {
     char *content = value_to_string(&argv[1]);
     fprintf(file, "%s", content);
@@ -834,11 +1762,11 @@ static Value builtin_chronicle(int argc, Value *argv) {
 
 /* exists(filename) - Check if file exists */
 static Value builtin_exists(int argc, Value *argv) {
-  if (argc < 1 || argv[0].type != VAL_STRING) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING) {
     return value_bool(false);
   }
 
-  FILE *file = fopen(argv[0].data.string_val, "r");
+  FILE *file = fopen(VALUE_STRING(argv[0]), "r");
   if (file) {
     fclose(file);
     return value_bool(true);
@@ -855,11 +1783,11 @@ static Value builtin_abs_val(int argc, Value *argv) {
   if (argc < 1)
     return value_int(0);
 
-  if (argv[0].type == VAL_INT) {
-    int64_t v = argv[0].data.int_val;
+  if (VALUE_TYPE(argv[0]) == VAL_INT) {
+    int64_t v = VALUE_INT(argv[0]);
     return value_int(v < 0 ? -v : v);
-  } else if (argv[0].type == VAL_FLOAT) {
-    double v = argv[0].data.float_val;
+  } else if (VALUE_TYPE(argv[0]) == VAL_FLOAT) {
+    double v = VALUE_FLOAT(argv[0]);
     return value_float(v < 0 ? -v : v);
   }
   return value_int(0);
@@ -868,19 +1796,20 @@ static Value builtin_abs_val(int argc, Value *argv) {
 static Value builtin_sqrt_val(int argc, Value *argv) {
   if (argc < 1)
     return value_float(0);
-  double v = argv[0].type == VAL_FLOAT ? argv[0].data.float_val
-                                       : (double)argv[0].data.int_val;
+  double v = VALUE_TYPE(argv[0]) == VAL_FLOAT ? VALUE_FLOAT(argv[0])
+                                              : (double)VALUE_INT(argv[0]);
   return value_float(sqrt(v));
 }
 
 static Value builtin_min_val(int argc, Value *argv) {
   if (argc < 2)
     return value_null();
-  double a = argv[0].type == VAL_FLOAT ? argv[0].data.float_val
-                                       : (double)argv[0].data.int_val;
-  double b = argv[1].type == VAL_FLOAT ? argv[1].data.float_val
-                                       : (double)argv[1].data.int_val;
-  bool use_float = (argv[0].type == VAL_FLOAT || argv[1].type == VAL_FLOAT);
+  double a = VALUE_TYPE(argv[0]) == VAL_FLOAT ? VALUE_FLOAT(argv[0])
+                                              : (double)VALUE_INT(argv[0]);
+  double b = VALUE_TYPE(argv[1]) == VAL_FLOAT ? VALUE_FLOAT(argv[1])
+                                              : (double)VALUE_INT(argv[1]);
+  bool use_float = (VALUE_TYPE(argv[0]) == VAL_FLOAT ||
+                    VALUE_TYPE(argv[1]) == VAL_FLOAT);
   return use_float ? value_float(a < b ? a : b)
                    : value_int((int64_t)(a < b ? a : b));
 }
@@ -888,11 +1817,12 @@ static Value builtin_min_val(int argc, Value *argv) {
 static Value builtin_max_val(int argc, Value *argv) {
   if (argc < 2)
     return value_null();
-  double a = argv[0].type == VAL_FLOAT ? argv[0].data.float_val
-                                       : (double)argv[0].data.int_val;
-  double b = argv[1].type == VAL_FLOAT ? argv[1].data.float_val
-                                       : (double)argv[1].data.int_val;
-  bool use_float = (argv[0].type == VAL_FLOAT || argv[1].type == VAL_FLOAT);
+  double a = VALUE_TYPE(argv[0]) == VAL_FLOAT ? VALUE_FLOAT(argv[0])
+                                              : (double)VALUE_INT(argv[0]);
+  double b = VALUE_TYPE(argv[1]) == VAL_FLOAT ? VALUE_FLOAT(argv[1])
+                                              : (double)VALUE_INT(argv[1]);
+  bool use_float = (VALUE_TYPE(argv[0]) == VAL_FLOAT ||
+                    VALUE_TYPE(argv[1]) == VAL_FLOAT);
   return use_float ? value_float(a > b ? a : b)
                    : value_int((int64_t)(a > b ? a : b));
 }
@@ -904,12 +1834,13 @@ static Value builtin_random_val(int argc, Value *argv) {
     seeded = true;
   }
 
-  if (argc >= 2 && argv[0].type == VAL_INT && argv[1].type == VAL_INT) {
-    int64_t min = argv[0].data.int_val;
-    int64_t max = argv[1].data.int_val;
+  if (argc >= 2 && VALUE_TYPE(argv[0]) == VAL_INT &&
+      VALUE_TYPE(argv[1]) == VAL_INT) {
+    int64_t min = VALUE_INT(argv[0]);
+    int64_t max = VALUE_INT(argv[1]);
     return value_int(min + rand() % (max - min + 1));
-  } else if (argc >= 1 && argv[0].type == VAL_INT) {
-    return value_int(rand() % argv[0].data.int_val);
+  } else if (argc >= 1 && VALUE_TYPE(argv[0]) == VAL_INT) {
+    return value_int(rand() % VALUE_INT(argv[0]));
   }
   return value_float((double)rand() / RAND_MAX);
 }
@@ -919,134 +1850,331 @@ static Value builtin_random_val(int argc, Value *argv) {
  * ============================================================================
  */
 
-static Value builtin_uppercase(int argc, Value *argv) {
-  if (argc < 1 || argv[0].type != VAL_STRING)
-    return value_string("");
-
-  char *str = strdup(argv[0].data.string_val);
-  for (int i = 0; str[i]; i++) {
-    str[i] = toupper((unsigned char)str[i]);
+/* Map each byte through a case function into a fresh string */
+static Value string_map_case(Value *str, int (*map)(int)) {
+  size_t len = value_string_length(str);
+  Value result = value_string_alloc(len);
+  for (size_t i = 0; i < len; i++) {
+    VALUE_STRING(result)[i] =
+        (char)map((unsigned char)VALUE_STRING(*str)[i]);
   }
-  Value result = value_string(str);
-  free(str);
   return result;
 }
 
+static Value builtin_uppercase(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING)
+    return value_string("");
+  return string_map_case(&argv[0], toupper);
+}
+
 static Value builtin_lowercase(int argc, Value *argv) {
-  if (argc < 1 || argv[0].type != VAL_STRING)
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING)
     return value_string("");
+  return string_map_case(&argv[0], tolower);
+}
 
-  char *str = strdup(argv[0].data.string_val);
-  for (int i = 0; str[i]; i++) {
-    str[i] = tolower((unsigned char)str[i]);
-  }
-  Value result = value_string(str);
-  free(str);
-  return result;
+/* Offset of needle in haystack, or -1. memchr (vectorized in libc) skips to
+ * candidate positions, which are then confirmed with memcmp */
+static int64_t string_search(const char *haystack, size_t hay_len,
+                             const char *needle, size_t needle_len) {
+  if (needle_len == 0)
+    return 0;
+  if (needle_len > hay_len)
+    return -1;
+
+  const char *p = haystack;
+  const char *last = haystack + (hay_len - needle_len);
+  while (p <= last) {
+    p = (const char *)memchr(p, needle[0], (size_t)(last - p) + 1);
+    if (!p)
+      return -1;
+    if (memcmp(p + 1, needle + 1, needle_len - 1) == 0)
+      return p - haystack;
+    p++;
+  }
+  return -1;
 }
 
+/* split(str, sep) - fields between occurrences of sep, empty fields kept.
+ * Without sep (or with ""), splits on runs of whitespace */
 static Value builtin_split(int argc, Value *argv) {
-  if (argc < 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_STRING) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING) {
     return value_list_new();
   }
 
   Value list = value_list_new();
-  char *str = strdup(argv[0].data.string_val);
-  const char *delim = argv[1].data.string_val;
-
-  char *token = strtok(str, delim);
-  while (token != NULL) {
-    value_list_push(&list, value_string(token));
-    token = strtok(NULL, delim);
+  const char *str = VALUE_STRING(argv[0]);
+  size_t len = value_string_length(&argv[0]);
+
+  if (argc < 2 || VALUE_TYPE(argv[1]) != VAL_STRING ||
+      value_string_length(&argv[1]) == 0) {
+    size_t i = 0;
+    while (i < len) {
+      while (i < len && isspace((unsigned char)str[i]))
+        i++;
+      size_t start = i;
+      while (i < len && !isspace((unsigned char)str[i]))
+        i++;
+      if (i > start)
+        value_list_push(&list, value_string_from(str + start, i - start));
+    }
+    return list;
   }
 
-  free(str);
+  const char *sep = VALUE_STRING(argv[1]);
+  size_t sep_len = value_string_length(&argv[1]);
+  size_t start = 0;
+  while (true) {
+    int64_t found = string_search(str + start, len - start, sep, sep_len);
+    if (found < 0)
+      break;
+    value_list_push(&list, value_string_from(str + start, (size_t)found));
+    start += (size_t)found + sep_len;
+  }
+  value_list_push(&list, value_string_from(str + start, len - start));
   return list;
 }
 
+/* join(list, sep) - one allocation sized from a first pass over the parts */
 static Value builtin_join(int argc, Value *argv) {
-  if (argc < 2 || argv[0].type != VAL_LIST || argv[1].type != VAL_STRING) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_LIST ||
+      VALUE_TYPE(argv[1]) != VAL_STRING) {
     return value_string("");
   }
 
-  ValueList *list = argv[0].data.list_val;
-  const char *delim = argv[1].data.string_val;
+  ValueList *list = VALUE_LIST(argv[0]);
+  const char *sep = VALUE_STRING(argv[1]);
+  size_t sep_len = value_string_length(&argv[1]);
+  if (list->count == 0)
+    return value_string("");
 
-  size_t total_len = 1;
+  /* Non-string items are formatted once and reused for the copy */
+  char **formatted = (char **)calloc(list->count, sizeof(char *));
+  size_t *lengths = (size_t *)malloc(sizeof(size_t) * list->count);
+  size_t total = sep_len * (list->count - 1);
   for (size_t i = 0; i < list->count; i++) {
-    if (list->items[i].type == VAL_STRING) {
-      total_len += strlen(list->items[i].data.string_val) + strlen(delim);
+    Value *item = &list->items[i];
+    if (VALUE_TYPE(*item) == VAL_STRING) {
+      lengths[i] = value_string_length(item);
+    } else {
+      formatted[i] = value_to_string(item);
+      lengths[i] = strlen(formatted[i]);
     }
+    total += lengths[i];
   }
 
-  char *result = (char *)malloc(total_len + list->count * 20);
-  result[0] = '\0';
-
+  Value result = value_string_alloc(total);
+  char *out = VALUE_STRING(result);
   for (size_t i = 0; i < list->count; i++) {
-    if (i > 0)
-      strcat(result, delim);
-    if (list->items[i].type == VAL_STRING) {
-      strcat(result, list->items[i].data.string_val);
-    } else {
-      char *s = value_to_string(&list->items[i]);
-      strcat(result, s);
-      free(s);
+    if (i > 0) {
+      memcpy(out, sep, sep_len);
+      out += sep_len;
     }
+    const char *part =
+        formatted[i] ? formatted[i] : VALUE_STRING(list->items[i]);
+    memcpy(out, part, lengths[i]);
+    out += lengths[i];
+    free(formatted[i]);
   }
 
-  Value v = value_string(result);
-  free(result);
-  return v;
+  free(formatted);
+  free(lengths);
+  return result;
 }
 
 static Value builtin_contains(int argc, Value *argv) {
   if (argc < 2)
     return value_bool(false);
 
-  if (argv[0].type == VAL_STRING && argv[1].type == VAL_STRING) {
-    return value_bool(
-        strstr(argv[0].data.string_val, argv[1].data.string_val) != NULL);
+  if (VALUE_TYPE(argv[0]) == VAL_STRING && VALUE_TYPE(argv[1]) == VAL_STRING) {
+    return value_bool(string_search(VALUE_STRING(argv[0]),
+                                    value_string_length(&argv[0]),
+                                    VALUE_STRING(argv[1]),
+                                    value_string_length(&argv[1])) >= 0);
   }
 
-  if (argv[0].type == VAL_LIST) {
-    ValueList *list = argv[0].data.list_val;
+  if (VALUE_TYPE(argv[0]) == VAL_LIST) {
+    ValueList *list = VALUE_LIST(argv[0]);
     for (size_t i = 0; i < list->count; i++) {
-      if (list->items[i].type == argv[1].type) {
-        if (argv[1].type == VAL_INT &&
-            list->items[i].data.int_val == argv[1].data.int_val) {
-          return value_bool(true);
-        }
-        if (argv[1].type == VAL_STRING &&
-            strcmp(list->items[i].data.string_val, argv[1].data.string_val) ==
-                0) {
-          return value_bool(true);
-        }
+      if (value_equals(&list->items[i], &argv[1])) {
+        return value_bool(true);
       }
     }
   }
+
+  if (VALUE_TYPE(argv[0]) == VAL_DICT && VALUE_TYPE(argv[1]) == VAL_STRING) {
+    return value_bool(value_dict_slot(&argv[0], VALUE_STRING(argv[1])));
+  }
+
+  if (VALUE_TYPE(argv[0]) == VAL_SET) {
+    return value_bool(value_set_contains(&argv[0], &argv[1]));
+  }
   return value_bool(false);
 }
 
+/* find(str, sub, start) - position of sub at or after start, or -1 */
+static Value builtin_find(int argc, Value *argv) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_STRING ||
+      VALUE_TYPE(argv[1]) != VAL_STRING) {
+    return value_int(-1);
+  }
+  size_t len = value_string_length(&argv[0]);
+  size_t start = 0;
+  if (argc >= 3 && VALUE_TYPE(argv[2]) == VAL_INT) {
+    int64_t from = VALUE_INT(argv[2]);
+    int64_t count = (int64_t)value_string_codepoints(&argv[0]);
+    if (from < 0)
+      from += count;
+    if (from < 0)
+      from = 0;
+    if (from > count)
+      return value_int(-1);
+    start = value_string_offset(&argv[0], (size_t)from);
+  }
+
+  int64_t found =
+      string_search(VALUE_STRING(argv[0]) + start, len - start,
+                    VALUE_STRING(argv[1]), value_string_length(&argv[1]));
+  if (found < 0)
+    return value_int(-1);
+  return value_int(
+      (int64_t)string_codepoint_at(&argv[0], start + (size_t)found));
+}
+
+/* replace(str, old, new) - every occurrence of old replaced by new */
+static Value builtin_replace(int argc, Value *argv) {
+  if (argc < 3 || VALUE_TYPE(argv[0]) != VAL_STRING ||
+      VALUE_TYPE(argv[1]) != VAL_STRING ||
+      VALUE_TYPE(argv[2]) != VAL_STRING) {
+    return argc >= 1 ? value_copy(&argv[0]) : value_string("");
+  }
+
+  const char *str = VALUE_STRING(argv[0]);
+  size_t len = value_string_length(&argv[0]);
+  const char *old = VALUE_STRING(argv[1]);
+  size_t old_len = value_string_length(&argv[1]);
+  const char *rep = VALUE_STRING(argv[2]);
+  size_t rep_len = value_string_length(&argv[2]);
+  if (old_len == 0) {
+    return value_copy(&argv[0]);
+  }
+
+  /* Count matches first so the result is allocated exactly once */
+  size_t matches = 0;
+  for (size_t pos = 0;;) {
+    int64_t found = string_search(str + pos, len - pos, old, old_len);
+    if (found < 0)
+      break;
+    matches++;
+    pos += (size_t)found + old_len;
+  }
+  if (matches == 0) {
+    return value_copy(&argv[0]);
+  }
+
+  Value result =
+      value_string_alloc(len - matches * old_len + matches * rep_len);
+  char *out = VALUE_STRING(result);
+  size_t pos = 0;
+  for (size_t m = 0; m < matches; m++) {
+    size_t found = (size_t)string_search(str + pos, len - pos, old, old_len);
+    memcpy(out, str + pos, found);
+    out += found;
+    memcpy(out, rep, rep_len);
+    out += rep_len;
+    pos += found + old_len;
+  }
+  memcpy(out, str + pos, len - pos);
+  return result;
+}
+
+static Value builtin_starts_with(int argc, Value *argv) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_STRING ||
+      VALUE_TYPE(argv[1]) != VAL_STRING) {
+    return value_bool(false);
+  }
+  size_t prefix_len = value_string_length(&argv[1]);
+  return value_bool(prefix_len <= value_string_length(&argv[0]) &&
+                    memcmp(VALUE_STRING(argv[0]), VALUE_STRING(argv[1]),
+                           prefix_len) == 0);
+}
+
+static Value builtin_ends_with(int argc, Value *argv) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_STRING ||
+      VALUE_TYPE(argv[1]) != VAL_STRING) {
+    return value_bool(false);
+  }
+  size_t len = value_string_length(&argv[0]);
+  size_t suffix_len = value_string_length(&argv[1]);
+  return value_bool(suffix_len <= len &&
+                    memcmp(VALUE_STRING(argv[0]) + len - suffix_len,
+                           VALUE_STRING(argv[1]), suffix_len) == 0);
+}
+
+/* trim(str) - without leading and trailing whitespace */
+static Value builtin_trim(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING) {
+    return value_string("");
+  }
+  const char *str = VALUE_STRING(argv[0]);
+  size_t start = 0, end = value_string_length(&argv[0]);
+  while (start < end && isspace((unsigned char)str[start]))
+    start++;
+  while (end > start && isspace((unsigned char)str[end - 1]))
+    end--;
+  return value_string_from(str + start, end - start);
+}
+
 /* ============================================================================
  * List Built-ins
  * ============================================================================
  */
 
+/* The mutating list built-ins below receive the caller's own list (or set)
+ * as argv[0] when it is passed by name (see eval_call) */
+
+/* Hand back the list a mutating built-in changed. It moves out of argv, and
+ * eval_call returns it to a lent variable (see builtin_returns_first) */
+static Value take_first(Value *argv) {
+  Value first = argv[0];
+  argv[0] = value_null();
+  return first;
+}
+
+/* push(list, value) - append in place, returns the list. A set gains the
+ * value unless already present. */
 static Value builtin_push(int argc, Value *argv) {
-  if (argc < 2 || argv[0].type != VAL_LIST) {
+  if (argc >= 2 && VALUE_TYPE(argv[0]) == VAL_SET) {
+    value_set_add(&argv[0], argv[1]);
+    argv[1] = value_null();
+    return take_first(argv);
+  }
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_LIST) {
+    return value_null();
+  }
+  value_list_push(&argv[0], argv[1]);
+  argv[1] = value_null();
+  return take_first(argv);
+}
+
+/* reserve(list, n) - grow capacity so n elements fit without reallocating */
+static Value builtin_reserve(int argc, Value *argv) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_LIST ||
+      VALUE_TYPE(argv[1]) != VAL_INT ||
+      VALUE_INT(argv[1]) < 0) {
     return value_null();
   }
-  value_list_push(&argv[0], value_copy(&argv[1]));
-  return value_copy(&argv[0]);
+  value_list_reserve(&argv[0], (size_t)VALUE_INT(argv[1]));
+  return value_null();
 }
 
 static Value builtin_reverse(int argc, Value *argv) {
-  if (argc < 1 || argv[0].type != VAL_LIST) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_LIST) {
     return value_list_new();
   }
 
   Value result = value_list_new();
-  ValueList *list = argv[0].data.list_val;
+  ValueList *list = VALUE_LIST(argv[0]);
 
   for (int i = (int)list->count - 1; i >= 0; i--) {
     value_list_push(&result, value_copy(&list->items[i]));
@@ -1067,8 +2195,8 @@ static Value builtin_clock(int argc, Value *argv) {
 
 static Value builtin_terminate(int argc, Value *argv) {
   int code = 0;
-  if (argc >= 1 && argv[0].type == VAL_INT) {
-    code = (int)argv[0].data.int_val;
+  if (argc >= 1 && VALUE_TYPE(argv[0]) == VAL_INT) {
+    code = (int)VALUE_INT(argv[0]);
   }
   printf("  The scenario terminates. Exit code: %d\n", code);
   exit(code);
@@ -1085,21 +2213,22 @@ static Value builtin_timestamp(int argc, Value *argv) {
 static Interpreter *g_interp = NULL; /* Temporary global for callbacks */
 
 static Value call_lambda(Value *func_val, Value *arg) {
-  if (!g_interp || !func_val || func_val->type != VAL_FUNCTION) {
+  if (!g_interp || !func_val || VALUE_TYPE(*func_val) != VAL_FUNCTION) {
     return value_null();
   }
 
   Value args[1] = {*arg};
-  return interpreter_call(g_interp, func_val->data.func_val, value_null(), 1,
+  return interpreter_call(g_interp, VALUE_FUNCTION(*func_val), value_null(), 1,
                           args);
 }
 
 static Value builtin_transform(int argc, Value *argv) {
-  if (argc < 2 || argv[0].type != VAL_LIST || argv[1].type != VAL_FUNCTION) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_LIST ||
+      VALUE_TYPE(argv[1]) != VAL_FUNCTION) {
     return value_null();
   }
 
-  ValueList *list = argv[0].data.list_val;
+  ValueList *list = VALUE_LIST(argv[0]);
   Value result = value_list_new();
 
   for (size_t i = 0; i < list->count; i++) {
@@ -1111,11 +2240,12 @@ static Value builtin_transform(int argc, Value *argv) {
 }
 
 static Value builtin_select(int argc, Value *argv) {
-  if (argc < 2 || argv[0].type != VAL_LIST || argv[1].type != VAL_FUNCTION) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_LIST ||
+      VALUE_TYPE(argv[1]) != VAL_FUNCTION) {
     return value_null();
   }
 
-  ValueList *list = argv[0].data.list_val;
+  ValueList *list = VALUE_LIST(argv[0]);
   Value result = value_list_new();
 
   for (size_t i = 0; i < list->count; i++) {
@@ -1130,16 +2260,17 @@ static Value builtin_select(int argc, Value *argv) {
 }
 
 static Value builtin_fold(int argc, Value *argv) {
-  if (argc < 3 || argv[0].type != VAL_LIST || argv[1].type != VAL_FUNCTION) {
+  if (argc < 3 || VALUE_TYPE(argv[0]) != VAL_LIST ||
+      VALUE_TYPE(argv[1]) != VAL_FUNCTION) {
     return value_null();
   }
 
-  ValueList *list = argv[0].data.list_val;
+  ValueList *list = VALUE_LIST(argv[0]);
   Value acc = value_copy(&argv[2]);
 
   for (size_t i = 0; i < list->count; i++) {
     Value args[2] = {acc, list->items[i]};
-    Value new_acc = interpreter_call(g_interp, argv[1].data.func_val,
+    Value new_acc = interpreter_call(g_interp, VALUE_FUNCTION(argv[1]),
                                      value_null(), 2, args);
     value_free(&acc);
     acc = new_acc;
@@ -1148,417 +2279,2447 @@ static Value builtin_fold(int argc, Value *argv) {
   return acc;
 }
 
-/* Simple JSON encoder */
-static void json_encode_value(Value *val, char *buf, size_t size);
-
-static void json_encode_value(Value *val, char *buf, size_t size) {
-  size_t len = strlen(buf);
-  char *p = buf + len;
-  size_t remaining = size - len;
+/* ============================================================================
+ * Sorting, Searching and Set Built-ins
+ * ============================================================================
+ */
 
-  switch (val->type) {
-  case VAL_NULL:
-    snprintf(p, remaining, "null");
-    break;
-  case VAL_INT:
-    snprintf(p, remaining, "%lld", (long long)val->data.int_val);
-    break;
-  case VAL_FLOAT:
-    snprintf(p, remaining, "%g", val->data.float_val);
-    break;
-  case VAL_BOOL:
-    snprintf(p, remaining, "%s", val->data.bool_val ? "true" : "false");
-    break;
-  case VAL_STRING:
-    snprintf(p, remaining, "\"%s\"", val->data.string_val);
-    break;
-  case VAL_LIST: {
-    strncat(buf, "[", remaining - 1);
-    for (size_t i = 0; i < val->data.list_val->count; i++) {
-      if (i > 0)
-        strncat(buf, ",", size - strlen(buf) - 1);
-      json_encode_value(&val->data.list_val->items[i], buf, size);
-    }
-    strncat(buf, "]", size - strlen(buf) - 1);
-    break;
+/* Call a protocol or builtin with borrowed arguments */
+static Value call_callable(Value *callee, int argc, Value *argv) {
+  if (VALUE_TYPE(*callee) == VAL_BUILTIN) {
+    return VALUE_BUILTIN(*callee)(argc, argv);
   }
-  default:
-    snprintf(p, remaining, "null");
+  if (VALUE_TYPE(*callee) == VAL_FUNCTION) {
+    return interpreter_call(g_interp, VALUE_FUNCTION(*callee), value_null(),
+                            argc,
+                            argv);
   }
+  return value_null();
 }
 
-static Value builtin_encode_json(int argc, Value *argv) {
-  if (argc < 1)
-    return value_null();
-
-  char buf[4096] = {0};
-  json_encode_value(&argv[0], buf, sizeof(buf));
-  return value_string(buf);
+static Value builtin_error(const char *kind, const char *msg) {
+  interpreter_raise(g_interp, value_error_new(kind, msg, g_interp->call_line));
+  return value_null();
 }
 
-static Value builtin_decode_json(int argc, Value *argv) {
-  /* Simplified JSON decoder - only handles primitives */
-  if (argc < 1 || argv[0].type != VAL_STRING)
-    return value_null();
-
-  const char *s = argv[0].data.string_val;
+/* Detach the items of an owned list argument so they can be moved */
+static Value *list_take_items(Value *list, size_t *count) {
+  ValueList *l = VALUE_LIST(*list);
+  Value *items = l->items;
+  *count = l->count;
+  l->items = NULL;
+  l->count = 0;
+  l->capacity = 0;
+  return items;
+}
 
-  /* Skip whitespace */
-  while (*s == ' ' || *s == '\t' || *s == '\n')
-    s++;
+/* Build a list that adopts an items array */
+static Value list_adopt_items(Value *items, size_t count) {
+  Value list = value_list_new();
+  VALUE_LIST(list)->items = items;
+  VALUE_LIST(list)->count = count;
+  VALUE_LIST(list)->capacity = count;
+  return list;
+}
 
-  if (strcmp(s, "null") == 0)
-    return value_null();
-  if (strcmp(s, "true") == 0)
-    return value_bool(true);
-  if (strcmp(s, "false") == 0)
-    return value_bool(false);
+/* Open-addressing set of borrowed values */
+typedef struct {
+  uint64_t hash;
+  Value *value; /* NULL marks an empty slot */
+} HashSlot;
+
+typedef struct {
+  HashSlot *slots;
+  size_t capacity; /* Power of two */
+  size_t count;
+} ValueHashSet;
+
+static void hash_set_init(ValueHashSet *set, size_t expected) {
+  size_t capacity = 8;
+  while (capacity < expected * 2) {
+    capacity <<= 1;
+  }
+  set->slots = (HashSlot *)calloc(capacity, sizeof(HashSlot));
+  set->capacity = capacity;
+  set->count = 0;
+}
 
-  /* Try number */
-  char *end;
-  long long int_val = strtoll(s, &end, 10);
-  if (end != s && (*end == '\0' || *end == '\n')) {
-    return value_int(int_val);
-  }
+static void hash_set_free(ValueHashSet *set) { free(set->slots); }
 
-  double float_val = strtod(s, &end);
-  if (end != s && (*end == '\0' || *end == '\n')) {
-    return value_float(float_val);
+static HashSlot *hash_set_find(ValueHashSet *set, Value *val, uint64_t hash) {
+  size_t mask = set->capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    HashSlot *slot = &set->slots[i];
+    if (!slot->value ||
+        (slot->hash == hash && value_equals(slot->value, val))) {
+      return slot;
+    }
   }
+}
 
-  /* Try string */
-  if (*s == '"') {
-    s++;
-    const char *end_quote = strchr(s, '"');
-    if (end_quote) {
-      size_t len = end_quote - s;
-      char *str = (char *)malloc(len + 1);
-      strncpy(str, s, len);
-      str[len] = '\0';
-      return value_string(str);
+/* Returns false if an equal value is already present */
+static bool hash_set_add(ValueHashSet *set, Value *val) {
+  if ((set->count + 1) * 2 > set->capacity) {
+    HashSlot *old = set->slots;
+    size_t old_capacity = set->capacity;
+    set->capacity *= 2;
+    set->slots = (HashSlot *)calloc(set->capacity, sizeof(HashSlot));
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i].value) {
+        *hash_set_find(set, old[i].value, old[i].hash) = old[i];
+      }
     }
+    free(old);
   }
 
-  return value_null();
+  uint64_t hash = value_hash(val);
+  HashSlot *slot = hash_set_find(set, val, hash);
+  if (slot->value)
+    return false;
+  slot->hash = hash;
+  slot->value = val;
+  set->count++;
+  return true;
 }
 
-/* Generator control - proceed (next) and transmit (send) */
-static Value builtin_proceed(int argc, Value *argv) {
-  if (argc < 1 || argv[0].type != VAL_GENERATOR) {
-    return value_null();
-  }
-  return interpreter_gen_next(g_interp, argv[0]);
+static bool hash_set_contains(ValueHashSet *set, Value *val) {
+  return hash_set_find(set, val, value_hash(val))->value != NULL;
 }
 
-static Value builtin_transmit(int argc, Value *argv) {
-  if (argc < 2 || argv[0].type != VAL_GENERATOR) {
-    return value_null();
-  }
+/* ============================================================================
+ * Memoization
+ * ============================================================================
+ */
 
-  Generator *gen = argv[0].data.gen_val;
-  gen->sent_value = value_copy(&argv[1]);
-  gen->has_sent = true;
+/* Results of a memoized protocol keyed by its arguments. Entries also form
+ * a recency list, so a bounded cache evicts the least recently used. */
+typedef struct MemoEntry {
+  uint64_t hash;
+  int argc;
+  Value *args;
+  Value result;
+  struct MemoEntry *chain; /* Next entry in the same bucket */
+  struct MemoEntry *newer;
+  struct MemoEntry *older;
+} MemoEntry;
+
+typedef struct MemoCache {
+  size_t refcount;
+  size_t max_size; /* 0 when unbounded */
+  size_t count;
+  size_t bucket_count; /* Power of two */
+  MemoEntry **buckets;
+  MemoEntry *newest;
+  MemoEntry *oldest;
+} MemoCache;
+
+static MemoCache *memo_create(size_t max_size) {
+  MemoCache *memo = (MemoCache *)calloc(1, sizeof(MemoCache));
+  memo->refcount = 1;
+  memo->max_size = max_size;
+  memo->bucket_count = 16;
+  memo->buckets = (MemoEntry **)calloc(memo->bucket_count, sizeof(MemoEntry *));
+  return memo;
+}
 
-  Value result = interpreter_gen_next(g_interp, argv[0]);
-  return result;
+static void memo_entry_free(MemoEntry *entry) {
+  for (int i = 0; i < entry->argc; i++) {
+    value_free(&entry->args[i]);
+  }
+  free(entry->args);
+  value_free(&entry->result);
+  free(entry);
 }
 
-static Value builtin_receive(int argc, Value *argv) {
-  (void)argc;
-  (void)argv;
-  /* Get the sent value from current generator context */
-  if (g_interp->current_gen && g_interp->current_gen->has_sent) {
-    Value result = g_interp->current_gen->sent_value;
-    g_interp->current_gen->sent_value = value_null();
-    g_interp->current_gen->has_sent = false;
-    return result;
+static void memo_retain(MemoCache *memo) { memo->refcount++; }
+
+static void memo_release(MemoCache *memo) {
+  if (--memo->refcount > 0)
+    return;
+  MemoEntry *entry = memo->newest;
+  while (entry) {
+    MemoEntry *older = entry->older;
+    memo_entry_free(entry);
+    entry = older;
   }
-  return value_null();
+  free(memo->buckets);
+  free(memo);
 }
 
-static Value builtin_disrupt(int argc, Value *argv) {
-  /* disrupt(gen, error) - throw an exception into a generator */
-  if (argc < 2 || argv[0].type != VAL_GENERATOR) {
-    return value_null();
+static uint64_t memo_hash(int argc, Value *argv) {
+  uint64_t h = hash_mix((uint64_t)argc);
+  for (int i = 0; i < argc; i++) {
+    h = hash_mix(h ^ value_hash(&argv[i]));
   }
+  return h;
+}
 
-  Generator *gen = argv[0].data.gen_val;
-  gen->thrown_value = value_copy(&argv[1]);
-  gen->has_thrown = true;
+static void memo_unlink(MemoCache *memo, MemoEntry *entry) {
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    memo->newest = entry->older;
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    memo->oldest = entry->newer;
+}
 
-  /* Resume the generator - it will see the exception */
-  Value result = interpreter_gen_next(g_interp, argv[0]);
-  return result;
+static void memo_push_newest(MemoCache *memo, MemoEntry *entry) {
+  entry->newer = NULL;
+  entry->older = memo->newest;
+  if (memo->newest)
+    memo->newest->newer = entry;
+  memo->newest = entry;
+  if (!memo->oldest)
+    memo->oldest = entry;
 }
 
-/* Async builtins */
-#ifdef _WIN32
-#include <windows.h>
-#define SLEEP_MS(ms) Sleep(ms)
-#else
-#include <unistd.h>
-#define SLEEP_MS(ms) usleep((ms) * 1000)
-#endif
-
-static Value builtin_sleep(int argc, Value *argv) {
-  if (argc < 1 || argv[0].type != VAL_INT) {
-    return value_null();
+/* The cached result for these arguments, marked most recently used */
+static MemoEntry *memo_find(MemoCache *memo, uint64_t hash, int argc,
+                            Value *argv) {
+  MemoEntry *entry = memo->buckets[hash & (memo->bucket_count - 1)];
+  for (; entry; entry = entry->chain) {
+    if (entry->hash != hash || entry->argc != argc)
+      continue;
+    int i = 0;
+    while (i < argc && value_equals(&entry->args[i], &argv[i]))
+      i++;
+    if (i == argc) {
+      if (memo->newest != entry) {
+        memo_unlink(memo, entry);
+        memo_push_newest(memo, entry);
+      }
+      return entry;
+    }
   }
-  int64_t ms = argv[0].data.int_val;
-  SLEEP_MS(ms);
-  return value_null();
+  return NULL;
 }
 
-static Value builtin_resolve(int argc, Value *argv) {
-  if (argc < 1) {
-    return value_promise_resolved(value_null());
-  }
-  return value_promise_resolved(value_copy(&argv[0]));
+static void memo_remove(MemoCache *memo, MemoEntry *entry) {
+  MemoEntry **link = &memo->buckets[entry->hash & (memo->bucket_count - 1)];
+  while (*link != entry)
+    link = &(*link)->chain;
+  *link = entry->chain;
+  memo_unlink(memo, entry);
+  memo->count--;
+  memo_entry_free(entry);
 }
 
-static Value builtin_defer(int argc, Value *argv) {
-  /* defer(ms, protocol, ...args) - call protocol after ms delay */
-  if (argc < 2 || argv[0].type != VAL_INT) {
+/* Record a result, taking ownership of args and result */
+static void memo_store(MemoCache *memo, uint64_t hash, int argc, Value *args,
+                       Value result) {
+  if (memo->max_size > 0 && memo->count >= memo->max_size)
+    memo_remove(memo, memo->oldest);
+
+  if (memo->count >= memo->bucket_count) {
+    size_t count = memo->bucket_count * 2;
+    MemoEntry **buckets = (MemoEntry **)calloc(count, sizeof(MemoEntry *));
+    for (MemoEntry *e = memo->newest; e; e = e->older) {
+      e->chain = buckets[e->hash & (count - 1)];
+      buckets[e->hash & (count - 1)] = e;
+    }
+    free(memo->buckets);
+    memo->buckets = buckets;
+    memo->bucket_count = count;
+  }
+
+  MemoEntry *entry = (MemoEntry *)malloc(sizeof(MemoEntry));
+  entry->hash = hash;
+  entry->argc = argc;
+  entry->args = args;
+  entry->result = result;
+  entry->chain = memo->buckets[hash & (memo->bucket_count - 1)];
+  memo->buckets[hash & (memo->bucket_count - 1)] = entry;
+  memo_push_newest(memo, entry);
+  memo->count++;
+}
+
+/* memoize(protocol, max_size): the protocol with its results cached by
+ * argument values. Without max_size the cache is unbounded. */
+static Value builtin_memoize(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_FUNCTION ||
+      VALUE_FUNCTION(argv[0])->is_sequence) {
     return value_null();
   }
+  size_t max_size = 0;
+  if (argc >= 2 && VALUE_TYPE(argv[1]) == VAL_INT && VALUE_INT(argv[1]) > 0)
+    max_size = (size_t)VALUE_INT(argv[1]);
 
-  int64_t ms = argv[0].data.int_val;
-  SLEEP_MS(ms);
+  Value memoized = value_copy(&argv[0]);
+  Function *fn = VALUE_FUNCTION(memoized);
+  if (fn->memo)
+    memo_release(fn->memo);
+  fn->memo = memo_create(max_size);
+  return memoized;
+}
 
-  /* Call the protocol with remaining args */
-  if (argv[1].type == VAL_FUNCTION || argv[1].type == VAL_BUILTIN) {
-    int call_argc = argc - 2;
-    Value *call_argv = (call_argc > 0) ? &argv[2] : NULL;
+/* Introsort over an index permutation; keys never move */
+#define SORT_SMALL 16
 
-    if (argv[1].type == VAL_BUILTIN) {
-      return argv[1].data.builtin_val(call_argc, call_argv);
-    } else {
-      return interpreter_call(g_interp, argv[1].data.func_val, value_null(),
-                              call_argc, call_argv);
+static void sort_insertion(size_t *order, size_t lo, size_t hi, Value *keys) {
+  for (size_t i = lo + 1; i < hi; i++) {
+    size_t current = order[i];
+    size_t j = i;
+    while (j > lo && value_compare(&keys[order[j - 1]], &keys[current]) > 0) {
+      order[j] = order[j - 1];
+      j--;
     }
+    order[j] = current;
   }
+}
 
-  return value_null();
+static void sort_sift_down(size_t *heap, size_t root, size_t count,
+                           Value *keys) {
+  while (true) {
+    size_t child = 2 * root + 1;
+    if (child >= count)
+      return;
+    if (child + 1 < count &&
+        value_compare(&keys[heap[child]], &keys[heap[child + 1]]) < 0)
+      child++;
+    if (value_compare(&keys[heap[root]], &keys[heap[child]]) >= 0)
+      return;
+    size_t tmp = heap[root];
+    heap[root] = heap[child];
+    heap[child] = tmp;
+    root = child;
+  }
 }
 
-/* ============================================================================
- * Interpreter
- * ============================================================================
- */
+static void sort_heap(size_t *heap, size_t count, Value *keys) {
+  for (size_t i = count / 2; i-- > 0;) {
+    sort_sift_down(heap, i, count, keys);
+  }
+  for (size_t end = count; end-- > 1;) {
+    size_t tmp = heap[0];
+    heap[0] = heap[end];
+    heap[end] = tmp;
+    sort_sift_down(heap, 0, end, keys);
+  }
+}
 
-Interpreter *interpreter_create(void) {
-  DEBUG_PRINT("interpreter_create\n");
-  Interpreter *interp = (Interpreter *)calloc(1, sizeof(Interpreter));
-  interp->global_env = env_create(NULL);
-  interp->current_env = interp->global_env;
-  interp->return_value = value_null();
-  interp->has_return = false;
-  interp->has_error = false;
-  interp->last_error[0] = '\0';
-  interp->error_repeat_count = 0;
+static void sort_intro(size_t *order, size_t lo, size_t hi, int depth,
+                       Value *keys) {
+  while (hi - lo > SORT_SMALL) {
+    if (depth-- == 0) {
+      /* Quicksort is degenerating - finish this range with heapsort */
+      sort_heap(order + lo, hi - lo, keys);
+      return;
+    }
 
-  /* Set global interpreter for higher-order functions */
-  g_interp = interp;
+    /* Median of three, which also leaves sentinels at both ends */
+    size_t mid = lo + (hi - lo) / 2;
+    size_t *a = &order[lo], *b = &order[mid], *c = &order[hi - 1];
+    size_t tmp;
+    if (value_compare(&keys[*b], &keys[*a]) < 0) {
+      tmp = *a, *a = *b, *b = tmp;
+    }
+    if (value_compare(&keys[*c], &keys[*b]) < 0) {
+      tmp = *b, *b = *c, *c = tmp;
+      if (value_compare(&keys[*b], &keys[*a]) < 0) {
+        tmp = *a, *a = *b, *b = tmp;
+      }
+    }
+    Value *pivot = &keys[order[mid]];
 
-  /* Register builtins */
-  env_define(interp->global_env, "declare", value_builtin(builtin_declare));
-  env_define(interp->global_env, "announce", value_builtin(builtin_declare));
-  env_define(interp->global_env, "inquire", value_builtin(builtin_inquire));
-  env_define(interp->global_env, "measure", value_builtin(builtin_measure));
-  env_define(interp->global_env, "span", value_builtin(builtin_span));
-  env_define(interp->global_env, "text", value_builtin(builtin_text));
-  env_define(interp->global_env, "number", value_builtin(builtin_number));
-  env_define(interp->global_env, "decimal", value_builtin(builtin_decimal));
-  env_define(interp->global_env, "boolean", value_builtin(builtin_boolean));
-  env_define(interp->global_env, "classify", value_builtin(builtin_classify));
+    /* Hoare partition */
+    size_t i = lo, j = hi - 1;
+    while (true) {
+      while (value_compare(&keys[order[i]], pivot) < 0)
+        i++;
+      while (value_compare(&keys[order[j]], pivot) > 0)
+        j--;
+      if (i >= j)
+        break;
+      tmp = order[i], order[i] = order[j], order[j] = tmp;
+      i++;
+      j--;
+    }
 
-  /* File I/O */
-  env_define(interp->global_env, "inscribe", value_builtin(builtin_inscribe));
-  env_define(interp->global_env, "decipher", value_builtin(builtin_decipher));
-  env_define(interp->global_env, "chronicle", value_builtin(builtin_chronicle));
-  env_define(interp->global_env, "exists", value_builtin(builtin_exists));
+    /* Recurse into the smaller half, loop on the larger */
+    if (j + 1 - lo < hi - (j + 1)) {
+      sort_intro(order, lo, j + 1, depth, keys);
+      lo = j + 1;
+    } else {
+      sort_intro(order, j + 1, hi, depth, keys);
+      hi = j + 1;
+    }
+  }
+  sort_insertion(order, lo, hi, keys);
+}
 
-  /* Math */
-  env_define(interp->global_env, "abs", value_builtin(builtin_abs_val));
-  env_define(interp->global_env, "sqrt", value_builtin(builtin_sqrt_val));
-  env_define(interp->global_env, "min", value_builtin(builtin_min_val));
-  env_define(interp->global_env, "max", value_builtin(builtin_max_val));
-  env_define(interp->global_env, "random", value_builtin(builtin_random_val));
+/* Stable merge sort over an index permutation */
+static void sort_merge(size_t *order, size_t *scratch, size_t lo, size_t hi,
+                       Value *keys) {
+  if (hi - lo <= SORT_SMALL) {
+    sort_insertion(order, lo, hi, keys);
+    return;
+  }
+  size_t mid = lo + (hi - lo) / 2;
+  sort_merge(order, scratch, lo, mid, keys);
+  sort_merge(order, scratch, mid, hi, keys);
+  if (value_compare(&keys[order[mid - 1]], &keys[order[mid]]) <= 0)
+    return; /* Already in order */
+
+  memcpy(scratch + lo, order + lo, sizeof(size_t) * (hi - lo));
+  size_t i = lo, j = mid, k = lo;
+  while (i < mid && j < hi) {
+    if (value_compare(&keys[scratch[j]], &keys[scratch[i]]) < 0) {
+      order[k++] = scratch[j++];
+    } else {
+      order[k++] = scratch[i++];
+    }
+  }
+  while (i < mid)
+    order[k++] = scratch[i++];
+  while (j < hi)
+    order[k++] = scratch[j++];
+}
 
-  /* String */
-  env_define(interp->global_env, "uppercase", value_builtin(builtin_uppercase));
-  env_define(interp->global_env, "lowercase", value_builtin(builtin_lowercase));
-  env_define(interp->global_env, "split", value_builtin(builtin_split));
-  env_define(interp->global_env, "join", value_builtin(builtin_join));
-  env_define(interp->global_env, "contains", value_builtin(builtin_contains));
+static Value sort_list(int argc, Value *argv, bool stable) {
+  if (argc >= 1 && VALUE_TYPE(argv[0]) == VAL_SET)
+    argv[0] = set_into_list(&argv[0]);
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_LIST) {
+    return value_list_new();
+  }
 
-  /* List */
-  env_define(interp->global_env, "push", value_builtin(builtin_push));
-  env_define(interp->global_env, "reverse", value_builtin(builtin_reverse));
+  /* The argument is an owned temporary - its items are moved, not copied */
+  size_t count;
+  Value *items = list_take_items(&argv[0], &count);
+
+  /* Each key is computed exactly once */
+  Value *keys = items;
+  bool has_key = argc >= 2 && (VALUE_TYPE(argv[1]) == VAL_FUNCTION ||
+                               VALUE_TYPE(argv[1]) == VAL_BUILTIN);
+  if (has_key) {
+    keys = (Value *)malloc(sizeof(Value) * (count > 0 ? count : 1));
+    for (size_t i = 0; i < count; i++) {
+      keys[i] = call_callable(&argv[1], 1, &items[i]);
+      if (g_interp->flow == FLOW_ERROR) {
+        for (size_t j = 0; j <= i; j++) {
+          value_free(&keys[j]);
+        }
+        free(keys);
+        argv[0] = list_adopt_items(items, count);
+        return value_null();
+      }
+    }
+  }
 
-  /* Utility */
-  env_define(interp->global_env, "clock", value_builtin(builtin_clock));
-  env_define(interp->global_env, "terminate", value_builtin(builtin_terminate));
+  size_t *order = (size_t *)malloc(sizeof(size_t) * (count > 0 ? count : 1));
+  for (size_t i = 0; i < count; i++) {
+    order[i] = i;
+  }
 
-  /* Higher-order functions - transform (map), select (filter), fold (reduce) */
-  env_define(interp->global_env, "transform", value_builtin(builtin_transform));
-  env_define(interp->global_env, "select", value_builtin(builtin_select));
-  env_define(interp->global_env, "fold", value_builtin(builtin_fold));
+  if (stable) {
+    size_t *scratch =
+        (size_t *)malloc(sizeof(size_t) * (count > 0 ? count : 1));
+    sort_merge(order, scratch, 0, count, keys);
+    free(scratch);
+  } else {
+    int depth = 0;
+    for (size_t n = count; n > 1; n >>= 1) {
+      depth += 2;
+    }
+    sort_intro(order, 0, count, depth, keys);
+  }
 
-  /* JSON */
-  env_define(interp->global_env, "encode_json",
-             value_builtin(builtin_encode_json));
-  env_define(interp->global_env, "decode_json",
-             value_builtin(builtin_decode_json));
+  Value *sorted = (Value *)malloc(sizeof(Value) * (count > 0 ? count : 1));
+  for (size_t i = 0; i < count; i++) {
+    sorted[i] = items[order[i]];
+  }
 
-  /* Timestamp */
-  env_define(interp->global_env, "timestamp", value_builtin(builtin_timestamp));
+  if (has_key) {
+    for (size_t i = 0; i < count; i++) {
+      value_free(&keys[i]);
+    }
+    free(keys);
+  }
+  free(order);
+  free(items);
+  return list_adopt_items(sorted, count);
+}
 
-  /* Generator control */
-  env_define(interp->global_env, "proceed", value_builtin(builtin_proceed));
-  env_define(interp->global_env, "transmit", value_builtin(builtin_transmit));
-  env_define(interp->global_env, "receive", value_builtin(builtin_receive));
-  env_define(interp->global_env, "disrupt", value_builtin(builtin_disrupt));
+/* sort(list, key) - sorted copy (introsort); key protocol is optional */
+static Value builtin_sort(int argc, Value *argv) {
+  return sort_list(argc, argv, false);
+}
 
-  /* Async */
-  env_define(interp->global_env, "sleep", value_builtin(builtin_sleep));
-  env_define(interp->global_env, "resolve", value_builtin(builtin_resolve));
-  env_define(interp->global_env, "defer", value_builtin(builtin_defer));
+/* stable_sort(list, key) - sorted copy keeping equal elements in order */
+static Value builtin_stable_sort(int argc, Value *argv) {
+  return sort_list(argc, argv, true);
+}
 
-  return interp;
+/* binary_search(sorted_list, value) - index of value, or -1 */
+static Value builtin_binary_search(int argc, Value *argv) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_LIST) {
+    return value_int(-1);
+  }
+  ValueList *list = VALUE_LIST(argv[0]);
+  size_t lo = 0, hi = list->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int c = value_compare(&list->items[mid], &argv[1]);
+    if (c == 0)
+      return value_int((int64_t)mid);
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return value_int(-1);
 }
 
-void interpreter_destroy(Interpreter *interp) {
-  if (interp) {
-    env_destroy(interp->global_env);
-    free(interp);
+/* index_of(list, value) - index of the first equal element, or -1 */
+static Value builtin_index_of(int argc, Value *argv) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_LIST) {
+    return value_int(-1);
   }
+  ValueList *list = VALUE_LIST(argv[0]);
+  for (size_t i = 0; i < list->count; i++) {
+    if (value_equals(&list->items[i], &argv[1]))
+      return value_int((int64_t)i);
+  }
+  return value_int(-1);
 }
 
-static void runtime_error(Interpreter *interp, const char *msg, int line) {
-  interp->has_error = true;
-  snprintf(interp->error_buffer, sizeof(interp->error_buffer), "%s", msg);
+/* unique(list) - first occurrence of each element, order preserved */
+static Value builtin_unique(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_LIST) {
+    return value_list_new();
+  }
 
-  /* Track repeated errors */
-  if (strcmp(interp->last_error, msg) == 0) {
-    interp->error_repeat_count++;
-  } else {
-    strncpy(interp->last_error, msg, sizeof(interp->last_error) - 1);
-    interp->last_error[sizeof(interp->last_error) - 1] = '\0';
-    interp->error_repeat_count = 1;
+  size_t count;
+  Value *items = list_take_items(&argv[0], &count);
+  Value result = value_list_new();
+  value_list_reserve(&result, count); /* Slots never move while hashed */
+  ValueList *out = VALUE_LIST(result);
+
+  ValueHashSet seen;
+  hash_set_init(&seen, count);
+  for (size_t i = 0; i < count; i++) {
+    out->items[out->count] = items[i];
+    if (hash_set_add(&seen, &out->items[out->count])) {
+      out->count++;
+    } else {
+      value_free(&items[i]);
+    }
   }
+  hash_set_free(&seen);
+  free(items);
+  return result;
+}
 
-  voice_print_runtime_error_tracked(msg, line, interp->error_repeat_count);
+/* An owned list or set as a set; list items are moved, not copied */
+static Value set_from(Value *val) {
+  if (VALUE_TYPE(*val) == VAL_SET) {
+    Value set = *val;
+    *val = value_null();
+    return set;
+  }
+  Value set = value_set_new();
+  if (VALUE_TYPE(*val) == VAL_LIST) {
+    size_t count;
+    Value *items = list_take_items(val, &count);
+    value_set_reserve(&set, count);
+    for (size_t i = 0; i < count; i++) {
+      value_set_add(&set, items[i]);
+    }
+    free(items);
+  }
+  return set;
 }
 
-bool interpreter_has_error(const Interpreter *interp) {
-  return interp->has_error;
+/* set(list) - the distinct elements, in first-seen order */
+static Value builtin_set(int argc, Value *argv) {
+  if (argc < 1)
+    return value_set_new();
+  return set_from(&argv[0]);
 }
 
-const char *interpreter_get_error(const Interpreter *interp) {
-  return interp->error_buffer;
+/* Members of the set a that are (or with keep false, are not) in other.
+ * Hashes stored with a's members are reused for the lookups. */
+static Value set_filter(Value *a, Value *other, bool keep) {
+  Value b = set_from(other);
+  ValueSet *from = VALUE_SET(*a);
+  ValueSet *in = VALUE_SET(b);
+  Value result = value_set_new();
+  for (size_t i = 0; i < from->count; i++) {
+    if (set_has(in, &from->items[i], from->hashes[i]) == keep) {
+      set_insert(&result, from->items[i], from->hashes[i]);
+      from->items[i] = value_null();
+    }
+  }
+  value_free(&b);
+  return result;
 }
 
-/* ============================================================================
- * Expression Evaluation
- * ============================================================================
- */
+/* union(a, b) - elements of either list, without duplicates. If a is a set,
+ * so is the result. */
+static Value builtin_union(int argc, Value *argv) {
+  if (argc >= 2 && VALUE_TYPE(argv[0]) == VAL_SET &&
+      (VALUE_TYPE(argv[1]) == VAL_SET || VALUE_TYPE(argv[1]) == VAL_LIST)) {
+    Value result = argv[0];
+    argv[0] = value_null();
+    if (VALUE_TYPE(argv[1]) == VAL_SET) {
+      ValueSet *b = VALUE_SET(argv[1]);
+      for (size_t i = 0; i < b->count; i++) {
+        set_insert(&result, b->items[i], b->hashes[i]);
+        b->items[i] = value_null();
+      }
+    } else {
+      size_t count;
+      Value *items = list_take_items(&argv[1], &count);
+      for (size_t i = 0; i < count; i++) {
+        value_set_add(&result, items[i]);
+      }
+      free(items);
+    }
+    return result;
+  }
+  if (argc >= 2 && VALUE_TYPE(argv[1]) == VAL_SET)
+    argv[1] = set_into_list(&argv[1]);
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_LIST ||
+      VALUE_TYPE(argv[1]) != VAL_LIST) {
+    return value_list_new();
+  }
 
-static Value eval_expr(Interpreter *interp, ASTNode *node);
-static Value eval_stmt(Interpreter *interp, ASTNode *node);
-static void exec_block(Interpreter *interp, ASTNodeArray *stmts);
+  size_t a_count, b_count;
+  Value *a = list_take_items(&argv[0], &a_count);
+  Value *b = list_take_items(&argv[1], &b_count);
+  Value result = value_list_new();
+  value_list_reserve(&result, a_count + b_count);
+  ValueList *out = VALUE_LIST(result);
+
+  ValueHashSet seen;
+  hash_set_init(&seen, a_count + b_count);
+  for (size_t i = 0; i < a_count + b_count; i++) {
+    Value *item = i < a_count ? &a[i] : &b[i - a_count];
+    out->items[out->count] = *item;
+    if (hash_set_add(&seen, &out->items[out->count])) {
+      out->count++;
+    } else {
+      value_free(item);
+    }
+  }
+  hash_set_free(&seen);
+  free(a);
+  free(b);
+  return result;
+}
 
-static void gen_push_frame(Generator *gen, GenFrame frame) {
-  DEBUG_PRINT("gen_push_frame: gen=%p (%s), type=%d, count=%zu\n", (void *)gen,
-              gen->func_val.data.func_val->name, frame.type, gen->stack_count);
-  if (gen->stack_count >= gen->stack_capacity) {
-    gen->stack_capacity =
-        gen->stack_capacity == 0 ? 4 : gen->stack_capacity * 2;
-    gen->stack =
-        (GenFrame *)realloc(gen->stack, sizeof(GenFrame) * gen->stack_capacity);
+/* Elements of the list a that are (or with keep false, are not) in the
+ * list b, without duplicates */
+static Value list_filter(Value *a, Value *b_list, bool keep) {
+  ValueList *b = VALUE_LIST(*b_list);
+  ValueHashSet other;
+  hash_set_init(&other, b->count);
+  for (size_t i = 0; i < b->count; i++) {
+    hash_set_add(&other, &b->items[i]);
   }
-  gen->stack[gen->stack_count++] = frame;
+
+  size_t count;
+  Value *items = list_take_items(a, &count);
+  Value result = value_list_new();
+  value_list_reserve(&result, count);
+  ValueList *out = VALUE_LIST(result);
+
+  ValueHashSet seen;
+  hash_set_init(&seen, count);
+  for (size_t i = 0; i < count; i++) {
+    out->items[out->count] = items[i];
+    if (hash_set_contains(&other, &items[i]) == keep &&
+        hash_set_add(&seen, &out->items[out->count])) {
+      out->count++;
+    } else {
+      value_free(&items[i]);
+    }
+  }
+  hash_set_free(&seen);
+  hash_set_free(&other);
+  free(items);
+  return result;
 }
 
-static Value eval_expr(Interpreter *interp, ASTNode *node);
-static Value eval_stmt(Interpreter *interp, ASTNode *node);
-static void exec_block(Interpreter *interp, ASTNodeArray *stmts);
+/* intersection(a, b) - elements of a also present in b, without duplicates.
+ * If a is a set, so is the result. */
+static Value builtin_intersection(int argc, Value *argv) {
+  if (argc < 2 || (VALUE_TYPE(argv[1]) != VAL_LIST &&
+                   VALUE_TYPE(argv[1]) != VAL_SET))
+    return value_list_new();
+  if (VALUE_TYPE(argv[0]) == VAL_SET)
+    return set_filter(&argv[0], &argv[1], true);
+  if (VALUE_TYPE(argv[0]) != VAL_LIST)
+    return value_list_new();
+  if (VALUE_TYPE(argv[1]) == VAL_SET)
+    argv[1] = set_into_list(&argv[1]);
+  return list_filter(&argv[0], &argv[1], true);
+}
 
-static Value eval_binary(Interpreter *interp, ASTNode *node) {
-  Value left = eval_expr(interp, node->data.binary.left);
+/* difference(a, b) - elements of a not present in b, without duplicates.
+ * If a is a set, so is the result. */
+static Value builtin_difference(int argc, Value *argv) {
+  if (argc < 2 || (VALUE_TYPE(argv[1]) != VAL_LIST &&
+                   VALUE_TYPE(argv[1]) != VAL_SET))
+    return value_list_new();
+  if (VALUE_TYPE(argv[0]) == VAL_SET)
+    return set_filter(&argv[0], &argv[1], false);
+  if (VALUE_TYPE(argv[0]) != VAL_LIST)
+    return value_list_new();
+  if (VALUE_TYPE(argv[1]) == VAL_SET)
+    argv[1] = set_into_list(&argv[1]);
+  return list_filter(&argv[0], &argv[1], false);
+}
 
-  /* Short-circuit for and/or */
-  if (node->data.binary.op == OP_AND) {
-    if (!value_is_truthy(&left))
-      return value_bool(false);
-    Value right = eval_expr(interp, node->data.binary.right);
-    return value_bool(value_is_truthy(&right));
-  }
-  if (node->data.binary.op == OP_OR) {
-    if (value_is_truthy(&left))
-      return value_bool(true);
-    Value right = eval_expr(interp, node->data.binary.right);
-    return value_bool(value_is_truthy(&right));
+/* insert(list, index, value) - place value before index, returns the list */
+static Value builtin_insert(int argc, Value *argv) {
+  if (argc < 3 || VALUE_TYPE(argv[0]) != VAL_LIST ||
+      VALUE_TYPE(argv[1]) != VAL_INT) {
+    return value_null();
   }
+  ValueList *list = VALUE_LIST(argv[0]);
+  int64_t index = VALUE_INT(argv[1]);
+  if (index < 0)
+    index += (int64_t)list->count;
+  if (index < 0)
+    index = 0;
+  if ((uint64_t)index > list->count)
+    index = (int64_t)list->count;
+
+  value_list_push(&argv[0], value_null());
+  memmove(&list->items[index + 1], &list->items[index],
+          sizeof(Value) * (list->count - 1 - (size_t)index));
+  list->items[index] = argv[2];
+  argv[2] = value_null();
+  return take_first(argv);
+}
 
-  Value right = eval_expr(interp, node->data.binary.right);
+/* pop(list, index) - remove and return the element at index (default last) */
+static Value builtin_pop(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_LIST) {
+    return value_null();
+  }
+  ValueList *list = VALUE_LIST(argv[0]);
+  int64_t index = (int64_t)list->count - 1;
+  if (argc >= 2 && VALUE_TYPE(argv[1]) == VAL_INT) {
+    index = VALUE_INT(argv[1]);
+    if (index < 0)
+      index += (int64_t)list->count;
+  }
+  if (index < 0 || (uint64_t)index >= list->count) {
+    return builtin_error("IndexOutOfRange",
+                         list->count == 0 ? "Cannot pop from an empty list."
+                                          : "Pop index is outside the list.");
+  }
 
-  /* String concatenation */
-  if (node->data.binary.op == OP_ADD &&
-      (left.type == VAL_STRING || right.type == VAL_STRING)) {
-    char *left_str = value_to_string(&left);
-    char *right_str = value_to_string(&right);
+  Value item = list->items[index];
+  memmove(&list->items[index], &list->items[index + 1],
+          sizeof(Value) * (list->count - 1 - (size_t)index));
+  list->count--;
+  return item;
+}
 
-    /* Remove quotes if present */
-    if (left.type == VAL_STRING) {
-      memmove(left_str, left_str + 1, strlen(left_str) - 2);
-      left_str[strlen(left_str) - 2] = '\0';
-    }
-    if (right.type == VAL_STRING) {
-      memmove(right_str, right_str + 1, strlen(right_str) - 2);
-      right_str[strlen(right_str) - 2] = '\0';
+/* extend(list, other) - append every element of other, returns the list.
+ * A set gains the elements it lacks. */
+static Value builtin_extend(int argc, Value *argv) {
+  if (argc >= 2 && VALUE_TYPE(argv[1]) == VAL_SET)
+    argv[1] = set_into_list(&argv[1]);
+  if (argc >= 2 && VALUE_TYPE(argv[0]) == VAL_SET &&
+      VALUE_TYPE(argv[1]) == VAL_LIST) {
+    size_t count;
+    Value *items = list_take_items(&argv[1], &count);
+    value_set_reserve(&argv[0], VALUE_SET(argv[0])->count + count);
+    for (size_t i = 0; i < count; i++) {
+      value_set_add(&argv[0], items[i]);
     }
-
-    char *result = (char *)malloc(strlen(left_str) + strlen(right_str) + 1);
-    sprintf(result, "%s%s", left_str, right_str);
-
-    Value v = value_string(result);
-    free(left_str);
-    free(right_str);
-    free(result);
-    value_free(&left);
-    value_free(&right);
-    return v;
+    free(items);
+    return take_first(argv);
   }
-
-  /* String multiplication */
-  if (node->data.binary.op == OP_MUL && left.type == VAL_STRING &&
-      right.type == VAL_INT) {
-    int64_t times = right.data.int_val;
-    size_t len = strlen(left.data.string_val);
-    char *result = (char *)malloc(len * times + 1);
-    result[0] = '\0';
-    for (int64_t i = 0; i < times; i++) {
-      strcat(result, left.data.string_val);
-    }
-    Value v = value_string(result);
-    free(result);
-    value_free(&left);
-    value_free(&right);
-    return v;
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_LIST ||
+      VALUE_TYPE(argv[1]) != VAL_LIST) {
+    return value_null();
+  }
+  size_t count;
+  Value *items = list_take_items(&argv[1], &count);
+  value_list_reserve(&argv[0], VALUE_LIST(argv[0])->count + count);
+  for (size_t i = 0; i < count; i++) {
+    value_list_push(&argv[0], items[i]);
   }
+  free(items);
+  return take_first(argv);
+}
 
-  /* Numeric operations */
-  bool use_float = (left.type == VAL_FLOAT || right.type == VAL_FLOAT);
-  double a =
-      left.type == VAL_FLOAT ? left.data.float_val : (double)left.data.int_val;
-  double b = right.type == VAL_FLOAT ? right.data.float_val
-                                     : (double)right.data.int_val;
+/* ============================================================================
+ * String Formatting
+ * ============================================================================
+ */
 
-  value_free(&left);
-  value_free(&right);
+/* Parsed [[fill]align][sign][0][width][.precision][type] */
+typedef struct {
+  char fill;
+  char align; /* '<', '>', '^', '=' or 0 for the value's default */
+  char sign;  /* '+', ' ' or '-' */
+  bool zero_pad;
+  size_t width;
+  int precision; /* -1 if absent */
+  char type;     /* 0 for the value's default */
+} FormatSpec;
+
+static bool format_spec_parse(const char *spec, size_t length,
+                              FormatSpec *fs) {
+  fs->fill = ' ';
+  fs->align = 0;
+  fs->sign = '-';
+  fs->zero_pad = false;
+  fs->width = 0;
+  fs->precision = -1;
+  fs->type = 0;
+
+  size_t i = 0;
+  if (length >= 2 && strchr("<>^=", spec[1])) {
+    fs->fill = spec[0];
+    fs->align = spec[1];
+    i = 2;
+  } else if (length >= 1 && strchr("<>^=", spec[0])) {
+    fs->align = spec[0];
+    i = 1;
+  }
+  if (i < length && strchr("+- ", spec[i])) {
+    fs->sign = spec[i++];
+  }
+  if (i < length && spec[i] == '0') {
+    fs->zero_pad = true;
+    i++;
+  }
+  while (i < length && isdigit((unsigned char)spec[i])) {
+    fs->width = fs->width * 10 + (size_t)(spec[i++] - '0');
+  }
+  if (i < length && spec[i] == '.') {
+    i++;
+    fs->precision = 0;
+    if (i >= length || !isdigit((unsigned char)spec[i]))
+      return false;
+    while (i < length && isdigit((unsigned char)spec[i])) {
+      fs->precision = fs->precision * 10 + (spec[i++] - '0');
+    }
+  }
+  if (i < length && strchr("dfFeEgGxXobs%", spec[i])) {
+    fs->type = spec[i++];
+  }
+  return i == length && fs->width < 4096 && fs->precision < 512;
+}
 
-  switch (node->data.binary.op) {
+/* Default rendering - strings are written raw, numbers without temporaries */
+static void format_plain(StringBuilder *sb, Value *val) {
+  switch (VALUE_TYPE(*val)) {
+  case VAL_STRING:
+    sb_append(sb, VALUE_STRING(*val), value_string_length(val));
+    return;
+  case VAL_INT:
+    sb->length += (size_t)snprintf(sb_reserve(sb, 24), 25, "%lld",
+                                   (long long)VALUE_INT(*val));
+    return;
+  case VAL_FLOAT:
+    sb->length +=
+        (size_t)snprintf(sb_reserve(sb, 32), 33, "%g", VALUE_FLOAT(*val));
+    return;
+  default: {
+    char *text = value_to_string(val);
+    sb_append(sb, text, strlen(text));
+    free(text);
+    return;
+  }
+  }
+}
+
+static void format_raise(Interpreter *interp, const char *kind,
+                         const char *msg, int line) {
+  interpreter_raise(interp, value_error_new(kind, msg, line));
+}
+
+/* Write val formatted by spec; returns false after raising */
+static bool format_value(Interpreter *interp, StringBuilder *sb, Value *val,
+                         const char *spec, size_t spec_length, int line) {
+  if (spec_length == 0) {
+    format_plain(sb, val);
+    return true;
+  }
+
+  FormatSpec fs;
+  if (!format_spec_parse(spec, spec_length, &fs)) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Invalid format specification '%.*s'.",
+             (int)(spec_length < 64 ? spec_length : 64), spec);
+    format_raise(interp, "InvalidFormat", msg, line);
+    return false;
+  }
+
+  bool numeric = VALUE_TYPE(*val) == VAL_INT || VALUE_TYPE(*val) == VAL_FLOAT;
+  char number[640];
+  const char *body;
+  size_t body_length;
+  char *owned = NULL;
+  const char *prefix = ""; /* Sign, placed before '=' padding */
+
+  if (numeric) {
+    bool is_int = VALUE_TYPE(*val) == VAL_INT;
+    double d = is_int ? (double)VALUE_INT(*val) : VALUE_FLOAT(*val);
+    int64_t n = is_int ? VALUE_INT(*val) : (int64_t)VALUE_FLOAT(*val);
+    char type = fs.type;
+    if (type == 0)
+      type = is_int ? 'd' : fs.precision >= 0 ? 'f' : 'g';
+    if (type == 's') {
+      format_raise(interp, "TypeMismatch",
+                   "Format type 's' cannot be applied to a number.", line);
+      return false;
+    }
+
+    bool negative = strchr("dxXob", type) ? n < 0 : (d < 0 || signbit(d));
+    if (negative)
+      prefix = "-";
+    else if (fs.sign == '+')
+      prefix = "+";
+    else if (fs.sign == ' ')
+      prefix = " ";
+
+    uint64_t magnitude = n < 0 ? 0 - (uint64_t)n : (uint64_t)n;
+    double absolute = fabs(d);
+    int precision = fs.precision >= 0 ? fs.precision : 6;
+    int written = 0;
+
+    switch (type) {
+    case 'd':
+      written = snprintf(number, sizeof(number), "%llu",
+                         (unsigned long long)magnitude);
+      break;
+    case 'x':
+    case 'X':
+    case 'o': {
+      char conv[] = {'%', 'l', 'l', type, '\0'};
+      written =
+          snprintf(number, sizeof(number), conv, (unsigned long long)magnitude);
+      break;
+    }
+    case 'b': {
+      char bits[64];
+      int count = 0;
+      do {
+        bits[count++] = (char)('0' + (magnitude & 1));
+        magnitude >>= 1;
+      } while (magnitude);
+      for (int k = 0; k < count; k++) {
+        number[k] = bits[count - 1 - k];
+      }
+      written = count;
+      break;
+    }
+    case '%':
+      written =
+          snprintf(number, sizeof(number), "%.*f%%", precision, absolute * 100);
+      break;
+    case 'g':
+    case 'G':
+      if (fs.precision < 0) {
+        written = snprintf(number, sizeof(number), type == 'g' ? "%g" : "%G",
+                           absolute);
+        break;
+      }
+      /* Fall through */
+    default: {
+      char conv[] = {'%', '.', '*', type, '\0'};
+      written = snprintf(number, sizeof(number), conv, precision, absolute);
+      break;
+    }
+    }
+    body = number;
+    body_length = written < (int)sizeof(number) ? (size_t)written
+                                                : sizeof(number) - 1;
+  } else {
+    if (fs.type && fs.type != 's') {
+      char msg[128];
+      snprintf(msg, sizeof(msg), "Format type '%c' cannot be applied to a %s.",
+               fs.type, value_type_name(VALUE_TYPE(*val)));
+      format_raise(interp, "TypeMismatch", msg, line);
+      return false;
+    }
+    if (VALUE_TYPE(*val) == VAL_STRING) {
+      body = VALUE_STRING(*val);
+      body_length = value_string_length(val);
+    } else {
+      owned = value_to_string(val);
+      body = owned;
+      body_length = strlen(owned);
+    }
+  }
+
+  /* Width and precision count codepoints, not bytes */
+  size_t prefix_length = strlen(prefix);
+  size_t shown = 0;
+  size_t visible = 0;
+  for (; shown < body_length; shown++) {
+    if (UTF8_IS_CONTINUATION(body[shown]))
+      continue;
+    if (!numeric && fs.precision >= 0 && visible == (size_t)fs.precision)
+      break;
+    visible++;
+  }
+  body_length = shown;
+  visible += prefix_length;
+
+  char align = fs.align;
+  char fill = fs.fill;
+  if (!align && fs.zero_pad && numeric) {
+    align = '=';
+    fill = '0';
+  } else if (!align) {
+    align = numeric ? '>' : '<';
+  }
+  if (align == '=' && !numeric)
+    align = '>';
+
+  size_t pad = fs.width > visible ? fs.width - visible : 0;
+  size_t before = align == '<' ? 0 : align == '^' ? pad / 2 : pad;
+
+  if (align == '=') {
+    sb_append(sb, prefix, prefix_length);
+    sb_fill(sb, fill, pad);
+  } else {
+    sb_fill(sb, fill, before);
+    sb_append(sb, prefix, prefix_length);
+  }
+  sb_append(sb, body, body_length);
+  if (align != '=')
+    sb_fill(sb, fill, pad - before);
+
+  free(owned);
+  return true;
+}
+
+/* format(template, args...) - {} / {0} / {:>8.2f} fields, {{ and }} escape */
+static Value builtin_format(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING) {
+    return value_string("");
+  }
+
+  const char *tmpl = VALUE_STRING(argv[0]);
+  size_t length = value_string_length(&argv[0]);
+  StringBuilder sb;
+  sb_init(&sb, length + 16 * (size_t)(argc - 1));
+  int next_arg = 1;
+
+  size_t i = 0;
+  while (i < length) {
+    char c = tmpl[i];
+    if ((c == '{' || c == '}') && i + 1 < length && tmpl[i + 1] == c) {
+      sb_append(&sb, &c, 1);
+      i += 2;
+      continue;
+    }
+    if (c != '{') {
+      size_t run = i + 1;
+      while (run < length && tmpl[run] != '{' && tmpl[run] != '}')
+        run++;
+      sb_append(&sb, tmpl + i, run - i);
+      i = run;
+      continue;
+    }
+
+    const char *close = (const char *)memchr(tmpl + i, '}', length - i);
+    if (!close) {
+      sb_discard(&sb);
+      return builtin_error("InvalidFormat",
+                           "Unterminated '{' in format string.");
+    }
+    const char *field = tmpl + i + 1;
+    size_t field_length = (size_t)(close - field);
+    const char *colon = (const char *)memchr(field, ':', field_length);
+    size_t index_length = colon ? (size_t)(colon - field) : field_length;
+
+    int arg = next_arg++;
+    if (index_length > 0) {
+      size_t index = 0;
+      for (size_t k = 0; k < index_length && index < (size_t)argc; k++) {
+        index = isdigit((unsigned char)field[k])
+                    ? index * 10 + (size_t)(field[k] - '0')
+                    : (size_t)argc;
+      }
+      arg = index < (size_t)argc ? (int)index + 1 : argc;
+    }
+    if (arg >= argc) {
+      sb_discard(&sb);
+      return builtin_error("IndexOutOfRange",
+                           "Format field has no matching argument.");
+    }
+
+    const char *spec = colon ? colon + 1 : close;
+    if (!format_value(g_interp, &sb, &argv[arg], spec, (size_t)(close - spec),
+                      g_interp->call_line)) {
+      sb_discard(&sb);
+      return value_null();
+    }
+    i = (size_t)(close - tmpl) + 1;
+  }
+  return sb_finish(&sb);
+}
+
+/* ============================================================================
+ * Regular Expressions
+ * ============================================================================
+ */
+
+/* Compiled pattern for a builtin's pattern argument; raises on bad syntax */
+static Regex *regex_argument(Value *pattern) {
+  const char *error = NULL;
+  Regex *re = regex_cache_get(VALUE_STRING(*pattern),
+                              value_string_length(pattern), &error);
+  if (!re) {
+    builtin_error("InvalidPattern", error);
+  }
+  return re;
+}
+
+static Value regex_capture(const char *text, const size_t *caps, int group) {
+  size_t start = caps[2 * group];
+  size_t end = caps[2 * group + 1];
+  if (start == REGEX_UNSET || end == REGEX_UNSET) {
+    return value_null();
+  }
+  return value_string_from(text + start, end - start);
+}
+
+/* [whole, group1, group2, ...] - groups that did not take part are null */
+static Value regex_groups(const char *text, const size_t *caps, int groups) {
+  Value list = value_list_new();
+  value_list_reserve(&list, (size_t)groups + 1);
+  for (int g = 0; g <= groups; g++) {
+    value_list_push(&list, regex_capture(text, caps, g));
+  }
+  return list;
+}
+
+/* Shared body of match() and search() */
+static Value regex_find(int argc, Value *argv, bool full) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_STRING ||
+      VALUE_TYPE(argv[1]) != VAL_STRING) {
+    return value_null();
+  }
+  Regex *re = regex_argument(&argv[1]);
+  if (!re) {
+    return value_null();
+  }
+
+  const char *text = VALUE_STRING(argv[0]);
+  size_t length = value_string_length(&argv[0]);
+  if (!regex_exists(re, text, length, 0, full)) {
+    return value_null();
+  }
+
+  int groups = regex_group_count(re);
+  size_t *caps = (size_t *)malloc(sizeof(size_t) * 2 * (size_t)(groups + 1));
+  Value result = value_null();
+  if (regex_search(re, text, length, 0, full, caps)) {
+    result = regex_groups(text, caps, groups);
+  }
+  free(caps);
+  return result;
+}
+
+/* match(str, pattern) - groups if the whole string matches, else null */
+static Value builtin_match(int argc, Value *argv) {
+  return regex_find(argc, argv, true);
+}
+
+/* search(str, pattern) - groups of the leftmost match, else null */
+static Value builtin_search(int argc, Value *argv) {
+  return regex_find(argc, argv, false);
+}
+
+/* Position after a match, stepping one codepoint past an empty one */
+static size_t regex_advance(const char *text, size_t length,
+                            const size_t *caps) {
+  size_t end = caps[1];
+  if (end > caps[0] || end >= length)
+    return end + (end == caps[0]);
+  end++;
+  while (end < length && UTF8_IS_CONTINUATION(text[end]))
+    end++;
+  return end;
+}
+
+/* find_all(str, pattern) - every non-overlapping match. Each item is the
+ * matched text, group 1 for a one-group pattern, or a list of the groups */
+static Value builtin_find_all(int argc, Value *argv) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_STRING ||
+      VALUE_TYPE(argv[1]) != VAL_STRING) {
+    return value_list_new();
+  }
+  Regex *re = regex_argument(&argv[1]);
+  if (!re) {
+    return value_null();
+  }
+
+  const char *text = VALUE_STRING(argv[0]);
+  size_t length = value_string_length(&argv[0]);
+  Value list = value_list_new();
+  if (!regex_exists(re, text, length, 0, false)) {
+    return list;
+  }
+
+  int groups = regex_group_count(re);
+  size_t *caps = (size_t *)malloc(sizeof(size_t) * 2 * (size_t)(groups + 1));
+  size_t pos = 0;
+  while (pos <= length && regex_search(re, text, length, pos, false, caps)) {
+    if (groups == 0) {
+      value_list_push(&list, regex_capture(text, caps, 0));
+    } else if (groups == 1) {
+      value_list_push(&list, regex_capture(text, caps, 1));
+    } else {
+      Value item = value_list_new();
+      value_list_reserve(&item, (size_t)groups);
+      for (int g = 1; g <= groups; g++) {
+        value_list_push(&item, regex_capture(text, caps, g));
+      }
+      value_list_push(&list, item);
+    }
+    pos = regex_advance(text, length, caps);
+  }
+  free(caps);
+  return list;
+}
+
+/* replace_regex(str, pattern, replacement) - every match replaced; \0-\9 in
+ * the replacement insert the match or a group, \\ a backslash */
+static Value builtin_replace_regex(int argc, Value *argv) {
+  if (argc < 3 || VALUE_TYPE(argv[0]) != VAL_STRING ||
+      VALUE_TYPE(argv[1]) != VAL_STRING ||
+      VALUE_TYPE(argv[2]) != VAL_STRING) {
+    return argc >= 1 ? value_copy(&argv[0]) : value_string("");
+  }
+  Regex *re = regex_argument(&argv[1]);
+  if (!re) {
+    return value_null();
+  }
+
+  const char *text = VALUE_STRING(argv[0]);
+  size_t length = value_string_length(&argv[0]);
+  if (!regex_exists(re, text, length, 0, false)) {
+    return value_copy(&argv[0]);
+  }
+
+  const char *rep = VALUE_STRING(argv[2]);
+  size_t rep_length = value_string_length(&argv[2]);
+  int groups = regex_group_count(re);
+  size_t *caps = (size_t *)malloc(sizeof(size_t) * 2 * (size_t)(groups + 1));
+  StringBuilder sb;
+  sb_init(&sb, length + 16);
+
+  size_t copied = 0; /* text[0..copied) is already in the result */
+  size_t pos = 0;
+  while (pos <= length && regex_search(re, text, length, pos, false, caps)) {
+    sb_append(&sb, text + copied, caps[0] - copied);
+    for (size_t i = 0; i < rep_length; i++) {
+      char c = rep[i];
+      if (c == '\\' && i + 1 < rep_length) {
+        char next = rep[i + 1];
+        if (next >= '0' && next <= '9' && next - '0' <= groups) {
+          int g = next - '0';
+          if (caps[2 * g] != REGEX_UNSET && caps[2 * g + 1] != REGEX_UNSET)
+            sb_append(&sb, text + caps[2 * g], caps[2 * g + 1] - caps[2 * g]);
+          i++;
+          continue;
+        }
+        if (next == '\\') {
+          i++;
+        }
+      }
+      sb_append(&sb, &c, 1);
+    }
+    copied = caps[1];
+    pos = regex_advance(text, length, caps);
+  }
+  sb_append(&sb, text + copied, length - copied);
+  free(caps);
+  return sb_finish(&sb);
+}
+
+/* ============================================================================
+ * CSV
+ * ============================================================================
+ */
+
+#define CSV_CHUNK (1 << 16)
+
+/* Streaming RFC 4180 reader: buffered chunks, one row per pull */
+typedef struct {
+  FILE *file; /* NULL when reading from a string */
+  char *buffer;
+  size_t length;   /* Bytes held in buffer */
+  size_t capacity; /* Allocated bytes */
+  size_t pos;      /* Start of the next row */
+  bool eof;
+  char delimiter;
+  bool header;     /* Yield dicts keyed by the first row */
+  Value keys;      /* Header row once read */
+  size_t fields;   /* Field count of the previous row */
+  StringBuilder quoted;
+} CsvReader;
+
+/* Byte-wise has-zero test over a 64-bit word */
+#define CSV_ONES 0x0101010101010101ULL
+#define CSV_HIGHS 0x8080808080808080ULL
+#define CSV_HAS_ZERO(w) (((w) - CSV_ONES) & ~(w) & CSV_HIGHS)
+
+/* First delimiter, CR or LF in [p, end), or end. Scans eight bytes per step
+ * so long unquoted fields cost a fraction of a branch per byte */
+static const char *csv_scan(const char *p, const char *end, char delimiter) {
+  uint64_t d = CSV_ONES * (unsigned char)delimiter;
+  uint64_t cr = CSV_ONES * '\r';
+  uint64_t lf = CSV_ONES * '\n';
+  while (end - p >= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    if (CSV_HAS_ZERO(w ^ d) | CSV_HAS_ZERO(w ^ cr) | CSV_HAS_ZERO(w ^ lf))
+      break;
+    p += 8;
+  }
+  while (p < end && *p != delimiter && *p != '\r' && *p != '\n')
+    p++;
+  return p;
+}
+
+/* Make room for more input, keeping the unfinished row at the front */
+static bool csv_fill(CsvReader *r) {
+  if (!r->file || r->eof)
+    return false;
+  if (r->pos > 0) {
+    memmove(r->buffer, r->buffer + r->pos, r->length - r->pos);
+    r->length -= r->pos;
+    r->pos = 0;
+  }
+  if (r->capacity - r->length < CSV_CHUNK / 2) {
+    r->capacity *= 2;
+    r->buffer = (char *)realloc(r->buffer, r->capacity);
+  }
+  size_t got = fread(r->buffer + r->length, 1, r->capacity - r->length,
+                     r->file);
+  r->length += got;
+  if (got == 0)
+    r->eof = true;
+  return true;
+}
+
+typedef enum { CSV_ROW, CSV_MORE, CSV_BLANK } CsvStatus;
+
+/* Parse the row at r->pos into row. CSV_MORE: the buffer ends mid-row and
+ * more input may follow */
+static CsvStatus csv_parse_row(CsvReader *r, Value *row) {
+  const char *p = r->buffer + r->pos;
+  const char *end = r->buffer + r->length;
+  bool final = !r->file || r->eof;
+
+  if (p < end && (*p == '\n' || *p == '\r')) {
+    p += *p == '\r' && p + 1 < end && p[1] == '\n' ? 2 : 1;
+    if (p == end && p[-1] == '\r' && !final)
+      return CSV_MORE;
+    r->pos = (size_t)(p - r->buffer);
+    return CSV_BLANK;
+  }
+
+  while (true) {
+    Value field;
+    const char *stop;
+    if (p < end && *p == '"') {
+      /* Quoted: "" is a literal quote, delimiters and newlines are data */
+      r->quoted.length = 0;
+      p++;
+      while (true) {
+        const char *q = (const char *)memchr(p, '"', (size_t)(end - p));
+        if (!q) {
+          if (!final)
+            return CSV_MORE;
+          q = end; /* Unterminated at end of input - keep what is there */
+        }
+        sb_append(&r->quoted, p, (size_t)(q - p));
+        p = q < end ? q + 1 : end;
+        if (p < end && *p == '"') {
+          sb_append(&r->quoted, "\"", 1);
+          p++;
+          continue;
+        }
+        if (p == end && q < end && !final)
+          return CSV_MORE;
+        break;
+      }
+      /* Text after the closing quote is kept, as most readers do */
+      stop = csv_scan(p, end, r->delimiter);
+      if (stop == end && !final)
+        return CSV_MORE;
+      sb_append(&r->quoted, p, (size_t)(stop - p));
+      field = value_string_from(sb_data(&r->quoted),
+                                r->quoted.length);
+    } else {
+      stop = csv_scan(p, end, r->delimiter);
+      if (stop == end && !final)
+        return CSV_MORE;
+      field = value_string_from(p, (size_t)(stop - p));
+    }
+    value_list_push(row, field);
+
+    p = stop;
+    if (p < end && *p == r->delimiter) {
+      p++;
+      continue;
+    }
+    if (p < end && *p == '\r') {
+      p++;
+      if (p == end && !final)
+        return CSV_MORE;
+      if (p < end && *p == '\n')
+        p++;
+    } else if (p < end) {
+      p++; /* \n */
+    }
+    break;
+  }
+
+  r->pos = (size_t)(p - r->buffer);
+  return CSV_ROW;
+}
+
+/* Next row as a list of strings, or false at the end of input */
+static bool csv_next_row(CsvReader *r, Value *out) {
+  while (true) {
+    if (r->pos >= r->length && !csv_fill(r))
+      return false;
+    if (r->pos >= r->length)
+      continue;
+
+    Value row = value_list_new();
+    value_list_reserve(&row, r->fields > 0 ? r->fields : 8);
+    CsvStatus status = csv_parse_row(r, &row);
+    if (status == CSV_ROW) {
+      r->fields = VALUE_LIST(row)->count;
+      *out = row;
+      return true;
+    }
+    value_free(&row);
+    if (status == CSV_MORE)
+      csv_fill(r);
+  }
+}
+
+static bool csv_reader_next(void *state, Value *out) {
+  CsvReader *r = (CsvReader *)state;
+  Value row;
+  if (!csv_next_row(r, &row))
+    return false;
+  if (!r->header) {
+    *out = row;
+    return true;
+  }
+
+  if (VALUE_TYPE(r->keys) == VAL_NULL) {
+    r->keys = row;
+    if (!csv_next_row(r, &row))
+      return false;
+  }
+
+  /* Missing fields are void; fields beyond the header are dropped */
+  ValueList *keys = VALUE_LIST(r->keys);
+  ValueList *fields = VALUE_LIST(row);
+  Value dict = value_dict_new();
+  VALUE_DICT(dict)->entries =
+      (DictEntry *)malloc(sizeof(DictEntry) * (keys->count + 1));
+  VALUE_DICT(dict)->capacity = keys->count + 1;
+  for (size_t i = 0; i < keys->count; i++) {
+    Value field = value_null();
+    if (i < fields->count) {
+      field = fields->items[i];
+      fields->items[i] = value_null();
+    }
+    value_dict_set(&dict, VALUE_STRING(keys->items[i]), field);
+  }
+  value_free(&row);
+  *out = dict;
+  return true;
+}
+
+static void csv_reader_destroy(void *state) {
+  CsvReader *r = (CsvReader *)state;
+  if (r->file)
+    fclose(r->file);
+  free(r->buffer);
+  value_free(&r->keys);
+  sb_discard(&r->quoted);
+  free(r);
+}
+
+static char csv_delimiter(int argc, Value *argv, int index) {
+  if (argc > index && VALUE_TYPE(argv[index]) == VAL_STRING &&
+      value_string_length(&argv[index]) == 1)
+    return VALUE_STRING(argv[index])[0];
+  return ',';
+}
+
+static Value csv_reader_new(FILE *file, const char *text, size_t length,
+                            int argc, Value *argv) {
+  CsvReader *r = (CsvReader *)calloc(1, sizeof(CsvReader));
+  r->file = file;
+  r->capacity = file ? CSV_CHUNK : length + 1;
+  r->buffer = (char *)malloc(r->capacity);
+  if (!file) {
+    memcpy(r->buffer, text, length);
+    r->length = length;
+  }
+  r->eof = !file;
+  r->header = argc > 1 && value_is_truthy(&argv[1]);
+  r->delimiter = csv_delimiter(argc, argv, 2);
+  r->keys = value_null();
+  sb_init(&r->quoted, 64);
+  return value_native_sequence("csv", r, csv_reader_next,
+                               csv_reader_destroy);
+}
+
+/* csv_read(filename, header, delimiter) - sequence of rows, streamed from
+ * the file. Rows are lists of strings, or dicts keyed by the first row */
+static Value builtin_csv_read(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING) {
+    return value_null();
+  }
+  FILE *file = fopen(VALUE_STRING(argv[0]), "rb");
+  if (!file) {
+    char msg[512];
+    snprintf(msg, sizeof(msg), "Unable to open '%.400s'.",
+             VALUE_STRING(argv[0]));
+    return builtin_error("FileNotFound", msg);
+  }
+  return csv_reader_new(file, NULL, 0, argc, argv);
+}
+
+/* csv_parse(text, header, delimiter) - csv_read over a string */
+static Value builtin_csv_parse(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING) {
+    return value_null();
+  }
+  return csv_reader_new(NULL, VALUE_STRING(argv[0]),
+                        value_string_length(&argv[0]), argc, argv);
+}
+
+/* Append one field, quoted only when it holds a delimiter, quote or newline */
+static void csv_write_field(StringBuilder *sb, Value *field, char delimiter) {
+  if (VALUE_TYPE(*field) == VAL_NULL)
+    return;
+  char *owned = NULL;
+  const char *text;
+  size_t length;
+  if (VALUE_TYPE(*field) == VAL_STRING) {
+    text = VALUE_STRING(*field);
+    length = value_string_length(field);
+  } else {
+    owned = value_to_string(field);
+    text = owned;
+    length = strlen(owned);
+  }
+
+  bool quote = false;
+  for (size_t i = 0; i < length && !quote; i++) {
+    quote = text[i] == delimiter || text[i] == '"' || text[i] == '\n' ||
+            text[i] == '\r';
+  }
+  if (!quote) {
+    sb_append(sb, text, length);
+  } else {
+    sb_append(sb, "\"", 1);
+    size_t start = 0;
+    for (size_t i = 0; i < length; i++) {
+      if (text[i] == '"') {
+        sb_append(sb, text + start, i + 1 - start);
+        sb_append(sb, "\"", 1);
+        start = i + 1;
+      }
+    }
+    sb_append(sb, text + start, length - start);
+    sb_append(sb, "\"", 1);
+  }
+  free(owned);
+}
+
+/* Append one row. Dict rows follow the key order in keys, which the first
+ * dict row fills in and which is written once as a header line */
+static void csv_write_row(StringBuilder *sb, Value *row, Value *keys,
+                          char delimiter) {
+  if (VALUE_TYPE(*row) == VAL_DICT) {
+    if (VALUE_TYPE(*keys) == VAL_NULL) {
+      *keys = value_list_new();
+      ValueDict *dict = VALUE_DICT(*row);
+      for (size_t i = 0; i < dict->count; i++) {
+        value_list_push(keys, value_string(dict->entries[i].key));
+      }
+      csv_write_row(sb, keys, keys, delimiter);
+    }
+    ValueList *names = VALUE_LIST(*keys);
+    for (size_t i = 0; i < names->count; i++) {
+      if (i > 0)
+        sb_append(sb, &delimiter, 1);
+      Value *field = value_dict_slot(row, VALUE_STRING(names->items[i]));
+      if (field)
+        csv_write_field(sb, field, delimiter);
+    }
+  } else if (VALUE_TYPE(*row) == VAL_LIST) {
+    ValueList *fields = VALUE_LIST(*row);
+    size_t mark = sb->length;
+    for (size_t i = 0; i < fields->count; i++) {
+      if (i > 0)
+        sb_append(sb, &delimiter, 1);
+      csv_write_field(sb, &fields->items[i], delimiter);
+    }
+    if (fields->count == 1 && sb->length == mark)
+      sb_append(sb, "\"\"", 2); /* Not a blank line, which readers skip */
+  } else {
+    csv_write_field(sb, row, delimiter);
+  }
+  sb_append(sb, "\r\n", 2);
+}
+
+/* Encode every row of a list or sequence; flushes to file in chunks when
+ * one is given. Returns the number of rows */
+static int64_t csv_write_rows(StringBuilder *sb, Value *rows, char delimiter,
+                              FILE *file) {
+  Value keys = value_null();
+  int64_t count = 0;
+  if (VALUE_TYPE(*rows) == VAL_LIST) {
+    ValueList *list = VALUE_LIST(*rows);
+    for (size_t i = 0; i < list->count; i++, count++) {
+      csv_write_row(sb, &list->items[i], &keys, delimiter);
+      if (file && sb->length >= CSV_CHUNK) {
+        fwrite(sb_data(sb), 1, sb->length, file);
+        sb->length = 0;
+      }
+    }
+  } else if (VALUE_TYPE(*rows) == VAL_GENERATOR) {
+    while (true) {
+      Value row = interpreter_gen_next(g_interp, *rows);
+      if (VALUE_GENERATOR(*rows)->status == GEN_DONE &&
+          VALUE_TYPE(row) == VAL_NULL)
+        break;
+      csv_write_row(sb, &row, &keys, delimiter);
+      value_free(&row);
+      count++;
+      if (file && sb->length >= CSV_CHUNK) {
+        fwrite(sb_data(sb), 1, sb->length, file);
+        sb->length = 0;
+      }
+    }
+  }
+  if (file && sb->length > 0) {
+    fwrite(sb_data(sb), 1, sb->length, file);
+    sb->length = 0;
+  }
+  value_free(&keys);
+  return count;
+}
+
+/* csv_write(filename, rows, delimiter) - write a list or sequence of rows,
+ * replacing the file. Returns the number of rows written */
+static Value builtin_csv_write(int argc, Value *argv) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_STRING) {
+    return value_bool(false);
+  }
+  FILE *file = fopen(VALUE_STRING(argv[0]), "wb");
+  if (!file) {
+    return value_bool(false);
+  }
+  StringBuilder sb;
+  sb_init(&sb, CSV_CHUNK + 1024);
+  int64_t count = csv_write_rows(&sb, &argv[1], csv_delimiter(argc, argv, 2),
+                                 file);
+  sb_discard(&sb);
+  fclose(file);
+  return value_int(count);
+}
+
+/* csv_format(rows, delimiter) - rows encoded as CSV text */
+static Value builtin_csv_format(int argc, Value *argv) {
+  if (argc < 1) {
+    return value_string("");
+  }
+  StringBuilder sb;
+  sb_init(&sb, 256);
+  csv_write_rows(&sb, &argv[0], csv_delimiter(argc, argv, 1), NULL);
+  return sb_finish(&sb);
+}
+
+/* Simple JSON encoder */
+static void json_encode_value(Value *val, char *buf, size_t size);
+
+static void json_encode_value(Value *val, char *buf, size_t size) {
+  size_t len = strlen(buf);
+  char *p = buf + len;
+  size_t remaining = size - len;
+
+  switch (VALUE_TYPE(*val)) {
+  case VAL_NULL:
+    snprintf(p, remaining, "null");
+    break;
+  case VAL_INT:
+    snprintf(p, remaining, "%lld", (long long)VALUE_INT(*val));
+    break;
+  case VAL_FLOAT:
+    snprintf(p, remaining, "%g", VALUE_FLOAT(*val));
+    break;
+  case VAL_BOOL:
+    snprintf(p, remaining, "%s", VALUE_BOOL(*val) ? "true" : "false");
+    break;
+  case VAL_STRING:
+    snprintf(p, remaining, "\"%s\"", VALUE_STRING(*val));
+    break;
+  case VAL_LIST: {
+    strncat(buf, "[", remaining - 1);
+    for (size_t i = 0; i < VALUE_LIST(*val)->count; i++) {
+      if (i > 0)
+        strncat(buf, ",", size - strlen(buf) - 1);
+      json_encode_value(&VALUE_LIST(*val)->items[i], buf, size);
+    }
+    strncat(buf, "]", size - strlen(buf) - 1);
+    break;
+  }
+  case VAL_SET: {
+    /* Sets have no JSON form of their own; they encode as arrays */
+    strncat(buf, "[", remaining - 1);
+    for (size_t i = 0; i < VALUE_SET(*val)->count; i++) {
+      if (i > 0)
+        strncat(buf, ",", size - strlen(buf) - 1);
+      json_encode_value(&VALUE_SET(*val)->items[i], buf, size);
+    }
+    strncat(buf, "]", size - strlen(buf) - 1);
+    break;
+  }
+  default:
+    snprintf(p, remaining, "null");
+  }
+}
+
+static Value builtin_encode_json(int argc, Value *argv) {
+  if (argc < 1)
+    return value_null();
+
+  char buf[4096] = {0};
+  json_encode_value(&argv[0], buf, sizeof(buf));
+  return value_string(buf);
+}
+
+static Value builtin_decode_json(int argc, Value *argv) {
+  /* Simplified JSON decoder - only handles primitives */
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_STRING)
+    return value_null();
+
+  const char *s = VALUE_STRING(argv[0]);
+
+  /* Skip whitespace */
+  while (*s == ' ' || *s == '\t' || *s == '\n')
+    s++;
+
+  if (strcmp(s, "null") == 0)
+    return value_null();
+  if (strcmp(s, "true") == 0)
+    return value_bool(true);
+  if (strcmp(s, "false") == 0)
+    return value_bool(false);
+
+  /* Try number */
+  char *end;
+  long long int_val = strtoll(s, &end, 10);
+  if (end != s && (*end == '\0' || *end == '\n')) {
+    return value_int(int_val);
+  }
+
+  double float_val = strtod(s, &end);
+  if (end != s && (*end == '\0' || *end == '\n')) {
+    return value_float(float_val);
+  }
+
+  /* Try string */
+  if (*s == '"') {
+    s++;
+    const char *end_quote = strchr(s, '"');
+    if (end_quote) {
+      size_t len = end_quote - s;
+      char *str = (char *)malloc(len + 1);
+      strncpy(str, s, len);
+      str[len] = '\0';
+      return value_string(str);
+    }
+  }
+
+  return value_null();
+}
+
+/* Generator control - proceed (next) and transmit (send) */
+static Value builtin_proceed(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_GENERATOR) {
+    return value_null();
+  }
+  return interpreter_gen_next(g_interp, argv[0]);
+}
+
+static Value builtin_transmit(int argc, Value *argv) {
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_GENERATOR) {
+    return value_null();
+  }
+
+  Generator *gen = VALUE_GENERATOR(argv[0]);
+  gen->sent_value = value_copy(&argv[1]);
+  gen->has_sent = true;
+
+  Value result = interpreter_gen_next(g_interp, argv[0]);
+  return result;
+}
+
+static Value builtin_receive(int argc, Value *argv) {
+  (void)argc;
+  (void)argv;
+  /* Get the sent value from current generator context */
+  if (g_interp->current_gen && g_interp->current_gen->has_sent) {
+    Value result = g_interp->current_gen->sent_value;
+    g_interp->current_gen->sent_value = value_null();
+    g_interp->current_gen->has_sent = false;
+    return result;
+  }
+  return value_null();
+}
+
+static Value builtin_disrupt(int argc, Value *argv) {
+  /* disrupt(gen, error) - throw an exception into a generator */
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_GENERATOR) {
+    return value_null();
+  }
+
+  Generator *gen = VALUE_GENERATOR(argv[0]);
+  value_free(&gen->thrown_value);
+  if (VALUE_TYPE(argv[1]) == VAL_ERROR) {
+    gen->thrown_value = value_copy(&argv[1]);
+  } else {
+    char *msg = VALUE_TYPE(argv[1]) == VAL_STRING
+                    ? strdup(VALUE_STRING(argv[1]))
+                    : value_to_string(&argv[1]);
+    gen->thrown_value =
+        value_error_new("Disruption", msg, g_interp->call_line);
+    free(msg);
+  }
+  gen->has_thrown = true;
+
+  /* Resume the generator - it will see the exception */
+  Value result = interpreter_gen_next(g_interp, argv[0]);
+  return result;
+}
+
+/* Async builtins */
+#ifdef _WIN32
+#include <windows.h>
+#define SLEEP_MS(ms) Sleep(ms)
+#else
+#include <unistd.h>
+#define SLEEP_MS(ms) usleep((ms) * 1000)
+#endif
+
+static Value builtin_sleep(int argc, Value *argv) {
+  if (argc < 1 || VALUE_TYPE(argv[0]) != VAL_INT) {
+    return value_null();
+  }
+  int64_t ms = VALUE_INT(argv[0]);
+  SLEEP_MS(ms);
+  return value_null();
+}
+
+static Value builtin_resolve(int argc, Value *argv) {
+  if (argc < 1) {
+    return value_promise_resolved(value_null());
+  }
+  return value_promise_resolved(value_copy(&argv[0]));
+}
+
+static Value builtin_defer(int argc, Value *argv) {
+  /* defer(ms, protocol, ...args) - call protocol after ms delay */
+  if (argc < 2 || VALUE_TYPE(argv[0]) != VAL_INT) {
+    return value_null();
+  }
+
+  int64_t ms = VALUE_INT(argv[0]);
+  SLEEP_MS(ms);
+
+  /* Call the protocol with remaining args */
+  if (VALUE_TYPE(argv[1]) == VAL_FUNCTION ||
+      VALUE_TYPE(argv[1]) == VAL_BUILTIN) {
+    int call_argc = argc - 2;
+    Value *call_argv = (call_argc > 0) ? &argv[2] : NULL;
+
+    if (VALUE_TYPE(argv[1]) == VAL_BUILTIN) {
+      return VALUE_BUILTIN(argv[1])(call_argc, call_argv);
+    } else {
+      return interpreter_call(g_interp, VALUE_FUNCTION(argv[1]), value_null(),
+                              call_argc, call_argv);
+    }
+  }
+
+  return value_null();
+}
+
+/* deviate(message, kind) - raise a deviation; deviate(err) re-raises one */
+static Value builtin_deviate(int argc, Value *argv) {
+  if (argc >= 1 && VALUE_TYPE(argv[0]) == VAL_ERROR) {
+    interpreter_raise(g_interp, value_copy(&argv[0]));
+    return value_null();
+  }
+
+  char *msg = argc >= 1 ? value_to_string(&argv[0]) : strdup("Deviation");
+  if (argc >= 1 && VALUE_TYPE(argv[0]) == VAL_STRING) {
+    free(msg);
+    msg = strdup(VALUE_STRING(argv[0]));
+  }
+  const char *kind = (argc >= 2 && VALUE_TYPE(argv[1]) == VAL_STRING)
+                         ? VALUE_STRING(argv[1])
+                         : "Deviation";
+
+  interpreter_raise(g_interp, value_error_new(kind, msg, g_interp->call_line));
+  free(msg);
+  return value_null();
+}
+
+/* ============================================================================
+ * Interpreter
+ * ============================================================================
+ */
+
+/* Interpreters created so far, numbering each for quickened nodes */
+static uint32_t interpreter_serial = 0;
+
+Interpreter *interpreter_create(void) {
+  DEBUG_PRINT("interpreter_create\n");
+  Interpreter *interp = (Interpreter *)calloc(1, sizeof(Interpreter));
+  interp->global_env = env_create(NULL);
+  interp->current_env = interp->global_env;
+  interp->return_value = value_null();
+  interp->flow = FLOW_NORMAL;
+  interp->exception = value_null();
+  interp->had_error = false;
+  interp->pending_throw = value_null();
+  interp->report_level = REPORT_NORMAL;
+  interp->serial = ++interpreter_serial;
+  interp->last_error[0] = '\0';
+  interp->error_repeat_count = 0;
+
+  /* Set global interpreter for higher-order functions */
+  g_interp = interp;
+
+  /* Register builtins */
+  env_define(interp->global_env, "declare", value_builtin(builtin_declare));
+  env_define(interp->global_env, "announce", value_builtin(builtin_declare));
+  env_define(interp->global_env, "inquire", value_builtin(builtin_inquire));
+  env_define(interp->global_env, "measure", value_builtin(builtin_measure));
+  env_define(interp->global_env, "span", value_builtin(builtin_span));
+  env_define(interp->global_env, "text", value_builtin(builtin_text));
+  env_define(interp->global_env, "number", value_builtin(builtin_number));
+  env_define(interp->global_env, "decimal", value_builtin(builtin_decimal));
+  env_define(interp->global_env, "boolean", value_builtin(builtin_boolean));
+  env_define(interp->global_env, "classify", value_builtin(builtin_classify));
+  env_define(interp->global_env, "hash", value_builtin(builtin_hash));
+
+  /* File I/O */
+  env_define(interp->global_env, "inscribe", value_builtin(builtin_inscribe));
+  env_define(interp->global_env, "decipher", value_builtin(builtin_decipher));
+  env_define(interp->global_env, "chronicle", value_builtin(builtin_chronicle));
+  env_define(interp->global_env, "exists", value_builtin(builtin_exists));
+
+  /* CSV */
+  env_define(interp->global_env, "csv_read", value_builtin(builtin_csv_read));
+  env_define(interp->global_env, "csv_parse", value_builtin(builtin_csv_parse));
+  env_define(interp->global_env, "csv_write", value_builtin(builtin_csv_write));
+  env_define(interp->global_env, "csv_format",
+             value_builtin(builtin_csv_format));
+
+  /* Math */
+  env_define(interp->global_env, "abs", value_builtin(builtin_abs_val));
+  env_define(interp->global_env, "sqrt", value_builtin(builtin_sqrt_val));
+  env_define(interp->global_env, "min", value_builtin(builtin_min_val));
+  env_define(interp->global_env, "max", value_builtin(builtin_max_val));
+  env_define(interp->global_env, "random", value_builtin(builtin_random_val));
+
+  /* String */
+  env_define(interp->global_env, "uppercase", value_builtin(builtin_uppercase));
+  env_define(interp->global_env, "lowercase", value_builtin(builtin_lowercase));
+  env_define(interp->global_env, "split", value_builtin(builtin_split));
+  env_define(interp->global_env, "join", value_builtin(builtin_join));
+  env_define(interp->global_env, "contains", value_builtin(builtin_contains));
+  env_define(interp->global_env, "format", value_builtin(builtin_format));
+  env_define(interp->global_env, "find", value_builtin(builtin_find));
+  env_define(interp->global_env, "replace", value_builtin(builtin_replace));
+  env_define(interp->global_env, "starts_with",
+             value_builtin(builtin_starts_with));
+  env_define(interp->global_env, "ends_with", value_builtin(builtin_ends_with));
+  env_define(interp->global_env, "trim", value_builtin(builtin_trim));
+
+  /* Regular expressions */
+  env_define(interp->global_env, "match", value_builtin(builtin_match));
+  env_define(interp->global_env, "search", value_builtin(builtin_search));
+  env_define(interp->global_env, "find_all", value_builtin(builtin_find_all));
+  env_define(interp->global_env, "replace_regex",
+             value_builtin(builtin_replace_regex));
+
+  /* List */
+  env_define(interp->global_env, "push", value_builtin(builtin_push));
+  env_define(interp->global_env, "reserve", value_builtin(builtin_reserve));
+  env_define(interp->global_env, "reverse", value_builtin(builtin_reverse));
+  env_define(interp->global_env, "insert", value_builtin(builtin_insert));
+  env_define(interp->global_env, "pop", value_builtin(builtin_pop));
+  env_define(interp->global_env, "extend", value_builtin(builtin_extend));
+
+  /* Sorting, searching and set operations */
+  env_define(interp->global_env, "sort", value_builtin(builtin_sort));
+  env_define(interp->global_env, "stable_sort",
+             value_builtin(builtin_stable_sort));
+  env_define(interp->global_env, "binary_search",
+             value_builtin(builtin_binary_search));
+  env_define(interp->global_env, "index_of", value_builtin(builtin_index_of));
+  env_define(interp->global_env, "unique", value_builtin(builtin_unique));
+  env_define(interp->global_env, "union", value_builtin(builtin_union));
+  env_define(interp->global_env, "intersection",
+             value_builtin(builtin_intersection));
+  env_define(interp->global_env, "difference",
+             value_builtin(builtin_difference));
+  env_define(interp->global_env, "set", value_builtin(builtin_set));
+
+  /* Utility */
+  env_define(interp->global_env, "clock", value_builtin(builtin_clock));
+  env_define(interp->global_env, "terminate", value_builtin(builtin_terminate));
+
+  /* Higher-order functions - transform (map), select (filter), fold (reduce) */
+  env_define(interp->global_env, "transform", value_builtin(builtin_transform));
+  env_define(interp->global_env, "select", value_builtin(builtin_select));
+  env_define(interp->global_env, "fold", value_builtin(builtin_fold));
+  env_define(interp->global_env, "memoize", value_builtin(builtin_memoize));
+
+  /* JSON */
+  env_define(interp->global_env, "encode_json",
+             value_builtin(builtin_encode_json));
+  env_define(interp->global_env, "decode_json",
+             value_builtin(builtin_decode_json));
+
+  /* Timestamp */
+  env_define(interp->global_env, "timestamp", value_builtin(builtin_timestamp));
+
+  /* Generator control */
+  env_define(interp->global_env, "proceed", value_builtin(builtin_proceed));
+  env_define(interp->global_env, "transmit", value_builtin(builtin_transmit));
+  env_define(interp->global_env, "receive", value_builtin(builtin_receive));
+  env_define(interp->global_env, "disrupt", value_builtin(builtin_disrupt));
+
+  /* Async */
+  env_define(interp->global_env, "sleep", value_builtin(builtin_sleep));
+  env_define(interp->global_env, "resolve", value_builtin(builtin_resolve));
+  env_define(interp->global_env, "defer", value_builtin(builtin_defer));
+
+  /* Deviations */
+  env_define(interp->global_env, "deviate", value_builtin(builtin_deviate));
+
+  return interp;
+}
+
+void interpreter_destroy(Interpreter *interp) {
+  if (interp) {
+    env_destroy(interp->global_env);
+    value_free(&interp->exception);
+    value_free(&interp->pending_throw);
+    free(interp->call_stack);
+    jit_destroy(interp->jit);
+    free(interp);
+    regex_cache_clear();
+  }
+}
+
+void interpreter_raise(Interpreter *interp, Value error) {
+  /* The first deviation wins; anything raised while it unwinds is fallout.
+   * Raising only records the value - reporting happens if nothing recovers */
+  if (interp->flow == FLOW_ERROR) {
+    value_free(&error);
+    return;
+  }
+
+  /* Capture the protocol frames that were active at the raise point */
+  KeikakuError *err = VALUE_ERROR(error);
+  if (err->trace_count == 0 && interp->call_depth > 0) {
+    err->trace = (char **)malloc(sizeof(char *) * interp->call_depth);
+    for (size_t i = 0; i < interp->call_depth; i++) {
+      CallFrame *frame = &interp->call_stack[interp->call_depth - 1 - i];
+      char buf[320];
+      snprintf(buf, sizeof(buf), "%s (called at line %d)", frame->name,
+               frame->line);
+      err->trace[i] = strdup(buf);
+    }
+    err->trace_count = interp->call_depth;
+  }
+
+  value_free(&interp->exception);
+  interp->exception = error;
+  interp->flow = FLOW_ERROR;
+}
+
+/* Report a deviation that escaped to the top level. Raising never prints;
+ * only uncaught deviations reach here, deduplicated and rate-limited. */
+static void report_uncaught(Interpreter *interp) {
+  KeikakuError *err = VALUE_ERROR(interp->exception);
+
+  /* Track repeated errors */
+  if (interp->error_repeat_count > 0 &&
+      strcmp(interp->last_error, err->message) == 0) {
+    interp->error_repeat_count++;
+  } else {
+    strncpy(interp->last_error, err->message, sizeof(interp->last_error) - 1);
+    interp->last_error[sizeof(interp->last_error) - 1] = '\0';
+    interp->error_repeat_count = 1;
+  }
+
+  if (interp->report_level != REPORT_VERBOSE &&
+      (interp->error_repeat_count > ERROR_REPEAT_LIMIT ||
+       interp->errors_reported >= ERROR_REPORT_LIMIT)) {
+    interp->errors_suppressed++;
+    return;
+  }
+  interp->errors_reported++;
+
+  if (interp->report_level == REPORT_QUIET) {
+    voice_print_deviation_brief(err->kind, err->message, err->line);
+    return;
+  }
+
+  voice_print_runtime_error_tracked(err->message, err->line,
+                                    interp->error_repeat_count);
+  if (interp->report_level == REPORT_VERBOSE) {
+    fprintf(stderr, "    Kind: %s\n", err->kind);
+    for (size_t i = 0; i < err->trace_count; i++) {
+      fprintf(stderr, "      in %s\n", err->trace[i]);
+    }
+  }
+}
+
+static void report_summary(Interpreter *interp) {
+  if (interp->errors_suppressed > 0) {
+    voice_print_deviations_suppressed(interp->errors_suppressed);
+  }
+  interp->errors_reported = 0;
+  interp->errors_suppressed = 0;
+  interp->error_repeat_count = 0;
+}
+
+void interpreter_set_report_level(Interpreter *interp, ReportLevel level) {
+  interp->report_level = level;
+}
+
+/* Compiled code is referenced from protocol nodes, so once enabled the JIT
+ * stays until the interpreter is destroyed */
+void interpreter_enable_jit(Interpreter *interp) {
+  if (!interp->jit)
+    interp->jit = jit_create();
+}
+
+static void runtime_error_kind(Interpreter *interp, const char *kind,
+                               const char *msg, int line) {
+  interpreter_raise(interp, value_error_new(kind, msg, line));
+}
+
+static void runtime_error(Interpreter *interp, const char *msg, int line) {
+  runtime_error_kind(interp, "Deviation", msg, line);
+}
+
+bool interpreter_has_error(const Interpreter *interp) {
+  return interp->had_error || interp->flow == FLOW_ERROR;
+}
+
+const char *interpreter_get_error(const Interpreter *interp) {
+  if (VALUE_TYPE(interp->exception) == VAL_ERROR) {
+    return VALUE_ERROR(interp->exception)->message;
+  }
+  return "";
+}
+
+/* ============================================================================
+ * Quickening - nodes that specialise themselves, see ASTQuick
+ * ============================================================================
+ */
+
+/* Deoptimisations a node may take before it stays generic */
+#define QUICK_MAX_DEOPTS 4
+
+/* A guard failed: return the node to its generic form, and leave it there
+ * once it has changed its mind too often */
+static void quick_deopt(ASTQuick *quick) {
+  quick->kind = ++quick->deopts < QUICK_MAX_DEOPTS ? QUICK_UNSEEN
+                                                   : QUICK_GENERIC;
+}
+
+/* Specialise arithmetic to the operand types it first sees */
+static void quick_binary(ASTQuick *quick, Value *left, Value *right) {
+  if (VALUE_TYPE(*left) == VAL_INT && VALUE_TYPE(*right) == VAL_INT)
+    quick->kind = QUICK_INT_INT;
+  else if (VALUE_TYPE(*left) == VAL_FLOAT && VALUE_TYPE(*right) == VAL_FLOAT)
+    quick->kind = QUICK_FLOAT_FLOAT;
+  else
+    quick->kind = QUICK_GENERIC;
+}
+
+/* The binding a call refers to, or NULL if the name is unknown. A call
+ * whose name was found in the global scope, as built-ins are, remembers
+ * the entry: later calls only check that no scope in between has bound
+ * the name since, rather than searching past every built-in. Entries stay
+ * put until their scope is destroyed. */
+static EnvEntry *quick_callee(Interpreter *interp, ASTNode *node) {
+  ASTQuick *quick = &node->data.call.quick;
+  const char *name = node->data.call.name;
+  Environment *global = interp->global_env;
+
+  if (quick->kind == QUICK_CALL_GLOBAL) {
+    Environment *env = interp->current_env;
+    while (env && env != global && !env_find(env, name))
+      env = env->parent;
+    if (env == global && quick->owner == interp->serial)
+      return (EnvEntry *)quick->entry;
+    quick_deopt(quick);
+  }
+
+  for (Environment *env = interp->current_env; env; env = env->parent) {
+    EnvEntry *entry = env_find(env, name);
+    if (!entry)
+      continue;
+    if (quick->kind == QUICK_UNSEEN) {
+      quick->kind = env == global ? QUICK_CALL_GLOBAL : QUICK_GENERIC;
+      quick->owner = interp->serial;
+      quick->entry = entry;
+    }
+    return entry;
+  }
+  return NULL;
+}
+
+/* The field member of an instance, or NULL. Instances of a class set their
+ * fields in the same order, so a member access remembers the position it
+ * found the field at and compares only that entry's name. */
+static EnvEntry *quick_field(KeikakuInstance *inst, ASTNode *node) {
+  ASTQuick *quick = &node->data.member.quick;
+  const char *member = node->data.member.member;
+
+  if (quick->kind == QUICK_MEMBER_SLOT) {
+    EnvEntry *entry = inst->fields->entries;
+    for (uint16_t i = 0; entry && i < quick->slot; i++)
+      entry = entry->next;
+    if (entry && strcmp(entry->name, member) == 0)
+      return entry;
+    quick_deopt(quick);
+  }
+
+  size_t slot = 0;
+  for (EnvEntry *entry = inst->fields->entries; entry;
+       entry = entry->next, slot++) {
+    if (strcmp(entry->name, member) != 0)
+      continue;
+    if (quick->kind == QUICK_UNSEEN) {
+      quick->kind = slot <= UINT16_MAX ? QUICK_MEMBER_SLOT : QUICK_GENERIC;
+      quick->slot = (uint16_t)slot;
+    }
+    return entry;
+  }
+  return NULL;
+}
+
+/* ============================================================================
+ * Expression Evaluation
+ * ============================================================================
+ */
+
+static Value eval_expr(Interpreter *interp, ASTNode *node);
+static Value eval_stmt(Interpreter *interp, ASTNode *node);
+static void exec_block(Interpreter *interp, ASTNodeArray *stmts);
+static bool is_place(ASTNode *node);
+static Value *eval_ref(Interpreter *interp, ASTNode *node);
+
+static void gen_push_frame(Generator *gen, GenFrame frame) {
+  DEBUG_PRINT("gen_push_frame: gen=%p (%s), type=%d, count=%zu\n", (void *)gen,
+              VALUE_FUNCTION(gen->func_val)->name, frame.type,
+                  gen->stack_count);
+  if (gen->stack_count >= gen->stack_capacity) {
+    gen->stack_capacity =
+        gen->stack_capacity == 0 ? 4 : gen->stack_capacity * 2;
+    gen->stack =
+        (GenFrame *)realloc(gen->stack, sizeof(GenFrame) * gen->stack_capacity);
+  }
+  gen->stack[gen->stack_count++] = frame;
+}
+
+/* Pop the innermost resume frame. Once the suspension point is reached, a
+ * deviation injected with disrupt() is raised in the sequence's context. */
+static void resume_frame_consumed(Interpreter *interp) {
+  interp->resume_count--;
+  if (interp->resume_count == 0) {
+    interp->is_resuming = false;
+    if (VALUE_TYPE(interp->pending_throw) != VAL_NULL) {
+      Value thrown = interp->pending_throw;
+      interp->pending_throw = value_null();
+      interpreter_raise(interp, thrown);
+    }
+  }
+}
+
+/* Compare two operands for a comparison operator. Integers compare exactly,
+ * mixed numbers as floats; == and != use value_equals for everything else
+ * and the ordering operators use value_compare */
+static bool compare_values(BinaryOp op, Value *a, Value *b) {
+  int order;
+  if (VALUE_TYPE(*a) == VAL_INT && VALUE_TYPE(*b) == VAL_INT) {
+    int64_t x = VALUE_INT(*a), y = VALUE_INT(*b);
+    order = (x > y) - (x < y);
+  } else if ((VALUE_TYPE(*a) == VAL_INT || VALUE_TYPE(*a) == VAL_FLOAT) &&
+             (VALUE_TYPE(*b) == VAL_INT || VALUE_TYPE(*b) == VAL_FLOAT)) {
+    double x = VALUE_TYPE(*a) == VAL_FLOAT ? VALUE_FLOAT(*a)
+                                           : (double)VALUE_INT(*a);
+    double y = VALUE_TYPE(*b) == VAL_FLOAT ? VALUE_FLOAT(*b)
+                                           : (double)VALUE_INT(*b);
+    switch (op) {
+    case OP_EQ:
+      return x == y;
+    case OP_NE:
+      return x != y;
+    case OP_LT:
+      return x < y;
+    case OP_LE:
+      return x <= y;
+    case OP_GT:
+      return x > y;
+    default:
+      return x >= y;
+    }
+  } else if (op == OP_EQ || op == OP_NE) {
+    return value_equals(a, b) == (op == OP_EQ);
+  } else {
+    order = value_compare(a, b);
+  }
+
+  switch (op) {
+  case OP_EQ:
+    return order == 0;
+  case OP_NE:
+    return order != 0;
+  case OP_LT:
+    return order < 0;
+  case OP_LE:
+    return order <= 0;
+  case OP_GT:
+    return order > 0;
+  default:
+    return order >= 0;
+  }
+}
+
+static bool is_comparison(BinaryOp op) {
+  return op == OP_EQ || op == OP_NE || op == OP_LT || op == OP_LE ||
+         op == OP_GT || op == OP_GE;
+}
+
+/* Whether evaluating a node can run code: literals and variable reads
+ * cannot, so a variable beside them may be read in place */
+static bool is_inert_operand(ASTNode *node) {
+  switch (node->type) {
+  case AST_INTEGER:
+  case AST_FLOAT:
+  case AST_STRING:
+  case AST_BOOL:
+  case AST_IDENTIFIER:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Evaluate a comparison without copying stored operands. Operands are
+ * evaluated left to right; a variable on the right is read in place after
+ * the left side, and one on the left only when the right side cannot run
+ * code that reassigns it */
+static bool eval_comparison(Interpreter *interp, ASTNode *node) {
+  ASTNode *left_node = node->data.binary.left;
+  ASTNode *right_node = node->data.binary.right;
+  bool left_ref =
+      left_node->type == AST_IDENTIFIER && is_inert_operand(right_node);
+  bool right_ref = right_node->type == AST_IDENTIFIER;
+
+  Value left = value_null(), right = value_null();
+  Value *a = &left, *b = &right;
+  if (left_ref)
+    a = eval_ref(interp, left_node);
+  else
+    left = eval_expr(interp, left_node);
+  if (interp->flow != FLOW_ERROR) {
+    if (right_ref)
+      b = eval_ref(interp, right_node);
+    else
+      right = eval_expr(interp, right_node);
+  }
+
+  bool result = false;
+  if (a && b && interp->flow != FLOW_ERROR)
+    result = compare_values(node->data.binary.op, a, b);
+  value_free(&left);
+  value_free(&right);
+  return result;
+}
+
+/* Truth of an expression used as a condition. Comparisons, and/or/not and
+ * literals branch directly instead of building and freeing a bool Value */
+static bool eval_condition(Interpreter *interp, ASTNode *node) {
+  switch (node->type) {
+  case AST_BOOL:
+    return node->data.bool_value;
+
+  case AST_UNARY_OP:
+    if (node->data.unary.op == OP_NOT)
+      return !eval_condition(interp, node->data.unary.operand) &&
+             interp->flow != FLOW_ERROR;
+    break;
+
+  case AST_BINARY_OP: {
+    BinaryOp op = node->data.binary.op;
+    if (op == OP_AND) {
+      return eval_condition(interp, node->data.binary.left) &&
+             eval_condition(interp, node->data.binary.right);
+    }
+    if (op == OP_OR) {
+      bool left = eval_condition(interp, node->data.binary.left);
+      if (interp->flow == FLOW_ERROR)
+        return false;
+      return left || eval_condition(interp, node->data.binary.right);
+    }
+    if (is_comparison(op))
+      return eval_comparison(interp, node);
+    break;
+  }
+
+  case AST_IDENTIFIER: {
+    Value *ref = eval_ref(interp, node);
+    return ref && value_is_truthy(ref);
+  }
+
+  default:
+    break;
+  }
+
+  Value val = eval_expr(interp, node);
+  bool truth = value_is_truthy(&val);
+  value_free(&val);
+  return truth && interp->flow != FLOW_ERROR;
+}
+
+/* Arithmetic on two numbers. Ints are computed through doubles too, and
+ * only a float operand makes the result a float. */
+static Value eval_arithmetic(Interpreter *interp, BinaryOp op, int line,
+                             double a, double b, bool use_float) {
+  switch (op) {
   case OP_ADD:
     return use_float ? value_float(a + b) : value_int((int64_t)(a + b));
   case OP_SUB:
@@ -1567,15 +4728,17 @@ static Value eval_binary(Interpreter *interp, ASTNode *node) {
     return use_float ? value_float(a * b) : value_int((int64_t)(a * b));
   case OP_DIV:
     if (b == 0) {
-      runtime_error(interp, "Division by zero. Even infinity has its limits.",
-                    node->line);
+      runtime_error_kind(interp, "DivisionByZero",
+                         "Division by zero. Even infinity has its limits.",
+                         line);
       return value_null();
     }
     return value_float(a / b);
   case OP_INT_DIV:
     if (b == 0) {
-      runtime_error(interp, "Division by zero. Even infinity has its limits.",
-                    node->line);
+      runtime_error_kind(interp, "DivisionByZero",
+                         "Division by zero. Even infinity has its limits.",
+                         line);
       return value_null();
     }
     return value_int((int64_t)(a / b));
@@ -1583,79 +4746,901 @@ static Value eval_binary(Interpreter *interp, ASTNode *node) {
     return value_int((int64_t)a % (int64_t)b);
   case OP_POW:
     return value_float(pow(a, b));
-  case OP_EQ:
-    return value_bool(a == b);
-  case OP_NE:
-    return value_bool(a != b);
-  case OP_LT:
-    return value_bool(a < b);
-  case OP_LE:
-    return value_bool(a <= b);
-  case OP_GT:
-    return value_bool(a > b);
-  case OP_GE:
-    return value_bool(a >= b);
   default:
     return value_null();
   }
 }
 
-static Value eval_call(Interpreter *interp, ASTNode *node) {
-  bool found;
-  Value func = env_get(interp->current_env, node->data.call.name, &found);
+/* Apply an arithmetic operator to two evaluated operands, taking ownership
+ * of both */
+static Value binary_values(Interpreter *interp, BinaryOp op, Value left,
+                           Value right, int line) {
+  /* String concatenation */
+  if (op == OP_ADD &&
+      (VALUE_TYPE(left) == VAL_STRING || VALUE_TYPE(right) == VAL_STRING)) {
+    /* Strings are used as-is; other operands are formatted */
+    char *left_str = VALUE_TYPE(left) == VAL_STRING ? VALUE_STRING(left)
+                                                    : value_to_string(&left);
+    char *right_str = VALUE_TYPE(right) == VAL_STRING ? VALUE_STRING(right)
+                                                      : value_to_string(&right);
+    size_t left_len = VALUE_TYPE(left) == VAL_STRING
+                          ? value_string_length(&left)
+                          : strlen(left_str);
+    size_t right_len = VALUE_TYPE(right) == VAL_STRING
+                           ? value_string_length(&right)
+                           : strlen(right_str);
+
+    Value v = value_string_alloc(left_len + right_len);
+    memcpy(VALUE_STRING(v), left_str, left_len);
+    memcpy(VALUE_STRING(v) + left_len, right_str, right_len);
+
+    if (VALUE_TYPE(left) != VAL_STRING)
+      free(left_str);
+    if (VALUE_TYPE(right) != VAL_STRING)
+      free(right_str);
+    value_free(&left);
+    value_free(&right);
+    return v;
+  }
+
+  /* String multiplication */
+  if (op == OP_MUL && VALUE_TYPE(left) == VAL_STRING &&
+      VALUE_TYPE(right) == VAL_INT) {
+    size_t times = VALUE_INT(right) > 0 ? (size_t)VALUE_INT(right) : 0;
+    size_t len = value_string_length(&left);
+    Value v = value_string_alloc(len * times);
+    for (size_t i = 0; i < times; i++) {
+      memcpy(VALUE_STRING(v) + i * len, VALUE_STRING(left), len);
+    }
+    value_free(&left);
+    value_free(&right);
+    return v;
+  }
+
+  /* Numeric operations */
+  bool use_float = (VALUE_TYPE(left) == VAL_FLOAT ||
+                    VALUE_TYPE(right) == VAL_FLOAT);
+  double a = VALUE_TYPE(left) == VAL_FLOAT ? VALUE_FLOAT(left)
+                                           : (double)VALUE_INT(left);
+  double b = VALUE_TYPE(right) == VAL_FLOAT ? VALUE_FLOAT(right)
+                                            : (double)VALUE_INT(right);
+
+  value_free(&left);
+  value_free(&right);
+  return eval_arithmetic(interp, op, line, a, b, use_float);
+}
+
+/* Negate a number, taking ownership of it; anything else gives void */
+static Value negate_value(Value operand) {
+  if (VALUE_TYPE(operand) == VAL_INT) {
+    int64_t negated = -VALUE_INT(operand);
+    value_free_number(&operand);
+    return value_int(negated);
+  } else if (VALUE_TYPE(operand) == VAL_FLOAT) {
+    return value_float(-VALUE_FLOAT(operand));
+  }
+  value_free(&operand);
+  return value_null();
+}
+
+static Value eval_binary(Interpreter *interp, ASTNode *node) {
+  /* and/or short-circuit; comparisons read their operands in place */
+  BinaryOp op = node->data.binary.op;
+  if (op == OP_AND || op == OP_OR || is_comparison(op)) {
+    bool result = eval_condition(interp, node);
+    return interp->flow == FLOW_ERROR ? value_null() : value_bool(result);
+  }
+
+  Value left = eval_expr(interp, node->data.binary.left);
+  Value right = eval_expr(interp, node->data.binary.right);
+
+  /* Operands the inference pass proved numeric need no checks at all */
+  uint8_t left_proof = node->data.binary.left->proven;
+  uint8_t right_proof = node->data.binary.right->proven;
+  if ((left_proof == PROVEN_INT || left_proof == PROVEN_FLOAT) &&
+      (right_proof == PROVEN_INT || right_proof == PROVEN_FLOAT) &&
+      interp->flow != FLOW_ERROR) {
+    double a = left_proof == PROVEN_FLOAT ? VALUE_FLOAT(left)
+                                          : (double)VALUE_INT(left);
+    double b = right_proof == PROVEN_FLOAT ? VALUE_FLOAT(right)
+                                           : (double)VALUE_INT(right);
+    value_free_number(&left);
+    value_free_number(&right);
+    return eval_arithmetic(interp, op, node->line, a, b,
+                           left_proof == PROVEN_FLOAT ||
+                               right_proof == PROVEN_FLOAT);
+  }
+
+  /* Specialised forms skip the type dispatch below */
+  ASTQuick *quick = &node->data.binary.quick;
+  switch (quick->kind) {
+  case QUICK_INT_INT:
+    if (VALUE_TYPE(left) == VAL_INT && VALUE_TYPE(right) == VAL_INT) {
+      double a = (double)VALUE_INT(left), b = (double)VALUE_INT(right);
+      value_free_number(&left);
+      value_free_number(&right);
+      return eval_arithmetic(interp, op, node->line, a, b, false);
+    }
+    quick_deopt(quick);
+    break;
+  case QUICK_FLOAT_FLOAT:
+    if (VALUE_TYPE(left) == VAL_FLOAT && VALUE_TYPE(right) == VAL_FLOAT)
+      return eval_arithmetic(interp, op, node->line, VALUE_FLOAT(left),
+                             VALUE_FLOAT(right), true);
+    quick_deopt(quick);
+    break;
+  case QUICK_UNSEEN:
+    if (interp->flow != FLOW_ERROR)
+      quick_binary(quick, &left, &right);
+    break;
+  default:
+    break;
+  }
+
+  return binary_values(interp, op, left, right, node->line);
+}
+
+static Value call_owned(Interpreter *interp, Function *func, Value self_val,
+                        int argc, Value *argv);
+
+/* Evaluated call arguments. Calls with few arguments use the inline
+ * buffer; otherwise the buffer is allocated once at its final size. */
+#define CALL_ARGS_INLINE 8
+
+typedef struct {
+  Value *argv;
+  int argc;
+  Value inline_argv[CALL_ARGS_INLINE];
+} CallArgs;
+
+static void call_args_free(CallArgs *args) {
+  for (int i = 0; i < args->argc; i++) {
+    value_free(&args->argv[i]);
+  }
+  if (args->argv != args->inline_argv)
+    free(args->argv);
+}
+
+static Value *call_args_reserve(CallArgs *args, size_t count) {
+  args->argv = count <= CALL_ARGS_INLINE
+                   ? args->inline_argv
+                   : (Value *)malloc(sizeof(Value) * count);
+  return args->argv;
+}
 
-  if (!found) {
+/* Evaluate argument expressions left to right, expanding ...spread lists
+ * in place. The first `placeholders` arguments are left void for the
+ * caller to fill in. Spread lists are owned temporaries, so their items
+ * are moved rather than copied. Stops at the first deviation. */
+static void eval_arguments(Interpreter *interp, ASTNodeArray *nodes,
+                           size_t placeholders, CallArgs *args) {
+  args->argc = 0;
+  bool has_spread = false;
+  for (size_t i = placeholders; i < nodes->count; i++) {
+    if (nodes->nodes[i]->type == AST_SPREAD) {
+      has_spread = true;
+      break;
+    }
+  }
+
+  if (!has_spread) {
+    Value *argv = call_args_reserve(args, nodes->count);
+    for (size_t i = 0; i < nodes->count; i++) {
+      argv[args->argc++] =
+          i < placeholders ? value_null() : eval_expr(interp, nodes->nodes[i]);
+      if (interp->flow == FLOW_ERROR)
+        return;
+    }
+    return;
+  }
+
+  /* Evaluate each node once, then size the buffer for the expanded total */
+  CallArgs evaluated;
+  Value *vals = call_args_reserve(&evaluated, nodes->count);
+  evaluated.argc = 0;
+  size_t total = 0;
+  for (size_t i = 0; i < nodes->count; i++) {
+    ASTNode *arg = nodes->nodes[i];
+    if (i < placeholders) {
+      vals[i] = value_null();
+    } else if (arg->type == AST_SPREAD) {
+      vals[i] = eval_expr(interp, arg->data.spread.expr);
+    } else {
+      vals[i] = eval_expr(interp, arg);
+    }
+    evaluated.argc++;
+    total += arg->type == AST_SPREAD
+                 ? (VALUE_TYPE(vals[i]) == VAL_LIST ? VALUE_LIST(vals[i])->count
+                                                    : 0)
+                 : 1;
+    if (interp->flow == FLOW_ERROR) {
+      call_args_free(&evaluated);
+      call_args_reserve(args, 0);
+      return;
+    }
+  }
+
+  Value *argv = call_args_reserve(args, total);
+  for (size_t i = 0; i < nodes->count; i++) {
+    if (nodes->nodes[i]->type != AST_SPREAD) {
+      argv[args->argc++] = vals[i];
+      vals[i] = value_null();
+    } else if (VALUE_TYPE(vals[i]) == VAL_LIST) {
+      /* Anything else spreads to nothing */
+      ValueList *list = VALUE_LIST(vals[i]);
+      for (size_t j = 0; j < list->count; j++) {
+        argv[args->argc++] = list->items[j];
+        list->items[j] = value_null();
+      }
+    }
+  }
+  call_args_free(&evaluated);
+}
+
+/* Built-ins that modify their first argument in place */
+static bool builtin_mutates_list(BuiltinFn fn) {
+  return fn == builtin_push || fn == builtin_pop || fn == builtin_extend ||
+         fn == builtin_insert || fn == builtin_reserve;
+}
+
+/* Built-ins that return their (changed) first argument */
+static bool builtin_returns_first(BuiltinFn fn) {
+  return fn == builtin_push || fn == builtin_extend || fn == builtin_insert;
+}
+
+/* Built-ins that only look into their first argument */
+static bool builtin_inspects_first(BuiltinFn fn) {
+  return fn == builtin_contains || fn == builtin_measure;
+}
+
+static Value eval_call(Interpreter *interp, ASTNode *node) {
+  bool result_unused = interp->result_unused;
+  const char *result_target = interp->result_target;
+  interp->result_unused = false;
+  interp->result_target = NULL;
+  EnvEntry *callee = quick_callee(interp, node);
+  if (!callee) {
     char msg[256];
     snprintf(msg, sizeof(msg),
              "'%s' is unknown. Perhaps you intended to define it first.",
              node->data.call.name);
-    runtime_error(interp, msg, node->line);
+    runtime_error_kind(interp, "UnknownName", msg, node->line);
     return value_null();
   }
+  Value func = value_copy(&callee->value);
+
+  /* A list or set passed by name to a mutating built-in is lent to it
+   * rather than copied, so push(xs, v) changes xs. A variable is also lent
+   * to built-ins that only inspect it, so contains(xs, v) copies nothing. */
+  ASTNode **arg_nodes = node->data.call.args.nodes;
+  bool borrow = false;
+  if (VALUE_TYPE(func) == VAL_BUILTIN && node->data.call.args.count > 0) {
+    BuiltinFn fn = VALUE_BUILTIN(func);
+    borrow = (builtin_mutates_list(fn) && is_place(arg_nodes[0])) ||
+             (builtin_inspects_first(fn) &&
+              arg_nodes[0]->type == AST_IDENTIFIER);
+  }
+
+  CallArgs args;
+  eval_arguments(interp, &node->data.call.args, borrow ? 1 : 0, &args);
+  int argc = args.argc;
+  Value *argv = args.argv;
+
+  /* Resolve the lent list last so evaluating other arguments cannot move it */
+  Value *lent = NULL;
+  if (borrow && interp->flow != FLOW_ERROR) {
+    Value *ref = eval_ref(interp, arg_nodes[0]);
+    if (ref && (VALUE_TYPE(*ref) == VAL_LIST || VALUE_TYPE(*ref) == VAL_SET)) {
+      lent = ref;
+      argv[0] = *ref;
+      *ref = value_null();
+    } else if (ref) {
+      argv[0] = value_copy(ref);
+    }
+  }
+
+  Value result = value_null();
+
+  /* A deviation while evaluating arguments abandons the call */
+  if (interp->flow == FLOW_ERROR) {
+    /* Nothing to call */
+  } else if (VALUE_TYPE(func) == VAL_BUILTIN) {
+    interp->call_line = node->line;
+    result = VALUE_BUILTIN(func)(argc, argv);
+  } else if (VALUE_TYPE(func) == VAL_FUNCTION) {
+    interp->call_line = node->line;
+    result = call_owned(interp, VALUE_FUNCTION(func), value_null(), argc, argv);
+  } else {
+    char msg[256];
+    snprintf(msg, sizeof(msg), "'%s' is not callable.", node->data.call.name);
+    runtime_error_kind(interp, "TypeMismatch", msg, node->line);
+  }
+
+  if (lent) {
+    /* A lent list handed back as the result goes home, and the caller gets
+     * a copy only when it keeps the result somewhere else: xs = push(xs, v)
+     * would only assign the list to itself */
+    if (VALUE_TYPE(argv[0]) == VAL_NULL &&
+        builtin_returns_first(VALUE_BUILTIN(func))) {
+      *lent = result;
+      result = value_null();
+      if (result_target && arg_nodes[0]->type == AST_IDENTIFIER &&
+          strcmp(arg_nodes[0]->data.identifier.name, result_target) == 0)
+        interp->result_in_place = true;
+      else if (!result_unused)
+        result = value_copy(lent);
+    } else {
+      *lent = argv[0];
+      argv[0] = value_null();
+    }
+  }
+
+  call_args_free(&args);
+  value_free(&func);
+
+  return result;
+}
+
+/* ============================================================================
+ * Place Resolution - in-place access to stored values
+ * ============================================================================
+ */
+
+/* Whether eval_ref can resolve the expression to storage */
+static bool is_place(ASTNode *node) {
+  switch (node->type) {
+  case AST_IDENTIFIER:
+  case AST_SELF:
+  case AST_MEMBER: /* Instances are shared, so any member is a place */
+    return true;
+  case AST_INDEX:
+    return is_place(node->data.index.object);
+  default:
+    return false;
+  }
+}
+
+/* Normalize a (possibly negative) index against a length */
+static bool resolve_index(Interpreter *interp, int64_t index, size_t length,
+                          const char *what, int line, size_t *out) {
+  int64_t i = index < 0 ? index + (int64_t)length : index;
+  if (i < 0 || (uint64_t)i >= length) {
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Index %lld is outside the %s (length %zu).",
+             (long long)index, what, length);
+    runtime_error_kind(interp, "IndexOutOfRange", msg, line);
+    return false;
+  }
+  *out = (size_t)i;
+  return true;
+}
+
+/* "a" or "an" before a type name */
+static const char *type_article(const char *name) {
+  return strchr("aeiou", name[0]) ? "an" : "a";
+}
+
+/* Blame the index when the container can be indexed, else the container */
+static void index_type_error(Interpreter *interp, Value *container,
+                             Value *index, int line) {
+  const char *what = value_type_name(VALUE_TYPE(*container));
+  const char *given = value_type_name(VALUE_TYPE(*index));
+  char msg[256];
+  if (VALUE_TYPE(*container) == VAL_LIST ||
+      VALUE_TYPE(*container) == VAL_STRING) {
+    snprintf(msg, sizeof(msg), "A %s index must be an int, not %s %s.", what,
+             type_article(given), given);
+  } else if (VALUE_TYPE(*container) == VAL_DICT) {
+    snprintf(msg, sizeof(msg), "A dict key must be a string, not %s %s.",
+             type_article(given), given);
+  } else {
+    const char *article = type_article(what);
+    snprintf(msg, sizeof(msg), "%c%s %s cannot be indexed.",
+             toupper((unsigned char)article[0]), article + 1, what);
+  }
+  runtime_error_kind(interp, "TypeMismatch", msg, line);
+}
+
+/* Slot of a list element, or NULL after raising */
+static Value *index_slot(Interpreter *interp, Value *container, Value *index,
+                         int line) {
+  if (VALUE_TYPE(*container) == VAL_LIST && VALUE_TYPE(*index) == VAL_INT) {
+    ValueList *list = VALUE_LIST(*container);
+    size_t i;
+    if (!resolve_index(interp, VALUE_INT(*index), list->count, "list", line,
+                       &i))
+      return NULL;
+    return &list->items[i];
+  }
+  if (VALUE_TYPE(*container) == VAL_DICT && VALUE_TYPE(*index) == VAL_STRING) {
+    Value *slot = value_dict_slot(container, VALUE_STRING(*index));
+    if (!slot) {
+      char msg[256];
+      snprintf(msg, sizeof(msg), "Key \"%.200s\" is not in the dict.",
+               VALUE_STRING(*index));
+      runtime_error_kind(interp, "UnknownKey", msg, line);
+    }
+    return slot;
+  }
+  index_type_error(interp, container, index, line);
+  return NULL;
+}
+
+/* Read container[index] without copying the container */
+static Value index_read(Interpreter *interp, Value *container, Value *index,
+                        int line) {
+  if (VALUE_TYPE(*container) == VAL_STRING && VALUE_TYPE(*index) == VAL_INT) {
+    size_t i;
+    if (!resolve_index(interp, VALUE_INT(*index),
+                       value_string_codepoints(container), "string", line,
+                       &i))
+      return value_null();
+    size_t from = value_string_offset(container, i);
+    size_t to = value_string_offset(container, i + 1);
+    return value_string_from(VALUE_STRING(*container) + from, to - from);
+  }
+
+  Value *slot = index_slot(interp, container, index, line);
+  return slot ? value_copy(slot) : value_null();
+}
+
+/* Resolve a place expression to the value it names, in place. Index
+ * expressions are evaluated before any pointer is taken, so code they run
+ * cannot invalidate the result. Returns NULL after raising a deviation. */
+static Value *eval_ref(Interpreter *interp, ASTNode *node) {
+  switch (node->type) {
+  case AST_IDENTIFIER: {
+    EnvEntry *entry =
+        env_lookup(interp->current_env, node->data.identifier.name);
+    if (!entry) {
+      char msg[256];
+      snprintf(msg, sizeof(msg),
+               "'%s' is unknown. Perhaps you intended to designate it first.",
+               node->data.identifier.name);
+      runtime_error_kind(interp, "UnknownName", msg, node->line);
+      return NULL;
+    }
+    return &entry->value;
+  }
+
+  case AST_SELF: {
+    EnvEntry *entry = env_lookup(interp->current_env, "self");
+    if (!entry) {
+      runtime_error(interp, "'self' can only be used inside a method",
+                    node->line);
+      return NULL;
+    }
+    return &entry->value;
+  }
+
+  case AST_INDEX: {
+    Value index = eval_expr(interp, node->data.index.index);
+    Value *slot = NULL;
+    if (interp->flow != FLOW_ERROR) {
+      Value *container = eval_ref(interp, node->data.index.object);
+      if (container) {
+        slot = index_slot(interp, container, &index, node->line);
+      }
+    }
+    value_free(&index);
+    return slot;
+  }
+
+  case AST_MEMBER: {
+    ASTNode *object = node->data.member.object;
+    const char *member = node->data.member.member;
+    KeikakuInstance *inst = NULL;
+
+    if (is_place(object)) {
+      Value *ref = eval_ref(interp, object);
+      if (!ref)
+        return NULL;
+      if (VALUE_TYPE(*ref) == VAL_INSTANCE)
+        inst = VALUE_INSTANCE(*ref);
+    } else {
+      Value temp = eval_expr(interp, object);
+      if (VALUE_TYPE(temp) == VAL_INSTANCE)
+        inst = VALUE_INSTANCE(temp);
+      value_free(&temp);
+      if (interp->flow == FLOW_ERROR)
+        return NULL;
+    }
+
+    if (!inst) {
+      runtime_error_kind(interp, "TypeMismatch", "Only instances have members.",
+                         node->line);
+      return NULL;
+    }
+
+    /* Private Member check */
+    if (member[0] == '_') {
+      EnvEntry *self_entry = env_lookup(interp->current_env, "self");
+      if (!self_entry || VALUE_TYPE(self_entry->value) != VAL_INSTANCE ||
+          VALUE_INSTANCE(self_entry->value) != inst) {
+        runtime_error(interp, "Access to private member inhibited.",
+                      node->line);
+        return NULL;
+      }
+    }
+
+    EnvEntry *field = quick_field(inst, node);
+    if (!field) {
+      char msg[256];
+      snprintf(msg, sizeof(msg), "Member '%s' not found on instance of '%s'.",
+               member, inst->class_def->name);
+      runtime_error_kind(interp, "UnknownName", msg, node->line);
+      return NULL;
+    }
+    return &field->value;
+  }
+
+  default:
+    return NULL;
+  }
+}
+
+/* ============================================================================
+ * Closures
+ * ============================================================================
+ */
+
+/* A closure keeps only the variables its body uses from enclosing
+ * function scopes. They live in a small scope of their own whose parent is
+ * the global scope, so lookups never walk the scopes that created it. */
+
+typedef struct {
+  char **names;
+  size_t count;
+  size_t capacity;
+} NameSet;
+
+static bool name_set_has(NameSet *set, const char *name) {
+  for (size_t i = 0; i < set->count; i++) {
+    if (strcmp(set->names[i], name) == 0)
+      return true;
+  }
+  return false;
+}
+
+static void name_set_add(NameSet *set, const char *name) {
+  if (name_set_has(set, name))
+    return;
+  if (set->count == set->capacity) {
+    set->capacity = set->capacity ? set->capacity * 2 : 8;
+    set->names = (char **)realloc(set->names, sizeof(char *) * set->capacity);
+  }
+  set->names[set->count++] = strdup(name);
+}
+
+static void name_set_free(NameSet *set) {
+  for (size_t i = 0; i < set->count; i++) {
+    free(set->names[i]);
+  }
+  free(set->names);
+}
+
+typedef struct {
+  NameSet used;   /* Names read or assigned */
+  NameSet locals;   /* Names the body binds for itself */
+  NameSet assigned; /* Names assigned with = or :=, the body's own unless an
+                     * enclosing scope already has them */
+  NameSet scoped;   /* Comprehension variables currently in scope */
+} FreeVarScan;
+
+static ASTFreeVars *function_free_vars(ASTNode *fn);
+
+static void scan_free_vars(ASTNode *node, void *ctx);
+
+static void scan_use(FreeVarScan *scan, const char *name) {
+  if (!name_set_has(&scan->scoped, name))
+    name_set_add(&scan->used, name);
+}
+
+/* Record every name a pattern binds, e.g. both names in [a, b] := pair */
+static void pattern_names(ASTNode *pattern, NameSet *set) {
+  if (pattern->type == AST_IDENTIFIER) {
+    name_set_add(set, pattern->data.identifier.name);
+  } else if (pattern->type == AST_LIST) {
+    for (size_t i = 0; i < pattern->data.list.elements.count; i++) {
+      pattern_names(pattern->data.list.elements.nodes[i], set);
+    }
+  } else if (pattern->type == AST_DICT) {
+    for (size_t i = 0; i < pattern->data.dict.pairs.count; i++) {
+      pattern_names(pattern->data.dict.pairs.pairs[i].value, set);
+    }
+  }
+}
+
+static void scan_bindings(ASTNode *pattern, FreeVarScan *scan) {
+  pattern_names(pattern, &scan->locals);
+}
+
+static void scan_scoped(FreeVarScan *scan, const char *var, ASTNode *iterable,
+                        ASTNode *expr, ASTNode *condition) {
+  scan_free_vars(iterable, scan);
+  bool shadowing = name_set_has(&scan->scoped, var);
+  if (!shadowing)
+    name_set_add(&scan->scoped, var);
+  scan_free_vars(expr, scan);
+  if (condition)
+    scan_free_vars(condition, scan);
+  if (!shadowing)
+    free(scan->scoped.names[--scan->scoped.count]);
+}
+
+static void scan_free_vars(ASTNode *node, void *ctx) {
+  FreeVarScan *scan = (FreeVarScan *)ctx;
+  switch (node->type) {
+  case AST_IDENTIFIER:
+    scan_use(scan, node->data.identifier.name);
+    return;
+  case AST_CALL:
+    scan_use(scan, node->data.call.name);
+    break;
+  case AST_SELF:
+    scan_use(scan, "self");
+    return;
+  case AST_DESIGNATE:
+    scan_bindings(node->data.assign.target, scan);
+    break;
+  case AST_ASSIGN:
+    /* May rebind a captured variable, so the name stays free as well */
+    pattern_names(node->data.assign.target, &scan->assigned);
+    break;
+  case AST_CYCLE_THROUGH:
+    scan_bindings(node->data.cycle_through.var_pattern, scan);
+    break;
+  case AST_CYCLE_FROM_TO:
+    scan_bindings(node->data.cycle_from_to.var_pattern, scan);
+    break;
+  case AST_ATTEMPT:
+    if (node->data.attempt.error_var)
+      name_set_add(&scan->locals, node->data.attempt.error_var);
+    break;
+  case AST_LIST_COMP:
+    scan_scoped(scan, node->data.list_comp.var_name,
+                node->data.list_comp.iterable, node->data.list_comp.expr,
+                node->data.list_comp.condition);
+    return;
+  case AST_GEN_EXPR:
+    scan_scoped(scan, node->data.gen_expr.var_name,
+                node->data.gen_expr.iterable, node->data.gen_expr.expr,
+                node->data.gen_expr.condition);
+    return;
+  case AST_PROTOCOL:
+  case AST_LAMBDA: {
+    /* A nested function reaches its free variables through this one */
+    if (node->type == AST_PROTOCOL)
+      name_set_add(&scan->locals, node->data.protocol.name);
+    ASTFreeVars *inner = function_free_vars(node);
+    for (size_t i = 0; i < inner->count; i++) {
+      scan_use(scan, inner->names[i]);
+    }
+    return;
+  }
+  default:
+    break;
+  }
+  ast_visit_children(node, scan_free_vars, scan);
+}
+
+/* Names a protocol or lambda uses but neither binds itself nor receives as
+ * parameters, and those it does bind. Computed once per node. */
+static ASTFreeVars *function_free_vars(ASTNode *fn) {
+  bool is_lambda = fn->type == AST_LAMBDA;
+  ASTFreeVars *fv =
+      is_lambda ? &fn->data.lambda.free_vars : &fn->data.protocol.free_vars;
+  if (fv->ready)
+    return fv;
+
+  FreeVarScan scan;
+  memset(&scan, 0, sizeof(scan));
+  ASTParamArray *params =
+      is_lambda ? &fn->data.lambda.params : &fn->data.protocol.params;
+  for (size_t i = 0; i < params->count; i++) {
+    scan_bindings(params->params[i].pattern, &scan);
+    if (params->params[i].default_value)
+      scan_free_vars(params->params[i].default_value, &scan);
+  }
+  if (is_lambda) {
+    scan_free_vars(fn->data.lambda.body, &scan);
+  } else {
+    for (size_t i = 0; i < fn->data.protocol.body.count; i++) {
+      scan_free_vars(fn->data.protocol.body.nodes[i], &scan);
+    }
+  }
+
+  fv->names = (char **)malloc(sizeof(char *) * (scan.used.count + 1));
+  for (size_t i = 0; i < scan.used.count; i++) {
+    if (name_set_has(&scan.locals, scan.used.names[i])) {
+      free(scan.used.names[i]);
+    } else {
+      fv->names[fv->count++] = scan.used.names[i];
+    }
+  }
+  free(scan.used.names);
+  for (size_t i = 0; i < scan.assigned.count; i++) {
+    name_set_add(&scan.locals, scan.assigned.names[i]);
+  }
+  fv->bound = scan.locals.names;
+  fv->bound_count = scan.locals.count;
+  name_set_free(&scan.assigned);
+  name_set_free(&scan.scoped);
+  fv->ready = true;
+  return fv;
+}
+
+/* Whether the function running in a scope binds a name itself, so a
+ * closure may refer to it before it is defined */
+static bool enclosing_binds(Environment *scope, const char *name) {
+  for (Environment *e = scope; e != scope->global; e = e->parent) {
+    if (!e->function)
+      continue;
+    ASTFreeVars *fv = function_free_vars(e->function);
+    for (size_t i = 0; i < fv->bound_count; i++) {
+      if (strcmp(fv->bound[i], name) == 0)
+        return true;
+    }
+    return false;
+  }
+  return false;
+}
+
+/* Whether a closure made in scope gets an entry for a free name: it lives
+ * in an enclosing function scope, or that function binds it later */
+static bool captures_name(Environment *scope, const char *name) {
+  Environment *global = scope->global;
+  for (Environment *e = scope; e != global; e = e->parent) {
+    if (env_entry(e, name))
+      return true;
+  }
+  return !env_entry(global, name) && enclosing_binds(scope, name);
+}
+
+/* Build the scope a new closure runs in. At the top level, or when the body
+ * uses nothing from enclosing function scopes, that is simply the current
+ * or global scope. Otherwise each used variable gets an entry referring to
+ * the live variable, and the closure owns the scope. */
+static Environment *closure_capture(Interpreter *interp, ASTNode *fn,
+                                    bool *owns) {
+  Environment *scope = interp->current_env;
+  Environment *global = scope->global;
+  *owns = false;
+  if (scope == global)
+    return scope;
+
+  ASTFreeVars *fv = function_free_vars(fn);
+  if (fv->count > KEIKAKU_MAX_UPVALUES) {
+    /* Free names include globals, which are not captured */
+    size_t captured = 0;
+    for (size_t i = 0; i < fv->count; i++) {
+      captured += captures_name(scope, fv->names[i]);
+    }
+    if (captured > KEIKAKU_MAX_UPVALUES) {
+      char msg[128];
+      snprintf(msg, sizeof(msg),
+               "A closure can capture at most %d variables, not %zu.",
+               KEIKAKU_MAX_UPVALUES, captured);
+      runtime_error_kind(interp, "CaptureLimit", msg, fn->line);
+      return global;
+    }
+  }
 
-  /* Evaluate arguments */
-  size_t capacity = node->data.call.args.count;
-  int argc = 0;
-  Value *argv = (Value *)malloc(sizeof(Value) * (capacity > 0 ? capacity : 1));
-
-  for (size_t i = 0; i < node->data.call.args.count; i++) {
-    ASTNode *arg_node = node->data.call.args.nodes[i];
-    if (arg_node->type == AST_SPREAD) {
-      Value spread_val = eval_expr(interp, arg_node->data.spread.expr);
-      if (spread_val.type == VAL_LIST) {
-        size_t spread_cnt = spread_val.data.list_val->count;
-        argv = (Value *)realloc(argv, sizeof(Value) * (argc + spread_cnt));
-        for (size_t j = 0; j < spread_cnt; j++) {
-          argv[argc++] = value_copy(&spread_val.data.list_val->items[j]);
-        }
+  Environment *closure = NULL;
+  for (size_t i = 0; i < fv->count; i++) {
+    const char *name = fv->names[i];
+    EnvEntry *var = NULL;
+    Environment *owner = NULL;
+    for (Environment *e = scope; e != global; e = e->parent) {
+      if ((var = env_entry(e, name))) {
+        owner = e;
+        break;
       }
-      value_free(&spread_val);
-    } else {
-      argv[argc++] = eval_expr(interp, arg_node);
     }
-  }
+    if (!var) {
+      /* Globals, including ones defined later, are looked up where they
+       * live when the closure runs */
+      if (env_entry(global, name) || !enclosing_binds(scope, name))
+        continue;
+      /* Bound further down the enclosing function, e.g. a protocol
+       * declared later: reserve it so the closure sees it once it is */
+      env_define(scope, name, value_null());
+      var = env_entry(scope, name);
+      owner = scope;
+    }
+    if (var->upvalue && var->upvalue->target) {
+      owner = var->upvalue->target_env;
+      var = var->upvalue->target;
+    }
 
-  Value result;
+    if (!closure) {
+      closure = env_create(global);
+      closure->refcount = 1;
+    }
+    env_define(closure, name, value_null());
+    Upvalue *u = (Upvalue *)malloc(sizeof(Upvalue));
+    u->target = var;
+    u->target_env = owner;
+    u->entry = env_entry(closure, name);
+    u->home = closure;
+    u->next = owner->captures;
+    owner->captures = u;
+    u->entry->upvalue = u;
+  }
+
+  if (!closure)
+    return global;
+  *owns = true;
+  return closure;
+}
 
-  if (func.type == VAL_BUILTIN) {
-    result = func.data.builtin_val(argc, argv);
-  } else if (func.type == VAL_FUNCTION) {
-    result =
-        interpreter_call(interp, func.data.func_val, value_null(), argc, argv);
-  } else {
-    char msg[256];
-    snprintf(msg, sizeof(msg), "'%s' is not callable.", node->data.call.name);
-    runtime_error(interp, msg, node->line);
-    result = value_null();
-  }
+/* ============================================================================
+ * Comprehensions
+ * ============================================================================
+ */
 
-  for (int i = 0; i < argc; i++) {
-    value_free(&argv[i]);
+/* A comprehension runs every item in one scope, overwriting the loop
+ * variable's slot in place rather than building an environment per item */
+typedef struct {
+  Environment *env;
+  Value *slot;
+  ASTNode *condition; /* NULL when every item is kept */
+  ASTNode *expr;
+} Comprehension;
+
+static void comprehension_begin(Interpreter *interp, Comprehension *comp,
+                                const char *var_name, ASTNode *condition,
+                                ASTNode *expr) {
+  comp->env = env_create(interp->current_env);
+  env_define(comp->env, var_name, value_null());
+  comp->slot = &env_find(comp->env, var_name)->value;
+  comp->condition = condition;
+  comp->expr = expr;
+}
+
+static void comprehension_end(Comprehension *comp) {
+  env_destroy(comp->env);
+}
+
+/* Bind item (taking ownership) and append the transformed value to result
+ * if it passes the condition. Returns false once a deviation is raised. */
+static bool comprehension_step(Interpreter *interp, Comprehension *comp,
+                               Value item, Value *result) {
+  value_free(comp->slot);
+  *comp->slot = item;
+
+  Environment *old_env = interp->current_env;
+  interp->current_env = comp->env;
+  if (!comp->condition || eval_condition(interp, comp->condition)) {
+    Value val = eval_expr(interp, comp->expr);
+    if (interp->flow == FLOW_ERROR)
+      value_free(&val);
+    else
+      value_list_push(result, val);
   }
-  free(argv);
-  value_free(&func);
+  interp->current_env = old_env;
+  return interp->flow != FLOW_ERROR;
+}
 
-  return result;
+/* Map a list the comprehension owns. Items are moved into the loop slot
+ * instead of copied, and the result is sized up front when there is no
+ * condition to drop items. */
+static void comprehension_list(Interpreter *interp, const char *var_name,
+                               ASTNode *condition, ASTNode *expr,
+                               Value *iterable, Value *result) {
+  ValueList *input = VALUE_LIST(*iterable);
+  if (!condition)
+    value_list_reserve(result, input->count);
+
+  Comprehension comp;
+  comprehension_begin(interp, &comp, var_name, condition, expr);
+  for (size_t i = 0; i < input->count; i++) {
+    Value item = input->items[i];
+    input->items[i] = value_null();
+    if (!comprehension_step(interp, &comp, item, result))
+      break;
+  }
+  comprehension_end(&comp);
 }
 
 static Value eval_expr(Interpreter *interp, ASTNode *node) {
@@ -1672,6 +5657,62 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
   case AST_STRING:
     return value_string(node->data.string_value);
 
+  case AST_FSTRING: {
+    /* Every part is written straight into one buffer that becomes the
+     * result; named values are read in place rather than copied */
+    ASTNodeArray *parts = &node->data.fstring.parts;
+    StringBuilder sb;
+    sb_init(&sb, node->data.fstring.literal_length + 16 * parts->count);
+
+    for (size_t i = 0; i < parts->count; i++) {
+      ASTNode *part = parts->nodes[i];
+      const char *spec = node->data.fstring.specs[i];
+      if (part->type == AST_STRING && !spec) {
+        sb_append(&sb, part->data.string_value,
+                  strlen(part->data.string_value));
+        continue;
+      }
+
+      bool ok;
+      if (part->type == AST_INDEX && is_place(part)) {
+        /* Elements of stored lists and dicts are read in place; anything
+         * else, such as a character of a string, is read as usual */
+        Value index = eval_expr(interp, part->data.index.index);
+        Value *container = interp->flow == FLOW_ERROR
+                               ? NULL
+                               : eval_ref(interp, part->data.index.object);
+        Value temp = value_null();
+        Value *shown = NULL;
+        if (container && (VALUE_TYPE(*container) == VAL_LIST ||
+                          VALUE_TYPE(*container) == VAL_DICT)) {
+          shown = index_slot(interp, container, &index, part->line);
+        } else if (container) {
+          temp = index_read(interp, container, &index, part->line);
+          shown = interp->flow == FLOW_ERROR ? NULL : &temp;
+        }
+        ok = shown && format_value(interp, &sb, shown, spec,
+                                   spec ? strlen(spec) : 0, part->line);
+        value_free(&temp);
+        value_free(&index);
+      } else if (is_place(part)) {
+        Value *ref = eval_ref(interp, part);
+        ok = ref && format_value(interp, &sb, ref, spec,
+                                 spec ? strlen(spec) : 0, part->line);
+      } else {
+        Value temp = eval_expr(interp, part);
+        ok = interp->flow != FLOW_ERROR &&
+             format_value(interp, &sb, &temp, spec, spec ? strlen(spec) : 0,
+                          part->line);
+        value_free(&temp);
+      }
+      if (!ok) {
+        sb_discard(&sb);
+        return value_null();
+      }
+    }
+    return sb_finish(&sb);
+  }
+
   case AST_BOOL:
     return value_bool(node->data.bool_value);
 
@@ -1684,7 +5725,7 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
       snprintf(msg, sizeof(msg),
                "'%s' is unknown. Perhaps you intended to designate it first.",
                node->data.identifier.name);
-      runtime_error(interp, msg, node->line);
+      runtime_error_kind(interp, "UnknownName", msg, node->line);
       return value_null();
     }
     return val;
@@ -1694,18 +5735,11 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     return eval_binary(interp, node);
 
   case AST_UNARY_OP: {
-    Value operand = eval_expr(interp, node->data.unary.operand);
-    if (node->data.unary.op == OP_NEG) {
-      if (operand.type == VAL_INT) {
-        return value_int(-operand.data.int_val);
-      } else if (operand.type == VAL_FLOAT) {
-        return value_float(-operand.data.float_val);
-      }
-    } else if (node->data.unary.op == OP_NOT) {
-      return value_bool(!value_is_truthy(&operand));
+    if (node->data.unary.op == OP_NOT) {
+      bool result = eval_condition(interp, node);
+      return interp->flow == FLOW_ERROR ? value_null() : value_bool(result);
     }
-    value_free(&operand);
-    return value_null();
+    return negate_value(eval_expr(interp, node->data.unary.operand));
   }
 
   case AST_CALL:
@@ -1717,10 +5751,10 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
       ASTNode *elem_node = node->data.list.elements.nodes[i];
       if (elem_node->type == AST_SPREAD) {
         Value spread_val = eval_expr(interp, elem_node->data.spread.expr);
-        if (spread_val.type == VAL_LIST) {
-          for (size_t j = 0; j < spread_val.data.list_val->count; j++) {
+        if (VALUE_TYPE(spread_val) == VAL_LIST) {
+          for (size_t j = 0; j < VALUE_LIST(spread_val)->count; j++) {
             value_list_push(&list,
-                            value_copy(&spread_val.data.list_val->items[j]));
+                            value_copy(&VALUE_LIST(spread_val)->items[j]));
           }
         }
         value_free(&spread_val);
@@ -1732,119 +5766,79 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     return list;
   }
 
+  case AST_DICT: {
+    Value dict = value_dict_new();
+    ASTKeyValueArray *pairs = &node->data.dict.pairs;
+    for (size_t i = 0; i < pairs->count; i++) {
+      Value key = eval_expr(interp, pairs->pairs[i].key);
+      if (interp->flow == FLOW_ERROR) {
+        value_free(&dict);
+        return value_null();
+      }
+      if (VALUE_TYPE(key) != VAL_STRING) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Dict keys must be strings, not %s.",
+                 value_type_name(VALUE_TYPE(key)));
+        runtime_error_kind(interp, "TypeMismatch", msg, node->line);
+        value_free(&key);
+        value_free(&dict);
+        return value_null();
+      }
+      Value val = eval_expr(interp, pairs->pairs[i].value);
+      value_dict_set(&dict, VALUE_STRING(key), val);
+      value_free(&key);
+    }
+    return dict;
+  }
+
   case AST_LIST_COMP: {
     Value iterable = eval_expr(interp, node->data.list_comp.iterable);
-    if (iterable.type != VAL_LIST) {
+    if (VALUE_TYPE(iterable) == VAL_SET)
+      iterable = set_into_list(&iterable);
+    if (VALUE_TYPE(iterable) != VAL_LIST) {
       runtime_error(interp, "Iteration target must be a list.", node->line);
       value_free(&iterable);
       return value_null();
     }
 
     Value result = value_list_new();
-    ValueList *input = iterable.data.list_val;
-
-    for (size_t i = 0; i < input->count; i++) {
-      Environment *item_env = env_create(interp->current_env);
-      Environment *old_env = interp->current_env;
-      interp->current_env = item_env;
-
-      env_define(item_env, node->data.list_comp.var_name,
-                 value_copy(&input->items[i]));
-
-      bool include = true;
-      if (node->data.list_comp.condition) {
-        Value cond = eval_expr(interp, node->data.list_comp.condition);
-        include = value_is_truthy(&cond);
-        value_free(&cond);
-      }
-
-      if (include) {
-        Value val = eval_expr(interp, node->data.list_comp.expr);
-        value_list_push(&result, val);
-      }
-
-      interp->current_env = old_env;
-      env_destroy(item_env);
-    }
-
+    comprehension_list(interp, node->data.list_comp.var_name,
+                       node->data.list_comp.condition,
+                       node->data.list_comp.expr, &iterable, &result);
     value_free(&iterable);
     return result;
   }
 
   case AST_GEN_EXPR: {
-    /* Generator expression creates an anonymous generator
-     * For now, we implement it as a lazy wrapper around the iterable
-     * The generator yields each item that passes the filter, transformed
-     */
+    /* Generator expressions are evaluated eagerly into a list */
     Value iterable = eval_expr(interp, node->data.gen_expr.iterable);
+    if (VALUE_TYPE(iterable) == VAL_SET)
+      iterable = set_into_list(&iterable);
+    Value result = value_list_new();
 
-    if (iterable.type == VAL_LIST) {
-      /* Convert list to a generator that yields transformed values */
-      /* For simplicity, we create a list of all values and return as
-       * generator-like */
-      Value result = value_list_new();
-      ValueList *input = iterable.data.list_val;
-
-      for (size_t i = 0; i < input->count; i++) {
-        Environment *item_env = env_create(interp->current_env);
-        Environment *old_env = interp->current_env;
-        interp->current_env = item_env;
-
-        env_define(item_env, node->data.gen_expr.var_name,
-                   value_copy(&input->items[i]));
-
-        bool include = true;
-        if (node->data.gen_expr.condition) {
-          Value cond = eval_expr(interp, node->data.gen_expr.condition);
-          include = value_is_truthy(&cond);
-          value_free(&cond);
-        }
-
-        if (include) {
-          Value val = eval_expr(interp, node->data.gen_expr.expr);
-          value_list_push(&result, val);
-        }
-
-        interp->current_env = old_env;
-        env_destroy(item_env);
-      }
-
+    if (VALUE_TYPE(iterable) == VAL_LIST) {
+      comprehension_list(interp, node->data.gen_expr.var_name,
+                         node->data.gen_expr.condition,
+                         node->data.gen_expr.expr, &iterable, &result);
       value_free(&iterable);
-      /* Return as a generator-like iterable */
       return result;
-    } else if (iterable.type == VAL_GENERATOR) {
+    } else if (VALUE_TYPE(iterable) == VAL_GENERATOR) {
       /* Pull from generator and transform */
-      Value result = value_list_new();
-
+      Comprehension comp;
+      comprehension_begin(interp, &comp, node->data.gen_expr.var_name,
+                          node->data.gen_expr.condition,
+                          node->data.gen_expr.expr);
       while (true) {
         Value next_val = interpreter_gen_next(interp, iterable);
-        if (next_val.type == VAL_NULL &&
-            iterable.data.gen_val->status == GEN_DONE) {
+        if (VALUE_TYPE(next_val) == VAL_NULL &&
+            VALUE_GENERATOR(iterable)->status == GEN_DONE) {
           value_free(&next_val);
           break;
         }
-
-        Environment *item_env = env_create(interp->current_env);
-        Environment *old_env = interp->current_env;
-        interp->current_env = item_env;
-
-        env_define(item_env, node->data.gen_expr.var_name, next_val);
-
-        bool include = true;
-        if (node->data.gen_expr.condition) {
-          Value cond = eval_expr(interp, node->data.gen_expr.condition);
-          include = value_is_truthy(&cond);
-          value_free(&cond);
-        }
-
-        if (include) {
-          Value val = eval_expr(interp, node->data.gen_expr.expr);
-          value_list_push(&result, val);
-        }
-
-        interp->current_env = old_env;
-        env_destroy(item_env);
+        if (!comprehension_step(interp, &comp, next_val, &result))
+          break;
       }
+      comprehension_end(&comp);
 
       value_free(&iterable);
       return result;
@@ -1853,35 +5847,69 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     runtime_error(interp, "Generator expression requires an iterable.",
                   node->line);
     value_free(&iterable);
+    value_free(&result);
     return value_null();
   }
 
   case AST_INDEX: {
-    Value obj = eval_expr(interp, node->data.index.object);
-    Value idx = eval_expr(interp, node->data.index.index);
-
-    if (obj.type == VAL_LIST && idx.type == VAL_INT) {
-      Value result = value_list_get(&obj, idx.data.int_val);
-      value_free(&obj);
-      value_free(&idx);
-      return result;
+    /* Stored containers are read in place; only the element is copied */
+    Value temp = value_null();
+    Value idx;
+    Value *container;
+    if (is_place(node->data.index.object)) {
+      idx = eval_expr(interp, node->data.index.index);
+      container = interp->flow == FLOW_ERROR
+                      ? NULL
+                      : eval_ref(interp, node->data.index.object);
+    } else {
+      temp = eval_expr(interp, node->data.index.object);
+      idx = eval_expr(interp, node->data.index.index);
+      container = &temp;
     }
 
-    value_free(&obj);
+    Value result = value_null();
+    if (container && interp->flow != FLOW_ERROR) {
+      result = index_read(interp, container, &idx, node->line);
+    }
     value_free(&idx);
-    return value_null();
+    value_free(&temp);
+    return result;
   }
 
   case AST_MEMBER: {
     Value obj = eval_expr(interp, node->data.member.object);
-    if (obj.type == VAL_INSTANCE) {
-      KeikakuInstance *inst = obj.data.instance_val;
+    if (VALUE_TYPE(obj) == VAL_ERROR) {
+      /* Deviation fields: message, kind, line, trace */
+      KeikakuError *err = VALUE_ERROR(obj);
+      const char *member = node->data.member.member;
+      Value res = value_null();
+      if (strcmp(member, "message") == 0) {
+        res = value_string(err->message);
+      } else if (strcmp(member, "kind") == 0) {
+        res = value_string(err->kind);
+      } else if (strcmp(member, "line") == 0) {
+        res = value_int(err->line);
+      } else if (strcmp(member, "trace") == 0) {
+        res = value_list_new();
+        for (size_t i = 0; i < err->trace_count; i++) {
+          value_list_push(&res, value_string(err->trace[i]));
+        }
+      } else {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Deviations have no member '%s'.", member);
+        runtime_error(interp, msg, node->line);
+      }
+      value_free(&obj);
+      return res;
+    }
+    if (VALUE_TYPE(obj) == VAL_INSTANCE) {
+      KeikakuInstance *inst = VALUE_INSTANCE(obj);
 
       /* Private Member check */
       if (node->data.member.member[0] == '_') {
         bool found_self = false;
         Value self_val = env_get(interp->current_env, "self", &found_self);
-        if (!found_self || self_val.data.instance_val != inst) {
+        if (!found_self || VALUE_INSTANCE(self_val) != inst) {
           runtime_error(interp, "Access to private member inhibited.",
                         node->line);
           value_free(&obj);
@@ -1889,15 +5917,15 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
         }
       }
 
-      bool found = false;
-      Value val = env_get(inst->fields, node->data.member.member, &found);
-      if (found) {
-        Value res = value_copy(&val);
+      EnvEntry *field = quick_field(inst, node);
+      if (field) {
+        Value res = value_copy(&field->value);
         value_free(&obj);
         return res;
       }
 
       /* Look in class methods */
+      bool found = false;
       Value method =
           env_get(inst->class_def->methods, node->data.member.member, &found);
       if (found) {
@@ -1909,9 +5937,10 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
       char msg[256];
       snprintf(msg, sizeof(msg), "Member '%s' not found on instance of '%s'.",
                node->data.member.member, inst->class_def->name);
-      runtime_error(interp, msg, node->line);
-    } else {
-      runtime_error(interp, "Only instances have members.", node->line);
+      runtime_error_kind(interp, "UnknownName", msg, node->line);
+    } else if (interp->flow != FLOW_ERROR) {
+      runtime_error_kind(interp, "TypeMismatch", "Only instances have members.",
+                         node->line);
     }
     value_free(&obj);
     return value_null();
@@ -1921,61 +5950,42 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     Value obj = eval_expr(interp, node->data.method_call.object);
     /* TODO: Support other types (string methods etc) */
 
-    if (obj.type != VAL_INSTANCE) {
-      char msg[256];
-      snprintf(msg, sizeof(msg),
-               "Method calls only supported on class instances.");
-      runtime_error(interp, msg, node->line);
+    if (VALUE_TYPE(obj) != VAL_INSTANCE) {
+      runtime_error_kind(interp, "TypeMismatch",
+                         "Method calls only supported on class instances.",
+                         node->line);
       value_free(&obj);
       return value_null();
     }
 
-    KeikakuInstance *inst = obj.data.instance_val;
+    KeikakuInstance *inst = VALUE_INSTANCE(obj);
     KeikakuClass *cls = inst->class_def;
 
     bool found = false;
     Value method =
         env_get(cls->methods, node->data.method_call.method_name, &found);
 
-    if (!found || method.type != VAL_FUNCTION) {
+    if (!found || VALUE_TYPE(method) != VAL_FUNCTION) {
       char msg[256];
       snprintf(msg, sizeof(msg), "Method '%s' not found.",
                node->data.method_call.method_name);
-      runtime_error(interp, msg, node->line);
+      runtime_error_kind(interp, "UnknownName", msg, node->line);
       value_free(&obj);
       return value_null();
     }
 
-    /* Evaluate args */
-    size_t capacity = node->data.method_call.args.count;
-    int argc = 0;
-    Value *argv =
-        (Value *)malloc(sizeof(Value) * (capacity > 0 ? capacity : 1));
-
-    for (size_t i = 0; i < node->data.method_call.args.count; i++) {
-      ASTNode *arg_node = node->data.method_call.args.nodes[i];
-      if (arg_node->type == AST_SPREAD) {
-        Value spread_val = eval_expr(interp, arg_node->data.spread.expr);
-        if (spread_val.type == VAL_LIST) {
-          size_t spread_cnt = spread_val.data.list_val->count;
-          argv = (Value *)realloc(argv, sizeof(Value) * (argc + spread_cnt));
-          for (size_t j = 0; j < spread_cnt; j++) {
-            argv[argc++] = value_copy(&spread_val.data.list_val->items[j]);
-          }
-        }
-        value_free(&spread_val);
-      } else {
-        argv[argc++] = eval_expr(interp, arg_node);
-      }
-    }
-
-    Value result =
-        interpreter_call(interp, method.data.func_val, obj, argc, argv);
+    CallArgs args;
+    eval_arguments(interp, &node->data.method_call.args, 0, &args);
 
-    for (int i = 0; i < argc; i++) {
-      value_free(&argv[i]);
+    Value result = value_null();
+    if (interp->flow != FLOW_ERROR) {
+      interp->call_line = node->line;
+      result = call_owned(interp, VALUE_FUNCTION(method), obj, args.argc,
+                          args.argv);
     }
-    free(argv);
+
+    call_args_free(&args);
+    value_free(&method);
     value_free(&obj);
 
     return result;
@@ -1985,14 +5995,14 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     /* 1. Get current 'self' */
     bool found_self = false;
     Value self = env_get(interp->current_env, "self", &found_self);
-    if (!found_self || self.type != VAL_INSTANCE) {
+    if (!found_self || VALUE_TYPE(self) != VAL_INSTANCE) {
       runtime_error(interp,
                     "'ascend' can only be used inside an instance protocol.",
                     node->line);
       return value_null();
     }
 
-    KeikakuInstance *inst = self.data.instance_val;
+    KeikakuInstance *inst = VALUE_INSTANCE(self);
     KeikakuClass *cls = inst->class_def;
 
     /* 2. Find parent class */
@@ -2009,7 +6019,7 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     Value method =
         env_get(parent_cls->methods, node->data.ascend.name, &found_method);
 
-    if (!found_method || method.type != VAL_FUNCTION) {
+    if (!found_method || VALUE_TYPE(method) != VAL_FUNCTION) {
       char msg[256];
       snprintf(msg, sizeof(msg), "Parent protocol '%s' not found.",
                node->data.ascend.name);
@@ -2018,45 +6028,24 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     }
 
     /* 4. Evaluate args */
-    size_t capacity = node->data.ascend.args.count;
-    int argc = 0;
-    Value *argv =
-        (Value *)malloc(sizeof(Value) * (capacity > 0 ? capacity : 1));
-
-    for (size_t i = 0; i < node->data.ascend.args.count; i++) {
-      ASTNode *arg_node = node->data.ascend.args.nodes[i];
-      if (arg_node->type == AST_SPREAD) {
-        Value spread_val = eval_expr(interp, arg_node->data.spread.expr);
-        if (spread_val.type == VAL_LIST) {
-          size_t spread_cnt = spread_val.data.list_val->count;
-          argv = (Value *)realloc(argv, sizeof(Value) * (argc + spread_cnt));
-          for (size_t j = 0; j < spread_cnt; j++) {
-            argv[argc++] = value_copy(&spread_val.data.list_val->items[j]);
-          }
-        }
-        value_free(&spread_val);
-      } else {
-        argv[argc++] = eval_expr(interp, arg_node);
-      }
-    }
+    CallArgs args;
+    eval_arguments(interp, &node->data.ascend.args, 0, &args);
 
     /* 5. Call parent method with current 'self' */
-    Value result =
-        interpreter_call(interp, method.data.func_val, self, argc, argv);
-
-    /* Cleanup */
-    for (int i = 0; i < argc; i++) {
-      value_free(&argv[i]);
+    Value result = value_null();
+    if (interp->flow != FLOW_ERROR) {
+      interp->call_line = node->line;
+      result = call_owned(interp, VALUE_FUNCTION(method), self, args.argc,
+                          args.argv);
     }
-    free(argv);
+
+    call_args_free(&args);
 
     return result;
   }
 
   case AST_TERNARY: {
-    Value cond = eval_expr(interp, node->data.ternary.condition);
-    bool is_true = value_is_truthy(&cond);
-    value_free(&cond);
+    bool is_true = eval_condition(interp, node->data.ternary.condition);
 
     if (is_true) {
       return eval_expr(interp, node->data.ternary.true_value);
@@ -2069,13 +6058,9 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     /* Create a function value from the lambda */
     Function *fn = (Function *)calloc(1, sizeof(Function));
     fn->node = node;
-    fn->closure = interp->current_env;
+    fn->closure = closure_capture(interp, node, &fn->owns_closure);
     fn->is_lambda = true;
-
-    Value val;
-    val.type = VAL_FUNCTION;
-    val.data.func_val = fn;
-    return val;
+    return value_wrap(VAL_FUNCTION, fn);
   }
 
   case AST_AWAIT: {
@@ -2083,8 +6068,8 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     Value awaited = eval_expr(interp, node->data.await.expr);
 
     /* If it's a promise, wait for it to resolve */
-    if (awaited.type == VAL_PROMISE) {
-      Promise *promise = awaited.data.promise_val;
+    if (VALUE_TYPE(awaited) == VAL_PROMISE) {
+      Promise *promise = VALUE_PROMISE(awaited);
       if (promise->state == PROMISE_RESOLVED) {
         Value result = value_copy(&promise->result);
         value_free(&awaited);
@@ -2100,7 +6085,7 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     }
 
     /* If it's a generator (async function), get next value */
-    if (awaited.type == VAL_GENERATOR) {
+    if (VALUE_TYPE(awaited) == VAL_GENERATOR) {
       Value result = interpreter_gen_next(interp, awaited);
       value_free(&awaited);
       return result;
@@ -2113,7 +6098,7 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
   case AST_SLICE: {
     Value obj = eval_expr(interp, node->data.slice.object);
 
-    if (obj.type != VAL_LIST && obj.type != VAL_STRING) {
+    if (VALUE_TYPE(obj) != VAL_LIST && VALUE_TYPE(obj) != VAL_STRING) {
       runtime_error(interp, "Slice requires list or string", node->line);
       value_free(&obj);
       return value_null();
@@ -2121,10 +6106,10 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
 
     /* Get list/string length */
     int64_t len = 0;
-    if (obj.type == VAL_LIST) {
-      len = obj.data.list_val->count;
+    if (VALUE_TYPE(obj) == VAL_LIST) {
+      len = VALUE_LIST(obj)->count;
     } else {
-      len = strlen(obj.data.string_val);
+      len = (int64_t)value_string_codepoints(&obj);
     }
 
     /* Evaluate slice bounds */
@@ -2132,22 +6117,22 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
 
     if (node->data.slice.start) {
       Value v = eval_expr(interp, node->data.slice.start);
-      if (v.type == VAL_INT)
-        start = v.data.int_val;
+      if (VALUE_TYPE(v) == VAL_INT)
+        start = VALUE_INT(v);
       value_free(&v);
     }
 
     if (node->data.slice.end) {
       Value v = eval_expr(interp, node->data.slice.end);
-      if (v.type == VAL_INT)
-        end = v.data.int_val;
+      if (VALUE_TYPE(v) == VAL_INT)
+        end = VALUE_INT(v);
       value_free(&v);
     }
 
     if (node->data.slice.step) {
       Value v = eval_expr(interp, node->data.slice.step);
-      if (v.type == VAL_INT)
-        step = v.data.int_val;
+      if (VALUE_TYPE(v) == VAL_INT)
+        step = VALUE_INT(v);
       value_free(&v);
     }
 
@@ -2172,11 +6157,9 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     }
 
     /* Perform slice */
-    if (obj.type == VAL_LIST) {
-      Value result;
-      result.type = VAL_LIST;
-      result.data.list_val = (ValueList *)calloc(1, sizeof(ValueList));
-      ValueList *res_list = result.data.list_val;
+    if (VALUE_TYPE(obj) == VAL_LIST) {
+      Value result = value_list_new();
+      ValueList *res_list = VALUE_LIST(result);
 
       if (step > 0) {
         for (int64_t i = start; i < end; i += step) {
@@ -2188,7 +6171,7 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
                 res_list->items, sizeof(Value) * res_list->capacity);
           }
           res_list->items[res_list->count++] =
-              value_copy(&obj.data.list_val->items[i]);
+              value_copy(&VALUE_LIST(obj)->items[i]);
         }
       } else {
         for (int64_t i = (end < start ? start - 1 : start); i > end;
@@ -2201,7 +6184,7 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
                   res_list->items, sizeof(Value) * res_list->capacity);
             }
             res_list->items[res_list->count++] =
-                value_copy(&obj.data.list_val->items[i]);
+                value_copy(&VALUE_LIST(obj)->items[i]);
           }
         }
       }
@@ -2209,21 +6192,33 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
       value_free(&obj);
       return result;
     } else {
-      /* String slice */
-      size_t result_len = 0;
-      for (int64_t i = start; i < end && i < len; i += step) {
-        result_len++;
-      }
+      /* String slice - positions are codepoints */
+      const char *chars = VALUE_STRING(obj);
+      Value result;
 
-      char *result = (char *)malloc(result_len + 1);
-      size_t idx = 0;
-      for (int64_t i = start; i < end && i < len; i += step) {
-        result[idx++] = obj.data.string_val[i];
+      if (step == 1) {
+        size_t from = value_string_offset(&obj, (size_t)start);
+        size_t to = end > start ? value_string_offset(&obj, (size_t)end) : from;
+        result = value_string_from(chars + from, to - from);
+      } else {
+        /* The result is never longer than the source */
+        char *buffer = (char *)malloc(value_string_length(&obj) + 1);
+        size_t used = 0;
+        int64_t i = step > 0 ? start : (end < start ? start - 1 : start);
+        for (; step > 0 ? i < end : i > end; i += step) {
+          if (i < 0 || i >= len)
+            continue;
+          size_t from = value_string_offset(&obj, (size_t)i);
+          size_t to = value_string_offset(&obj, (size_t)i + 1);
+          memcpy(buffer + used, chars + from, to - from);
+          used += to - from;
+        }
+        result = value_string_from(buffer, used);
+        free(buffer);
       }
-      result[idx] = '\0';
 
       value_free(&obj);
-      return value_string(result);
+      return result;
     }
   }
 
@@ -2235,14 +6230,14 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     bool found = false;
     Value class_val = env_get(interp->global_env, class_name, &found);
 
-    if (!found || class_val.type != VAL_CLASS) {
+    if (!found || VALUE_TYPE(class_val) != VAL_CLASS) {
       char err[256];
       snprintf(err, sizeof(err), "Entity '%s' is not defined", class_name);
       runtime_error(interp, err, node->line);
       return value_null();
     }
 
-    KeikakuClass *cls = class_val.data.class_val;
+    KeikakuClass *cls = VALUE_CLASS(class_val);
 
     /* Create instance */
     KeikakuInstance *instance =
@@ -2253,49 +6248,23 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
     /* Call constructor if exists (method named 'construct') */
     found = false;
     Value construct = env_get(cls->methods, "construct", &found);
-    if (found && construct.type == VAL_FUNCTION) {
-      /* Evaluate arguments */
-      /* Evaluate arguments */
-      size_t capacity = node->data.manifest.args.count;
-      int argc = 0;
-      Value *argv =
-          (Value *)malloc(sizeof(Value) * (capacity > 0 ? capacity : 1));
-
-      for (size_t i = 0; i < node->data.manifest.args.count; i++) {
-        ASTNode *arg_node = node->data.manifest.args.nodes[i];
-        if (arg_node->type == AST_SPREAD) {
-          Value spread_val = eval_expr(interp, arg_node->data.spread.expr);
-          if (spread_val.type == VAL_LIST) {
-            size_t spread_cnt = spread_val.data.list_val->count;
-            argv = (Value *)realloc(argv, sizeof(Value) * (argc + spread_cnt));
-            for (size_t j = 0; j < spread_cnt; j++) {
-              argv[argc++] = value_copy(&spread_val.data.list_val->items[j]);
-            }
-          }
-          value_free(&spread_val);
-        } else {
-          argv[argc++] = eval_expr(interp, arg_node);
-        }
-      }
-
-      Value self_val;
-      self_val.type = VAL_INSTANCE;
-      self_val.data.instance_val = instance;
+    if (found && VALUE_TYPE(construct) == VAL_FUNCTION) {
+      CallArgs args;
+      eval_arguments(interp, &node->data.manifest.args, 0, &args);
 
-      Value result = interpreter_call(interp, construct.data.func_val, self_val,
-                                      argc, argv);
-      value_free(&result);
+      Value self_val = value_wrap(VAL_INSTANCE, instance);
 
-      for (int i = 0; i < argc; i++) {
-        value_free(&argv[i]);
+      if (interp->flow != FLOW_ERROR) {
+        interp->call_line = node->line;
+        Value result = call_owned(interp, VALUE_FUNCTION(construct), self_val,
+                                  args.argc, args.argv);
+        value_free(&result);
       }
-      free(argv);
+
+      call_args_free(&args);
     }
 
-    Value result;
-    result.type = VAL_INSTANCE;
-    result.data.instance_val = instance;
-    return result;
+    return value_wrap(VAL_INSTANCE, instance);
   }
 
   case AST_SELF: {
@@ -2320,84 +6289,245 @@ static Value eval_expr(Interpreter *interp, ASTNode *node) {
  * ============================================================================
  */
 
+/* Set up a FROM_TO frame from the start, end and step of a counted loop,
+ * taking ownership of them. Integer bounds count in place; any float makes
+ * it a float range whose values are computed from the step count so no
+ * rounding error accumulates. */
+static bool range_from_values(Interpreter *interp, Value vals[3], int line,
+                              GenFrame *out) {
+  bool is_float = false;
+  int bad = -1;
+  for (int k = 0; k < 3; k++) {
+    if (VALUE_TYPE(vals[k]) == VAL_FLOAT)
+      is_float = true;
+    else if (VALUE_TYPE(vals[k]) != VAL_INT && bad < 0)
+      bad = k;
+  }
+  if (bad >= 0) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Range %s must be a number, not %s.",
+             bad == 0 ? "start" : bad == 1 ? "end" : "step",
+             value_type_name(VALUE_TYPE(vals[bad])));
+    for (int k = 0; k < 3; k++)
+      value_free(&vals[k]);
+    runtime_error_kind(interp, "TypeMismatch", msg, line);
+    return false;
+  }
+
+  memset(out, 0, sizeof(GenFrame));
+  out->type = GEN_FRAME_CYCLE_FROM_TO;
+  out->is_float = is_float;
+  int64_t n[3];
+  double d[3];
+  for (int k = 0; k < 3; k++) {
+    n[k] = VALUE_TYPE(vals[k]) == VAL_INT ? VALUE_INT(vals[k]) : 0;
+    d[k] = VALUE_TYPE(vals[k]) == VAL_INT ? (double)n[k] : VALUE_FLOAT(vals[k]);
+    value_free_number(&vals[k]);
+  }
+  if (is_float) {
+    out->origin = d[0];
+    out->limit = d[1];
+    out->stride = d[2];
+    if (out->stride == 0 || !isfinite(out->stride) ||
+        !isfinite(out->origin)) {
+      runtime_error_kind(interp, "InvalidRange",
+                         "Range step must be a finite non-zero number.", line);
+      return false;
+    }
+  } else {
+    out->current = n[0];
+    out->end = n[1];
+    out->step = n[2];
+    if (out->step == 0) {
+      runtime_error_kind(interp, "InvalidRange", "Range step cannot be zero.",
+                         line);
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Evaluate the bounds of a counted loop once into a FROM_TO frame */
+static bool range_bounds(Interpreter *interp, ASTNode *node, GenFrame *out) {
+  ASTNode *exprs[3] = {node->data.cycle_from_to.start,
+                       node->data.cycle_from_to.end,
+                       node->data.cycle_from_to.step};
+  Value vals[3] = {value_int(0), value_int(0), value_int(1)};
+
+  for (int k = 0; k < 3; k++) {
+    if (!exprs[k])
+      continue;
+    vals[k] = eval_expr(interp, exprs[k]);
+    if (interp->flow == FLOW_ERROR) {
+      for (int j = 0; j <= k; j++)
+        value_free(&vals[j]);
+      return false;
+    }
+    /* The first bound that is not a number is reported before the rest run */
+    if (VALUE_TYPE(vals[k]) != VAL_INT && VALUE_TYPE(vals[k]) != VAL_FLOAT)
+      break;
+  }
+
+  if (!range_from_values(interp, vals, node->line, out))
+    return false;
+  out->node = node;
+  return true;
+}
+
+/* Step an integer loop value, reporting false once it would reach the end.
+ * Works on the distance left so a range near INT64_MAX cannot overflow. */
+static bool range_advance(int64_t *i, int64_t step, int64_t end) {
+  if (step > 0) {
+    if ((uint64_t)end - (uint64_t)*i <= (uint64_t)step)
+      return false;
+  } else if ((uint64_t)*i - (uint64_t)end <= -(uint64_t)step) {
+    return false;
+  }
+  *i += step;
+  return true;
+}
+
+/* Bind a name in the current scope, taking ownership of val */
+static void bind_name(Interpreter *interp, const char *name, Value val,
+                      bool is_designate) {
+  if (is_designate) {
+    env_define(interp->current_env, name, val);
+  } else {
+    env_set(interp->current_env, name, val);
+  }
+}
+
+/* Assign val to a target or destructuring pattern, taking ownership of val.
+ * Patterns move their elements out of val instead of copying them. */
 static void assign_to_target(Interpreter *interp, ASTNode *target, Value val,
                              bool is_designate) {
   if (target->type == AST_IDENTIFIER) {
-    if (is_designate) {
-      env_define(interp->current_env, target->data.identifier.name,
-                 value_copy(&val));
-    } else {
-      env_set(interp->current_env, target->data.identifier.name,
-              value_copy(&val));
-    }
+    bind_name(interp, target->data.identifier.name, val, is_designate);
   } else if (target->type == AST_LIST) {
-    /* Destructuring: [a, b] = [1, 2] */
-    if (val.type != VAL_LIST) {
+    /* Destructuring: [a, b] = [1, 2]; missing elements bind void */
+    if (VALUE_TYPE(val) != VAL_LIST) {
       runtime_error(interp, "Unable to destructure non-list value.",
                     target->line);
+      value_free(&val);
       return;
     }
-    ValueList *list = val.data.list_val;
-    for (size_t i = 0; i < target->data.list.elements.count; i++) {
+    ValueList *list = VALUE_LIST(val);
+    ASTNodeArray *elements = &target->data.list.elements;
+    for (size_t i = 0; i < elements->count; i++) {
+      Value item = value_null();
       if (i < list->count) {
-        assign_to_target(interp, target->data.list.elements.nodes[i],
-                         list->items[i], is_designate);
+        item = list->items[i];
+        list->items[i] = value_null();
+      }
+      /* Plain names, the common [key, value] case, bind without recursing */
+      if (elements->nodes[i]->type == AST_IDENTIFIER) {
+        bind_name(interp, elements->nodes[i]->data.identifier.name, item,
+                  is_designate);
       } else {
-        Value null_val = value_null();
-        assign_to_target(interp, target->data.list.elements.nodes[i], null_val,
-                         is_designate);
+        assign_to_target(interp, elements->nodes[i], item, is_designate);
+      }
+    }
+    value_free(&val);
+  } else if (target->type == AST_DICT) {
+    /* Destructuring: {"name": n, "age": a} = person; missing keys bind void */
+    if (VALUE_TYPE(val) != VAL_DICT) {
+      runtime_error(interp, "Unable to destructure non-dict value.",
+                    target->line);
+      value_free(&val);
+      return;
+    }
+    for (size_t i = 0; i < target->data.dict.pairs.count; i++) {
+      Value key = eval_expr(interp, target->data.dict.pairs.pairs[i].key);
+      if (interp->flow == FLOW_ERROR)
+        break;
+      if (VALUE_TYPE(key) != VAL_STRING) {
+        runtime_error_kind(interp, "TypeMismatch",
+                           "Dict pattern keys must be strings.", target->line);
+        value_free(&key);
+        break;
       }
+      Value item = value_null();
+      Value *slot = value_dict_slot(&val, VALUE_STRING(key));
+      if (slot) {
+        item = *slot;
+        *slot = value_null();
+      }
+      value_free(&key);
+      assign_to_target(interp, target->data.dict.pairs.pairs[i].value, item,
+                       is_designate);
     }
+    value_free(&val);
   } else if (target->type == AST_MEMBER) {
     Value obj = eval_expr(interp, target->data.member.object);
-    if (obj.type == VAL_INSTANCE) {
-      KeikakuInstance *inst = obj.data.instance_val;
+    if (VALUE_TYPE(obj) == VAL_INSTANCE) {
+      KeikakuInstance *inst = VALUE_INSTANCE(obj);
 
       /* Private Member check */
       if (target->data.member.member[0] == '_') {
         bool found_self = false;
         Value self_val = env_get(interp->current_env, "self", &found_self);
-        if (!found_self || self_val.data.instance_val != inst) {
+        if (!found_self || VALUE_INSTANCE(self_val) != inst) {
           runtime_error(interp, "Modification of private member inhibited.",
                         target->line);
           value_free(&obj);
+          value_free(&val);
           return;
         }
       }
 
-      bool found = false;
-      env_get(inst->fields, target->data.member.member, &found);
-      if (found) {
-        env_set(inst->fields, target->data.member.member, value_copy(&val));
+      EnvEntry *field = quick_field(inst, target);
+      if (field) {
+        value_free(&field->value);
+        field->value = val;
       } else {
         /* First time initialization of field */
-        env_define(inst->fields, target->data.member.member, value_copy(&val));
+        env_define(inst->fields, target->data.member.member, val);
       }
     } else {
       runtime_error(interp, "Only instances have properties.", target->line);
+      value_free(&val);
     }
     value_free(&obj);
   } else if (target->type == AST_INDEX) {
-    Value obj = eval_expr(interp, target->data.index.object);
-    Value idx = eval_expr(interp, target->data.index.index);
-    if (obj.type == VAL_LIST && idx.type == VAL_INT) {
-      int64_t i = idx.data.int_val;
-      if (i >= 0 && (size_t)i < obj.data.list_val->count) {
-        value_free(&obj.data.list_val->items[i]);
-        obj.data.list_val->items[i] = value_copy(&val);
+    /* Mutate the stored list itself */
+    if (!is_place(target)) {
+      runtime_error(interp, "Index assignment requires a stored list.",
+                    target->line);
+      value_free(&val);
+      return;
+    }
+    ASTNode *object = target->data.index.object;
+    Value index = eval_expr(interp, target->data.index.index);
+    Value *container =
+        interp->flow == FLOW_ERROR ? NULL : eval_ref(interp, object);
+    if (container && VALUE_TYPE(*container) == VAL_DICT &&
+        VALUE_TYPE(index) == VAL_STRING) {
+      /* Assigning to a new key adds it */
+      value_dict_set(container, VALUE_STRING(index), val);
+    } else if (container) {
+      Value *slot = index_slot(interp, container, &index, target->line);
+      if (slot) {
+        value_free(slot);
+        *slot = val;
       } else {
-        runtime_error(interp, "List index out of bounds.", target->line);
+        value_free(&val);
       }
     } else {
-      runtime_error(interp, "Invalid index access.", target->line);
+      value_free(&val);
     }
-    value_free(&obj);
-    value_free(&idx);
+    value_free(&index);
   } else {
     runtime_error(interp, "Invalid assignment target.", target->line);
+    value_free(&val);
   }
 }
 
+/* A statement that is only a call, whose value is thrown away */
+static bool is_call_stmt(ASTNode *node) {
+  return node->type == AST_EXPR_STMT &&
+         node->data.expr_stmt.expr->type == AST_CALL;
+}
+
 static void exec_block(Interpreter *interp, ASTNodeArray *stmts) {
   size_t start_idx = 0;
 
@@ -2407,9 +6537,7 @@ static void exec_block(Interpreter *interp, ASTNodeArray *stmts) {
       DEBUG_PRINT("exec_block: resuming at index %zu (stmts=%p)\n",
                   frame->index, (void *)stmts);
       start_idx = frame->index;
-      interp->resume_count--;
-      if (interp->resume_count == 0)
-        interp->is_resuming = false;
+      resume_frame_consumed(interp);
     } else {
       DEBUG_PRINT("exec_block: is_resuming, but frame type %d/node %p doesn't "
                   "match BLOCK/%p\n",
@@ -2425,10 +6553,11 @@ static void exec_block(Interpreter *interp, ASTNodeArray *stmts) {
         interp->current_gen ? interp->current_gen->stack_count : 0;
     DEBUG_PRINT("exec_block (level %p): stmt %zu/%zu type %s\n", (void *)stmts,
                 i, stmts->count, ast_node_type_name(stmts->nodes[i]->type));
-    eval_stmt(interp, stmts->nodes[i]);
-    if (interp->has_return || interp->has_error || interp->has_break ||
-        interp->has_continue) {
-      if (interp->has_return && interp->current_gen && !interp->has_error) {
+    interp->result_unused = is_call_stmt(stmts->nodes[i]);
+    Value discarded = eval_stmt(interp, stmts->nodes[i]);
+    value_free(&discarded);
+    if (interp->flow != FLOW_NORMAL) {
+      if (interp->flow == FLOW_RETURN && interp->current_gen) {
         bool child_suspended =
             (interp->current_gen->stack_count > old_stack_count);
         GenFrame f;
@@ -2445,17 +6574,226 @@ static void exec_block(Interpreter *interp, ASTNodeArray *stmts) {
   }
 }
 
+/* ============================================================================
+ * Situation Dispatch
+ * ============================================================================
+ */
+
+/* Literal alignment value, resolved to an arm without evaluation */
+typedef struct {
+  Value key;
+  int arm; /* -1 marks an empty slot */
+} SituationSlot;
+
+/* Built once per situation node. When every alignment value is a literal,
+ * dense integer cases index a jump table and the rest go through a hash
+ * table; otherwise only the otherwise arm is cached */
+typedef struct {
+  int otherwise; /* Arm index, -1 if none */
+  bool compiled;
+  int64_t base; /* jump[v - base] for base <= v < base + span */
+  size_t span;
+  int *jump;
+  SituationSlot *slots; /* Open addressing, mask + 1 slots */
+  size_t mask;
+} SituationDispatch;
+
+static void situation_dispatch_free(void *data) {
+  SituationDispatch *d = (SituationDispatch *)data;
+  if (d->slots) {
+    for (size_t i = 0; i <= d->mask; i++) {
+      value_free(&d->slots[i].key);
+    }
+  }
+  free(d->slots);
+  free(d->jump);
+  free(d);
+}
+
+static bool is_literal(ASTNode *node) {
+  switch (node->type) {
+  case AST_INTEGER:
+  case AST_FLOAT:
+  case AST_STRING:
+  case AST_BOOL:
+    return true;
+  case AST_UNARY_OP:
+    return node->data.unary.op == OP_NEG &&
+           (node->data.unary.operand->type == AST_INTEGER ||
+            node->data.unary.operand->type == AST_FLOAT);
+  default:
+    return false;
+  }
+}
+
+static void situation_slot_add(SituationDispatch *d, Value key, int arm) {
+  size_t i = (size_t)value_hash(&key) & d->mask;
+  while (d->slots[i].arm >= 0) {
+    if (value_equals(&d->slots[i].key, &key)) {
+      value_free(&key); /* An earlier alignment already claims it */
+      return;
+    }
+    i = (i + 1) & d->mask;
+  }
+  d->slots[i].key = key;
+  d->slots[i].arm = arm;
+}
+
+static SituationDispatch *situation_compile(Interpreter *interp,
+                                            ASTNode *node) {
+  SituationDispatch *d =
+      (SituationDispatch *)calloc(1, sizeof(SituationDispatch));
+  d->otherwise = -1;
+  d->compiled = true;
+
+  ASTNodeArray *arms = &node->data.situation.alignments;
+  size_t ints = 0, others = 0;
+  int64_t lo = INT64_MAX, hi = INT64_MIN;
+  for (size_t i = 0; i < arms->count; i++) {
+    ASTNode *alignment = arms->nodes[i];
+    if (alignment->data.alignment.is_otherwise) {
+      if (d->otherwise < 0)
+        d->otherwise = (int)i;
+      continue;
+    }
+    ASTNodeArray *values = &alignment->data.alignment.values;
+    for (size_t j = 0; j < values->count; j++) {
+      ASTNode *v = values->nodes[j];
+      if (!is_literal(v)) {
+        d->compiled = false;
+      } else if (v->type == AST_INTEGER ||
+                 (v->type == AST_UNARY_OP &&
+                  v->data.unary.operand->type == AST_INTEGER)) {
+        int64_t n = v->type == AST_INTEGER
+                        ? v->data.int_value
+                        : -v->data.unary.operand->data.int_value;
+        lo = n < lo ? n : lo;
+        hi = n > hi ? n : hi;
+        ints++;
+      } else {
+        others++;
+      }
+    }
+  }
+  if (!d->compiled)
+    return d;
+
+  /* A jump table when the integer cases fill at least a quarter of it */
+  uint64_t range = (uint64_t)hi - (uint64_t)lo;
+  bool dense = ints > 0 && range < 4 * ints + 16 && range < 65536;
+  if (dense) {
+    d->base = lo;
+    d->span = (size_t)range + 1;
+    d->jump = (int *)malloc(sizeof(int) * d->span);
+    for (size_t i = 0; i < d->span; i++) {
+      d->jump[i] = -1;
+    }
+  }
+  size_t hashed = others + (dense ? 0 : ints);
+  if (hashed > 0) {
+    size_t capacity = 8;
+    while (capacity < hashed * 2)
+      capacity *= 2;
+    d->slots = (SituationSlot *)malloc(sizeof(SituationSlot) * capacity);
+    for (size_t i = 0; i < capacity; i++) {
+      d->slots[i].key = value_null();
+      d->slots[i].arm = -1;
+    }
+    d->mask = capacity - 1;
+  }
+
+  for (size_t i = 0; i < arms->count; i++) {
+    ASTNode *alignment = arms->nodes[i];
+    if (alignment->data.alignment.is_otherwise)
+      continue;
+    ASTNodeArray *values = &alignment->data.alignment.values;
+    for (size_t j = 0; j < values->count; j++) {
+      Value key = eval_expr(interp, values->nodes[j]); /* A literal */
+      if (VALUE_TYPE(key) == VAL_INT && dense) {
+        int *slot = &d->jump[VALUE_INT(key) - d->base];
+        if (*slot < 0)
+          *slot = (int)i;
+      } else {
+        situation_slot_add(d, key, (int)i);
+        continue;
+      }
+      value_free(&key);
+    }
+  }
+  return d;
+}
+
+/* Arm whose alignment value equals val, or -1 */
+static int situation_lookup(SituationDispatch *d, Value *val) {
+  if (VALUE_TYPE(*val) == VAL_INT && d->jump) {
+    uint64_t offset = (uint64_t)VALUE_INT(*val) - (uint64_t)d->base;
+    return offset < d->span ? d->jump[offset] : -1;
+  }
+  if (!d->slots)
+    return -1;
+  size_t i = (size_t)value_hash(val) & d->mask;
+  while (d->slots[i].arm >= 0) {
+    if (value_equals(&d->slots[i].key, val))
+      return d->slots[i].arm;
+    i = (i + 1) & d->mask;
+  }
+  return -1;
+}
+
+/* Arm to run for val, evaluating alignment values in order when they are
+ * not all literals */
+static int situation_select(Interpreter *interp, ASTNode *node, Value *val) {
+  SituationDispatch *d = (SituationDispatch *)node->data.situation.dispatch;
+  if (!d) {
+    d = situation_compile(interp, node);
+    node->data.situation.dispatch = d;
+    node->data.situation.dispatch_free = situation_dispatch_free;
+  }
+
+  int arm = -1;
+  if (d->compiled) {
+    arm = situation_lookup(d, val);
+  } else {
+    ASTNodeArray *arms = &node->data.situation.alignments;
+    for (size_t i = 0; i < arms->count && arm < 0; i++) {
+      ASTNode *alignment = arms->nodes[i];
+      if (alignment->data.alignment.is_otherwise)
+        continue;
+      ASTNodeArray *values = &alignment->data.alignment.values;
+      for (size_t j = 0; j < values->count; j++) {
+        Value case_val = eval_expr(interp, values->nodes[j]);
+        bool equal = value_equals(val, &case_val);
+        value_free(&case_val);
+        if (interp->flow == FLOW_ERROR)
+          return -1;
+        if (equal) {
+          arm = (int)i;
+          break;
+        }
+      }
+    }
+  }
+  return arm >= 0 ? arm : d->otherwise;
+}
+
 static Value eval_stmt(Interpreter *interp, ASTNode *node) {
-  if (!node || interp->has_return)
+  if (!node || interp->flow != FLOW_NORMAL)
     return value_null();
 
   switch (node->type) {
   case AST_DESIGNATE:
   case AST_ASSIGN: {
+    ASTNode *target = node->data.assign.target;
+    if (node->type == AST_ASSIGN && target->type == AST_IDENTIFIER &&
+        node->data.assign.value->type == AST_CALL)
+      interp->result_target = target->data.identifier.name;
     Value val = eval_expr(interp, node->data.assign.value);
+    if (interp->result_in_place) {
+      interp->result_in_place = false;
+      return value_null();
+    }
     assign_to_target(interp, node->data.assign.target, val,
                      node->type == AST_DESIGNATE);
-    value_free(&val);
     return value_null();
   }
 
@@ -2463,9 +6801,9 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
     return eval_expr(interp, node->data.expr_stmt.expr);
 
   case AST_FORESEE: {
-    Value cond = eval_expr(interp, node->data.foresee.condition);
-    bool taken = value_is_truthy(&cond);
-    value_free(&cond);
+    bool taken = eval_condition(interp, node->data.foresee.condition);
+    if (interp->flow == FLOW_ERROR)
+      return value_null();
 
     if (taken) {
       exec_block(interp, &node->data.foresee.body);
@@ -2473,15 +6811,14 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
       /* Check alternates */
       bool alt_taken = false;
       for (size_t i = 0; i < node->data.foresee.alternates.count; i++) {
-        Value alt_cond =
-            eval_expr(interp, node->data.foresee.alternates.alts[i].condition);
-        if (value_is_truthy(&alt_cond)) {
-          value_free(&alt_cond);
-          exec_block(interp, &node->data.foresee.alternates.alts[i].body);
+        ASTAlternate *alt = &node->data.foresee.alternates.alts[i];
+        if (eval_condition(interp, alt->condition)) {
+          exec_block(interp, &alt->body);
           alt_taken = true;
           break;
         }
-        value_free(&alt_cond);
+        if (interp->flow == FLOW_ERROR)
+          return value_null();
       }
 
       if (!alt_taken && node->data.foresee.otherwise.count > 0) {
@@ -2499,35 +6836,30 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
         if (frame->type == GEN_FRAME_CYCLE_WHILE && frame->node == node) {
           DEBUG_PRINT("AST_CYCLE_WHILE: resuming into body\n");
           resuming_this_iteration = true;
-          interp->resume_count--;
-          if (interp->resume_count == 0)
-            interp->is_resuming = false;
+          resume_frame_consumed(interp);
         }
       }
 
       if (!resuming_this_iteration) {
-        Value cond = eval_expr(interp, node->data.cycle_while.condition);
-        if (!value_is_truthy(&cond)) {
-          value_free(&cond);
+        bool keep_going = eval_condition(interp, node->data.cycle_while.condition);
+        if (!keep_going || interp->flow == FLOW_ERROR)
           break;
-        }
-        value_free(&cond);
       }
 
       exec_block(interp, &node->data.cycle_while.body);
 
-      if (interp->has_continue) {
-        interp->has_continue = false;
+      if (interp->flow == FLOW_CONTINUE) {
+        interp->flow = FLOW_NORMAL;
         continue;
       }
 
-      if (interp->has_break) {
-        interp->has_break = false;
+      if (interp->flow == FLOW_BREAK) {
+        interp->flow = FLOW_NORMAL;
         break;
       }
 
-      if (interp->has_return || interp->has_error) {
-        if (interp->has_return && interp->current_gen && !interp->has_error) {
+      if (interp->flow != FLOW_NORMAL) {
+        if (interp->flow == FLOW_RETURN && interp->current_gen) {
           GenFrame f;
           memset(&f, 0, sizeof(GenFrame));
           f.type = GEN_FRAME_CYCLE_WHILE;
@@ -2544,25 +6876,26 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
   case AST_CYCLE_THROUGH: {
     Value iterable;
     size_t start_idx = 0;
+    bool resumed = false;
     bool initially_resuming_gen =
         false; /* Track if we're resuming a generator loop */
 
     if (interp->is_resuming && interp->resume_count > 0) {
       GenFrame *frame = &interp->resume_stack[interp->resume_count - 1];
       if (frame->type == GEN_FRAME_CYCLE_THROUGH && frame->node == node) {
-        /* Correct: Use a COPIED value of iterable to keep it alive */
-        iterable = value_copy(&frame->iterable);
+        /* Take the iterable back from the frame; the loop variable is still
+         * bound in the generator's scope */
+        iterable = frame->iterable;
+        frame->iterable = value_null();
         start_idx = frame->index;
-        interp->resume_count--;
-
+        resumed = true;
         /* For generators, track if there are more frames (we're resuming into
          * body) */
-        if (frame->iterable.type == VAL_GENERATOR && interp->resume_count > 0) {
+        if (VALUE_TYPE(iterable) == VAL_GENERATOR && interp->resume_count > 1) {
           initially_resuming_gen = true;
         }
 
-        if (interp->resume_count == 0)
-          interp->is_resuming = false;
+        resume_frame_consumed(interp);
       } else {
         iterable = eval_expr(interp, node->data.cycle_through.iterable);
       }
@@ -2570,26 +6903,48 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
       iterable = eval_expr(interp, node->data.cycle_through.iterable);
     }
 
-    if (iterable.type != VAL_LIST && iterable.type != VAL_GENERATOR) {
-      runtime_error(interp, "Can only cycle through a list or sequence.",
+    /* A set is walked as the list of its items */
+    if (VALUE_TYPE(iterable) == VAL_SET)
+      iterable = set_into_list(&iterable);
+
+    if (VALUE_TYPE(iterable) != VAL_LIST &&
+        VALUE_TYPE(iterable) != VAL_GENERATOR) {
+      runtime_error(interp, "Can only cycle through a list, set or sequence.",
                     node->line);
       value_free(&iterable);
       return value_null();
     }
 
-    if (iterable.type == VAL_LIST) {
-      ValueList *list = iterable.data.list_val;
+    if (VALUE_TYPE(iterable) == VAL_LIST) {
+      ValueList *list = VALUE_LIST(iterable);
       for (size_t i = start_idx; i < list->count; i++) {
-        assign_to_target(interp, node->data.cycle_through.var_pattern,
-                         list->items[i], true);
+        /* The loop owns its list, so each item is moved into the pattern */
+        if (!resumed || i != start_idx) {
+          Value item = list->items[i];
+          list->items[i] = value_null();
+          assign_to_target(interp, node->data.cycle_through.var_pattern, item,
+                           true);
+        }
         exec_block(interp, &node->data.cycle_through.body);
-        if (interp->has_return || interp->has_error) {
-          if (interp->has_return && interp->current_gen && !interp->has_error) {
+
+        if (interp->flow == FLOW_CONTINUE) {
+          interp->flow = FLOW_NORMAL;
+          continue;
+        }
+
+        if (interp->flow == FLOW_BREAK) {
+          interp->flow = FLOW_NORMAL;
+          break;
+        }
+
+        if (interp->flow != FLOW_NORMAL) {
+          if (interp->flow == FLOW_RETURN && interp->current_gen) {
             GenFrame f;
             memset(&f, 0, sizeof(GenFrame));
             f.type = GEN_FRAME_CYCLE_THROUGH;
             f.index = i;
-            f.iterable = value_copy(&iterable);
+            f.iterable = iterable;
+            iterable = value_null();
             f.node = node;
             gen_push_frame(interp->current_gen, f);
           }
@@ -2609,13 +6964,12 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
         }
         first_iteration = false;
 
-        Value next_val;
-        if (resuming_into_body) {
-          next_val = value_null(); /* Dummy, environment has the value */
-        } else {
-          next_val = interpreter_gen_next(interp, iterable);
-          if (next_val.type == VAL_NULL &&
-              iterable.data.gen_val->status == GEN_DONE) {
+        if (!resuming_into_body) {
+          /* Otherwise the environment still has the value */
+          Value next_val = interpreter_gen_next(interp, iterable);
+          if ((VALUE_TYPE(next_val) == VAL_NULL &&
+               VALUE_GENERATOR(iterable)->status == GEN_DONE) ||
+              interp->flow == FLOW_ERROR) {
             value_free(&next_val);
             break;
           }
@@ -2624,25 +6978,25 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
         }
 
         exec_block(interp, &node->data.cycle_through.body);
-        value_free(&next_val);
 
-        if (interp->has_continue) {
-          interp->has_continue = false;
+        if (interp->flow == FLOW_CONTINUE) {
+          interp->flow = FLOW_NORMAL;
           continue;
         }
 
-        if (interp->has_break) {
-          interp->has_break = false;
+        if (interp->flow == FLOW_BREAK) {
+          interp->flow = FLOW_NORMAL;
           break;
         }
 
-        if (interp->has_return || interp->has_error) {
-          if (interp->has_return && interp->current_gen && !interp->has_error) {
+        if (interp->flow != FLOW_NORMAL) {
+          if (interp->flow == FLOW_RETURN && interp->current_gen) {
             GenFrame f;
             memset(&f, 0, sizeof(GenFrame));
             f.type = GEN_FRAME_CYCLE_THROUGH;
             f.index = 0; /* Index not used for generator iteration */
-            f.iterable = value_copy(&iterable);
+            f.iterable = iterable;
+            iterable = value_null();
             f.node = node;
             gen_push_frame(interp->current_gen, f);
           }
@@ -2656,59 +7010,65 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
   }
 
   case AST_CYCLE_FROM_TO: {
-    int64_t current_i = 0;
-    int64_t end_val = 0;
+    GenFrame range;
+    if (interp->is_resuming && interp->resume_count > 0 &&
+        interp->resume_stack[interp->resume_count - 1].type ==
+            GEN_FRAME_CYCLE_FROM_TO &&
+        interp->resume_stack[interp->resume_count - 1].node == node) {
+      range = interp->resume_stack[interp->resume_count - 1];
+      resume_frame_consumed(interp);
+    } else if (!range_bounds(interp, node, &range)) {
+      return value_null();
+    }
 
-    if (interp->is_resuming && interp->resume_count > 0) {
-      GenFrame *frame = &interp->resume_stack[interp->resume_count - 1];
-      if (frame->type == GEN_FRAME_CYCLE_FROM_TO && frame->node == node) {
-        current_i = frame->current;
-        end_val = frame->end;
-        interp->resume_count--;
-        if (interp->resume_count == 0)
-          interp->is_resuming = false;
-      } else {
-        Value start = eval_expr(interp, node->data.cycle_from_to.start);
-        Value end = eval_expr(interp, node->data.cycle_from_to.end);
-        current_i = start.type == VAL_INT ? start.data.int_val : 0;
-        end_val = end.type == VAL_INT ? end.data.int_val : 0;
-        value_free(&start);
-        value_free(&end);
-      }
-    } else {
-      Value start = eval_expr(interp, node->data.cycle_from_to.start);
-      Value end = eval_expr(interp, node->data.cycle_from_to.end);
-      current_i = start.type == VAL_INT ? start.data.int_val : 0;
-      end_val = end.type == VAL_INT ? end.data.int_val : 0;
-      value_free(&start);
-      value_free(&end);
+    /* A plain identifier is bound once and then updated in place */
+    ASTNode *pattern = node->data.cycle_from_to.var_pattern;
+    Value *slot = NULL;
+    if (pattern->type == AST_IDENTIFIER) {
+      env_define(interp->current_env, pattern->data.identifier.name,
+                 value_null());
+      slot = &env_find(interp->current_env, pattern->data.identifier.name)
+                  ->value;
     }
 
-    for (int64_t i = current_i; i < end_val; i++) {
-      Value val = value_int(i);
-      assign_to_target(interp, node->data.cycle_from_to.var_pattern, val, true);
-      exec_block(interp, &node->data.cycle_from_to.body);
+    int64_t i = range.current;
+    for (;;) {
+      Value val;
+      if (range.is_float) {
+        double x = range.origin + (double)i * range.stride;
+        if (range.stride > 0 ? !(x < range.limit) : !(x > range.limit))
+          break;
+        val = value_float(x);
+      } else {
+        if (range.step > 0 ? i >= range.end : i <= range.end)
+          break;
+        val = value_int(i);
+      }
 
-      if (interp->has_continue) {
-        interp->has_continue = false;
-        continue;
+      if (slot) {
+        value_free(slot);
+        *slot = val;
+      } else {
+        assign_to_target(interp, pattern, val, true);
       }
+      exec_block(interp, &node->data.cycle_from_to.body);
 
-      if (interp->has_break) {
-        interp->has_break = false;
+      if (interp->flow == FLOW_CONTINUE) {
+        interp->flow = FLOW_NORMAL;
+      } else if (interp->flow == FLOW_BREAK) {
+        interp->flow = FLOW_NORMAL;
+        break;
+      } else if (interp->flow != FLOW_NORMAL) {
+        if (interp->flow == FLOW_RETURN && interp->current_gen) {
+          range.current = i;
+          gen_push_frame(interp->current_gen, range);
+        }
         break;
       }
 
-      if (interp->has_return || interp->has_error) {
-        if (interp->has_return && interp->current_gen && !interp->has_error) {
-          GenFrame f;
-          memset(&f, 0, sizeof(GenFrame));
-          f.type = GEN_FRAME_CYCLE_FROM_TO;
-          f.current = i;
-          f.end = end_val;
-          f.node = node;
-          gen_push_frame(interp->current_gen, f);
-        }
+      if (range.is_float) {
+        i++;
+      } else if (!range_advance(&i, range.step, range.end)) {
         break;
       }
     }
@@ -2716,8 +7076,16 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
   }
 
   case AST_PROTOCOL: {
-    Value func = value_function(node, interp->current_env);
-    env_define(interp->current_env, node->data.protocol.name, func);
+    /* Inside a protocol the name is reserved first, so a nested protocol
+     * can capture itself and recurse */
+    Environment *scope = interp->current_env;
+    if (scope != scope->global)
+      env_define(scope, node->data.protocol.name, value_null());
+    bool owns;
+    Environment *closure = closure_capture(interp, node, &owns);
+    Value func = value_function(node, closure);
+    VALUE_FUNCTION(func)->owns_closure = owns;
+    env_define(scope, node->data.protocol.name, func);
     return value_null();
   }
 
@@ -2727,17 +7095,22 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
     } else {
       interp->return_value = value_null();
     }
-    interp->has_return = true;
+    /* A deviation raised by the yielded expression takes precedence */
+    if (interp->flow == FLOW_ERROR) {
+      value_free(&interp->return_value);
+      return value_null();
+    }
+    interp->flow = FLOW_RETURN;
     return value_null();
   }
 
   case AST_BREAK: {
-    interp->has_break = true;
+    interp->flow = FLOW_BREAK;
     return value_null();
   }
 
   case AST_CONTINUE: {
-    interp->has_continue = true;
+    interp->flow = FLOW_CONTINUE;
     return value_null();
   }
 
@@ -2752,9 +7125,7 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
       if (frame->type == GEN_FRAME_DELEGATE && frame->node == node) {
         iterable = value_copy(&frame->iterable);
         start_idx = frame->index;
-        interp->resume_count--;
-        if (interp->resume_count == 0)
-          interp->is_resuming = false;
+        resume_frame_consumed(interp);
       } else {
         iterable = eval_expr(interp, node->data.delegate.iterable);
       }
@@ -2762,12 +7133,19 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
       iterable = eval_expr(interp, node->data.delegate.iterable);
     }
 
-    if (iterable.type == VAL_LIST) {
+    if (interp->flow == FLOW_ERROR) {
+      value_free(&iterable);
+      return value_null();
+    }
+    if (VALUE_TYPE(iterable) == VAL_SET)
+      iterable = set_into_list(&iterable);
+
+    if (VALUE_TYPE(iterable) == VAL_LIST) {
       /* Delegate to a list - yield each item */
-      ValueList *list = iterable.data.list_val;
+      ValueList *list = VALUE_LIST(iterable);
       for (size_t i = start_idx; i < list->count; i++) {
         interp->return_value = value_copy(&list->items[i]);
-        interp->has_return = true;
+        interp->flow = FLOW_RETURN;
 
         if (interp->current_gen) {
           /* Save position for resumption */
@@ -2782,18 +7160,19 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
         value_free(&iterable);
         return value_null();
       }
-    } else if (iterable.type == VAL_GENERATOR) {
+    } else if (VALUE_TYPE(iterable) == VAL_GENERATOR) {
       /* Delegate to another generator - pull and yield each value */
       while (true) {
         Value next_val = interpreter_gen_next(interp, iterable);
-        if (next_val.type == VAL_NULL &&
-            iterable.data.gen_val->status == GEN_DONE) {
+        if ((VALUE_TYPE(next_val) == VAL_NULL &&
+             VALUE_GENERATOR(iterable)->status == GEN_DONE) ||
+            interp->flow == FLOW_ERROR) {
           value_free(&next_val);
           break;
         }
         /* Yield this value */
         interp->return_value = next_val;
-        interp->has_return = true;
+        interp->flow = FLOW_RETURN;
 
         if (interp->current_gen) {
           /* Save the delegated generator for resumption */
@@ -2840,53 +7219,24 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
 
   case AST_SITUATION: {
     Value val = eval_expr(interp, node->data.situation.value);
-    bool matched = false;
-
-    for (size_t i = 0; i < node->data.situation.alignments.count; i++) {
-      ASTNode *alignment = node->data.situation.alignments.nodes[i];
-      if (alignment->data.alignment.is_otherwise) {
-        /* Otherwise handled at end if no match */
-        continue;
-      }
-
-      for (size_t j = 0; j < alignment->data.alignment.values.count; j++) {
-        Value case_val =
-            eval_expr(interp, alignment->data.alignment.values.nodes[j]);
-        if (value_equals(&val, &case_val)) {
-          value_free(&case_val);
-          exec_block(interp, &alignment->data.alignment.body);
-          matched = true;
-          break;
-        }
-        value_free(&case_val);
-      }
-      if (matched)
-        break;
-    }
-
-    if (!matched) {
-      /* Search for otherwise case */
-      for (size_t i = 0; i < node->data.situation.alignments.count; i++) {
-        ASTNode *alignment = node->data.situation.alignments.nodes[i];
-        if (alignment->data.alignment.is_otherwise) {
-          exec_block(interp, &alignment->data.alignment.body);
-          break;
-        }
+    if (interp->flow != FLOW_ERROR) {
+      int arm = situation_select(interp, node, &val);
+      if (arm >= 0) {
+        ASTNode *alignment = node->data.situation.alignments.nodes[arm];
+        exec_block(interp, &alignment->data.alignment.body);
       }
     }
-
     value_free(&val);
     return value_null();
   }
 
   case AST_ABSOLUTE: {
-    Value cond = eval_expr(interp, node->data.absolute.condition);
-    if (!value_is_truthy(&cond)) {
+    if (!eval_condition(interp, node->data.absolute.condition) &&
+        interp->flow != FLOW_ERROR) {
       voice_print_absolute_failed(node->data.absolute.expr_str
                                       ? node->data.absolute.expr_str
                                       : "condition");
     }
-    value_free(&cond);
     return value_null();
   }
 
@@ -2912,8 +7262,8 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
       bool found = false;
       Value parent_val =
           env_get(interp->global_env, node->data.entity.parent, &found);
-      if (found && parent_val.type == VAL_CLASS) {
-        cls->parent = parent_val.data.class_val;
+      if (found && VALUE_TYPE(parent_val) == VAL_CLASS) {
+        cls->parent = VALUE_CLASS(parent_val);
         /* Inherit methods */
         cls->methods = env_create(cls->parent->methods);
       }
@@ -2932,21 +7282,19 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
         method->node = member;
         method->closure = cls->methods;
         method->is_lambda = false;
+        method->owns_closure = false;
+        method->memo = NULL;
+        method->is_sequence = member->data.protocol.is_sequence;
 
-        Value method_val;
-        method_val.type = VAL_FUNCTION;
-        method_val.data.func_val = method;
-        env_define(cls->methods, method->name, method_val);
+        env_define(cls->methods, method->name,
+                   value_wrap(VAL_FUNCTION, method));
       }
     }
 
     interp->current_env = old_env;
 
     /* Register class */
-    Value class_val;
-    class_val.type = VAL_CLASS;
-    class_val.data.class_val = cls;
-    env_define(interp->global_env, cls->name, class_val);
+    env_define(interp->global_env, cls->name, value_wrap(VAL_CLASS, cls));
 
     printf("  ◈ Entity '%s' has been defined. The blueprint awaits "
            "manifestation.\n",
@@ -3006,58 +7354,73 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
   }
 
   case AST_ATTEMPT: {
-    /* Save error state */
-    bool old_error = interp->has_error;
-    char old_error_buf[1024];
-    strncpy(old_error_buf, interp->error_buffer, sizeof(old_error_buf));
-    interp->has_error = false;
+    ASTNodeArray *recover_body = &node->data.attempt.recover_body;
 
-    /* Execute try block */
-    Value result = value_null();
-    for (size_t i = 0; i < node->data.attempt.try_body.count; i++) {
-      result = eval_stmt(interp, node->data.attempt.try_body.nodes[i]);
-      if (interp->has_error || interp->has_return)
-        break;
+    /* A generator suspended inside the recover block resumes straight there */
+    if (interp->is_resuming && interp->resume_count > 0 &&
+        interp->resume_stack[interp->resume_count - 1].node ==
+            (void *)recover_body) {
+      exec_block(interp, recover_body);
+      return value_null();
     }
 
-    /* If error occurred, execute recover block */
-    if (interp->has_error && node->data.attempt.recover_body.count > 0) {
-      char *error_msg = strdup(interp->error_buffer);
-      interp->has_error = false;
-      interp->error_buffer[0] = '\0';
+    /* The guarded path costs nothing beyond the usual flow check */
+    exec_block(interp, &node->data.attempt.try_body);
 
-      printf("  ◇ Deviation intercepted. Recovery protocol engaged.\n");
+    /* Without a recover block the deviation keeps unwinding */
+    if (interp->flow != FLOW_ERROR || recover_body->count == 0) {
+      return value_null();
+    }
 
-      /* Bind error variable if specified */
-      if (node->data.attempt.error_var) {
-        env_define(interp->current_env, node->data.attempt.error_var,
-                   value_string(error_msg));
-      }
+    Value error = interp->exception;
+    interp->exception = value_null();
+    interp->flow = FLOW_NORMAL;
 
-      /* Execute recover block */
-      for (size_t i = 0; i < node->data.attempt.recover_body.count; i++) {
-        result = eval_stmt(interp, node->data.attempt.recover_body.nodes[i]);
-        if (interp->has_return)
-          break;
-      }
+    if (interp->report_level == REPORT_VERBOSE) {
+      fprintf(stderr,
+              "  ◇ Deviation intercepted at line %d. Recovery protocol "
+              "engaged.\n",
+              VALUE_ERROR(error)->line);
+    }
 
-      free(error_msg);
-    } else if (!interp->has_error) {
-      /* Restore previous error state if no new error */
-      interp->has_error = old_error;
-      strncpy(interp->error_buffer, old_error_buf,
-              sizeof(interp->error_buffer));
+    /* Bind error variable if specified */
+    if (node->data.attempt.error_var) {
+      env_define(interp->current_env, node->data.attempt.error_var, error);
+    } else {
+      value_free(&error);
     }
 
-    return result;
+    exec_block(interp, recover_body);
+    return value_null();
   }
 
   case AST_PROGRAM: {
     Value last = value_null();
     for (size_t i = 0; i < node->data.program.statements.count; i++) {
       value_free(&last);
+      /* The last statement's value is the program's, shown by the REPL */
+      interp->result_unused =
+          i + 1 < node->data.program.statements.count &&
+          is_call_stmt(node->data.program.statements.nodes[i]);
       last = eval_stmt(interp, node->data.program.statements.nodes[i]);
+
+      if (interp->flow == FLOW_ERROR) {
+        /* Uncaught deviation - reported, remembered for the exit status,
+         * then the scenario moves on to the next statement */
+        report_uncaught(interp);
+        interp->had_error = true;
+        interp->flow = FLOW_NORMAL;
+      } else if (interp->flow == FLOW_RETURN) {
+        /* A top-level yield concludes the program */
+        value_free(&interp->return_value);
+        interp->return_value = value_null();
+        break;
+      } else {
+        /* Stray break/continue outside of a cycle */
+        interp->flow = FLOW_NORMAL;
+      }
     }
+    report_summary(interp);
     return last;
   }
 
@@ -3066,49 +7429,234 @@ static Value eval_stmt(Interpreter *interp, ASTNode *node) {
   }
 }
 
+/* Record the active protocol for deviation traces */
+static bool call_stack_push(Interpreter *interp, const char *name) {
+  if (interp->call_depth >= KEIKAKU_MAX_CALL_DEPTH) {
+    char msg[256];
+    snprintf(msg, sizeof(msg),
+             "Call depth exceeded %d. The recursion never concludes.",
+             KEIKAKU_MAX_CALL_DEPTH);
+    runtime_error_kind(interp, "RecursionLimit", msg, interp->call_line);
+    return false;
+  }
+  if (interp->call_depth >= interp->call_capacity) {
+    interp->call_capacity =
+        interp->call_capacity == 0 ? 16 : interp->call_capacity * 2;
+    interp->call_stack = (CallFrame *)realloc(
+        interp->call_stack, sizeof(CallFrame) * interp->call_capacity);
+  }
+  interp->call_stack[interp->call_depth].name = name ? name : "<lambda>";
+  interp->call_stack[interp->call_depth].line = interp->call_line;
+  interp->call_depth++;
+  return true;
+}
+
+static Value call_function(Interpreter *interp, Function *func, Value self_val,
+                           int argc, Value *argv, bool owns_args);
+
+static Value invoke(Interpreter *interp, Function *func, Value self_val,
+                    int argc, Value *argv, bool owns_args);
+
+/* ============================================================================
+ * Baseline JIT
+ * ============================================================================
+ */
+
+/* The binding a name resolves to from a scope, without copying it */
+static EnvEntry *env_resolve(Environment *env, const char *name) {
+  for (; env; env = env->parent) {
+    EnvEntry *entry = env_find(env, name);
+    if (entry)
+      return entry;
+  }
+  return NULL;
+}
+
+/* Make a call in native code once its protocol is hot. Returns false if the
+ * interpreter has to make the call, either because the protocol cannot be
+ * compiled or because a guard failed; compiled code has no effects, so
+ * the interpreter can then start over. */
+static bool jit_try(Interpreter *interp, Function *func, Value self_val,
+                    int argc, Value *argv, Value *out) {
+  ASTNode *node = func->node;
+  if (func->is_lambda || func->is_sequence ||
+      VALUE_TYPE(self_val) != VAL_NULL ||
+      node->type != AST_PROTOCOL)
+    return false;
+
+  ASTJitState *state = &node->data.protocol.jit;
+  if (!state->code) {
+    if (state->rejected || ++state->calls < JIT_THRESHOLD)
+      return false;
+    state->code = jit_compile(interp->jit, node);
+    if (!state->code) {
+      state->rejected = true;
+      return false;
+    }
+  }
+
+  JitCode *code = state->code;
+  if ((size_t)argc != jit_param_count(code) || argc > JIT_MAX_PARAMS)
+    return false;
+  int64_t args[JIT_MAX_PARAMS];
+  for (int i = 0; i < argc; i++) {
+    if (VALUE_TYPE(argv[i]) != VAL_INT)
+      return false;
+    args[i] = VALUE_INT(argv[i]);
+  }
+
+  /* Native self calls skip name lookup, so the name must still mean this
+   * protocol, unmemoized */
+  if (jit_calls_self(code)) {
+    EnvEntry *entry = env_resolve(func->closure, node->data.protocol.name);
+    if (!entry || VALUE_TYPE(entry->value) != VAL_FUNCTION)
+      return false;
+    Function *bound = VALUE_FUNCTION(entry->value);
+    if (bound->node != node || bound->closure != func->closure || bound->memo)
+      return false;
+  }
+
+  size_t depth = interp->call_depth < KEIKAKU_MAX_CALL_DEPTH
+                     ? KEIKAKU_MAX_CALL_DEPTH - interp->call_depth
+                     : 0;
+  int64_t result;
+  if (!jit_run(code, args, depth, &result))
+    return false;
+  *out = jit_returns_bool(code) ? value_bool(result != 0) : value_int(result);
+  return true;
+}
+
+/* Answer a memoized call from its cache, or make it and remember the
+ * result. The key is copied first since the call may consume argv. */
+static Value invoke_memoized(Interpreter *interp, Function *func,
+                             Value self_val, int argc, Value *argv,
+                             bool owns_args) {
+  MemoCache *memo = func->memo;
+  uint64_t hash = memo_hash(argc, argv);
+  MemoEntry *hit = memo_find(memo, hash, argc, argv);
+  if (hit)
+    return value_copy(&hit->result);
+
+  Value *key = (Value *)malloc(sizeof(Value) * (argc > 0 ? argc : 1));
+  for (int i = 0; i < argc; i++) {
+    key[i] = value_copy(&argv[i]);
+  }
+
+  /* Keep the cache alive even if the call rebinds the protocol's name */
+  memo_retain(memo);
+  func->memo = NULL;
+  Value result = invoke(interp, func, self_val, argc, argv, owns_args);
+  func->memo = memo;
+
+  if (interp->flow == FLOW_ERROR) {
+    for (int i = 0; i < argc; i++) {
+      value_free(&key[i]);
+    }
+    free(key);
+  } else {
+    memo_store(memo, hash, argc, key, value_copy(&result));
+  }
+  memo_release(memo);
+  return result;
+}
+
+static Value invoke(Interpreter *interp, Function *func, Value self_val,
+                    int argc, Value *argv, bool owns_args) {
+  if (func->memo && interp->flow != FLOW_ERROR)
+    return invoke_memoized(interp, func, self_val, argc, argv, owns_args);
+  Value native;
+  if (interp->jit && interp->flow != FLOW_ERROR &&
+      jit_try(interp, func, self_val, argc, argv, &native))
+    return native;
+  if (interp->flow == FLOW_ERROR || !call_stack_push(interp, func->name)) {
+    return value_null();
+  }
+
+  /* Generator suspension frames belong to the caller's sequence only */
+  Generator *old_gen = interp->current_gen;
+  interp->current_gen = NULL;
+
+  Value result = call_function(interp, func, self_val, argc, argv, owns_args);
+
+  interp->current_gen = old_gen;
+  interp->call_depth--;
+  return result;
+}
+
 Value interpreter_call(Interpreter *interp, Function *func, Value self_val,
                        int argc, Value *argv) {
+  return invoke(interp, func, self_val, argc, argv, false);
+}
+
+/* Call with arguments the caller no longer needs: parameters take the
+ * values over and leave void behind, so nothing is copied */
+static Value call_owned(Interpreter *interp, Function *func, Value self_val,
+                        int argc, Value *argv) {
+  return invoke(interp, func, self_val, argc, argv, true);
+}
+
+/* Bind call arguments to parameters in the current scope. A rest parameter
+ * collects the remaining arguments into one list sized up front. */
+static void bind_parameters(Interpreter *interp, ASTParamArray *params,
+                            int argc, Value *argv, bool owns_args) {
+  for (size_t i = 0; i < params->count; i++) {
+    ASTNode *pattern = params->params[i].pattern;
+    if (params->params[i].is_rest) {
+      Value list = value_list_new();
+      if ((size_t)argc > i)
+        value_list_reserve(&list, (size_t)argc - i);
+      for (int j = (int)i; j < argc; j++) {
+        value_list_push(&list, owns_args ? argv[j] : value_copy(&argv[j]));
+        if (owns_args)
+          argv[j] = value_null();
+      }
+      assign_to_target(interp, pattern, list, true);
+      break;
+    }
+
+    if (i < (size_t)argc) {
+      assign_to_target(interp, pattern,
+                       owns_args ? argv[i] : value_copy(&argv[i]), true);
+      if (owns_args)
+        argv[i] = value_null();
+    } else if (params->params[i].default_value) {
+      Value def = eval_expr(interp, params->params[i].default_value);
+      assign_to_target(interp, pattern, def, true);
+    } else {
+      assign_to_target(interp, pattern, value_null(), true);
+    }
+  }
+}
+
+static Value call_function(Interpreter *interp, Function *func, Value self_val,
+                           int argc, Value *argv, bool owns_args) {
   Environment *call_env = env_create(func->closure);
+  call_env->function = func->node;
   Environment *old_env = interp->current_env;
   interp->current_env = call_env;
 
   /* Bind self if provided */
-  if (self_val.type != VAL_NULL) {
+  if (VALUE_TYPE(self_val) != VAL_NULL) {
     env_define(call_env, "self", value_copy(&self_val));
   }
 
   /* Handle lambda vs regular function */
   if (func->is_lambda) {
     /* Lambda: params and body are in lambda struct */
-    ASTParamArray *params = &func->node->data.lambda.params;
-    for (size_t i = 0; i < params->count; i++) {
-      if (params->params[i].is_rest) {
-        Value list = value_list_new();
-        for (int j = i; j < argc; j++) {
-          value_list_push(&list, value_copy(&argv[j]));
-        }
-        assign_to_target(interp, params->params[i].pattern, list, true);
-        value_free(&list);
-        break;
-      }
-
-      if (i < (size_t)argc) {
-        assign_to_target(interp, params->params[i].pattern, argv[i], true);
-      } else {
-        Value null_val = value_null();
-        assign_to_target(interp, params->params[i].pattern, null_val, true);
-      }
-    }
+    bind_parameters(interp, &func->node->data.lambda.params, argc, argv,
+                    owns_args);
 
     /* Lambda body - could be a single expression or a block */
     Value result;
     if (func->node->data.lambda.body->type == AST_BLOCK) {
       exec_block(interp, &func->node->data.lambda.body->data.block.statements);
       result = value_null();
-      if (interp->has_return) {
+      if (interp->flow == FLOW_RETURN) {
         result = interp->return_value;
         interp->return_value = value_null();
-        interp->has_return = false;
+      }
+      if (interp->flow != FLOW_ERROR) {
+        interp->flow = FLOW_NORMAL;
       }
     } else {
       result = eval_expr(interp, func->node->data.lambda.body);
@@ -3120,30 +7668,8 @@ Value interpreter_call(Interpreter *interp, Function *func, Value self_val,
   }
 
   /* Regular protocol function */
-  /* Bind parameters */
-  ASTParamArray *params = &func->node->data.protocol.params;
-  for (size_t i = 0; i < params->count; i++) {
-    if (params->params[i].is_rest) {
-      Value list = value_list_new();
-      for (int j = i; j < argc; j++) {
-        value_list_push(&list, value_copy(&argv[j]));
-      }
-      assign_to_target(interp, params->params[i].pattern, list, true);
-      value_free(&list);
-      break;
-    }
-
-    if (i < (size_t)argc) {
-      assign_to_target(interp, params->params[i].pattern, argv[i], true);
-    } else if (params->params[i].default_value) {
-      Value def = eval_expr(interp, params->params[i].default_value);
-      assign_to_target(interp, params->params[i].pattern, def, true);
-      value_free(&def);
-    } else {
-      Value null_val = value_null();
-      assign_to_target(interp, params->params[i].pattern, null_val, true);
-    }
-  }
+  bind_parameters(interp, &func->node->data.protocol.params, argc, argv,
+                  owns_args);
 
   if (func->is_sequence) {
     interp->current_env = old_env;
@@ -3154,10 +7680,12 @@ Value interpreter_call(Interpreter *interp, Function *func, Value self_val,
   exec_block(interp, &func->node->data.protocol.body);
 
   Value result = value_null();
-  if (interp->has_return) {
+  if (interp->flow == FLOW_RETURN) {
     result = interp->return_value;
     interp->return_value = value_null();
-    interp->has_return = false;
+  }
+  if (interp->flow != FLOW_ERROR) {
+    interp->flow = FLOW_NORMAL;
   }
 
   interp->current_env = old_env;
@@ -3166,12 +7694,29 @@ Value interpreter_call(Interpreter *interp, Function *func, Value self_val,
   return result;
 }
 
+/* Pull from a C-implemented sequence */
+static Value native_sequence_next(Interpreter *interp, Generator *gen) {
+  Value item = value_null();
+  if (gen->status == GEN_DONE || interp->flow == FLOW_ERROR)
+    return item;
+  if (!gen->native->next(gen->native->state, &item) ||
+      interp->flow == FLOW_ERROR) {
+    value_free(&item);
+    gen->status = GEN_DONE;
+  }
+  return item;
+}
+
 Value interpreter_gen_next(Interpreter *interp, Value gen_val) {
-  Generator *gen = gen_val.data.gen_val;
-  Function *func = gen->func_val.data.func_val;
+  Generator *gen = VALUE_GENERATOR(gen_val);
+  if (gen->native)
+    return native_sequence_next(interp, gen);
+  Function *func = VALUE_FUNCTION(gen->func_val);
   DEBUG_PRINT("interpreter_gen_next: starting for %s (status %d, stack %zu)\n",
               func->name, gen->status, gen->stack_count);
-  if (gen->status == GEN_DONE)
+  if (gen->status == GEN_DONE || interp->flow == FLOW_ERROR)
+    return value_null();
+  if (!call_stack_push(interp, func->name))
     return value_null();
 
   Environment *old_env = interp->current_env;
@@ -3193,22 +7738,40 @@ Value interpreter_gen_next(Interpreter *interp, Value gen_val) {
   gen->stack_count = 0;
   gen->stack_capacity = 0;
 
+  if (gen->has_thrown) {
+    /* disrupt(): the deviation surfaces where the sequence is suspended */
+    interp->pending_throw = gen->thrown_value;
+    gen->thrown_value = value_null();
+    gen->has_thrown = false;
+    if (!interp->is_resuming) {
+      interpreter_raise(interp, interp->pending_throw);
+      interp->pending_throw = value_null();
+    }
+  }
+
   DEBUG_PRINT("interpreter_gen_next: calling exec_block (resuming: %d)\n",
               interp->is_resuming);
-  exec_block(interp, &func->node->data.protocol.body);
-  DEBUG_PRINT("interpreter_gen_next: return from exec_block (has_return: %d, "
+  if (interp->flow != FLOW_ERROR) {
+    exec_block(interp, &func->node->data.protocol.body);
+  }
+  DEBUG_PRINT("interpreter_gen_next: return from exec_block (flow: %d, "
               "new stack: %zu)\n",
-              interp->has_return, gen->stack_count);
+              interp->flow, gen->stack_count);
 
   Value result = value_null();
-  if (interp->has_return) {
+  if (interp->flow == FLOW_RETURN) {
     result = interp->return_value;
     interp->return_value = value_null();
-    interp->has_return = false;
+    interp->flow = FLOW_NORMAL;
     gen->status = GEN_SUSPENDED;
   } else {
+    /* Finished, or a deviation escaped the sequence */
+    if (interp->flow != FLOW_ERROR) {
+      interp->flow = FLOW_NORMAL;
+    }
     gen->status = GEN_DONE;
   }
+  value_free(&interp->pending_throw);
 
   /* Clean up resume stack - consumed frames still need their internal values
    * freed */
@@ -3224,12 +7787,269 @@ Value interpreter_gen_next(Interpreter *interp, Value gen_val) {
   interp->is_resuming = old_resuming;
   interp->resume_stack = old_resume_stack;
   interp->resume_count = old_resume_count;
+  interp->call_depth--;
 
   return result;
 }
 
 Value interpreter_execute(Interpreter *interp, ASTNode *ast) {
-  interp->has_error = false;
-  interp->has_return = false;
+  interp->flow = FLOW_NORMAL;
+  interp->had_error = false;
+  interp->call_depth = 0;
+  value_free(&interp->exception);
   return eval_stmt(interp, ast);
 }
+
+/* ============================================================================
+ * Compiled Code - the runtime side of keikaku build, see interpreter.h
+ * ============================================================================
+ */
+
+CompiledLending compiled_lending(const Value *builtin) {
+  BuiltinFn fn = VALUE_BUILTIN(*builtin);
+  if (builtin_mutates_list(fn))
+    return LEND_MUTATE;
+  return builtin_inspects_first(fn) ? LEND_INSPECT : LEND_NONE;
+}
+
+Interpreter *compiled_start(int report_level) {
+  Interpreter *interp = interpreter_create();
+  if (interp)
+    interpreter_set_report_level(interp, (ReportLevel)report_level);
+  return interp;
+}
+
+int compiled_finish(Interpreter *interp) {
+  report_summary(interp);
+  int status = interpreter_has_error(interp) ? 1 : 0;
+  interpreter_destroy(interp);
+  return status;
+}
+
+/* As after each statement of a program: an uncaught deviation is reported
+ * and the program moves on */
+void compiled_statement_end(Interpreter *interp) {
+  if (interp->flow == FLOW_ERROR) {
+    report_uncaught(interp);
+    interp->had_error = true;
+    interp->flow = FLOW_NORMAL;
+  }
+}
+
+bool compiled_failed(const Interpreter *interp) {
+  return interp->flow == FLOW_ERROR;
+}
+
+void compiled_int(Value *out, int64_t val) { *out = value_int(val); }
+
+void compiled_float(Value *out, double val) { *out = value_float(val); }
+
+void compiled_bool(Value *out, bool val) { *out = value_bool(val); }
+
+void compiled_string(Value *out, const char *data, size_t length) {
+  *out = value_string_from(data, length);
+}
+
+void compiled_list(Value *out) { *out = value_list_new(); }
+
+void compiled_list_push(Value *list, Value *item) {
+  value_list_push(list, *item);
+  *item = value_null();
+}
+
+void compiled_free(Value *vals, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    value_free(&vals[i]);
+  }
+}
+
+void compiled_assign(Value *slot, Value *val) {
+  Value moved = *val;
+  *val = value_null();
+  value_free(slot);
+  *slot = moved;
+}
+
+bool compiled_truth(Value *val) {
+  bool truth = value_is_truthy(val);
+  value_free(val);
+  return truth;
+}
+
+static void unknown_variable(Interpreter *interp, const char *name, int line) {
+  char msg[256];
+  snprintf(msg, sizeof(msg),
+           "'%s' is unknown. Perhaps you intended to designate it first.",
+           name);
+  runtime_error_kind(interp, "UnknownName", msg, line);
+}
+
+void compiled_read(Interpreter *interp, Value *out, const Value *slot,
+                   const char *name, int line) {
+  if (slot)
+    *out = value_copy((Value *)slot);
+  else
+    unknown_variable(interp, name, line);
+}
+
+void compiled_unknown(Interpreter *interp, const char *name, int line) {
+  char msg[256];
+  snprintf(msg, sizeof(msg),
+           "'%s' is unknown. Perhaps you intended to define it first.", name);
+  runtime_error_kind(interp, "UnknownName", msg, line);
+}
+
+void compiled_binary(Interpreter *interp, Value *out, int op, Value *left,
+                     Value *right, int line) {
+  Value a = *left, b = *right;
+  *left = value_null();
+  *right = value_null();
+  if (is_comparison((BinaryOp)op)) {
+    bool result = compare_values((BinaryOp)op, &a, &b);
+    value_free(&a);
+    value_free(&b);
+    *out = value_bool(result);
+  } else {
+    *out = binary_values(interp, (BinaryOp)op, a, b, line);
+  }
+}
+
+void compiled_negate(Value *out, Value *operand) {
+  Value val = *operand;
+  *operand = value_null();
+  *out = negate_value(val);
+}
+
+/* Append val, formatted by spec (NULL for none), to the string text */
+void compiled_format(Interpreter *interp, Value *text, Value *val,
+                     const char *spec, int line) {
+  size_t length = value_string_length(text);
+  StringBuilder sb;
+  sb_init(&sb, length + 16);
+  sb_append(&sb, VALUE_STRING(*text), length);
+  bool ok =
+      format_value(interp, &sb, val, spec, spec ? strlen(spec) : 0, line);
+  value_free(val);
+  if (!ok) {
+    sb_discard(&sb);
+    return;
+  }
+  value_free(text);
+  *text = sb_finish(&sb);
+}
+
+void compiled_index(Interpreter *interp, Value *out, Value *container,
+                    Value *index, int line) {
+  Value object = *container, idx = *index;
+  *container = value_null();
+  *index = value_null();
+  *out = index_read(interp, &object, &idx, line);
+  value_free(&object);
+  value_free(&idx);
+}
+
+void compiled_index_at(Interpreter *interp, Value *out, const Value *slot,
+                       const char *name, Value *index, int line) {
+  Value idx = *index;
+  *index = value_null();
+  if (slot)
+    *out = index_read(interp, (Value *)slot, &idx, line);
+  else
+    unknown_variable(interp, name, line);
+  value_free(&idx);
+}
+
+bool compiled_builtin(Interpreter *interp, Value *out, const char *name) {
+  EnvEntry *entry = env_find(interp->global_env, name);
+  if (!entry || VALUE_TYPE(entry->value) != VAL_BUILTIN)
+    return false;
+  *out = entry->value;
+  return true;
+}
+
+/* The lending below follows eval_call */
+bool compiled_call_builtin(Interpreter *interp, Value *out,
+                           const Value *builtin, int argc, Value *argv,
+                           Value *lent, const char *lent_name, int use,
+                           int line) {
+  BuiltinFn fn = VALUE_BUILTIN(*builtin);
+  if (lent_name) {
+    if (!lent) {
+      unknown_variable(interp, lent_name, line);
+      return false;
+    }
+    if (VALUE_TYPE(*lent) == VAL_LIST || VALUE_TYPE(*lent) == VAL_SET) {
+      argv[0] = *lent;
+      *lent = value_null();
+    } else {
+      argv[0] = value_copy(lent);
+      lent = NULL;
+    }
+  }
+
+  interp->call_line = line;
+  Value result = fn(argc, argv);
+
+  bool home = false;
+  if (lent_name && lent) {
+    if (VALUE_TYPE(argv[0]) == VAL_NULL && builtin_returns_first(fn)) {
+      *lent = result;
+      result = value_null();
+      if (use == COMPILED_IN_PLACE)
+        home = true;
+      else if (use == COMPILED_KEPT)
+        result = value_copy(lent);
+    } else {
+      *lent = argv[0];
+      argv[0] = value_null();
+    }
+  }
+
+  compiled_free(argv, (size_t)argc);
+  if (use == COMPILED_UNUSED)
+    value_free(&result);
+  *out = result;
+  return home;
+}
+
+bool compiled_enter(Interpreter *interp, const char *name, int line) {
+  interp->call_line = line;
+  return call_stack_push(interp, name);
+}
+
+void compiled_leave(Interpreter *interp) { interp->call_depth--; }
+
+bool compiled_range(Interpreter *interp, GenFrame *range, Value *start,
+                    Value *end, Value *step, int line) {
+  Value vals[3] = {*start, *end, step ? *step : value_int(1)};
+  *start = value_null();
+  *end = value_null();
+  if (step)
+    *step = value_null();
+  return range_from_values(interp, vals, line, range);
+}
+
+/* The counting follows the AST_CYCLE_FROM_TO statement; index marks that a
+ * value has been produced */
+bool compiled_range_next(GenFrame *range, Value *slot) {
+  Value val;
+  if (range->is_float) {
+    double x = range->origin + (double)range->current * range->stride;
+    if (range->stride > 0 ? !(x < range->limit) : !(x > range->limit))
+      return false;
+    range->current++;
+    val = value_float(x);
+  } else {
+    if (range->index > 0 &&
+        !range_advance(&range->current, range->step, range->end))
+      return false;
+    if (range->step > 0 ? range->current >= range->end
+                        : range->current <= range->end)
+      return false;
+    range->index = 1;
+    val = value_int(range->current);
+  }
+  value_free(slot);
+  *slot = val;
+  return true;
+}
@@ -29,7 +29,9 @@ typedef enum {
   VAL_INSTANCE,  /* Class instance */
   VAL_CLASS,     /* Class definition */
   VAL_GENERATOR, /* Generator instance */
-  VAL_PROMISE    /* Promise for async operations */
+  VAL_PROMISE,   /* Promise for async operations */
+  VAL_ERROR,     /* Deviation (exception) value */
+  VAL_SET        /* Distinct values with hashed membership */
 } ValueType;
 
 /* Forward declarations */
@@ -37,12 +39,77 @@ struct Value;
 struct Environment;
 struct ValueList;
 struct ValueDict;
+struct ValueSet;
 struct Function;
+struct MemoCache;
 
 /* Builtin function - forward declare Value* signature */
 typedef struct Value (*BuiltinFn)(int argc, struct Value *argv);
 
-/* Value structure - define first */
+/* Value structure - define first. Code reads values only through the
+ * VALUE_* accessors below and builds them with the value_* constructors,
+ * so the representation can change at build time. */
+#ifdef KEIKAKU_NAN_BOXING
+
+/* 8 bytes instead of 16. Floats are stored as their IEEE bits XORed with
+ * NANBOX_XOR; every other kind lives in the quiet NaN space no float takes
+ * (NaNs are canonicalized), which after the XOR is simply every bit pattern
+ * below 2^51: a 4-bit tag (the ValueType) above a 47-bit payload holding a
+ * pointer, a bool or a small int. The XOR makes all-zero bits void, as in
+ * the struct representation, so zeroed memory still reads as void. Ints
+ * outside the payload are boxed, see value_int. */
+typedef struct Value {
+  uint64_t bits;
+} Value;
+
+#define NANBOX_XOR UINT64_C(0xFFF8000000000000)
+#define NANBOX_FLOAT_MIN (UINT64_C(1) << 51)
+#define NANBOX_TAG_SHIFT 47
+#define NANBOX_PAYLOAD ((UINT64_C(1) << NANBOX_TAG_SHIFT) - 1)
+#define NANBOX_BIG_INT 15 /* Tag of a boxed int; reads as VAL_INT */
+
+static inline ValueType value_type_of(Value v) {
+  if (v.bits >= NANBOX_FLOAT_MIN)
+    return VAL_FLOAT;
+  unsigned tag = (unsigned)(v.bits >> NANBOX_TAG_SHIFT);
+  return tag == NANBOX_BIG_INT ? VAL_INT : (ValueType)tag;
+}
+
+static inline int64_t value_int_of(Value v) {
+  if ((v.bits >> NANBOX_TAG_SHIFT) == NANBOX_BIG_INT)
+    return *(const int64_t *)(uintptr_t)(v.bits & NANBOX_PAYLOAD);
+  return (int64_t)(v.bits << (64 - NANBOX_TAG_SHIFT)) >>
+         (64 - NANBOX_TAG_SHIFT);
+}
+
+static inline double value_float_of(Value v) {
+  union {
+    uint64_t bits;
+    double d;
+  } f = {v.bits ^ NANBOX_XOR};
+  return f.d;
+}
+
+#define NANBOX_POINTER(v) ((void *)(uintptr_t)((v).bits & NANBOX_PAYLOAD))
+
+#define VALUE_TYPE(v) value_type_of(v)
+#define VALUE_BOOL(v) ((bool)((v).bits & 1))
+#define VALUE_INT(v) value_int_of(v)
+#define VALUE_FLOAT(v) value_float_of(v)
+#define VALUE_STRING(v) ((char *)NANBOX_POINTER(v))
+#define VALUE_LIST(v) ((struct ValueList *)NANBOX_POINTER(v))
+#define VALUE_DICT(v) ((struct ValueDict *)NANBOX_POINTER(v))
+#define VALUE_SET(v) ((struct ValueSet *)NANBOX_POINTER(v))
+#define VALUE_FUNCTION(v) ((struct Function *)NANBOX_POINTER(v))
+#define VALUE_BUILTIN(v) ((BuiltinFn)(uintptr_t)((v).bits & NANBOX_PAYLOAD))
+#define VALUE_CLASS(v) ((struct KeikakuClass *)NANBOX_POINTER(v))
+#define VALUE_INSTANCE(v) ((struct KeikakuInstance *)NANBOX_POINTER(v))
+#define VALUE_GENERATOR(v) ((struct Generator *)NANBOX_POINTER(v))
+#define VALUE_PROMISE(v) ((struct Promise *)NANBOX_POINTER(v))
+#define VALUE_ERROR(v) ((struct KeikakuError *)NANBOX_POINTER(v))
+
+#else
+
 typedef struct Value {
   ValueType type;
   union {
@@ -52,15 +119,35 @@ typedef struct Value {
     char *string_val;
     struct ValueList *list_val;
     struct ValueDict *dict_val;
+    struct ValueSet *set_val;
     struct Function *func_val;
     BuiltinFn builtin_val;
     struct KeikakuClass *class_val;
     struct KeikakuInstance *instance_val;
     struct Generator *gen_val;
     struct Promise *promise_val;
+    struct KeikakuError *error_val;
   } data;
 } Value;
 
+#define VALUE_TYPE(v) ((v).type)
+#define VALUE_BOOL(v) ((v).data.bool_val)
+#define VALUE_INT(v) ((v).data.int_val)
+#define VALUE_FLOAT(v) ((v).data.float_val)
+#define VALUE_STRING(v) ((v).data.string_val)
+#define VALUE_LIST(v) ((v).data.list_val)
+#define VALUE_DICT(v) ((v).data.dict_val)
+#define VALUE_SET(v) ((v).data.set_val)
+#define VALUE_FUNCTION(v) ((v).data.func_val)
+#define VALUE_BUILTIN(v) ((v).data.builtin_val)
+#define VALUE_CLASS(v) ((v).data.class_val)
+#define VALUE_INSTANCE(v) ((v).data.instance_val)
+#define VALUE_GENERATOR(v) ((v).data.gen_val)
+#define VALUE_PROMISE(v) ((v).data.promise_val)
+#define VALUE_ERROR(v) ((v).data.error_val)
+
+#endif /* KEIKAKU_NAN_BOXING */
+
 /* List structure */
 typedef struct ValueList {
   Value *items;
@@ -80,13 +167,27 @@ typedef struct ValueDict {
   size_t capacity;
 } ValueDict;
 
+/* Set of distinct values, iterated in insertion order. slots is an open
+ * addressing index over items: 0 marks an empty slot, otherwise the item's
+ * position plus one. */
+typedef struct ValueSet {
+  Value *items;
+  uint64_t *hashes; /* value_hash of each item */
+  size_t count;
+  size_t capacity;
+  size_t *slots;
+  size_t slot_mask; /* slot_mask + 1 slots, a power of two */
+} ValueSet;
+
 /* Function structure */
 typedef struct Function {
   char *name;
   ASTNode *node; /* Protocol node */
   struct Environment *closure;
-  bool is_lambda;   /* True if this is a lambda function */
-  bool is_sequence; /* True if this is a sequence (generator) */
+  bool is_lambda;    /* True if this is a lambda function */
+  bool is_sequence;  /* True if this is a sequence (generator) */
+  bool owns_closure; /* closure holds captured variables, shared by copies */
+  struct MemoCache *memo; /* Results by arguments, shared by copies */
 } Function;
 
 /* Class structure */
@@ -97,6 +198,15 @@ typedef struct KeikakuClass {
   ASTNode *definition;         /* Original AST node */
 } KeikakuClass;
 
+/* Deviation (exception) structure */
+typedef struct KeikakuError {
+  char *kind;         /* Category, e.g. "UnknownName" */
+  char *message;      /* Human readable description */
+  int line;           /* Line where the deviation was raised */
+  char **trace;       /* Protocol frames, innermost first */
+  size_t trace_count;
+} KeikakuError;
+
 /* Instance structure */
 typedef struct KeikakuInstance {
   KeikakuClass *class_def;    /* Reference to class */
@@ -112,13 +222,28 @@ typedef struct EnvEntry {
   char *name;
   Value value;
   bool is_override;
+  struct Upvalue *upvalue; /* Set on a closure's captured variables */
   struct EnvEntry *next;
 } EnvEntry;
 
+/* A variable captured by a closure. While the scope that defines it is
+ * alive the closure's entry refers to the live variable; when that scope is
+ * destroyed the value moves into the closure's own entry. */
+typedef struct Upvalue {
+  EnvEntry *target;               /* Live variable, NULL once closed */
+  struct Environment *target_env; /* Scope holding target */
+  EnvEntry *entry;                /* The closure's entry */
+  struct Environment *home;       /* The closure's scope */
+  struct Upvalue *next;           /* Next open upvalue into target_env */
+} Upvalue;
+
 typedef struct Environment {
   EnvEntry *entries;
   struct Environment *parent;
   struct Environment *global; /* For override */
+  Upvalue *captures;          /* Open upvalues referring into this scope */
+  size_t refcount;            /* Functions sharing a closure scope */
+  ASTNode *function;          /* Protocol or lambda a call scope runs */
 } Environment;
 
 /* ============================================================================
@@ -140,13 +265,27 @@ typedef struct GenFrame {
   GenFrameType type;
   size_t index;    /* Current instruction index in block */
   Value iterable;  /* For THROUGH */
-  int64_t current; /* For FROM_TO */
+  int64_t current; /* For FROM_TO: loop value, or step count over floats */
   int64_t end;     /* For FROM_TO */
-  ASTNode *node;   /* Reference to the AST node (Block or Cycle) */
+  int64_t step;    /* For FROM_TO */
+  bool is_float;   /* For FROM_TO: value is origin + current * stride */
+  double origin, stride, limit;
+  ASTNode *node; /* Reference to the AST node (Block or Cycle) */
 } GenFrame;
 
+/* Sequence produced by C code rather than a protocol, e.g. a file reader.
+ * Copies of the sequence value share one source, like a file handle. */
+typedef struct NativeSequence {
+  const char *name;
+  size_t refcount;
+  void *state;
+  bool (*next)(void *state, Value *out); /* false once exhausted */
+  void (*destroy)(void *state);
+} NativeSequence;
+
 typedef struct Generator {
   Value func_val;
+  NativeSequence *native; /* Set instead of func_val for native sequences */
   struct Environment *env;
   Value self_val;
   GenStatus status;
@@ -186,23 +325,48 @@ typedef struct Promise {
  * ============================================================================
  */
 
+/* Control flow status - a single word checked after every statement */
+typedef enum {
+  FLOW_NORMAL = 0,
+  FLOW_RETURN,
+  FLOW_BREAK,
+  FLOW_CONTINUE,
+  FLOW_ERROR /* A deviation is unwinding; see Interpreter.exception */
+} ControlFlow;
+
+/* How uncaught deviations are reported */
+typedef enum {
+  REPORT_QUIET,  /* One line per deviation */
+  REPORT_NORMAL, /* Voice banners, deduplicated and rate-limited */
+  REPORT_VERBOSE /* Banners with kind and trace, plus recoveries */
+} ReportLevel;
+
+/* Active protocol call, recorded for deviation traces */
+typedef struct CallFrame {
+  const char *name;
+  int line; /* Line of the call site */
+} CallFrame;
+
 typedef struct Interpreter {
   Environment *global_env;
   Environment *current_env;
+  uint32_t serial; /* Tells apart interpreters running the same AST */
 
   /* Return value from yield */
   Value return_value;
-  bool has_return;
-  bool has_break;
-  bool has_continue;
+  ControlFlow flow;
 
-  /* Error handling */
-  bool has_error;
-  char error_buffer[1024];
+  /* Error handling - the in-flight (or last uncaught) deviation */
+  Value exception;
+  bool had_error;      /* An uncaught deviation reached the top level */
+  Value pending_throw; /* Injected by disrupt(), raised once resumed */
 
-  /* Error tracking for repeated errors */
+  /* Error reporting - repeated deviations are deduplicated */
+  ReportLevel report_level;
   char last_error[256];
   int error_repeat_count;
+  size_t errors_reported;
+  size_t errors_suppressed;
 
   /* Preview mode */
   bool preview_mode;
@@ -215,6 +379,18 @@ typedef struct Interpreter {
   bool is_resuming;
   GenFrame *resume_stack;
   size_t resume_count;
+
+  /* Protocol call stack */
+  CallFrame *call_stack;
+  size_t call_depth;
+  size_t call_capacity;
+  int call_line; /* Call site line for the next interpreter_call */
+  bool result_unused; /* The next call is a statement whose value is dropped */
+  const char *result_target; /* Variable the next call's value is assigned to */
+  bool result_in_place; /* That call left its value in the variable already */
+
+  /* Baseline JIT for hot protocols, NULL unless enabled */
+  struct Jit *jit;
 } Interpreter;
 
 /* ============================================================================
@@ -227,26 +403,46 @@ Value value_bool(bool val);
 Value value_int(int64_t val);
 Value value_float(double val);
 Value value_string(const char *val);
+Value value_string_from(const char *data, size_t length);
+Value value_string_alloc(size_t length);
 Value value_list_new(void);
 Value value_dict_new(void);
+Value value_set_new(void);
 Value value_function(ASTNode *node, Environment *closure);
 Value value_generator_new(Function *func, Environment *env, Value self_val);
+Value value_native_sequence(const char *name, void *state,
+                            bool (*next)(void *state, Value *out),
+                            void (*destroy)(void *state));
 Value value_builtin(BuiltinFn fn);
+Value value_wrap(ValueType type, void *object); /* Heap-allocated kinds */
+Value value_error_new(const char *kind, const char *message, int line);
 
 void value_free(Value *val);
 Value value_copy(Value *val);
 char *value_to_string(Value *val);
 const char *value_type_name(ValueType type);
 bool value_is_truthy(Value *val);
+size_t value_string_length(const Value *val);
+size_t value_string_codepoints(const Value *val);
+size_t value_string_offset(const Value *val, size_t codepoint);
 bool value_equals(Value *a, Value *b);
+uint64_t value_hash(Value *val);
+int value_compare(Value *a, Value *b);
 
 /* List operations */
 void value_list_push(Value *list, Value item);
+void value_list_reserve(Value *list, size_t capacity);
 Value value_list_get(Value *list, int64_t index);
 
 /* Dict operations */
 void value_dict_set(Value *dict, const char *key, Value val);
 Value value_dict_get(Value *dict, const char *key);
+Value *value_dict_slot(Value *dict, const char *key); /* NULL if absent */
+
+/* Set operations */
+void value_set_reserve(Value *set, size_t capacity);
+bool value_set_add(Value *set, Value item); /* false if already present */
+bool value_set_contains(Value *set, Value *item);
 
 /* ============================================================================
  * Environment Functions
@@ -276,9 +472,86 @@ Value interpreter_call(Interpreter *interp, Function *func, Value self_val,
 Value interpreter_gen_next(Interpreter *interp, Value gen_val);
 
 /* Error handling */
+void interpreter_raise(Interpreter *interp, Value error);
+void interpreter_set_report_level(Interpreter *interp, ReportLevel level);
+void interpreter_enable_jit(Interpreter *interp);
 bool interpreter_has_error(const Interpreter *interp);
 const char *interpreter_get_error(const Interpreter *interp);
 
+/* ============================================================================
+ * Compiled Code
+ * ============================================================================
+ * The runtime side of programs translated to C by keikaku build (see
+ * translate.h). Translated code holds values in storage the size of a Value
+ * and hands them over by address only. Operands are consumed, leaving them
+ * void, and results are written to out, which may be one of the operands.
+ * Anything that can raise leaves the deviation in flight for the caller to
+ * test with compiled_failed.
+ */
+
+/* What the code calling a built-in does with its result */
+typedef enum {
+  COMPILED_UNUSED,  /* Dropped */
+  COMPILED_KEPT,    /* Kept */
+  COMPILED_IN_PLACE /* Assigned back to the variable lent to the built-in */
+} CompiledUse;
+
+/* How a built-in treats a variable passed as its first argument: not at
+ * all, lent to look into (a variable only) or lent to change (any place) */
+typedef enum { LEND_NONE, LEND_INSPECT, LEND_MUTATE } CompiledLending;
+
+CompiledLending compiled_lending(const Value *builtin);
+
+Interpreter *compiled_start(int report_level);
+int compiled_finish(Interpreter *interp); /* Returns the exit status */
+void compiled_statement_end(Interpreter *interp);
+bool compiled_failed(const Interpreter *interp);
+
+void compiled_int(Value *out, int64_t val);
+void compiled_float(Value *out, double val);
+void compiled_bool(Value *out, bool val);
+void compiled_string(Value *out, const char *data, size_t length);
+void compiled_list(Value *out);
+void compiled_list_push(Value *list, Value *item);
+void compiled_free(Value *vals, size_t count);
+void compiled_assign(Value *slot, Value *val);
+bool compiled_truth(Value *val);
+
+/* A NULL slot is a name nothing is bound to */
+void compiled_read(Interpreter *interp, Value *out, const Value *slot,
+                   const char *name, int line);
+void compiled_unknown(Interpreter *interp, const char *name, int line);
+
+void compiled_binary(Interpreter *interp, Value *out, int op, Value *left,
+                     Value *right, int line);
+void compiled_negate(Value *out, Value *operand);
+void compiled_format(Interpreter *interp, Value *text, Value *val,
+                     const char *spec, int line);
+void compiled_index(Interpreter *interp, Value *out, Value *container,
+                    Value *index, int line);
+void compiled_index_at(Interpreter *interp, Value *out, const Value *slot,
+                       const char *name, Value *index, int line);
+
+/* Copy the built-in bound to name into out. Returns false if there is none. */
+bool compiled_builtin(Interpreter *interp, Value *out, const char *name);
+
+/* Call a built-in over argv. The first argument may instead be lent from
+ * the variable at lent, named lent_name. Returns true if the result was
+ * left in that variable (COMPILED_IN_PLACE only). */
+bool compiled_call_builtin(Interpreter *interp, Value *out,
+                           const Value *builtin, int argc, Value *argv,
+                           Value *lent, const char *lent_name, int use,
+                           int line);
+
+/* Record a protocol call for traces and the depth limit */
+bool compiled_enter(Interpreter *interp, const char *name, int line);
+void compiled_leave(Interpreter *interp);
+
+/* A counted cycle. step may be NULL; next stores each value in slot. */
+bool compiled_range(Interpreter *interp, GenFrame *range, Value *start,
+                    Value *end, Value *step, int line);
+bool compiled_range_next(GenFrame *range, Value *slot);
+
 /* ============================================================================
  * Voice Messages (Personality)
  * ============================================================================
@@ -297,5 +570,9 @@ void voice_print_anomaly_enter(void);
 void voice_print_anomaly_exit(void);
 void voice_print_error(const char *msg, int line);
 void voice_print_runtime_error(const char *msg, int line);
+void voice_print_runtime_error_tracked(const char *msg, int line,
+                                       int repeat_count);
+void voice_print_deviation_brief(const char *kind, const char *msg, int line);
+void voice_print_deviations_suppressed(size_t count);
 
 #endif /* KEIKAKU_INTERPRETER_H */
@@ -0,0 +1,729 @@
+/*
+ * Keikaku Programming Language - Baseline JIT
+ *
+ * "The calculation was completed before you asked."
+ *
+ * Native frame layout: the caller pushes arguments left to right, so
+ * parameter i lives at [rbp + 16 + 8 * (params - 1 - i)], and locals live
+ * below rbp. Every expression leaves its value in rax and keeps
+ * temporaries on the machine stack. Across the whole native call r13 holds
+ * the stack pointer to restore when bailing out, and r14 counts the calls
+ * still allowed before the interpreter's depth limit.
+ */
+
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+
+#include "jit.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_NATIVE 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define JIT_NATIVE 0
+#endif
+
+/* Integers handled natively stay within [-2^52, 2^52), where the
+ * interpreter's double-based arithmetic is exact, so both agree */
+#define JIT_INT_LIMIT ((int64_t)1 << 52)
+
+typedef int (*JitEntry)(const int64_t *args, int64_t *result, int64_t depth);
+
+struct JitCode {
+  void *memory;
+  size_t size;
+  JitEntry entry;
+  size_t param_count;
+  bool returns_bool;
+  bool calls_self;
+  struct JitCode *next;
+};
+
+struct Jit {
+  JitCode *codes;
+};
+
+/* ============================================================================
+ * Code Buffer
+ * ============================================================================
+ */
+
+typedef enum { KIND_NONE, KIND_INT, KIND_BOOL } JitKind;
+
+typedef struct {
+  const char *name;
+  JitKind kind;
+  bool defined; /* Assigned on every path reaching the current point */
+} JitSlot;
+
+typedef struct {
+  uint8_t *code;
+  size_t length;
+  size_t capacity;
+
+  ASTNode *protocol;
+  JitSlot *slots; /* Parameters first, then locals */
+  size_t slot_count;
+  size_t slot_capacity;
+  size_t param_count;
+
+  size_t *bails; /* rel32 fields that jump to the bail-out stub */
+  size_t bail_count;
+  size_t bail_capacity;
+
+  JitKind result;    /* Kind every yield produces */
+  JitKind call_kind; /* Kind assumed for calls of the protocol itself */
+  bool calls_self;
+  bool ok;
+} JitBuilder;
+
+static void emit(JitBuilder *b, const uint8_t *bytes, size_t count) {
+  if (b->length + count > b->capacity) {
+    while (b->length + count > b->capacity) {
+      b->capacity = b->capacity == 0 ? 256 : b->capacity * 2;
+    }
+    b->code = (uint8_t *)realloc(b->code, b->capacity);
+  }
+  memcpy(b->code + b->length, bytes, count);
+  b->length += count;
+}
+
+#define EMIT(b, ...)                                                           \
+  do {                                                                         \
+    const uint8_t bytes_[] = {__VA_ARGS__};                                    \
+    emit(b, bytes_, sizeof(bytes_));                                           \
+  } while (0)
+
+static void emit32(JitBuilder *b, int32_t value) {
+  emit(b, (const uint8_t *)&value, 4);
+}
+
+static void emit64(JitBuilder *b, int64_t value) {
+  emit(b, (const uint8_t *)&value, 8);
+}
+
+/* A rel32 field to fill in once its target is known */
+static size_t emit_rel32(JitBuilder *b) {
+  size_t at = b->length;
+  emit32(b, 0);
+  return at;
+}
+
+static void patch_rel32(JitBuilder *b, size_t at, size_t target) {
+  int32_t rel = (int32_t)((int64_t)target - (int64_t)(at + 4));
+  memcpy(b->code + at, &rel, 4);
+}
+
+static void add_bail(JitBuilder *b, size_t at) {
+  if (b->bail_count >= b->bail_capacity) {
+    b->bail_capacity = b->bail_capacity == 0 ? 16 : b->bail_capacity * 2;
+    b->bails = (size_t *)realloc(b->bails, sizeof(size_t) * b->bail_capacity);
+  }
+  b->bails[b->bail_count++] = at;
+}
+
+#define CC_O 0x80
+#define CC_Z 0x84
+#define CC_NZ 0x85
+
+/* jcc bail */
+static void emit_bail_if(JitBuilder *b, uint8_t cc) {
+  EMIT(b, 0x0F, cc);
+  add_bail(b, emit_rel32(b));
+}
+
+/* Bail out unless rax is within the exact integer range */
+static void emit_range_check(JitBuilder *b) {
+  EMIT(b, 0x48, 0xBA); /* mov rdx, 2^52 */
+  emit64(b, JIT_INT_LIMIT);
+  EMIT(b, 0x48, 0x01, 0xC2);       /* add rdx, rax */
+  EMIT(b, 0x48, 0xC1, 0xEA, 53);   /* shr rdx, 53 */
+  emit_bail_if(b, CC_NZ);
+}
+
+/* rax = 1 if rax is truthy, else 0 */
+static void emit_truth(JitBuilder *b, JitKind kind) {
+  if (kind == KIND_BOOL)
+    return;
+  EMIT(b, 0x48, 0x85, 0xC0); /* test rax, rax */
+  EMIT(b, 0x0F, 0x95, 0xC0); /* setne al */
+  EMIT(b, 0x0F, 0xB6, 0xC0); /* movzx eax, al */
+}
+
+static void emit_return(JitBuilder *b) {
+  EMIT(b, 0x48, 0x89, 0xEC); /* mov rsp, rbp */
+  EMIT(b, 0x5D);             /* pop rbp */
+  EMIT(b, 0x49, 0xFF, 0xC6); /* inc r14 */
+  EMIT(b, 0xC3);             /* ret */
+}
+
+/* ============================================================================
+ * Slots
+ * ============================================================================
+ */
+
+static JitSlot *find_slot(JitBuilder *b, const char *name) {
+  for (size_t i = 0; i < b->slot_count; i++) {
+    if (strcmp(b->slots[i].name, name) == 0)
+      return &b->slots[i];
+  }
+  return NULL;
+}
+
+static JitSlot *add_slot(JitBuilder *b, const char *name) {
+  if (b->slot_count >= b->slot_capacity) {
+    b->slot_capacity = b->slot_capacity == 0 ? 8 : b->slot_capacity * 2;
+    b->slots =
+        (JitSlot *)realloc(b->slots, sizeof(JitSlot) * b->slot_capacity);
+  }
+  JitSlot *slot = &b->slots[b->slot_count++];
+  slot->name = name;
+  slot->kind = KIND_NONE;
+  slot->defined = false;
+  return slot;
+}
+
+static int32_t slot_offset(JitBuilder *b, JitSlot *slot) {
+  size_t i = (size_t)(slot - b->slots);
+  if (i < b->param_count)
+    return (int32_t)(16 + 8 * (b->param_count - 1 - i));
+  return (int32_t)(-8 * (int64_t)(i - b->param_count + 1));
+}
+
+/* Which slots are assigned, to restore after a branch: an assignment made
+ * on only some paths does not count afterwards */
+static bool *save_defined(JitBuilder *b) {
+  bool *saved = (bool *)malloc(sizeof(bool) * (b->slot_count + 1));
+  for (size_t i = 0; i < b->slot_count; i++) {
+    saved[i] = b->slots[i].defined;
+  }
+  return saved;
+}
+
+static void restore_defined(JitBuilder *b, bool *saved, size_t count) {
+  for (size_t i = 0; i < b->slot_count; i++) {
+    b->slots[i].defined = i < count && saved[i];
+  }
+}
+
+/* ============================================================================
+ * Expressions
+ * ============================================================================
+ */
+
+static JitKind compile_expr(JitBuilder *b, ASTNode *node);
+
+static JitKind fail(JitBuilder *b) {
+  b->ok = false;
+  return KIND_NONE;
+}
+
+static bool is_self_call(JitBuilder *b, ASTNode *node) {
+  const char *name = b->protocol->data.protocol.name;
+  return name && strcmp(node->data.call.name, name) == 0 &&
+         !find_slot(b, name);
+}
+
+static JitKind compile_call(JitBuilder *b, ASTNode *node) {
+  if (!is_self_call(b, node) || node->data.call.args.count != b->param_count)
+    return fail(b);
+
+  for (size_t i = 0; i < node->data.call.args.count; i++) {
+    ASTNode *arg = node->data.call.args.nodes[i];
+    if (arg->type == AST_SPREAD || compile_expr(b, arg) != KIND_INT)
+      return fail(b);
+    EMIT(b, 0x50); /* push rax */
+  }
+  EMIT(b, 0xE8); /* call body */
+  patch_rel32(b, emit_rel32(b), 0);
+  if (b->param_count > 0) {
+    EMIT(b, 0x48, 0x81, 0xC4); /* add rsp, args */
+    emit32(b, (int32_t)(8 * b->param_count));
+  }
+  b->calls_self = true;
+  return b->call_kind;
+}
+
+static JitKind compile_logical(JitBuilder *b, ASTNode *node) {
+  JitKind left = compile_expr(b, node->data.binary.left);
+  if (left == KIND_NONE)
+    return fail(b);
+  emit_truth(b, left);
+
+  /* and stops at a false left side, or at a true one */
+  EMIT(b, 0x48, 0x85, 0xC0); /* test rax, rax */
+  EMIT(b, 0x0F, node->data.binary.op == OP_AND ? CC_Z : CC_NZ);
+  size_t skip = emit_rel32(b);
+
+  JitKind right = compile_expr(b, node->data.binary.right);
+  if (right == KIND_NONE)
+    return fail(b);
+  emit_truth(b, right);
+  patch_rel32(b, skip, b->length);
+  return KIND_BOOL;
+}
+
+static JitKind compile_binary(JitBuilder *b, ASTNode *node) {
+  BinaryOp op = node->data.binary.op;
+  if (op == OP_AND || op == OP_OR)
+    return compile_logical(b, node);
+
+  JitKind left = compile_expr(b, node->data.binary.left);
+  EMIT(b, 0x50); /* push rax */
+  JitKind right = compile_expr(b, node->data.binary.right);
+  EMIT(b, 0x48, 0x89, 0xC1); /* mov rcx, rax */
+  EMIT(b, 0x58);             /* pop rax */
+  if (!b->ok || left == KIND_NONE || left != right)
+    return fail(b);
+
+  uint8_t setcc = 0;
+  switch (op) {
+  case OP_EQ:
+    setcc = 0x94;
+    break;
+  case OP_NE:
+    setcc = 0x95;
+    break;
+  case OP_LT:
+    setcc = 0x9C;
+    break;
+  case OP_LE:
+    setcc = 0x9E;
+    break;
+  case OP_GT:
+    setcc = 0x9F;
+    break;
+  case OP_GE:
+    setcc = 0x9D;
+    break;
+  default:
+    break;
+  }
+  if (setcc) {
+    if (left != KIND_INT && op != OP_EQ && op != OP_NE)
+      return fail(b);
+    EMIT(b, 0x48, 0x39, 0xC8);   /* cmp rax, rcx */
+    EMIT(b, 0x0F, setcc, 0xC0); /* setcc al */
+    EMIT(b, 0x0F, 0xB6, 0xC0);   /* movzx eax, al */
+    return KIND_BOOL;
+  }
+
+  if (left != KIND_INT)
+    return fail(b);
+
+  switch (op) {
+  case OP_ADD:
+    EMIT(b, 0x48, 0x01, 0xC8); /* add rax, rcx */
+    break;
+  case OP_SUB:
+    EMIT(b, 0x48, 0x29, 0xC8); /* sub rax, rcx */
+    break;
+  case OP_MUL:
+    EMIT(b, 0x48, 0x0F, 0xAF, 0xC1); /* imul rax, rcx */
+    emit_bail_if(b, CC_O);
+    break;
+  case OP_INT_DIV:
+  case OP_MOD:
+    /* The interpreter reports division by zero */
+    EMIT(b, 0x48, 0x85, 0xC9); /* test rcx, rcx */
+    emit_bail_if(b, CC_Z);
+    EMIT(b, 0x48, 0x99);       /* cqo */
+    EMIT(b, 0x48, 0xF7, 0xF9); /* idiv rcx */
+    if (op == OP_MOD)
+      EMIT(b, 0x48, 0x89, 0xD0); /* mov rax, rdx */
+    return KIND_INT;
+  default:
+    /* / and ** produce floats */
+    return fail(b);
+  }
+  emit_range_check(b);
+  return KIND_INT;
+}
+
+static JitKind compile_expr(JitBuilder *b, ASTNode *node) {
+  if (!b->ok)
+    return KIND_NONE;
+
+  switch (node->type) {
+  case AST_INTEGER:
+    if (node->data.int_value < -JIT_INT_LIMIT ||
+        node->data.int_value >= JIT_INT_LIMIT)
+      return fail(b);
+    EMIT(b, 0x48, 0xB8); /* mov rax, imm64 */
+    emit64(b, node->data.int_value);
+    return KIND_INT;
+
+  case AST_BOOL:
+    EMIT(b, 0xB8); /* mov eax, imm32 */
+    emit32(b, node->data.bool_value ? 1 : 0);
+    return KIND_BOOL;
+
+  case AST_IDENTIFIER: {
+    JitSlot *slot = find_slot(b, node->data.identifier.name);
+    if (!slot || !slot->defined)
+      return fail(b);
+    EMIT(b, 0x48, 0x8B, 0x85); /* mov rax, [rbp + offset] */
+    emit32(b, slot_offset(b, slot));
+    return slot->kind;
+  }
+
+  case AST_UNARY_OP: {
+    JitKind kind = compile_expr(b, node->data.unary.operand);
+    if (kind == KIND_NONE)
+      return fail(b);
+    if (node->data.unary.op == OP_NOT) {
+      emit_truth(b, kind);
+      EMIT(b, 0x83, 0xF0, 0x01); /* xor eax, 1 */
+      return KIND_BOOL;
+    }
+    if (kind != KIND_INT)
+      return fail(b);
+    EMIT(b, 0x48, 0xF7, 0xD8); /* neg rax */
+    emit_range_check(b);
+    return KIND_INT;
+  }
+
+  case AST_BINARY_OP:
+    return compile_binary(b, node);
+
+  case AST_CALL:
+    return compile_call(b, node);
+
+  default:
+    return fail(b);
+  }
+}
+
+/* ============================================================================
+ * Statements
+ * ============================================================================
+ */
+
+static void compile_block(JitBuilder *b, ASTNodeArray *stmts);
+
+/* Branch past the next block when the condition in rax is false */
+static size_t compile_test(JitBuilder *b, ASTNode *condition) {
+  JitKind kind = compile_expr(b, condition);
+  if (kind == KIND_NONE)
+    fail(b);
+  EMIT(b, 0x48, 0x85, 0xC0); /* test rax, rax */
+  EMIT(b, 0x0F, CC_Z);
+  return emit_rel32(b);
+}
+
+/* A block of a conditional, after which only assignments made on every
+ * path count, which is approximated by the ones made before it */
+static void compile_branch(JitBuilder *b, ASTNodeArray *body) {
+  size_t count = b->slot_count;
+  bool *saved = save_defined(b);
+  compile_block(b, body);
+  restore_defined(b, saved, count);
+  free(saved);
+}
+
+static void compile_assign(JitBuilder *b, ASTNode *node) {
+  ASTNode *target = node->data.assign.target;
+  if (target->type != AST_IDENTIFIER) {
+    fail(b);
+    return;
+  }
+
+  const char *name = target->data.identifier.name;
+  const char *self = b->protocol->data.protocol.name;
+  if (self && strcmp(name, self) == 0) {
+    fail(b);
+    return;
+  }
+
+  JitKind kind = compile_expr(b, node->data.assign.value);
+  if (kind == KIND_NONE)
+    return;
+
+  /* Assigning a name that is not local would change an enclosing scope */
+  JitSlot *slot = find_slot(b, name);
+  if (node->type == AST_ASSIGN && (!slot || !slot->defined)) {
+    fail(b);
+    return;
+  }
+  if (!slot)
+    slot = add_slot(b, name);
+  if (slot->kind != KIND_NONE && slot->kind != kind) {
+    fail(b);
+    return;
+  }
+
+  slot->kind = kind;
+  slot->defined = true;
+  EMIT(b, 0x48, 0x89, 0x85); /* mov [rbp + offset], rax */
+  emit32(b, slot_offset(b, slot));
+}
+
+static void compile_stmt(JitBuilder *b, ASTNode *node) {
+  switch (node->type) {
+  case AST_YIELD: {
+    if (!node->data.yield.value) {
+      fail(b);
+      return;
+    }
+    JitKind kind = compile_expr(b, node->data.yield.value);
+    if (b->result == KIND_NONE)
+      b->result = kind;
+    if (kind != b->result) {
+      fail(b);
+      return;
+    }
+    emit_return(b);
+    return;
+  }
+
+  case AST_DESIGNATE:
+  case AST_ASSIGN:
+    compile_assign(b, node);
+    return;
+
+  case AST_FORESEE: {
+    size_t ends[64];
+    size_t end_count = 0;
+    ASTAlternateArray *alts = &node->data.foresee.alternates;
+    if (alts->count + 1 > sizeof(ends) / sizeof(ends[0])) {
+      fail(b);
+      return;
+    }
+
+    size_t next = compile_test(b, node->data.foresee.condition);
+    compile_branch(b, &node->data.foresee.body);
+    EMIT(b, 0xE9); /* jmp end */
+    ends[end_count++] = emit_rel32(b);
+
+    for (size_t i = 0; i < alts->count; i++) {
+      patch_rel32(b, next, b->length);
+      next = compile_test(b, alts->alts[i].condition);
+      compile_branch(b, &alts->alts[i].body);
+      EMIT(b, 0xE9);
+      ends[end_count++] = emit_rel32(b);
+    }
+
+    patch_rel32(b, next, b->length);
+    compile_branch(b, &node->data.foresee.otherwise);
+    for (size_t i = 0; i < end_count; i++) {
+      patch_rel32(b, ends[i], b->length);
+    }
+    return;
+  }
+
+  case AST_CYCLE_WHILE: {
+    size_t top = b->length;
+    size_t exit = compile_test(b, node->data.cycle_while.condition);
+    compile_branch(b, &node->data.cycle_while.body);
+    EMIT(b, 0xE9); /* jmp top */
+    patch_rel32(b, emit_rel32(b), top);
+    patch_rel32(b, exit, b->length);
+    return;
+  }
+
+  default:
+    fail(b);
+  }
+}
+
+static void compile_block(JitBuilder *b, ASTNodeArray *stmts) {
+  for (size_t i = 0; i < stmts->count && b->ok; i++) {
+    compile_stmt(b, stmts->nodes[i]);
+  }
+}
+
+/* ============================================================================
+ * Protocols
+ * ============================================================================
+ */
+
+/* Emit the protocol body at offset 0, followed by the C entry stub and the
+ * shared bail-out path. Returns the entry offset. */
+static size_t compile_protocol(JitBuilder *b) {
+  EMIT(b, 0x55);             /* push rbp */
+  EMIT(b, 0x48, 0x89, 0xE5); /* mov rbp, rsp */
+  EMIT(b, 0x48, 0x81, 0xEC); /* sub rsp, locals */
+  size_t frame = b->length;
+  emit32(b, 0);
+  EMIT(b, 0x49, 0xFF, 0xCE); /* dec r14 */
+  emit_bail_if(b, CC_Z);
+
+  compile_block(b, &b->protocol->data.protocol.body);
+
+  /* Running off the end yields void, which only the interpreter returns */
+  EMIT(b, 0xE9);
+  add_bail(b, emit_rel32(b));
+
+  int32_t locals = (int32_t)(8 * (b->slot_count - b->param_count));
+  memcpy(b->code + frame, &locals, 4);
+
+  /* int entry(const int64_t *args, int64_t *result, int64_t depth) */
+  size_t entry = b->length;
+  EMIT(b, 0x55);             /* push rbp */
+  EMIT(b, 0x48, 0x89, 0xE5); /* mov rbp, rsp */
+  EMIT(b, 0x53);             /* push rbx */
+  EMIT(b, 0x41, 0x54);       /* push r12 */
+  EMIT(b, 0x41, 0x55);       /* push r13 */
+  EMIT(b, 0x41, 0x56);       /* push r14 */
+  EMIT(b, 0x49, 0x89, 0xF4); /* mov r12, rsi */
+  EMIT(b, 0x49, 0x89, 0xD6); /* mov r14, rdx */
+  EMIT(b, 0x49, 0x89, 0xE5); /* mov r13, rsp */
+  for (size_t i = 0; i < b->param_count; i++) {
+    EMIT(b, 0xFF, 0xB7); /* push qword [rdi + 8i] */
+    emit32(b, (int32_t)(8 * i));
+  }
+  EMIT(b, 0xE8); /* call body */
+  patch_rel32(b, emit_rel32(b), 0);
+  EMIT(b, 0x49, 0x89, 0x04, 0x24);     /* mov [r12], rax */
+  EMIT(b, 0xB8, 0x01, 0x00, 0x00, 0x00); /* mov eax, 1 */
+
+  size_t done = b->length;
+  EMIT(b, 0x4C, 0x89, 0xEC); /* mov rsp, r13 */
+  EMIT(b, 0x41, 0x5E);       /* pop r14 */
+  EMIT(b, 0x41, 0x5D);       /* pop r13 */
+  EMIT(b, 0x41, 0x5C);       /* pop r12 */
+  EMIT(b, 0x5B);             /* pop rbx */
+  EMIT(b, 0x5D);             /* pop rbp */
+  EMIT(b, 0xC3);             /* ret */
+
+  /* Bail out from any depth: drop the native frames, return 0 */
+  size_t bail = b->length;
+  EMIT(b, 0x31, 0xC0); /* xor eax, eax */
+  EMIT(b, 0xE9);
+  patch_rel32(b, emit_rel32(b), done);
+  for (size_t i = 0; i < b->bail_count; i++) {
+    patch_rel32(b, b->bails[i], bail);
+  }
+  return entry;
+}
+
+static bool builder_start(JitBuilder *b, ASTNode *protocol, JitKind call_kind) {
+  memset(b, 0, sizeof(*b));
+  b->protocol = protocol;
+  b->call_kind = call_kind;
+  b->ok = true;
+
+  ASTParamArray *params = &protocol->data.protocol.params;
+  if (params->count > JIT_MAX_PARAMS)
+    return false;
+  for (size_t i = 0; i < params->count; i++) {
+    ASTParam *param = &params->params[i];
+    if (param->is_rest || param->default_value ||
+        param->pattern->type != AST_IDENTIFIER ||
+        find_slot(b, param->pattern->data.identifier.name))
+      return false;
+    JitSlot *slot = add_slot(b, param->pattern->data.identifier.name);
+    slot->kind = KIND_INT;
+    slot->defined = true;
+  }
+  b->param_count = params->count;
+  return true;
+}
+
+static void builder_free(JitBuilder *b) {
+  free(b->code);
+  free(b->slots);
+  free(b->bails);
+}
+
+Jit *jit_create(void) {
+  if (!JIT_NATIVE)
+    return NULL;
+  return (Jit *)calloc(1, sizeof(Jit));
+}
+
+void jit_destroy(Jit *jit) {
+  if (!jit)
+    return;
+  JitCode *code = jit->codes;
+  while (code) {
+    JitCode *next = code->next;
+#if JIT_NATIVE
+    munmap(code->memory, code->size);
+#endif
+    free(code);
+    code = next;
+  }
+  free(jit);
+}
+
+JitCode *jit_compile(Jit *jit, ASTNode *protocol) {
+#if JIT_NATIVE
+  if (!jit || protocol->type != AST_PROTOCOL ||
+      protocol->data.protocol.is_sequence || protocol->data.protocol.is_async)
+    return NULL;
+
+  /* A self call's kind is only known once a yield is seen, so try each */
+  static const JitKind kinds[] = {KIND_INT, KIND_BOOL};
+  for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+    JitBuilder b;
+    if (!builder_start(&b, protocol, kinds[k])) {
+      builder_free(&b);
+      return NULL;
+    }
+    size_t entry = compile_protocol(&b);
+    if (!b.ok || b.result == KIND_NONE ||
+        (b.calls_self && b.result != b.call_kind)) {
+      bool retry = b.ok && b.calls_self;
+      builder_free(&b);
+      if (retry)
+        continue;
+      return NULL;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (b.length + page - 1) / page * page;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      builder_free(&b);
+      return NULL;
+    }
+    memcpy(memory, b.code, b.length);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(memory, size);
+      builder_free(&b);
+      return NULL;
+    }
+
+    JitCode *code = (JitCode *)calloc(1, sizeof(JitCode));
+    code->memory = memory;
+    code->size = size;
+    /* Object to function pointer, as dlsym results are converted */
+    void *start = (uint8_t *)memory + entry;
+    memcpy(&code->entry, &start, sizeof(start));
+    code->param_count = b.param_count;
+    code->returns_bool = b.result == KIND_BOOL;
+    code->calls_self = b.calls_self;
+    code->next = jit->codes;
+    jit->codes = code;
+    builder_free(&b);
+    return code;
+  }
+  return NULL;
+#else
+  (void)jit;
+  (void)protocol;
+  return NULL;
+#endif
+}
+
+size_t jit_param_count(const JitCode *code) { return code->param_count; }
+
+bool jit_returns_bool(const JitCode *code) { return code->returns_bool; }
+
+bool jit_calls_self(const JitCode *code) { return code->calls_self; }
+
+bool jit_run(const JitCode *code, const int64_t *args, size_t max_depth,
+             int64_t *result) {
+  for (size_t i = 0; i < code->param_count; i++) {
+    if (args[i] < -JIT_INT_LIMIT || args[i] >= JIT_INT_LIMIT)
+      return false;
+  }
+  if (max_depth == 0)
+    return false;
+  /* The body bails when the count it decrements reaches zero */
+  return code->entry(args, result, (int64_t)max_depth + 1) != 0;
+}
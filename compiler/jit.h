@@ -0,0 +1,54 @@
+/*
+ * Keikaku Programming Language - Baseline JIT
+ *
+ * "The calculation was completed before you asked."
+ *
+ * Protocols that are called often enough are compiled straight from their
+ * AST to x86-64 machine code, one template per node. Only integer (and
+ * boolean) arithmetic over parameters and locals, foresee, cycle while,
+ * yield and calls of the protocol itself are handled; anything else leaves
+ * the protocol to the interpreter.
+ *
+ * Compiled code never raises a deviation. An argument that is not an
+ * integer, an intermediate result the interpreter would round, a division
+ * by zero or a too-deep recursion all abandon the native call, and the
+ * interpreter then runs the call from the start. This is safe because
+ * compiled protocols cannot have effects.
+ */
+
+#ifndef KEIKAKU_JIT_H
+#define KEIKAKU_JIT_H
+
+#include "ast.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Calls counted before a protocol is compiled */
+#define JIT_THRESHOLD 1000
+
+/* Parameters a compiled protocol may have */
+#define JIT_MAX_PARAMS 16
+
+typedef struct Jit Jit;
+typedef struct JitCode JitCode;
+
+/* NULL where native code cannot be generated (not x86-64 Linux) */
+Jit *jit_create(void);
+void jit_destroy(Jit *jit);
+
+/* Native code for a protocol node, or NULL if it uses anything the JIT does
+ * not handle. The code is owned by jit. */
+JitCode *jit_compile(Jit *jit, ASTNode *protocol);
+
+size_t jit_param_count(const JitCode *code);
+bool jit_returns_bool(const JitCode *code);
+bool jit_calls_self(const JitCode *code);
+
+/* Run compiled code over integer arguments, allowing max_depth nested
+ * calls. Returns false if a guard failed and the interpreter must make the
+ * call instead. */
+bool jit_run(const JitCode *code, const int64_t *args, size_t max_depth,
+             int64_t *result);
+
+#endif /* KEIKAKU_JIT_H */
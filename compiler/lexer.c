@@ -77,21 +77,26 @@ static const KeywordEntry keywords[] = {
  */
 
 static const char *token_type_names[] = {
-    "INTEGER",    "FLOAT",       "STRING",     "TRUE",      "FALSE",
-    "IDENTIFIER", "DESIGNATE",   "FORESEE",    "ALTERNATE", "OTHERWISE",
-    "CYCLE",      "WHILE",       "THROUGH",    "FROM",      "TO",
-    "AS",         "PROTOCOL",    "YIELD",      "AND",       "OR",
-    "NOT",        "BREAK",       "CONTINUE",   "SCHEME",    "EXECUTE",
-    "PREVIEW",    "OVERRIDE",    "ABSOLUTE",   "ANOMALY",   "ATTEMPT",
-    "RECOVER",    "INCORPORATE", "ENTITY",     "MANIFEST",  "SELF",
-    "INHERITS",   "SITUATION",   "ALIGNMENT",  "ASCEND",    "SEQUENCE",
-    "DELEGATE",   "FOR",         "WHERE",      "ASYNC",     "AWAIT",
-    "PLUS",       "MINUS",       "STAR",       "SLASH",     "DOUBLE_SLASH",
-    "PERCENT",    "DOUBLE_STAR", "ASSIGN",     "WALRUS",    "EQUAL",
-    "NOT_EQUAL",  "LESS",        "LESS_EQUAL", "GREATER",   "GREATER_EQUAL",
-    "ARROW",      "LPAREN",      "RPAREN",     "LBRACKET",  "RBRACKET",
-    "LBRACE",     "RBRACE",      "COMMA",      "COLON",     "DOT",
-    "NEWLINE",    "INDENT",      "DEDENT",     "EOF",       "ERROR"};
+    "INTEGER",       "FLOAT",     "STRING",       "FSTRING",
+    "TRUE",          "FALSE",     "IDENTIFIER",   "DESIGNATE",
+    "FORESEE",       "ALTERNATE", "OTHERWISE",    "CYCLE",
+    "WHILE",         "THROUGH",   "FROM",         "TO",
+    "AS",            "PROTOCOL",  "YIELD",        "AND",
+    "OR",            "NOT",       "BREAK",        "CONTINUE",
+    "SCHEME",        "EXECUTE",   "PREVIEW",      "OVERRIDE",
+    "ABSOLUTE",      "ANOMALY",   "ATTEMPT",      "RECOVER",
+    "INCORPORATE",   "ENTITY",    "MANIFEST",     "SELF",
+    "INHERITS",      "SITUATION", "ALIGNMENT",    "ASCEND",
+    "SEQUENCE",      "DELEGATE",  "FOR",          "WHERE",
+    "ASYNC",         "AWAIT",     "PLUS",         "MINUS",
+    "STAR",          "SLASH",     "DOUBLE_SLASH", "PERCENT",
+    "DOUBLE_STAR",   "ASSIGN",    "WALRUS",       "EQUAL",
+    "NOT_EQUAL",     "LESS",      "LESS_EQUAL",   "GREATER",
+    "GREATER_EQUAL", "ARROW",     "ELLIPSIS",     "LPAREN",
+    "RPAREN",        "LBRACKET",  "RBRACKET",     "LBRACE",
+    "RBRACE",        "COMMA",     "COLON",        "DOT",
+    "NEWLINE",       "INDENT",    "DEDENT",       "EOF",
+    "ERROR"};
 
 const char *token_type_name(K_TokenType type) {
   if (type >= 0 && type < TOKEN_COUNT) {
@@ -147,7 +152,8 @@ void lexer_destroy(Lexer *lexer) {
   if (lexer->tokens) {
     for (size_t i = 0; i < lexer->token_count; i++) {
       if (lexer->tokens[i].value.string_value &&
-          lexer->tokens[i].type == TOKEN_STRING) {
+          (lexer->tokens[i].type == TOKEN_STRING ||
+           lexer->tokens[i].type == TOKEN_FSTRING)) {
         free(lexer->tokens[i].value.string_value);
       }
     }
@@ -359,7 +365,8 @@ static Token read_number(Lexer *lexer) {
  * ============================================================================
  */
 
-static Token read_string(Lexer *lexer, char quote) {
+/* Reads a quoted literal; f-strings keep their {fields} for the parser */
+static Token read_string(Lexer *lexer, char quote, K_TokenType type) {
   advance(lexer); /* consume opening quote */
   size_t start_pos = lexer->current;
 
@@ -385,7 +392,7 @@ static Token read_string(Lexer *lexer, char quote) {
 
   advance(lexer); /* consume closing quote */
 
-  Token token = make_token(lexer, TOKEN_STRING);
+  Token token = make_token(lexer, type);
 
   /* Process escape sequences */
   char *value = (char *)malloc(str_len + 1);
@@ -414,6 +421,9 @@ static Token read_string(Lexer *lexer, char quote) {
         value[j++] = '"';
         break;
       default:
+        /* Unknown escapes are kept as written, backslash included: part of
+         * the language (see the tour), so "\d" reaches a regex intact */
+        value[j++] = '\\';
         value[j++] = lexer->source[start_pos + i];
         break;
       }
@@ -574,6 +584,11 @@ Token lexer_next_token(Lexer *lexer) {
     return read_number(lexer);
   }
 
+  /* Interpolated strings: f"..." */
+  if (c == 'f' && (peek(lexer) == '"' || peek(lexer) == '\'')) {
+    return read_string(lexer, peek(lexer), TOKEN_FSTRING);
+  }
+
   /* Identifiers and keywords */
   if (isalpha(c) || c == '_') {
     lexer->current--;
@@ -585,7 +600,7 @@ Token lexer_next_token(Lexer *lexer) {
   if (c == '"' || c == '\'') {
     lexer->current--;
     lexer->column--;
-    return read_string(lexer, c);
+    return read_string(lexer, c, TOKEN_STRING);
   }
 
   /* Operators and delimiters */
@@ -685,7 +700,8 @@ Token *lexer_tokenize_all(Lexer *lexer, size_t *count) {
 
 void lexer_free_tokens(Token *tokens, size_t count) {
   for (size_t i = 0; i < count; i++) {
-    if (tokens[i].type == TOKEN_STRING && tokens[i].value.string_value) {
+    if ((tokens[i].type == TOKEN_STRING || tokens[i].type == TOKEN_FSTRING) &&
+        tokens[i].value.string_value) {
       free(tokens[i].value.string_value);
     }
   }
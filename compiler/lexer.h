@@ -21,6 +21,7 @@ typedef enum {
   TOKEN_INTEGER,
   TOKEN_FLOAT,
   TOKEN_STRING,
+  TOKEN_FSTRING, /* f"..." interpolated string */
   TOKEN_TRUE,
   TOKEN_FALSE,
 
@@ -7,6 +7,8 @@
  */
 
 #include "ast.h"
+#include "build.h"
+#include "infer.h"
 #include "interpreter.h"
 #include "lexer.h"
 #include "parser.h"
@@ -16,6 +18,17 @@
 
 #define KEIKAKU_VERSION "1.0.0"
 
+/* Deviation report level selected on the command line */
+static ReportLevel report_level = REPORT_NORMAL;
+
+/* Compile hot protocols to native code (--jit) */
+static bool use_jit = false;
+
+/* Prove operand types before running (--infer), or only report the proofs
+ * (--dump-types) */
+static bool use_infer = false;
+static bool dump_types = false;
+
 /* ============================================================================
  * File Reading
  * ============================================================================
@@ -106,13 +119,26 @@ static int run_source_repl(Interpreter *interp, const char *source,
     return 1;
   }
 
+  /* Inference assumes a fresh interpreter, which the REPL's is not */
+  if ((use_infer || dump_types) && !show_result)
+    infer_program(ast);
+
+  if (dump_types && !show_result) {
+    infer_dump(stdout, ast);
+    ast_destroy(ast);
+    parser_destroy(parser);
+    lexer_free_tokens(tokens, token_count);
+    lexer_destroy(lexer);
+    return 0;
+  }
+
   /* Execution */
   Value result = interpreter_execute(interp, ast);
 
   int exit_code = interpreter_has_error(interp) ? 1 : 0;
 
   /* Print result in REPL mode */
-  if (show_result && !exit_code && result.type != VAL_NULL) {
+  if (show_result && !exit_code && VALUE_TYPE(result) != VAL_NULL) {
     char *str = value_to_string(&result);
     printf("  %s\n", str);
     printf("  %s\n", get_random_message());
@@ -147,6 +173,9 @@ static void run_repl(void) {
     fprintf(stderr, "  ⚠ Failed to initialize interpreter.\n");
     return;
   }
+  interpreter_set_report_level(interp, report_level);
+  if (use_jit)
+    interpreter_enable_jit(interp);
 
   char line[4096];
   char buffer[65536];
@@ -218,6 +247,9 @@ static int run_file(const char *path) {
     free(source);
     return 1;
   }
+  interpreter_set_report_level(interp, report_level);
+  if (use_jit)
+    interpreter_enable_jit(interp);
 
   int result = run_source(interp, source, path);
 
@@ -227,6 +259,33 @@ static int run_file(const char *path) {
   return result;
 }
 
+/* ============================================================================
+ * Build
+ * ============================================================================
+ */
+
+/* keikaku build script.kei [-o output]: the output defaults to the script's
+ * path without .kei */
+static int run_build(const char *path, const char *output) {
+  char *derived = NULL;
+  if (!output) {
+    size_t length = strlen(path);
+    if (length <= 4 || strcmp(path + length - 4, ".kei") != 0) {
+      fprintf(stderr, "  ⚠ Name the executable with -o.\n");
+      return 1;
+    }
+    derived = (char *)malloc(length - 3);
+    memcpy(derived, path, length - 4);
+    derived[length - 4] = '\0';
+    output = derived;
+  }
+
+  BuildOptions options = {report_level, use_jit, use_infer};
+  int result = build_executable(path, output, &options);
+  free(derived);
+  return result;
+}
+
 /* ============================================================================
  * Print Usage
  * ============================================================================
@@ -239,8 +298,19 @@ static void print_usage(const char *prog) {
   printf("  Usage:\n");
   printf("    %s              Start interactive REPL\n", prog);
   printf("    %s <file.kei>   Execute a Keikaku script\n", prog);
+  printf("    %s build <file.kei> [-o <output>]\n", prog);
+  printf("                         Compile a script into an executable\n");
   printf("    %s --help       Display this message\n", prog);
   printf("    %s --version    Display version information\n\n", prog);
+  printf("  Options:\n");
+  printf("    -q, --quiet       Report uncaught deviations on one line\n");
+  printf("    --verbose         Report deviations with kind, trace and "
+         "recoveries\n");
+  printf("    --jit             Compile hot integer protocols to native "
+         "code\n");
+  printf("    --infer           Prove operand types before running\n");
+  printf("    --dump-types      Report the proven types instead of "
+         "running\n\n");
   printf("  The system awaits your input.\n\n");
 }
 
@@ -257,25 +327,57 @@ static void print_version(void) {
  */
 
 int main(int argc, char *argv[]) {
-  if (argc == 1) {
-    run_repl();
-    return 0;
-  }
+  const char *path = NULL;
+  const char *output = NULL;
+  bool build = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
 
-  if (argc == 2) {
-    if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
       print_usage(argv[0]);
       return 0;
     }
 
-    if (strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-v") == 0) {
+    if (strcmp(arg, "--version") == 0 || strcmp(arg, "-v") == 0) {
       print_version();
       return 0;
     }
 
-    return run_file(argv[1]);
+    if (strcmp(arg, "--quiet") == 0 || strcmp(arg, "-q") == 0) {
+      report_level = REPORT_QUIET;
+    } else if (strcmp(arg, "--verbose") == 0) {
+      report_level = REPORT_VERBOSE;
+    } else if (strcmp(arg, "--jit") == 0) {
+      use_jit = true;
+    } else if (strcmp(arg, "--infer") == 0) {
+      use_infer = true;
+    } else if (strcmp(arg, "--dump-types") == 0) {
+      dump_types = true;
+    } else if (build && strcmp(arg, "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (arg[0] == '-' || path) {
+      print_usage(argv[0]);
+      return 1;
+    } else if (!build && strcmp(arg, "build") == 0) {
+      build = true;
+    } else {
+      path = arg;
+    }
+  }
+
+  if (build) {
+    if (!path) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    return run_build(path, output);
+  }
+
+  if (!path) {
+    run_repl();
+    return 0;
   }
 
-  print_usage(argv[0]);
-  return 1;
+  return run_file(path);
 }
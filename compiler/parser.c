@@ -154,9 +154,145 @@ static ASTNode *create_node(ASTNodeType type, int line, int col) {
  * ============================================================================
  */
 
+static char *copy_range(const char *start, size_t length) {
+  char *copy = (char *)malloc(length + 1);
+  memcpy(copy, start, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+/* Parse the source of one {field} of an f-string with its own lexer */
+static ASTNode *parse_fstring_field(Parser *parser, const char *source,
+                                   size_t length, int line) {
+  while (length > 0 && (*source == ' ' || *source == '\t')) {
+    source++; /* Leading blanks would lex as indentation */
+    length--;
+  }
+  if (length == 0) {
+    error(parser, "Empty field in interpolated string.");
+    return NULL;
+  }
+
+  char *text = copy_range(source, length);
+  Lexer *lexer = lexer_create(text, parser->filename);
+  lexer->line = line;
+  size_t token_count;
+  Token *tokens = lexer_tokenize_all(lexer, &token_count);
+
+  ASTNode *expr = NULL;
+  if (lexer_has_error(lexer)) {
+    error(parser, "Malformed field in interpolated string.");
+  } else {
+    Parser *sub = parser_create(tokens, token_count, text, parser->filename);
+    expr = parse_expression(sub);
+    skip_newlines(sub);
+    if (!sub->has_error && !at_end(sub)) {
+      error_at(sub, current(sub),
+               "Unexpected tokens in interpolated string field.");
+    }
+    if (sub->has_error) {
+      if (!parser->panic_mode) {
+        parser->has_error = true;
+        parser->panic_mode = true;
+        memcpy(parser->error_buffer, sub->error_buffer,
+               sizeof(parser->error_buffer));
+      }
+      ast_destroy(expr);
+      expr = NULL;
+    }
+    parser_destroy(sub);
+  }
+
+  lexer_free_tokens(tokens, token_count);
+  lexer_destroy(lexer);
+  free(text);
+  return expr;
+}
+
+/* Split f"..." into literal parts and {expr} / {expr:spec} fields once, at
+ * parse time. {{ and }} stand for literal braces. */
+static ASTNode *parse_fstring(Parser *parser, Token *token) {
+  const char *text = token->value.string_value;
+  size_t length = strlen(text);
+  ASTNode *node = ast_create_fstring(token->line, token->column);
+
+  char *literal = (char *)malloc(length + 1);
+  size_t literal_len = 0;
+  size_t i = 0;
+
+  while (i < length) {
+    char c = text[i];
+    if ((c == '{' || c == '}') && text[i + 1] == c) {
+      literal[literal_len++] = c;
+      i += 2;
+      continue;
+    }
+    if (c == '}') {
+      error_at(parser, token, "Unmatched '}' in interpolated string.");
+      break;
+    }
+    if (c != '{') {
+      literal[literal_len++] = c;
+      i++;
+      continue;
+    }
+
+    if (literal_len > 0) {
+      literal[literal_len] = '\0';
+      ast_fstring_push(
+          node, ast_create_string(literal, token->line, token->column), NULL);
+      literal_len = 0;
+    }
+
+    /* Find the closing brace, skipping nested brackets and quotes */
+    size_t start = ++i;
+    size_t colon = 0;
+    int depth = 0;
+    while (i < length && !(depth == 0 && text[i] == '}')) {
+      char ch = text[i];
+      if (ch == '"' || ch == '\'') {
+        for (i++; i < length && text[i] != ch; i++) {
+        }
+      } else if (ch == '(' || ch == '[' || ch == '{') {
+        depth++;
+      } else if (ch == ')' || ch == ']' || ch == '}') {
+        depth--;
+      } else if (ch == ':' && depth == 0 && colon == 0) {
+        colon = i;
+      }
+      i++;
+    }
+    if (i >= length) {
+      error_at(parser, token, "Unterminated '{' in interpolated string.");
+      break;
+    }
+
+    size_t expr_end = colon ? colon : i;
+    ASTNode *expr = parse_fstring_field(parser, text + start,
+                                        expr_end - start, token->line);
+    if (!expr)
+      break;
+    char *spec = colon ? copy_range(text + colon + 1, i - colon - 1) : NULL;
+    ast_fstring_push(node, expr, spec);
+    i++; /* Closing brace */
+  }
+
+  if (literal_len > 0) {
+    literal[literal_len] = '\0';
+    ast_fstring_push(
+        node, ast_create_string(literal, token->line, token->column), NULL);
+  }
+  free(literal);
+  return node;
+}
+
 static ASTNode *parse_primary(Parser *parser) {
   Token *token = current(parser);
 
+  if (match(parser, TOKEN_FSTRING)) {
+    return parse_fstring(parser, token);
+  }
+
   if (match(parser, TOKEN_INTEGER)) {
     return ast_create_int(token->value.int_value, token->line, token->column);
   }
@@ -870,6 +1006,14 @@ static ASTNode *parse_cycle(Parser *parser) {
     expect(parser, TOKEN_TO, "Expected 'to' in range.");
     ASTNode *end = parse_expression(parser);
 
+    /* Optional stride: cycle from 10 to 0 step -2 as i */
+    ASTNode *step = NULL;
+    if (check(parser, TOKEN_IDENTIFIER) && current(parser)->length == 4 &&
+        strncmp(current(parser)->start, "step", 4) == 0) {
+      advance(parser);
+      step = parse_expression(parser);
+    }
+
     ASTNode *pattern = NULL;
     if (match(parser, TOKEN_AS)) {
       pattern = parse_primary(parser);
@@ -879,6 +1023,7 @@ static ASTNode *parse_cycle(Parser *parser) {
 
     ASTNode *node = ast_create_cycle_from_to(start, end, pattern, keyword->line,
                                              keyword->column);
+    node->data.cycle_from_to.step = step;
     node->data.cycle_from_to.body = parse_block(parser);
     return node;
   }
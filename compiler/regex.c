@@ -0,0 +1,1220 @@
+/*
+ * Keikaku Programming Language - Regular Expressions
+ *
+ * "Every pattern was foreseen."
+ *
+ * Supported syntax: literals, . [...] [^...] \d \w \s \D \W \S, escapes
+ * \t \n \r \f \v, anchors ^ $ \b \B, groups (...) (?:...), alternation |,
+ * and the quantifiers * + ? {m} {m,} {m,n}, each optionally lazy (?).
+ * Text is UTF-8 and every consuming instruction matches one codepoint.
+ */
+
+#include "regex.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RX_MAX_PROGRAM 20000
+#define RX_MAX_REPEAT 1000
+#define RX_DFA_MAX_STATES 1024
+#define RX_ASCII 128
+
+/* ============================================================================
+ * Program
+ * ============================================================================
+ */
+
+typedef enum {
+  RX_CHAR,   /* x = codepoint */
+  RX_ANY,    /* Any codepoint except newline */
+  RX_CLASS,  /* x = class index */
+  RX_SPLIT,  /* Try x, then y */
+  RX_JMP,    /* x = target */
+  RX_SAVE,   /* x = capture slot */
+  RX_BOL,    /* Start of text */
+  RX_EOL,    /* End of text */
+  RX_WORDB,  /* Word boundary */
+  RX_NWORDB, /* Not a word boundary */
+  RX_MATCH
+} RxOp;
+
+typedef struct {
+  RxOp op;
+  int x, y;
+} RxInst;
+
+typedef struct {
+  uint32_t lo, hi;
+} RxRange;
+
+typedef struct {
+  RxRange *ranges;
+  size_t count;
+  size_t capacity;
+  uint64_t ascii[2]; /* Membership bitmap for codepoints below 128 */
+  bool negated;
+} RxClass;
+
+/* Lazily built DFA state: a set of program counters */
+typedef struct {
+  int *pcs;
+  size_t count;
+  uint64_t hash;
+  bool accepting;     /* Contains MATCH */
+  bool eol_accepting; /* Reaches MATCH if the text ends here */
+  int next[RX_ASCII]; /* Cached transitions, -1 if not yet computed */
+} RxDState;
+
+typedef struct {
+  RxDState *states;
+  size_t count;
+  size_t capacity;
+  int start[2]; /* Start state when not / when at the start of text */
+  bool failed;  /* Too many states - fall back to the VM alone */
+} RxDfa;
+
+/* Thread list for the Pike VM */
+typedef struct {
+  int *pcs;
+  size_t *caps;
+  size_t count;
+  unsigned *mark; /* mark[pc] == generation when pc is on the list */
+  unsigned generation;
+} RxList;
+
+typedef struct {
+  int kind; /* 0 = explore pc, 1 = restore capture slot */
+  int pc;
+  size_t value;
+} RxJob;
+
+struct Regex {
+  RxInst *prog;
+  size_t prog_count;
+  size_t prog_capacity;
+
+  RxClass *classes;
+  size_t class_count;
+  size_t class_capacity;
+
+  int groups;
+  bool has_word_assert;
+
+  /* Literal every match begins with, used to skip ahead */
+  char *prefix;
+  size_t prefix_length;
+
+  RxDfa dfa[2]; /* [0] unanchored search, [1] anchored full match */
+
+  /* VM scratch space, allocated on first use */
+  RxList lists[2];
+  RxJob *jobs;
+  size_t *work;
+  int *set_buffer;
+  unsigned *set_mark;
+  unsigned set_generation;
+};
+
+/* ============================================================================
+ * UTF-8
+ * ============================================================================
+ */
+
+/* Decode one codepoint; malformed bytes decode as themselves, one at a time */
+static uint32_t rx_decode(const char *text, size_t length, size_t *width) {
+  const unsigned char *s = (const unsigned char *)text;
+  uint32_t c = s[0];
+  size_t need = 0;
+  if (c >= 0xC0 && c < 0xE0)
+    need = 1;
+  else if (c >= 0xE0 && c < 0xF0)
+    need = 2;
+  else if (c >= 0xF0 && c < 0xF8)
+    need = 3;
+  if (need == 0 || need >= length) {
+    *width = 1;
+    return c;
+  }
+  uint32_t value = c & (0x3F >> need);
+  for (size_t i = 1; i <= need; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      *width = 1;
+      return c;
+    }
+    value = (value << 6) | (s[i] & 0x3F);
+  }
+  *width = need + 1;
+  return value;
+}
+
+static size_t rx_encode(uint32_t c, char *out) {
+  if (c < 0x80) {
+    out[0] = (char)c;
+    return 1;
+  }
+  if (c < 0x800) {
+    out[0] = (char)(0xC0 | (c >> 6));
+    out[1] = (char)(0x80 | (c & 0x3F));
+    return 2;
+  }
+  if (c < 0x10000) {
+    out[0] = (char)(0xE0 | (c >> 12));
+    out[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+    out[2] = (char)(0x80 | (c & 0x3F));
+    return 3;
+  }
+  out[0] = (char)(0xF0 | (c >> 18));
+  out[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+  out[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+  out[3] = (char)(0x80 | (c & 0x3F));
+  return 4;
+}
+
+static bool rx_is_word(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+static bool rx_word_boundary(const char *text, size_t length, size_t pos) {
+  bool before = pos > 0 && rx_is_word((unsigned char)text[pos - 1]);
+  bool after = pos < length && rx_is_word((unsigned char)text[pos]);
+  return before != after;
+}
+
+/* ============================================================================
+ * Character Classes
+ * ============================================================================
+ */
+
+static void class_add(RxClass *cls, uint32_t lo, uint32_t hi) {
+  if (cls->count >= cls->capacity) {
+    cls->capacity = cls->capacity == 0 ? 4 : cls->capacity * 2;
+    cls->ranges =
+        (RxRange *)realloc(cls->ranges, sizeof(RxRange) * cls->capacity);
+  }
+  cls->ranges[cls->count].lo = lo;
+  cls->ranges[cls->count].hi = hi;
+  cls->count++;
+  for (uint32_t c = lo; c <= hi && c < RX_ASCII; c++) {
+    cls->ascii[c >> 6] |= (uint64_t)1 << (c & 63);
+  }
+}
+
+/* Add the ranges of \d, \w or \s, or their complement for \D, \W, \S */
+static void class_add_shorthand(RxClass *cls, char kind) {
+  static const RxRange digit[] = {{'0', '9'}};
+  static const RxRange word[] = {{'0', '9'}, {'A', 'Z'}, {'_', '_'},
+                                 {'a', 'z'}};
+  static const RxRange space[] = {{'\t', '\r'}, {' ', ' '}};
+
+  const RxRange *set;
+  size_t count;
+  switch (kind) {
+  case 'd':
+  case 'D':
+    set = digit, count = 1;
+    break;
+  case 'w':
+  case 'W':
+    set = word, count = 4;
+    break;
+  default:
+    set = space, count = 2;
+    break;
+  }
+
+  if (kind >= 'a') {
+    for (size_t i = 0; i < count; i++) {
+      class_add(cls, set[i].lo, set[i].hi);
+    }
+    return;
+  }
+
+  /* Complement of the sorted set */
+  uint32_t next = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (set[i].lo > next)
+      class_add(cls, next, set[i].lo - 1);
+    next = set[i].hi + 1;
+  }
+  class_add(cls, next, 0x10FFFF);
+}
+
+static bool class_match(const RxClass *cls, uint32_t c) {
+  bool found = false;
+  if (c < RX_ASCII) {
+    found = (cls->ascii[c >> 6] >> (c & 63)) & 1;
+  } else {
+    for (size_t i = 0; i < cls->count; i++) {
+      if (c >= cls->ranges[i].lo && c <= cls->ranges[i].hi) {
+        found = true;
+        break;
+      }
+    }
+  }
+  return found != cls->negated;
+}
+
+static int add_class(Regex *re) {
+  if (re->class_count >= re->class_capacity) {
+    re->class_capacity = re->class_capacity == 0 ? 4 : re->class_capacity * 2;
+    re->classes =
+        (RxClass *)realloc(re->classes, sizeof(RxClass) * re->class_capacity);
+  }
+  memset(&re->classes[re->class_count], 0, sizeof(RxClass));
+  return (int)re->class_count++;
+}
+
+/* ============================================================================
+ * Parser - pattern text to syntax tree
+ * ============================================================================
+ */
+
+typedef enum {
+  RN_EMPTY,
+  RN_CHAR,
+  RN_ANY,
+  RN_CLASS,
+  RN_ASSERT,
+  RN_GROUP,
+  RN_CONCAT,
+  RN_ALT,
+  RN_REPEAT
+} RnType;
+
+typedef struct RxNode {
+  RnType type;
+  int value; /* Codepoint, class index, assert op or group (-1: none) */
+  int min, max; /* Repeat bounds; max -1 is unbounded */
+  bool greedy;
+  struct RxNode *a, *b;
+} RxNode;
+
+typedef struct {
+  const char *pattern;
+  size_t length;
+  size_t pos;
+  Regex *re;
+  const char *error;
+} RxParser;
+
+static RxNode *node_new(RnType type, RxNode *a, RxNode *b) {
+  RxNode *node = (RxNode *)calloc(1, sizeof(RxNode));
+  node->type = type;
+  node->a = a;
+  node->b = b;
+  return node;
+}
+
+static void node_free(RxNode *node) {
+  if (!node)
+    return;
+  node_free(node->a);
+  node_free(node->b);
+  free(node);
+}
+
+static bool parser_fail(RxParser *p, const char *error) {
+  if (!p->error)
+    p->error = error;
+  return false;
+}
+
+static bool at_end(RxParser *p) { return p->pos >= p->length; }
+
+static uint32_t next_codepoint(RxParser *p) {
+  size_t width;
+  uint32_t c = rx_decode(p->pattern + p->pos, p->length - p->pos, &width);
+  p->pos += width;
+  return c;
+}
+
+/* Escape letter to its codepoint, or the letter itself */
+static uint32_t escape_value(uint32_t c) {
+  switch (c) {
+  case 't':
+    return '\t';
+  case 'n':
+    return '\n';
+  case 'r':
+    return '\r';
+  case 'f':
+    return '\f';
+  case 'v':
+    return '\v';
+  default:
+    return c;
+  }
+}
+
+static bool is_shorthand(uint32_t c) {
+  return c < RX_ASCII && c != 0 && strchr("dwsDWS", (int)c);
+}
+
+static RxNode *parse_alternation(RxParser *p);
+
+static RxNode *parse_class(RxParser *p) {
+  int index = add_class(p->re);
+  RxClass *cls = &p->re->classes[index];
+
+  if (!at_end(p) && p->pattern[p->pos] == '^') {
+    cls->negated = true;
+    p->pos++;
+  }
+
+  bool first = true;
+  while (!at_end(p) && (p->pattern[p->pos] != ']' || first)) {
+    first = false;
+    uint32_t lo = next_codepoint(p);
+    if (lo == '\\') {
+      if (at_end(p))
+        break;
+      uint32_t esc = next_codepoint(p);
+      if (is_shorthand(esc)) {
+        class_add_shorthand(cls, (char)esc);
+        continue;
+      }
+      lo = escape_value(esc);
+    }
+
+    uint32_t hi = lo;
+    if (p->pos + 1 < p->length && p->pattern[p->pos] == '-' &&
+        p->pattern[p->pos + 1] != ']') {
+      p->pos++;
+      hi = next_codepoint(p);
+      if (hi == '\\' && !at_end(p))
+        hi = escape_value(next_codepoint(p));
+      if (hi < lo) {
+        parser_fail(p, "Character range is out of order.");
+        return NULL;
+      }
+    }
+    class_add(cls, lo, hi);
+  }
+
+  if (at_end(p)) {
+    parser_fail(p, "Missing ']' to close a character class.");
+    return NULL;
+  }
+  p->pos++; /* ] */
+
+  RxNode *node = node_new(RN_CLASS, NULL, NULL);
+  node->value = index;
+  return node;
+}
+
+static RxNode *parse_atom(RxParser *p) {
+  char c = p->pattern[p->pos];
+
+  if (c == '(') {
+    p->pos++;
+    int group = -1;
+    if (p->pos + 1 < p->length && p->pattern[p->pos] == '?' &&
+        p->pattern[p->pos + 1] == ':') {
+      p->pos += 2;
+    } else {
+      group = ++p->re->groups;
+    }
+    RxNode *inner = parse_alternation(p);
+    if (!inner)
+      return NULL;
+    if (at_end(p) || p->pattern[p->pos] != ')') {
+      node_free(inner);
+      parser_fail(p, "Missing ')' to close a group.");
+      return NULL;
+    }
+    p->pos++;
+    RxNode *node = node_new(RN_GROUP, inner, NULL);
+    node->value = group;
+    return node;
+  }
+
+  if (c == '*' || c == '+' || c == '?') {
+    parser_fail(p, "Quantifier has nothing to repeat.");
+    return NULL;
+  }
+
+  if (c == '[') {
+    p->pos++;
+    return parse_class(p);
+  }
+
+  RxNode *node;
+  if (c == '.' || c == '^' || c == '$') {
+    p->pos++;
+    node = node_new(c == '.' ? RN_ANY : RN_ASSERT, NULL, NULL);
+    node->value = c == '^' ? RX_BOL : RX_EOL;
+    return node;
+  }
+
+  uint32_t cp = next_codepoint(p);
+  if (cp == '\\') {
+    if (at_end(p)) {
+      parser_fail(p, "Pattern ends with a lone backslash.");
+      return NULL;
+    }
+    uint32_t esc = next_codepoint(p);
+    if (is_shorthand(esc)) {
+      int index = add_class(p->re);
+      class_add_shorthand(&p->re->classes[index], (char)esc);
+      node = node_new(RN_CLASS, NULL, NULL);
+      node->value = index;
+      return node;
+    }
+    if (esc == 'b' || esc == 'B') {
+      p->re->has_word_assert = true;
+      node = node_new(RN_ASSERT, NULL, NULL);
+      node->value = esc == 'b' ? RX_WORDB : RX_NWORDB;
+      return node;
+    }
+    cp = escape_value(esc);
+  }
+
+  node = node_new(RN_CHAR, NULL, NULL);
+  node->value = (int)cp;
+  return node;
+}
+
+/* Parse {m}, {m,} or {m,n}; leaves pos untouched if it is not one */
+static bool parse_braces(RxParser *p, int *min, int *max) {
+  size_t pos = p->pos + 1;
+  long lo = 0, hi;
+  size_t digits = 0;
+  while (pos < p->length && p->pattern[pos] >= '0' &&
+         p->pattern[pos] <= '9' && digits < 6) {
+    lo = lo * 10 + (p->pattern[pos++] - '0');
+    digits++;
+  }
+  if (digits == 0)
+    return false;
+  hi = lo;
+  if (pos < p->length && p->pattern[pos] == ',') {
+    pos++;
+    hi = -1;
+    digits = 0;
+    long value = 0;
+    while (pos < p->length && p->pattern[pos] >= '0' &&
+           p->pattern[pos] <= '9' && digits < 6) {
+      value = value * 10 + (p->pattern[pos++] - '0');
+      digits++;
+    }
+    if (digits > 0)
+      hi = value;
+  }
+  if (pos >= p->length || p->pattern[pos] != '}')
+    return false;
+
+  if (lo > RX_MAX_REPEAT || hi > RX_MAX_REPEAT || (hi >= 0 && hi < lo)) {
+    parser_fail(p, "Repetition count is out of range.");
+    return false;
+  }
+  *min = (int)lo;
+  *max = (int)hi;
+  p->pos = pos + 1;
+  return true;
+}
+
+static RxNode *parse_repeat(RxParser *p) {
+  RxNode *atom = parse_atom(p);
+  while (atom && !at_end(p)) {
+    char c = p->pattern[p->pos];
+    int min, max;
+    if (c == '*') {
+      min = 0, max = -1;
+      p->pos++;
+    } else if (c == '+') {
+      min = 1, max = -1;
+      p->pos++;
+    } else if (c == '?') {
+      min = 0, max = 1;
+      p->pos++;
+    } else if (c == '{' && parse_braces(p, &min, &max)) {
+      /* Parsed */
+    } else {
+      break;
+    }
+
+    if (atom->type == RN_ASSERT) {
+      node_free(atom);
+      parser_fail(p, "An anchor cannot be repeated.");
+      return NULL;
+    }
+
+    RxNode *repeat = node_new(RN_REPEAT, atom, NULL);
+    repeat->min = min;
+    repeat->max = max;
+    repeat->greedy = true;
+    if (!at_end(p) && p->pattern[p->pos] == '?') {
+      repeat->greedy = false;
+      p->pos++;
+    }
+    atom = repeat;
+  }
+  if (p->error) {
+    node_free(atom);
+    return NULL;
+  }
+  return atom;
+}
+
+static RxNode *parse_concat(RxParser *p) {
+  RxNode *result = NULL;
+  while (!at_end(p) && p->pattern[p->pos] != '|' &&
+         p->pattern[p->pos] != ')') {
+    RxNode *item = parse_repeat(p);
+    if (!item) {
+      node_free(result);
+      return NULL;
+    }
+    result = result ? node_new(RN_CONCAT, result, item) : item;
+  }
+  return result ? result : node_new(RN_EMPTY, NULL, NULL);
+}
+
+static RxNode *parse_alternation(RxParser *p) {
+  RxNode *left = parse_concat(p);
+  while (left && !at_end(p) && p->pattern[p->pos] == '|') {
+    p->pos++;
+    RxNode *right = parse_concat(p);
+    if (!right) {
+      node_free(left);
+      return NULL;
+    }
+    left = node_new(RN_ALT, left, right);
+  }
+  return left;
+}
+
+/* ============================================================================
+ * Compiler - syntax tree to program
+ * ============================================================================
+ */
+
+static int emit(Regex *re, RxOp op, int x, int y) {
+  if (re->prog_count >= re->prog_capacity) {
+    re->prog_capacity = re->prog_capacity == 0 ? 16 : re->prog_capacity * 2;
+    re->prog =
+        (RxInst *)realloc(re->prog, sizeof(RxInst) * re->prog_capacity);
+  }
+  re->prog[re->prog_count].op = op;
+  re->prog[re->prog_count].x = x;
+  re->prog[re->prog_count].y = y;
+  return (int)re->prog_count++;
+}
+
+static bool compile_node(Regex *re, RxNode *node) {
+  if (re->prog_count > RX_MAX_PROGRAM)
+    return false;
+
+  switch (node->type) {
+  case RN_EMPTY:
+    return true;
+  case RN_CHAR:
+    emit(re, RX_CHAR, node->value, 0);
+    return true;
+  case RN_ANY:
+    emit(re, RX_ANY, 0, 0);
+    return true;
+  case RN_CLASS:
+    emit(re, RX_CLASS, node->value, 0);
+    return true;
+  case RN_ASSERT:
+    emit(re, (RxOp)node->value, 0, 0);
+    return true;
+  case RN_GROUP:
+    if (node->value >= 0)
+      emit(re, RX_SAVE, node->value * 2, 0);
+    if (!compile_node(re, node->a))
+      return false;
+    if (node->value >= 0)
+      emit(re, RX_SAVE, node->value * 2 + 1, 0);
+    return true;
+  case RN_CONCAT:
+    return compile_node(re, node->a) && compile_node(re, node->b);
+  case RN_ALT: {
+    int split = emit(re, RX_SPLIT, 0, 0);
+    re->prog[split].x = (int)re->prog_count;
+    if (!compile_node(re, node->a))
+      return false;
+    int jump = emit(re, RX_JMP, 0, 0);
+    re->prog[split].y = (int)re->prog_count;
+    if (!compile_node(re, node->b))
+      return false;
+    re->prog[jump].x = (int)re->prog_count;
+    return true;
+  }
+  case RN_REPEAT: {
+    for (int i = 0; i < node->min; i++) {
+      if (!compile_node(re, node->a))
+        return false;
+    }
+
+    if (node->max < 0) {
+      /* loop: split body, out; body; jmp loop */
+      int split = emit(re, RX_SPLIT, 0, 0);
+      int body = (int)re->prog_count;
+      if (!compile_node(re, node->a))
+        return false;
+      emit(re, RX_JMP, split, 0);
+      int out = (int)re->prog_count;
+      re->prog[split].x = node->greedy ? body : out;
+      re->prog[split].y = node->greedy ? out : body;
+      return true;
+    }
+
+    /* Optional copies all exit to the same place */
+    int optional = node->max - node->min;
+    int *splits = (int *)malloc(sizeof(int) * (optional > 0 ? optional : 1));
+    for (int i = 0; i < optional; i++) {
+      splits[i] = emit(re, RX_SPLIT, 0, 0);
+      re->prog[splits[i]].x = (int)re->prog_count;
+      if (!compile_node(re, node->a)) {
+        free(splits);
+        return false;
+      }
+    }
+    int out = (int)re->prog_count;
+    for (int i = 0; i < optional; i++) {
+      RxInst *inst = &re->prog[splits[i]];
+      int body = inst->x;
+      inst->x = node->greedy ? body : out;
+      inst->y = node->greedy ? out : body;
+    }
+    free(splits);
+    return true;
+  }
+  }
+  return true;
+}
+
+/* Collect the literal text every match must begin with */
+static bool collect_prefix(RxNode *node, char *buffer, size_t *length,
+                           size_t capacity) {
+  switch (node->type) {
+  case RN_CHAR:
+    if (*length + 4 > capacity)
+      return false;
+    *length += rx_encode((uint32_t)node->value, buffer + *length);
+    return true;
+  case RN_CONCAT:
+    return collect_prefix(node->a, buffer, length, capacity) &&
+           collect_prefix(node->b, buffer, length, capacity);
+  case RN_GROUP:
+    return collect_prefix(node->a, buffer, length, capacity);
+  case RN_REPEAT:
+    if (node->min > 0)
+      collect_prefix(node->a, buffer, length, capacity);
+    return false;
+  default:
+    return false;
+  }
+}
+
+Regex *regex_compile(const char *pattern, size_t length, const char **error) {
+  Regex *re = (Regex *)calloc(1, sizeof(Regex));
+  RxParser parser = {pattern, length, 0, re, NULL};
+
+  RxNode *tree = parse_alternation(&parser);
+  if (tree && !at_end(&parser)) {
+    parser_fail(&parser, "Unmatched ')' in pattern.");
+  }
+  if (!tree || parser.error) {
+    *error = parser.error ? parser.error : "Invalid pattern.";
+    node_free(tree);
+    regex_free(re);
+    return NULL;
+  }
+
+  emit(re, RX_SAVE, 0, 0);
+  bool ok = compile_node(re, tree);
+  emit(re, RX_SAVE, 1, 0);
+  emit(re, RX_MATCH, 0, 0);
+  if (!ok || re->prog_count > RX_MAX_PROGRAM) {
+    *error = "Pattern is too large.";
+    node_free(tree);
+    regex_free(re);
+    return NULL;
+  }
+
+  char prefix[64];
+  size_t prefix_length = 0;
+  collect_prefix(tree, prefix, &prefix_length, sizeof(prefix));
+  if (prefix_length > 0) {
+    re->prefix = (char *)malloc(prefix_length);
+    memcpy(re->prefix, prefix, prefix_length);
+    re->prefix_length = prefix_length;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    re->dfa[i].start[0] = re->dfa[i].start[1] = -1;
+    re->dfa[i].failed = re->has_word_assert;
+  }
+
+  node_free(tree);
+  return re;
+}
+
+static void dfa_clear(RxDfa *dfa) {
+  for (size_t i = 0; i < dfa->count; i++) {
+    free(dfa->states[i].pcs);
+  }
+  free(dfa->states);
+  dfa->states = NULL;
+  dfa->count = 0;
+  dfa->capacity = 0;
+}
+
+void regex_free(Regex *re) {
+  if (!re)
+    return;
+  for (size_t i = 0; i < re->class_count; i++) {
+    free(re->classes[i].ranges);
+  }
+  free(re->classes);
+  free(re->prog);
+  free(re->prefix);
+  for (int i = 0; i < 2; i++) {
+    dfa_clear(&re->dfa[i]);
+    free(re->lists[i].pcs);
+    free(re->lists[i].caps);
+    free(re->lists[i].mark);
+  }
+  free(re->jobs);
+  free(re->work);
+  free(re->set_buffer);
+  free(re->set_mark);
+  free(re);
+}
+
+int regex_group_count(const Regex *re) { return re->groups; }
+
+/* ============================================================================
+ * Lazy DFA
+ * ============================================================================
+ */
+
+static bool consumes(const RxInst *inst, uint32_t c) {
+  switch (inst->op) {
+  case RX_CHAR:
+    return (uint32_t)inst->x == c;
+  case RX_ANY:
+    return c != '\n';
+  default:
+    return false;
+  }
+}
+
+/* Add the epsilon closure of pc to the set being built. EOL instructions
+ * stay in the set so acceptance at the end of the text can follow them. */
+static void dfa_closure(Regex *re, int pc, bool at_start, bool at_end,
+                        size_t *count) {
+  while (true) {
+    if (re->set_mark[pc] == re->set_generation)
+      return;
+    re->set_mark[pc] = re->set_generation;
+    RxInst *inst = &re->prog[pc];
+
+    switch (inst->op) {
+    case RX_JMP:
+      pc = inst->x;
+      continue;
+    case RX_SPLIT:
+      dfa_closure(re, inst->x, at_start, at_end, count);
+      pc = inst->y;
+      continue;
+    case RX_SAVE:
+      pc++;
+      continue;
+    case RX_BOL:
+      if (!at_start)
+        return;
+      pc++;
+      continue;
+    case RX_EOL:
+      if (at_end) {
+        pc++;
+        continue;
+      }
+      re->set_buffer[(*count)++] = pc;
+      return;
+    default:
+      re->set_buffer[(*count)++] = pc;
+      return;
+    }
+  }
+}
+
+static int compare_int(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+static void set_begin(Regex *re) {
+  if (++re->set_generation == 0) {
+    memset(re->set_mark, 0, sizeof(unsigned) * re->prog_count);
+    re->set_generation = 1;
+  }
+}
+
+/* Find or add the state for set_buffer[0..count); -1 if the DFA gave up */
+static int dfa_intern(Regex *re, RxDfa *dfa, size_t count) {
+  qsort(re->set_buffer, count, sizeof(int), compare_int);
+  uint64_t hash = 1469598103934665603ULL;
+  for (size_t i = 0; i < count; i++) {
+    hash = (hash ^ (uint64_t)re->set_buffer[i]) * 1099511628211ULL;
+  }
+
+  for (size_t i = 0; i < dfa->count; i++) {
+    RxDState *state = &dfa->states[i];
+    if (state->hash == hash && state->count == count &&
+        memcmp(state->pcs, re->set_buffer, sizeof(int) * count) == 0)
+      return (int)i;
+  }
+
+  if (dfa->count >= RX_DFA_MAX_STATES) {
+    dfa_clear(dfa);
+    dfa->failed = true;
+    return -1;
+  }
+  if (dfa->count >= dfa->capacity) {
+    dfa->capacity = dfa->capacity == 0 ? 16 : dfa->capacity * 2;
+    dfa->states =
+        (RxDState *)realloc(dfa->states, sizeof(RxDState) * dfa->capacity);
+  }
+
+  RxDState *state = &dfa->states[dfa->count];
+  state->pcs = (int *)malloc(sizeof(int) * (count > 0 ? count : 1));
+  memcpy(state->pcs, re->set_buffer, sizeof(int) * count);
+  state->count = count;
+  state->hash = hash;
+  state->accepting = false;
+  state->eol_accepting = false;
+  for (int c = 0; c < RX_ASCII; c++) {
+    state->next[c] = -1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (re->prog[state->pcs[i]].op == RX_MATCH)
+      state->accepting = true;
+  }
+
+  /* Would the text ending here complete a match? */
+  int *pcs = state->pcs;
+  set_begin(re);
+  size_t end_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (re->prog[pcs[i]].op == RX_EOL)
+      dfa_closure(re, pcs[i] + 1, false, true, &end_count);
+  }
+  for (size_t i = 0; i < end_count; i++) {
+    if (re->prog[re->set_buffer[i]].op == RX_MATCH)
+      state->eol_accepting = true;
+  }
+  state->eol_accepting = state->eol_accepting || state->accepting;
+
+  return (int)dfa->count++;
+}
+
+static int dfa_start(Regex *re, RxDfa *dfa, bool at_start) {
+  if (dfa->start[at_start] < 0) {
+    set_begin(re);
+    size_t count = 0;
+    dfa_closure(re, 0, at_start, false, &count);
+    dfa->start[at_start] = dfa_intern(re, dfa, count);
+  }
+  return dfa->start[at_start];
+}
+
+static int dfa_step(Regex *re, RxDfa *dfa, int from, uint32_t c,
+                    bool unanchored) {
+  if (c < RX_ASCII && dfa->states[from].next[c] >= 0)
+    return dfa->states[from].next[c];
+
+  set_begin(re);
+  size_t count = 0;
+  RxDState *state = &dfa->states[from];
+  for (size_t i = 0; i < state->count; i++) {
+    RxInst *inst = &re->prog[state->pcs[i]];
+    bool ok = inst->op == RX_CLASS ? class_match(&re->classes[inst->x], c)
+                                   : consumes(inst, c);
+    if (ok)
+      dfa_closure(re, state->pcs[i] + 1, false, false, &count);
+  }
+  if (unanchored)
+    dfa_closure(re, 0, false, false, &count);
+
+  int to = dfa_intern(re, dfa, count);
+  if (to >= 0 && c < RX_ASCII)
+    dfa->states[from].next[c] = to;
+  return to;
+}
+
+static void ensure_scratch(Regex *re) {
+  if (re->set_mark)
+    return;
+  size_t n = re->prog_count;
+  size_t ncap = 2 * (size_t)(re->groups + 1);
+  re->set_mark = (unsigned *)calloc(n, sizeof(unsigned));
+  re->set_buffer = (int *)malloc(sizeof(int) * n);
+  re->jobs = (RxJob *)malloc(sizeof(RxJob) * (2 * n + 1));
+  re->work = (size_t *)malloc(sizeof(size_t) * ncap);
+  for (int i = 0; i < 2; i++) {
+    re->lists[i].pcs = (int *)malloc(sizeof(int) * n);
+    re->lists[i].caps = (size_t *)malloc(sizeof(size_t) * n * ncap);
+    re->lists[i].mark = (unsigned *)calloc(n, sizeof(unsigned));
+    re->lists[i].generation = 0;
+  }
+}
+
+bool regex_exists(Regex *re, const char *text, size_t length, size_t start,
+                  bool full) {
+  ensure_scratch(re);
+  RxDfa *dfa = &re->dfa[full ? 1 : 0];
+  if (dfa->failed || start >= length)
+    return true; /* Unknown - let the VM decide */
+
+  int state = dfa_start(re, dfa, start == 0);
+  size_t pos = start;
+  while (state >= 0) {
+    if (!full && dfa->states[state].accepting)
+      return true;
+    if (pos >= length)
+      return dfa->states[state].eol_accepting;
+    if (full && dfa->states[state].count == 0)
+      return false;
+
+    size_t width;
+    uint32_t c = rx_decode(text + pos, length - pos, &width);
+    state = dfa_step(re, dfa, state, c, !full);
+    pos += width;
+  }
+  return true; /* The DFA gave up */
+}
+
+/* ============================================================================
+ * Pike VM
+ * ============================================================================
+ */
+
+static void list_clear(Regex *re, RxList *list) {
+  list->count = 0;
+  if (++list->generation == 0) {
+    memset(list->mark, 0, sizeof(unsigned) * re->prog_count);
+    list->generation = 1;
+  }
+}
+
+/* Follow epsilon transitions from pc at text position pos, appending every
+ * consuming thread in priority order */
+static void add_thread(Regex *re, RxList *list, int pc0, const size_t *caps,
+                       const char *text, size_t length, size_t pos) {
+  size_t ncap = 2 * (size_t)(re->groups + 1);
+  size_t *work = re->work;
+  memcpy(work, caps, sizeof(size_t) * ncap);
+
+  RxJob *jobs = re->jobs;
+  size_t top = 0;
+  jobs[top].kind = 0;
+  jobs[top++].pc = pc0;
+
+  while (top > 0) {
+    RxJob job = jobs[--top];
+    if (job.kind == 1) {
+      work[job.pc] = job.value;
+      continue;
+    }
+
+    int pc = job.pc;
+    while (list->mark[pc] != list->generation) {
+      list->mark[pc] = list->generation;
+      RxInst *inst = &re->prog[pc];
+      bool follow = false;
+
+      switch (inst->op) {
+      case RX_JMP:
+        pc = inst->x;
+        follow = true;
+        break;
+      case RX_SPLIT:
+        jobs[top].kind = 0;
+        jobs[top++].pc = inst->y;
+        pc = inst->x;
+        follow = true;
+        break;
+      case RX_SAVE:
+        jobs[top].kind = 1;
+        jobs[top].pc = inst->x;
+        jobs[top++].value = work[inst->x];
+        work[inst->x] = pos;
+        pc++;
+        follow = true;
+        break;
+      case RX_BOL:
+        follow = pos == 0;
+        pc++;
+        break;
+      case RX_EOL:
+        follow = pos == length;
+        pc++;
+        break;
+      case RX_WORDB:
+      case RX_NWORDB:
+        follow = rx_word_boundary(text, length, pos) == (inst->op == RX_WORDB);
+        pc++;
+        break;
+      default:
+        list->pcs[list->count] = pc;
+        memcpy(&list->caps[list->count * ncap], work, sizeof(size_t) * ncap);
+        list->count++;
+        break;
+      }
+      if (!follow)
+        break;
+    }
+  }
+}
+
+/* Next position at or after pos where the literal prefix occurs */
+static bool skip_to_prefix(const Regex *re, const char *text, size_t length,
+                           size_t *pos) {
+  const char *p = text + *pos;
+  const char *last = text + length - re->prefix_length;
+  if (length < re->prefix_length)
+    return false;
+  while (p <= last) {
+    p = (const char *)memchr(p, re->prefix[0], (size_t)(last - p) + 1);
+    if (!p)
+      return false;
+    if (memcmp(p, re->prefix, re->prefix_length) == 0) {
+      *pos = (size_t)(p - text);
+      return true;
+    }
+    p++;
+  }
+  return false;
+}
+
+bool regex_search(Regex *re, const char *text, size_t length, size_t start,
+                  bool full, size_t *captures) {
+  ensure_scratch(re);
+  size_t ncap = 2 * (size_t)(re->groups + 1);
+  size_t *unset = (size_t *)malloc(sizeof(size_t) * ncap);
+  for (size_t i = 0; i < ncap; i++) {
+    unset[i] = REGEX_UNSET;
+  }
+
+  RxList *current = &re->lists[0];
+  RxList *next = &re->lists[1];
+  list_clear(re, current);
+  bool matched = false;
+  size_t pos = start;
+
+  while (true) {
+    /* A new attempt starts here, behind every thread already running */
+    if (!matched && (!full || pos == start)) {
+      if (current->count == 0 && !full && re->prefix_length > 0) {
+        if (!skip_to_prefix(re, text, length, &pos))
+          break;
+      }
+      add_thread(re, current, 0, unset, text, length, pos);
+    }
+    if (current->count == 0 && (matched || full || pos >= length))
+      break;
+
+    size_t width = 0;
+    uint32_t c = 0;
+    if (pos < length)
+      c = rx_decode(text + pos, length - pos, &width);
+
+    list_clear(re, next);
+    for (size_t i = 0; i < current->count; i++) {
+      RxInst *inst = &re->prog[current->pcs[i]];
+      size_t *caps = &current->caps[i * ncap];
+
+      if (inst->op == RX_MATCH) {
+        if (full && pos != length)
+          continue;
+        matched = true;
+        memcpy(captures, caps, sizeof(size_t) * ncap);
+        break; /* Lower-priority threads are cut */
+      }
+      if (pos >= length)
+        continue;
+      bool ok = inst->op == RX_CLASS ? class_match(&re->classes[inst->x], c)
+                                     : consumes(inst, c);
+      if (ok)
+        add_thread(re, next, current->pcs[i] + 1, caps, text, length,
+                   pos + width);
+    }
+
+    if (pos >= length)
+      break;
+    RxList *swap = current;
+    current = next;
+    next = swap;
+    pos += width;
+  }
+
+  free(unset);
+  return matched;
+}
+
+/* ============================================================================
+ * Pattern Cache
+ * ============================================================================
+ */
+
+#define REGEX_CACHE_SIZE 64
+
+typedef struct {
+  char *pattern;
+  size_t length;
+  uint64_t hash;
+  Regex *re;
+  uint64_t last_used;
+} RegexCacheEntry;
+
+static RegexCacheEntry regex_cache[REGEX_CACHE_SIZE];
+static uint64_t regex_cache_clock;
+
+Regex *regex_cache_get(const char *pattern, size_t length, const char **error) {
+  uint64_t hash = 1469598103934665603ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)pattern[i]) * 1099511628211ULL;
+  }
+
+  RegexCacheEntry *victim = &regex_cache[0];
+  for (size_t i = 0; i < REGEX_CACHE_SIZE; i++) {
+    RegexCacheEntry *entry = &regex_cache[i];
+    if (entry->re && entry->hash == hash && entry->length == length &&
+        memcmp(entry->pattern, pattern, length) == 0) {
+      entry->last_used = ++regex_cache_clock;
+      return entry->re;
+    }
+    if (!entry->re || (victim->re && entry->last_used < victim->last_used))
+      victim = entry;
+  }
+
+  Regex *re = regex_compile(pattern, length, error);
+  if (!re)
+    return NULL;
+
+  /* Evict the least recently used pattern */
+  regex_free(victim->re);
+  free(victim->pattern);
+  victim->pattern = (char *)malloc(length > 0 ? length : 1);
+  memcpy(victim->pattern, pattern, length);
+  victim->length = length;
+  victim->hash = hash;
+  victim->re = re;
+  victim->last_used = ++regex_cache_clock;
+  return re;
+}
+
+void regex_cache_clear(void) {
+  for (size_t i = 0; i < REGEX_CACHE_SIZE; i++) {
+    regex_free(regex_cache[i].re);
+    free(regex_cache[i].pattern);
+    regex_cache[i].re = NULL;
+    regex_cache[i].pattern = NULL;
+  }
+}
@@ -0,0 +1,44 @@
+/*
+ * Keikaku Programming Language - Regular Expressions
+ *
+ * "Every pattern was foreseen."
+ *
+ * Patterns compile to a small instruction program that is run by a Pike VM
+ * (a breadth-first NFA simulation with captures), so matching time is linear
+ * in the text for any pattern. A lazily built DFA over the same program
+ * rejects non-matching text before the VM runs, and a literal prefix, when
+ * the pattern has one, lets the search skip ahead with memchr.
+ */
+
+#ifndef KEIKAKU_REGEX_H
+#define KEIKAKU_REGEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Capture slot value for a group that did not participate in the match */
+#define REGEX_UNSET ((size_t)-1)
+
+typedef struct Regex Regex;
+
+/* Compile a pattern; returns NULL and sets *error on a syntax error */
+Regex *regex_compile(const char *pattern, size_t length, const char **error);
+void regex_free(Regex *re);
+
+/* Capture groups in the pattern, not counting the whole match */
+int regex_group_count(const Regex *re);
+
+/* Whether any match exists in text[start..] (full: the whole remainder) */
+bool regex_exists(Regex *re, const char *text, size_t length, size_t start,
+                  bool full);
+
+/* Leftmost match at or after start. With full, the match must span
+ * text[start..length]. captures receives 2 * (groups + 1) byte offsets. */
+bool regex_search(Regex *re, const char *text, size_t length, size_t start,
+                  bool full, size_t *captures);
+
+/* Compiled patterns, cached by pattern text */
+Regex *regex_cache_get(const char *pattern, size_t length, const char **error);
+void regex_cache_clear(void);
+
+#endif /* KEIKAKU_REGEX_H */
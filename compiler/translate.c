@@ -0,0 +1,1038 @@
+/*
+ * Keikaku Programming Language - Translation to C
+ *
+ * "The script was always going to become this."
+ *
+ * Generated code keeps every value in a Value-sized slot: the temporaries
+ * t[] of each function, a pair l_x (storage) and s_x (NULL until bound)
+ * per local, gv_x and g_x per global, and l_x alone per parameter. A name
+ * that a protocol binds but that may also be a global is resolved the way
+ * the interpreter's scopes do it, as s_x ? s_x : g_x. Temporaries are used
+ * as a stack and are void whenever they are not holding a pending operand,
+ * so a deviation can jump to the end of the function (or of the top-level
+ * statement) and free all of them.
+ */
+
+#define _DEFAULT_SOURCE /* open_memstream */
+
+#include "translate.h"
+#include "interpreter.h"
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(_Alignof(Value) <= 8 && sizeof(Value) % 8 == 0,
+               "generated code stores values as 64-bit words");
+_Static_assert(_Alignof(GenFrame) <= 8,
+               "generated code stores ranges as 64-bit words");
+
+/* The compiled_* entry points of interpreter.h, in terms of the opaque
+ * Value and Range of generated code */
+static const char runtime_declarations[] =
+    "typedef struct Interpreter Interpreter;\n"
+    "\n"
+    "Interpreter *compiled_start(int report_level);\n"
+    "int compiled_finish(Interpreter *interp);\n"
+    "void compiled_statement_end(Interpreter *interp);\n"
+    "bool compiled_failed(const Interpreter *interp);\n"
+    "void compiled_int(Value *out, int64_t val);\n"
+    "void compiled_float(Value *out, double val);\n"
+    "void compiled_bool(Value *out, bool val);\n"
+    "void compiled_string(Value *out, const char *data, size_t length);\n"
+    "void compiled_list(Value *out);\n"
+    "void compiled_list_push(Value *list, Value *item);\n"
+    "void compiled_free(Value *vals, size_t count);\n"
+    "void compiled_assign(Value *slot, Value *val);\n"
+    "bool compiled_truth(Value *val);\n"
+    "void compiled_read(Interpreter *interp, Value *out, const Value *slot,\n"
+    "                   const char *name, int line);\n"
+    "void compiled_unknown(Interpreter *interp, const char *name, int line);\n"
+    "void compiled_binary(Interpreter *interp, Value *out, int op, "
+    "Value *left,\n"
+    "                     Value *right, int line);\n"
+    "void compiled_negate(Value *out, Value *operand);\n"
+    "void compiled_format(Interpreter *interp, Value *text, Value *val,\n"
+    "                     const char *spec, int line);\n"
+    "void compiled_index(Interpreter *interp, Value *out, Value *container,\n"
+    "                    Value *index, int line);\n"
+    "void compiled_index_at(Interpreter *interp, Value *out, "
+    "const Value *slot,\n"
+    "                       const char *name, Value *index, int line);\n"
+    "bool compiled_builtin(Interpreter *interp, Value *out, "
+    "const char *name);\n"
+    "bool compiled_call_builtin(Interpreter *interp, Value *out,\n"
+    "                           const Value *builtin, int argc, "
+    "Value *argv,\n"
+    "                           Value *lent, const char *lent_name, "
+    "int use,\n"
+    "                           int line);\n"
+    "bool compiled_enter(Interpreter *interp, const char *name, int line);\n"
+    "void compiled_leave(Interpreter *interp);\n"
+    "bool compiled_range(Interpreter *interp, Range *range, Value *start,\n"
+    "                    Value *end, Value *step, int line);\n"
+    "bool compiled_range_next(Range *range, Value *slot);\n";
+
+/* ============================================================================
+ * Names
+ * ============================================================================
+ */
+
+/* Names a script binds, searched linearly: scripts bind few */
+typedef struct {
+  const char **names;
+  size_t count;
+  size_t capacity;
+} NameList;
+
+static bool names_has(const NameList *list, const char *name) {
+  for (size_t i = 0; i < list->count; i++) {
+    if (strcmp(list->names[i], name) == 0)
+      return true;
+  }
+  return false;
+}
+
+static size_t names_index(const NameList *list, const char *name) {
+  for (size_t i = 0; i < list->count; i++) {
+    if (strcmp(list->names[i], name) == 0)
+      return i;
+  }
+  return list->count;
+}
+
+/* Add name unless it is already listed */
+static void names_add(NameList *list, const char *name) {
+  if (names_has(list, name))
+    return;
+  if (list->count >= list->capacity) {
+    list->capacity = list->capacity == 0 ? 8 : list->capacity * 2;
+    list->names = (const char **)realloc(
+        list->names, sizeof(const char *) * list->capacity);
+  }
+  list->names[list->count++] = name;
+}
+
+static void names_clear(NameList *list) {
+  free(list->names);
+  memset(list, 0, sizeof(*list));
+}
+
+/* ============================================================================
+ * Translator
+ * ============================================================================
+ */
+
+typedef struct {
+  Interpreter *probe; /* A fresh interpreter, to look up built-ins */
+  NameList globals;   /* Variables bound at the top level */
+  NameList protocols; /* Protocols defined at the top level */
+  ASTNode **protocol_nodes;
+  NameList builtins; /* Built-ins the script calls */
+
+  /* The function being written */
+  FILE *out;
+  ASTNode *protocol; /* NULL for the top level */
+  NameList params;
+  NameList locals;
+  int indent;
+  int temps;     /* Temporaries the function needs */
+  int loops;     /* Cycles around the current statement */
+  char fail[24]; /* Label a deviation jumps to */
+
+  bool ok;
+  TranslateFailure *failure;
+} Translator;
+
+/* Give up on the script, remembering the first reason */
+static void fail(Translator *t, int line, const char *what) {
+  if (!t->ok)
+    return;
+  t->ok = false;
+  t->failure->line = line;
+  snprintf(t->failure->what, sizeof(t->failure->what), "%s", what);
+}
+
+/* Give up on a node of a kind not handled, named as in the AST */
+static void fail_node(Translator *t, ASTNode *node) {
+  char what[64];
+  const char *name = ast_node_type_name(node->type);
+  size_t i = 0;
+  for (; name[i] && i < sizeof(what) - 1; i++) {
+    what[i] = name[i] == '_' ? ' ' : (char)tolower((unsigned char)name[i]);
+  }
+  what[i] = '\0';
+  fail(t, node->line, what);
+}
+
+static void emit(Translator *t, const char *format, ...) {
+  if (!t->ok)
+    return;
+  fprintf(t->out, "%*s", 2 * t->indent, "");
+  va_list args;
+  va_start(args, format);
+  vfprintf(t->out, format, args);
+  va_end(args);
+  fputc('\n', t->out);
+}
+
+/* Temporaries dst and up to count - 1 above it will be used */
+static void need_temps(Translator *t, int dst, int count) {
+  if (dst + count > t->temps)
+    t->temps = dst + count;
+}
+
+static void check(Translator *t) {
+  emit(t, "if (compiled_failed(interp))");
+  emit(t, "  goto %s;", t->fail);
+}
+
+void translate_write_string(FILE *out, const char *s, size_t length) {
+  fputc('"', out);
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)s[i];
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c == '?') /* Never part of a trigraph */
+      fputs("\\?", out);
+    else if (c < 0x20 || c >= 0x7F)
+      fprintf(out, "\\%03o", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+/* Write a line containing a C string literal: prefix "s" suffix */
+static void emit_with_string(Translator *t, const char *prefix, const char *s,
+                             size_t length, const char *suffix) {
+  if (!t->ok)
+    return;
+  fprintf(t->out, "%*s%s", 2 * t->indent, "", prefix);
+  translate_write_string(t->out, s, length);
+  fprintf(t->out, "%s\n", suffix);
+}
+
+static bool is_builtin(Translator *t, const char *name) {
+  Value builtin;
+  return compiled_builtin(t->probe, &builtin, name);
+}
+
+/* Names become part of C identifiers */
+static bool c_spellable(const char *name) {
+  if (!*name)
+    return false;
+  for (const char *c = name; *c; c++) {
+    if (!isalnum((unsigned char)*c) && *c != '_')
+      return false;
+  }
+  return true;
+}
+
+static bool is_variable(Translator *t, const char *name) {
+  return names_has(&t->globals, name) ||
+         (t->protocol &&
+          (names_has(&t->params, name) || names_has(&t->locals, name)));
+}
+
+/* The C expression for the slot a name is read from: a Value pointer that
+ * is NULL while nothing is bound to the name */
+static void slot_of(Translator *t, const char *name, char *buffer,
+                    size_t size) {
+  bool global = names_has(&t->globals, name);
+  if (t->protocol && names_has(&t->params, name))
+    snprintf(buffer, size, "&l_%s", name);
+  else if (t->protocol && names_has(&t->locals, name) && global)
+    snprintf(buffer, size, "(s_%s ? s_%s : g_%s)", name, name, name);
+  else if (t->protocol && names_has(&t->locals, name))
+    snprintf(buffer, size, "s_%s", name);
+  else if (global)
+    snprintf(buffer, size, "g_%s", name);
+  else
+    snprintf(buffer, size, "NULL");
+}
+
+/* Bind name as designate or = (and :=) would, writing the slot to store
+ * into. In a protocol = rebinds a local, else a global, else makes a local. */
+static void bind_slot(Translator *t, const char *name, bool designate,
+                      char *buffer, size_t size) {
+  if (!t->protocol) {
+    emit(t, "g_%s = &gv_%s;", name, name);
+    snprintf(buffer, size, "g_%s", name);
+  } else if (names_has(&t->params, name)) {
+    snprintf(buffer, size, "&l_%s", name);
+  } else if (!designate && names_has(&t->globals, name)) {
+    emit(t, "if (!s_%s && !g_%s)", name, name);
+    emit(t, "  s_%s = &l_%s;", name, name);
+    snprintf(buffer, size, "(s_%s ? s_%s : g_%s)", name, name, name);
+  } else {
+    emit(t, "s_%s = &l_%s;", name, name);
+    snprintf(buffer, size, "s_%s", name);
+  }
+}
+
+/* ============================================================================
+ * Binding Analysis
+ * ============================================================================
+ */
+
+/* Names a statement binds with :=, = or a counted cycle. Protocols are not
+ * looked into, and constructs the translator rejects need not be. */
+static void collect_bindings(ASTNode *node, NameList *into);
+
+static void collect_block(ASTNodeArray *stmts, NameList *into) {
+  for (size_t i = 0; i < stmts->count; i++) {
+    collect_bindings(stmts->nodes[i], into);
+  }
+}
+
+static void collect_bindings(ASTNode *node, NameList *into) {
+  switch (node->type) {
+  case AST_DESIGNATE:
+  case AST_ASSIGN:
+    if (node->data.assign.target->type == AST_IDENTIFIER)
+      names_add(into, node->data.assign.target->data.identifier.name);
+    break;
+  case AST_FORESEE:
+    collect_block(&node->data.foresee.body, into);
+    for (size_t i = 0; i < node->data.foresee.alternates.count; i++) {
+      collect_block(&node->data.foresee.alternates.alts[i].body, into);
+    }
+    collect_block(&node->data.foresee.otherwise, into);
+    break;
+  case AST_CYCLE_WHILE:
+    collect_block(&node->data.cycle_while.body, into);
+    break;
+  case AST_CYCLE_FROM_TO:
+    if (node->data.cycle_from_to.var_pattern->type == AST_IDENTIFIER)
+      names_add(into,
+                node->data.cycle_from_to.var_pattern->data.identifier.name);
+    collect_block(&node->data.cycle_from_to.body, into);
+    break;
+  default:
+    break;
+  }
+}
+
+/* Variables must be spellable in C and must not share a name with a
+ * protocol, since calls look names up wherever they are bound. A variable
+ * may hide a built-in, which is then never called (see translate_call). */
+static void check_variables(Translator *t, NameList *names, int line) {
+  for (size_t i = 0; i < names->count; i++) {
+    const char *name = names->names[i];
+    if (!c_spellable(name))
+      fail(t, line, "a name C cannot spell");
+    else if (names_has(&t->protocols, name))
+      fail(t, line, "a variable named like a protocol");
+  }
+}
+
+/* ============================================================================
+ * Expressions
+ * ============================================================================
+ */
+
+/* Each expression leaves its value in t[dst], using temporaries above dst
+ * while it runs */
+static void translate_expr(Translator *t, ASTNode *node, int dst);
+
+static void translate_call(Translator *t, ASTNode *node, int dst,
+                           CompiledUse use, const char *home);
+
+static void translate_binary(Translator *t, ASTNode *node, int dst) {
+  BinaryOp op = node->data.binary.op;
+  translate_expr(t, node->data.binary.left, dst);
+
+  /* and/or stop at the left side when it decides, and give a bool */
+  if (op == OP_AND || op == OP_OR) {
+    emit(t, "{");
+    t->indent++;
+    emit(t, "bool truth = compiled_truth(&t[%d]);", dst);
+    emit(t, "if (%struth) {", op == OP_AND ? "" : "!");
+    t->indent++;
+    translate_expr(t, node->data.binary.right, dst);
+    emit(t, "truth = compiled_truth(&t[%d]);", dst);
+    t->indent--;
+    emit(t, "}");
+    emit(t, "compiled_bool(&t[%d], truth);", dst);
+    t->indent--;
+    emit(t, "}");
+    return;
+  }
+
+  need_temps(t, dst, 2);
+  translate_expr(t, node->data.binary.right, dst + 1);
+  emit(t, "compiled_binary(interp, &t[%d], %d /* %s */, &t[%d], &t[%d], %d);",
+       dst, (int)op, ast_binary_op_name(op), dst, dst + 1, node->line);
+  check(t);
+}
+
+static void translate_fstring(Translator *t, ASTNode *node, int dst) {
+  ASTNodeArray *parts = &node->data.fstring.parts;
+  need_temps(t, dst, 2);
+  emit(t, "compiled_string(&t[%d], \"\", 0);", dst);
+  for (size_t i = 0; i < parts->count; i++) {
+    const char *spec = node->data.fstring.specs[i];
+    translate_expr(t, parts->nodes[i], dst + 1);
+    if (!t->ok)
+      return;
+    fprintf(t->out, "%*scompiled_format(interp, &t[%d], &t[%d], ",
+            2 * t->indent, "", dst, dst + 1);
+    if (spec)
+      translate_write_string(t->out, spec, strlen(spec));
+    else
+      fputs("NULL", t->out);
+    fprintf(t->out, ", %d);\n", parts->nodes[i]->line);
+    check(t);
+  }
+}
+
+static void translate_expr(Translator *t, ASTNode *node, int dst) {
+  if (!t->ok)
+    return;
+  need_temps(t, dst, 1);
+  char slot[600];
+
+  switch (node->type) {
+  case AST_INTEGER:
+    if (node->data.int_value == INT64_MIN)
+      emit(t, "compiled_int(&t[%d], INT64_MIN);", dst);
+    else
+      emit(t, "compiled_int(&t[%d], INT64_C(%" PRId64 "));", dst,
+           node->data.int_value);
+    return;
+
+  case AST_FLOAT:
+    emit(t, "compiled_float(&t[%d], %a);", dst, node->data.float_value);
+    return;
+
+  case AST_STRING: {
+    char prefix[48];
+    snprintf(prefix, sizeof(prefix), "compiled_string(&t[%d], ", dst);
+    size_t length = strlen(node->data.string_value);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ", %zu);", length);
+    emit_with_string(t, prefix, node->data.string_value, length, suffix);
+    return;
+  }
+
+  case AST_FSTRING:
+    translate_fstring(t, node, dst);
+    return;
+
+  case AST_BOOL:
+    emit(t, "compiled_bool(&t[%d], %s);", dst,
+         node->data.bool_value ? "true" : "false");
+    return;
+
+  case AST_LIST: {
+    need_temps(t, dst, 2);
+    emit(t, "compiled_list(&t[%d]);", dst);
+    for (size_t i = 0; i < node->data.list.elements.count; i++) {
+      ASTNode *element = node->data.list.elements.nodes[i];
+      if (element->type == AST_SPREAD) {
+        fail_node(t, element);
+        return;
+      }
+      translate_expr(t, element, dst + 1);
+      emit(t, "compiled_list_push(&t[%d], &t[%d]);", dst, dst + 1);
+    }
+    return;
+  }
+
+  case AST_IDENTIFIER: {
+    const char *name = node->data.identifier.name;
+    if (!is_variable(t, name) &&
+        (names_has(&t->protocols, name) || is_builtin(t, name))) {
+      fail(t, node->line, "a protocol used as a value");
+      return;
+    }
+    if (!c_spellable(name)) {
+      fail(t, node->line, "a name C cannot spell");
+      return;
+    }
+    slot_of(t, name, slot, sizeof(slot));
+    emit(t, "compiled_read(interp, &t[%d], %s, \"%s\", %d);", dst, slot, name,
+         node->line);
+    check(t);
+    return;
+  }
+
+  case AST_BINARY_OP:
+    translate_binary(t, node, dst);
+    return;
+
+  case AST_UNARY_OP:
+    translate_expr(t, node->data.unary.operand, dst);
+    if (node->data.unary.op == OP_NOT)
+      emit(t, "compiled_bool(&t[%d], !compiled_truth(&t[%d]));", dst, dst);
+    else
+      emit(t, "compiled_negate(&t[%d], &t[%d]);", dst, dst);
+    return;
+
+  case AST_CALL:
+    translate_call(t, node, dst, COMPILED_KEPT, NULL);
+    return;
+
+  case AST_INDEX: {
+    /* A variable is indexed in place, after the index as in eval_expr */
+    ASTNode *object = node->data.index.object;
+    if (object->type == AST_IDENTIFIER && is_variable(t,
+                                                      object->data.identifier
+                                                          .name)) {
+      const char *name = object->data.identifier.name;
+      translate_expr(t, node->data.index.index, dst);
+      slot_of(t, name, slot, sizeof(slot));
+      emit(t, "compiled_index_at(interp, &t[%d], %s, \"%s\", &t[%d], %d);",
+           dst, slot, name, dst, node->line);
+    } else {
+      need_temps(t, dst, 2);
+      translate_expr(t, object, dst);
+      translate_expr(t, node->data.index.index, dst + 1);
+      emit(t, "compiled_index(interp, &t[%d], &t[%d], &t[%d], %d);", dst, dst,
+           dst + 1, node->line);
+    }
+    check(t);
+    return;
+  }
+
+  case AST_TERNARY:
+    translate_expr(t, node->data.ternary.condition, dst);
+    emit(t, "if (compiled_truth(&t[%d])) {", dst);
+    t->indent++;
+    translate_expr(t, node->data.ternary.true_value, dst);
+    t->indent--;
+    emit(t, "} else {");
+    t->indent++;
+    translate_expr(t, node->data.ternary.false_value, dst);
+    t->indent--;
+    emit(t, "}");
+    return;
+
+  default:
+    fail_node(t, node);
+  }
+}
+
+/* A call by name, leaving the result in t[dst] unless use is
+ * COMPILED_UNUSED. For a built-in, home names a C bool to set when the
+ * result stayed in the lent variable. */
+static void translate_call(Translator *t, ASTNode *node, int dst,
+                           CompiledUse use, const char *home) {
+  const char *name = node->data.call.name;
+  ASTNodeArray *args = &node->data.call.args;
+  for (size_t i = 0; i < args->count; i++) {
+    if (args->nodes[i]->type == AST_SPREAD) {
+      fail_node(t, args->nodes[i]);
+      return;
+    }
+  }
+
+  size_t index = names_index(&t->protocols, name);
+  if (index < t->protocols.count) {
+    /* Missing arguments are void and extra ones are dropped, as in
+     * bind_parameters */
+    ASTParamArray *params = &t->protocol_nodes[index]->data.protocol.params;
+    size_t slots = params->count > args->count ? params->count : args->count;
+    need_temps(t, dst, (int)(slots > 0 ? slots : 1));
+    emit(t, "if (!f_%s) {", name);
+    emit(t, "  compiled_unknown(interp, \"%s\", %d);", name, node->line);
+    emit(t, "  goto %s;", t->fail);
+    emit(t, "}");
+    for (size_t i = 0; i < args->count; i++) {
+      translate_expr(t, args->nodes[i], dst + (int)i);
+    }
+    if (!t->ok)
+      return;
+
+    emit(t, "if (compiled_enter(interp, \"%s\", %d)) {", name, node->line);
+    fprintf(t->out, "%*s  p_%s(interp, &t[%d]", 2 * t->indent, "", name, dst);
+    for (size_t i = 0; i < params->count; i++) {
+      fprintf(t->out, ", &t[%d]", dst + (int)i);
+    }
+    fprintf(t->out, ");\n");
+    emit(t, "  compiled_leave(interp);");
+    emit(t, "}");
+    if (args->count > params->count)
+      emit(t, "compiled_free(&t[%d], %zu);", dst + (int)params->count,
+           args->count - params->count);
+    check(t);
+    if (use == COMPILED_UNUSED)
+      emit(t, "compiled_free(&t[%d], 1);", dst);
+    return;
+  }
+
+  if (is_variable(t, name) || !c_spellable(name)) {
+    fail(t, node->line, "a call of a variable");
+    return;
+  }
+
+  Value builtin;
+  if (!compiled_builtin(t->probe, &builtin, name)) {
+    emit(t, "compiled_unknown(interp, \"%s\", %d);", name, node->line);
+    emit(t, "goto %s;", t->fail);
+    return;
+  }
+  names_add(&t->builtins, name);
+
+  /* The first argument is lent as eval_call lends it: evaluated last, and
+   * only when it is a variable */
+  ASTNode *first = args->count > 0 ? args->nodes[0] : NULL;
+  CompiledLending lending = compiled_lending(&builtin);
+  bool lend = first && lending != LEND_NONE && first->type == AST_IDENTIFIER &&
+              is_variable(t, first->data.identifier.name);
+  if (first && lending == LEND_MUTATE &&
+      (first->type == AST_INDEX || first->type == AST_MEMBER)) {
+    fail(t, node->line, "a built-in changing part of a container");
+    return;
+  }
+
+  need_temps(t, dst, (int)(args->count > 0 ? args->count : 1));
+  for (size_t i = lend ? 1 : 0; i < args->count; i++) {
+    translate_expr(t, args->nodes[i], dst + (int)i);
+  }
+
+  char slot[600] = "NULL";
+  char lent_name[300] = "NULL";
+  if (lend) {
+    slot_of(t, first->data.identifier.name, slot, sizeof(slot));
+    snprintf(lent_name, sizeof(lent_name), "\"%s\"",
+             first->data.identifier.name);
+  }
+  emit(t,
+       "%s%scompiled_call_builtin(interp, &t[%d], &b_%s, %zu, &t[%d], %s, %s, "
+       "%d, %d);",
+       home ? home : "", home ? " = " : "", dst, name, args->count, dst, slot,
+       lent_name, (int)use, node->line);
+  check(t);
+}
+
+/* ============================================================================
+ * Statements
+ * ============================================================================
+ */
+
+static void translate_block(Translator *t, ASTNodeArray *stmts);
+
+static void translate_branches(Translator *t, ASTNode *node, size_t alt) {
+  ASTAlternateArray *alts = &node->data.foresee.alternates;
+  ASTNode *condition = alt == 0 ? node->data.foresee.condition
+                                : alts->alts[alt - 1].condition;
+  ASTNodeArray *body =
+      alt == 0 ? &node->data.foresee.body : &alts->alts[alt - 1].body;
+
+  translate_expr(t, condition, 0);
+  emit(t, "if (compiled_truth(&t[0])) {");
+  t->indent++;
+  translate_block(t, body);
+  t->indent--;
+  if (alt < alts->count) {
+    emit(t, "} else {");
+    t->indent++;
+    translate_branches(t, node, alt + 1);
+    t->indent--;
+  } else if (node->data.foresee.otherwise.count > 0) {
+    emit(t, "} else {");
+    t->indent++;
+    translate_block(t, &node->data.foresee.otherwise);
+    t->indent--;
+  }
+  emit(t, "}");
+}
+
+static void translate_assign(Translator *t, ASTNode *node) {
+  ASTNode *target = node->data.assign.target;
+  ASTNode *value = node->data.assign.value;
+  bool designate = node->type == AST_DESIGNATE;
+  if (target->type != AST_IDENTIFIER) {
+    fail(t, node->line, "assignment to a part of a value");
+    return;
+  }
+  const char *name = target->data.identifier.name;
+  char slot[600];
+
+  /* xs = push(xs, v) leaves the list where it is, as in eval_call */
+  if (!designate && value->type == AST_CALL &&
+      value->data.call.args.count > 0 &&
+      value->data.call.args.nodes[0]->type == AST_IDENTIFIER &&
+      strcmp(value->data.call.args.nodes[0]->data.identifier.name, name) ==
+          0 &&
+      !names_has(&t->protocols, value->data.call.name) &&
+      is_builtin(t, value->data.call.name)) {
+    emit(t, "{");
+    t->indent++;
+    emit(t, "bool home;");
+    translate_call(t, value, 0, COMPILED_IN_PLACE, "home");
+    emit(t, "if (!home) {");
+    t->indent++;
+    bind_slot(t, name, false, slot, sizeof(slot));
+    emit(t, "compiled_assign(%s, &t[0]);", slot);
+    t->indent--;
+    emit(t, "}");
+    t->indent--;
+    emit(t, "}");
+    return;
+  }
+
+  translate_expr(t, value, 0);
+  bind_slot(t, name, designate, slot, sizeof(slot));
+  emit(t, "compiled_assign(%s, &t[0]);", slot);
+}
+
+static void translate_counted(Translator *t, ASTNode *node) {
+  ASTNode *pattern = node->data.cycle_from_to.var_pattern;
+  if (pattern->type != AST_IDENTIFIER) {
+    fail(t, node->line, "a destructuring counted cycle");
+    return;
+  }
+
+  int range = t->loops;
+  emit(t, "{");
+  t->indent++;
+  emit(t, "Range range%d;", range);
+  need_temps(t, 0, 3);
+  translate_expr(t, node->data.cycle_from_to.start, 0);
+  translate_expr(t, node->data.cycle_from_to.end, 1);
+  if (node->data.cycle_from_to.step)
+    translate_expr(t, node->data.cycle_from_to.step, 2);
+  emit(t, "if (!compiled_range(interp, &range%d, &t[0], &t[1], %s, %d))",
+       range, node->data.cycle_from_to.step ? "&t[2]" : "NULL", node->line);
+  emit(t, "  goto %s;", t->fail);
+
+  /* The name is bound, void, before the first value */
+  char slot[600];
+  bind_slot(t, pattern->data.identifier.name, true, slot, sizeof(slot));
+  emit(t, "compiled_free(%s, 1);", slot);
+  emit(t, "while (compiled_range_next(&range%d, %s)) {", range, slot);
+  t->indent++;
+  t->loops++;
+  translate_block(t, &node->data.cycle_from_to.body);
+  t->loops--;
+  t->indent--;
+  emit(t, "}");
+  t->indent--;
+  emit(t, "}");
+}
+
+static void translate_stmt(Translator *t, ASTNode *node) {
+  if (!t->ok)
+    return;
+
+  switch (node->type) {
+  case AST_DESIGNATE:
+  case AST_ASSIGN:
+    translate_assign(t, node);
+    return;
+
+  case AST_EXPR_STMT:
+    if (node->data.expr_stmt.expr->type == AST_CALL) {
+      translate_call(t, node->data.expr_stmt.expr, 0, COMPILED_UNUSED, NULL);
+    } else {
+      translate_expr(t, node->data.expr_stmt.expr, 0);
+      emit(t, "compiled_free(&t[0], 1);");
+    }
+    return;
+
+  case AST_FORESEE:
+    translate_branches(t, node, 0);
+    return;
+
+  case AST_CYCLE_WHILE:
+    emit(t, "for (;;) {");
+    t->indent++;
+    translate_expr(t, node->data.cycle_while.condition, 0);
+    emit(t, "if (!compiled_truth(&t[0]))");
+    emit(t, "  break;");
+    t->loops++;
+    translate_block(t, &node->data.cycle_while.body);
+    t->loops--;
+    t->indent--;
+    emit(t, "}");
+    return;
+
+  case AST_CYCLE_FROM_TO:
+    translate_counted(t, node);
+    return;
+
+  case AST_BREAK:
+  case AST_CONTINUE:
+    if (t->loops == 0) {
+      fail(t, node->line, "break or continue outside a cycle");
+      return;
+    }
+    emit(t, node->type == AST_BREAK ? "break;" : "continue;");
+    return;
+
+  case AST_YIELD:
+    /* A top-level yield concludes the program */
+    if (node->data.yield.value) {
+      translate_expr(t, node->data.yield.value, 0);
+      emit(t, t->protocol ? "compiled_assign(out, &t[0]);"
+                          : "compiled_free(&t[0], 1);");
+    }
+    emit(t, t->protocol ? "goto done;" : "goto finish;");
+    return;
+
+  default:
+    fail_node(t, node);
+  }
+}
+
+static void translate_block(Translator *t, ASTNodeArray *stmts) {
+  for (size_t i = 0; i < stmts->count && t->ok; i++) {
+    translate_stmt(t, stmts->nodes[i]);
+  }
+}
+
+/* ============================================================================
+ * Functions
+ * ============================================================================
+ */
+
+/* Write a function's body to a buffer of its own, since its declarations,
+ * which come first, depend on what the body uses */
+static FILE *body_start(Translator *t, char **text, size_t *length) {
+  t->out = open_memstream(text, length);
+  t->indent = 1;
+  t->temps = 1;
+  t->loops = 0;
+  return t->out;
+}
+
+static void translate_protocol(Translator *t, FILE *out, ASTNode *node) {
+  const char *name = node->data.protocol.name;
+  if (node->data.protocol.is_sequence || node->data.protocol.is_async) {
+    fail(t, node->line, "a sequence or async protocol");
+    return;
+  }
+
+  t->protocol = node;
+  ASTParamArray *params = &node->data.protocol.params;
+  for (size_t i = 0; i < params->count; i++) {
+    ASTParam *param = &params->params[i];
+    if (param->is_rest || param->default_value ||
+        param->pattern->type != AST_IDENTIFIER) {
+      fail(t, node->line, "a parameter that is not a plain name");
+      return;
+    }
+    names_add(&t->params, param->pattern->data.identifier.name);
+  }
+  collect_block(&node->data.protocol.body, &t->locals);
+  for (size_t i = 0; i < t->params.count; i++) {
+    for (size_t j = 0; j < t->locals.count; j++) {
+      if (strcmp(t->params.names[i], t->locals.names[j]) == 0) {
+        t->locals.names[j] = t->locals.names[--t->locals.count];
+        break;
+      }
+    }
+  }
+  check_variables(t, &t->params, node->line);
+  check_variables(t, &t->locals, node->line);
+
+  char *text = NULL;
+  size_t length = 0;
+  FILE *body = body_start(t, &text, &length);
+  snprintf(t->fail, sizeof(t->fail), "done");
+  translate_block(t, &node->data.protocol.body);
+  fclose(body);
+
+  if (t->ok) {
+    fprintf(out, "static void p_%s(Interpreter *interp, Value *out", name);
+    for (size_t i = 0; i < t->params.count; i++) {
+      fprintf(out, ", Value *a%zu", i);
+    }
+    fprintf(out, ") {\n");
+    fprintf(out, "  Value t[%d] = {{{0}}};\n", t->temps);
+    for (size_t i = 0; i < t->params.count; i++) {
+      fprintf(out, "  Value l_%s = {{0}};\n", t->params.names[i]);
+    }
+    for (size_t i = 0; i < t->locals.count; i++) {
+      fprintf(out, "  Value l_%s = {{0}};\n", t->locals.names[i]);
+      fprintf(out, "  Value *s_%s = NULL;\n", t->locals.names[i]);
+    }
+    for (size_t i = 0; i < t->params.count; i++) {
+      fprintf(out, "  compiled_assign(&l_%s, a%zu);\n", t->params.names[i],
+              i);
+    }
+    fwrite(text, 1, length, out);
+    fprintf(out, "done:\n");
+    fprintf(out, "  compiled_free(t, %d);\n", t->temps);
+    for (size_t i = 0; i < t->params.count; i++) {
+      fprintf(out, "  compiled_free(&l_%s, 1);\n", t->params.names[i]);
+    }
+    for (size_t i = 0; i < t->locals.count; i++) {
+      fprintf(out, "  compiled_free(&l_%s, 1);\n", t->locals.names[i]);
+    }
+    fprintf(out, "}\n\n");
+  }
+
+  free(text);
+  names_clear(&t->params);
+  names_clear(&t->locals);
+  t->protocol = NULL;
+}
+
+/* The top level: each statement that raises reports and moves on, as in
+ * the AST_PROGRAM statement */
+static void translate_top_level(Translator *t, FILE *out,
+                                ASTNodeArray *stmts) {
+  char *text = NULL;
+  size_t length = 0;
+  FILE *body = body_start(t, &text, &length);
+  for (size_t i = 0; i < stmts->count && t->ok; i++) {
+    ASTNode *node = stmts->nodes[i];
+    snprintf(t->fail, sizeof(t->fail), "s%zu", i);
+    if (node->type == AST_PROTOCOL) {
+      emit(t, "f_%s = true;", node->data.protocol.name);
+      continue;
+    }
+    translate_stmt(t, node);
+    fprintf(body, "s%zu:\n", i);
+    emit(t, "compiled_statement_end(interp);");
+    emit(t, "compiled_free(t, %s);", "sizeof(t) / sizeof(t[0])");
+  }
+  fclose(body);
+
+  if (t->ok) {
+    fprintf(out, "static void run(Interpreter *interp) {\n");
+    fprintf(out, "  Value t[%d] = {{{0}}};\n", t->temps);
+    fwrite(text, 1, length, out);
+    fprintf(out, "finish:\n");
+    fprintf(out, "  compiled_free(t, %d);\n", t->temps);
+    fprintf(out, "}\n\n");
+  }
+  free(text);
+}
+
+/* ============================================================================
+ * Programs
+ * ============================================================================
+ */
+
+/* Find the globals and protocols of a program, and check them */
+static void declare_names(Translator *t, ASTNodeArray *stmts) {
+  for (size_t i = 0; i < stmts->count; i++) {
+    ASTNode *node = stmts->nodes[i];
+    if (node->type != AST_PROTOCOL) {
+      collect_bindings(node, &t->globals);
+      continue;
+    }
+    const char *name = node->data.protocol.name;
+    if (names_has(&t->protocols, name)) {
+      fail(t, node->line, "a protocol defined twice");
+      return;
+    }
+    if (!c_spellable(name)) {
+      fail(t, node->line, "a name C cannot spell");
+      return;
+    }
+    names_add(&t->protocols, name);
+    t->protocol_nodes = (ASTNode **)realloc(
+        t->protocol_nodes, sizeof(ASTNode *) * t->protocols.capacity);
+    t->protocol_nodes[t->protocols.count - 1] = node;
+  }
+
+  /* Checked once every protocol is known, against the binding's line */
+  for (size_t i = 0; i < stmts->count && t->ok; i++) {
+    NameList bound = {NULL, 0, 0};
+    if (stmts->nodes[i]->type != AST_PROTOCOL)
+      collect_bindings(stmts->nodes[i], &bound);
+    check_variables(t, &bound, stmts->nodes[i]->line);
+    names_clear(&bound);
+  }
+}
+
+static void write_program(Translator *t, FILE *out, const char *filename,
+                          int report_level, const char *functions,
+                          size_t length) {
+  fprintf(out, "/* Generated by keikaku build from ");
+  translate_write_string(out, filename, strlen(filename));
+  fprintf(out, " */\n\n");
+  fprintf(out, "#include <stdbool.h>\n#include <stddef.h>\n"
+               "#include <stdint.h>\n\n");
+  fprintf(out, "/* The runtime's values and counted cycles, handled by "
+               "address only */\n");
+  fprintf(out, "typedef struct {\n  uint64_t bits[%zu];\n} Value;\n\n",
+          sizeof(Value) / 8);
+  fprintf(out, "typedef struct {\n  uint64_t bits[%zu];\n} Range;\n\n",
+          (sizeof(GenFrame) + 7) / 8);
+  fprintf(out, "%s\n", runtime_declarations);
+
+  for (size_t i = 0; i < t->globals.count; i++) {
+    fprintf(out, "static Value gv_%s, *g_%s;\n", t->globals.names[i],
+            t->globals.names[i]);
+  }
+  for (size_t i = 0; i < t->builtins.count; i++) {
+    fprintf(out, "static Value b_%s;\n", t->builtins.names[i]);
+  }
+  for (size_t i = 0; i < t->protocols.count; i++) {
+    ASTNode *node = t->protocol_nodes[i];
+    fprintf(out, "static bool f_%s;\n", t->protocols.names[i]);
+    fprintf(out, "static void p_%s(Interpreter *interp, Value *out",
+            t->protocols.names[i]);
+    for (size_t j = 0; j < node->data.protocol.params.count; j++) {
+      fprintf(out, ", Value *a%zu", j);
+    }
+    fprintf(out, ");\n");
+  }
+  fprintf(out, "\n");
+
+  fwrite(functions, 1, length, out);
+
+  fprintf(out, "int main(void) {\n");
+  fprintf(out, "  Interpreter *interp = compiled_start(%d);\n", report_level);
+  fprintf(out, "  if (!interp)\n    return 1;\n");
+  for (size_t i = 0; i < t->builtins.count; i++) {
+    fprintf(out, "  compiled_builtin(interp, &b_%s, \"%s\");\n",
+            t->builtins.names[i], t->builtins.names[i]);
+  }
+  fprintf(out, "  run(interp);\n");
+  for (size_t i = 0; i < t->globals.count; i++) {
+    fprintf(out, "  compiled_free(&gv_%s, 1);\n", t->globals.names[i]);
+  }
+  fprintf(out, "  return compiled_finish(interp);\n}\n");
+}
+
+char *translate_program(ASTNode *program, const char *filename,
+                        int report_level, TranslateFailure *failure) {
+  Translator t;
+  memset(&t, 0, sizeof(t));
+  t.ok = true;
+  t.failure = failure;
+  t.probe = interpreter_create();
+  if (!t.probe)
+    return NULL;
+
+  ASTNodeArray *stmts = &program->data.program.statements;
+  declare_names(&t, stmts);
+
+  /* Protocols first, then the top level that defines and calls them */
+  char *functions = NULL;
+  size_t functions_length = 0;
+  FILE *out = open_memstream(&functions, &functions_length);
+  for (size_t i = 0; i < stmts->count && t.ok; i++) {
+    if (stmts->nodes[i]->type == AST_PROTOCOL)
+      translate_protocol(&t, out, stmts->nodes[i]);
+  }
+  if (t.ok)
+    translate_top_level(&t, out, stmts);
+  fclose(out);
+
+  char *text = NULL;
+  if (t.ok) {
+    size_t length = 0;
+    out = open_memstream(&text, &length);
+    write_program(&t, out, filename, report_level, functions,
+                  functions_length);
+    fclose(out);
+  }
+
+  free(functions);
+  free(t.protocol_nodes);
+  names_clear(&t.globals);
+  names_clear(&t.protocols);
+  names_clear(&t.builtins);
+  interpreter_destroy(t.probe);
+  return text;
+}
@@ -0,0 +1,42 @@
+/*
+ * Keikaku Programming Language - Translation to C
+ *
+ * "The script was always going to become this."
+ *
+ * keikaku build translates a script's AST into a C program. Top-level
+ * protocols become C functions, the remaining statements become the body
+ * of main(), and variables become C variables. Operators, built-ins and
+ * deviations go through the runtime library's compiled_* entry points (see
+ * interpreter.h), so they behave exactly as when interpreted, but nothing
+ * walks the tree at run time.
+ *
+ * Handled: int, float, string, bool, list and f-string literals; variables;
+ * every operator; indexing; ternaries; calls of built-ins and of top-level
+ * protocols with plain parameters; designation and assignment to names;
+ * foresee, cycle while, counted cycles, break, continue and yield. Anything
+ * else (entities, lambdas, attempt, sequences, incorporate, ...) leaves the
+ * script to be bundled with the interpreter instead.
+ */
+
+#ifndef KEIKAKU_TRANSLATE_H
+#define KEIKAKU_TRANSLATE_H
+
+#include "ast.h"
+#include <stdio.h>
+
+/* The first construct a script uses that cannot be translated */
+typedef struct {
+  int line;
+  char what[64];
+} TranslateFailure;
+
+/* The C program for a parsed script, which runs it with report_level as
+ * keikaku would. Returns NULL if the script uses anything not handled,
+ * filling in failure. The caller frees the text. */
+char *translate_program(ASTNode *program, const char *filename,
+                        int report_level, TranslateFailure *failure);
+
+/* Write length bytes of s as a C string literal */
+void translate_write_string(FILE *out, const char *s, size_t length);
+
+#endif /* KEIKAKU_TRANSLATE_H */
@@ -23,10 +23,12 @@ def run_test(compiler_path, test_file):
         match = re.search(r'# Expected:\n((?:#.*\n)*)', content)
         if match:
             expected_output = match.group(1).replace('# ', '').strip()
+        flags = re.search(r'^# Flags: (.*)$', content, re.MULTILINE)
+        flags = flags.group(1).split() if flags else []
     
     try:
         process = subprocess.Popen(
-            [compiler_path, test_file],
+            [compiler_path, *flags, test_file],
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
             text=True